@@ -0,0 +1,169 @@
+/* Copyright (c) Mark Harmstone 2016-17
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// Intrusive AVL tree, used to index lists which would otherwise have to be
+// walked from the head. The caller finds where a new node goes by walking
+// down from the root itself, then calls avl_link with the empty link it ended
+// up at; nodes don't need to know anything about what they're embedded in.
+
+static __inline int avl_height(avl_node* n) {
+    return n ? n->height : 0;
+}
+
+static void avl_update_height(avl_node* n) {
+    int lh = avl_height(n->left), rh = avl_height(n->right);
+
+    n->height = (lh > rh ? lh : rh) + 1;
+}
+
+static void avl_replace(avl_node** root, avl_node* parent, avl_node* old, avl_node* n) {
+    if (!parent)
+        *root = n;
+    else if (parent->left == old)
+        parent->left = n;
+    else
+        parent->right = n;
+
+    if (n)
+        n->parent = parent;
+}
+
+static avl_node* avl_rotate_left(avl_node** root, avl_node* n) {
+    avl_node* r = n->right;
+
+    n->right = r->left;
+    if (r->left)
+        r->left->parent = n;
+
+    avl_replace(root, n->parent, n, r);
+
+    r->left = n;
+    n->parent = r;
+
+    avl_update_height(n);
+    avl_update_height(r);
+
+    return r;
+}
+
+static avl_node* avl_rotate_right(avl_node** root, avl_node* n) {
+    avl_node* l = n->left;
+
+    n->left = l->right;
+    if (l->right)
+        l->right->parent = n;
+
+    avl_replace(root, n->parent, n, l);
+
+    l->right = n;
+    n->parent = l;
+
+    avl_update_height(n);
+    avl_update_height(l);
+
+    return l;
+}
+
+static void avl_rebalance(avl_node** root, avl_node* n) {
+    while (n) {
+        int balance;
+
+        avl_update_height(n);
+
+        balance = avl_height(n->left) - avl_height(n->right);
+
+        if (balance > 1) {
+            if (avl_height(n->left->left) < avl_height(n->left->right))
+                avl_rotate_left(root, n->left);
+
+            n = avl_rotate_right(root, n);
+        } else if (balance < -1) {
+            if (avl_height(n->right->right) < avl_height(n->right->left))
+                avl_rotate_right(root, n->right);
+
+            n = avl_rotate_left(root, n);
+        }
+
+        n = n->parent;
+    }
+}
+
+void avl_link(avl_node** root, avl_node* n, avl_node* parent, avl_node** link) {
+    n->parent = parent;
+    n->left = n->right = NULL;
+    n->height = 1;
+
+    *link = n;
+
+    avl_rebalance(root, parent);
+}
+
+void avl_remove(avl_node** root, avl_node* n) {
+    avl_node* parent;
+
+    if (n->left && n->right) {
+        avl_node* succ = n->right;
+
+        while (succ->left) {
+            succ = succ->left;
+        }
+
+        if (succ->parent != n) {
+            parent = succ->parent;
+
+            parent->left = succ->right;
+            if (succ->right)
+                succ->right->parent = parent;
+
+            succ->right = n->right;
+            n->right->parent = succ;
+        } else
+            parent = succ;
+
+        succ->left = n->left;
+        n->left->parent = succ;
+
+        avl_replace(root, n->parent, n, succ);
+        succ->height = n->height;
+    } else {
+        parent = n->parent;
+
+        avl_replace(root, parent, n, n->left ? n->left : n->right);
+    }
+
+    avl_rebalance(root, parent);
+}
+
+avl_node* avl_next(avl_node* n) {
+    if (n->right) {
+        n = n->right;
+
+        while (n->left) {
+            n = n->left;
+        }
+
+        return n;
+    }
+
+    while (n->parent && n->parent->right == n) {
+        n = n->parent;
+    }
+
+    return n->parent;
+}
@@ -0,0 +1,123 @@
+/* Copyright (c) Mark Harmstone 2016-17
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <windef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Unkeyed BLAKE2b, as used by btrfs with a 256-bit digest (RFC 7693).
+
+#define BLAKE2B_BLOCK_SIZE 128
+
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static const uint64_t blake2b_iv[] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t blake2b_sigma[12][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+    { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+    { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+    { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+    { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+    { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+    { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+    { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+    { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
+};
+
+#define G(a, b, c, d, x, y) { \
+    a = a + b + x; \
+    d = ROR64(d ^ a, 32); \
+    c = c + d; \
+    b = ROR64(b ^ c, 24); \
+    a = a + b + y; \
+    d = ROR64(d ^ a, 16); \
+    c = c + d; \
+    b = ROR64(b ^ c, 63); \
+}
+
+static void blake2b_compress(uint64_t* h, const uint8_t* block, uint64_t counter, bool last) {
+    uint64_t m[16], v[16];
+    unsigned int i;
+
+    // the on-disk format is little-endian, as is every CPU we run on
+    memcpy(m, block, sizeof(m));
+
+    for (i = 0; i < 8; i++) {
+        v[i] = h[i];
+        v[i + 8] = blake2b_iv[i];
+    }
+
+    v[12] ^= counter;
+
+    if (last)
+        v[14] = ~v[14];
+
+    for (i = 0; i < 12; i++) {
+        const uint8_t* s = blake2b_sigma[i];
+
+        G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+    }
+
+    for (i = 0; i < 8; i++) {
+        h[i] ^= v[i] ^ v[i + 8];
+    }
+}
+
+void blake2b(void* out, size_t outlen, const void* in, size_t inlen) {
+    uint64_t h[8];
+    uint8_t last[BLAKE2B_BLOCK_SIZE];
+    const uint8_t* data = in;
+    uint64_t counter = 0;
+    unsigned int i;
+
+    for (i = 0; i < 8; i++) {
+        h[i] = blake2b_iv[i];
+    }
+
+    h[0] ^= 0x01010000 | (uint64_t)outlen;
+
+    // the final block is always compressed with the last flag set, even if it's full
+    while (inlen > BLAKE2B_BLOCK_SIZE) {
+        counter += BLAKE2B_BLOCK_SIZE;
+        blake2b_compress(h, data, counter, false);
+        data += BLAKE2B_BLOCK_SIZE;
+        inlen -= BLAKE2B_BLOCK_SIZE;
+    }
+
+    memcpy(last, data, inlen);
+    memset(last + inlen, 0, BLAKE2B_BLOCK_SIZE - inlen);
+
+    counter += inlen;
+    blake2b_compress(h, last, counter, true);
+
+    memcpy(out, h, outlen);
+}
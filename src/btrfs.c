@@ -63,7 +63,7 @@ DEFINE_GUID(BtrfsBusInterface, 0x4d414874, 0x6865, 0x6761, 0x6d, 0x65, 0x83, 0x6
 
 PDRIVER_OBJECT drvobj;
 PDEVICE_OBJECT master_devobj, busobj;
-bool have_sse42 = false, have_sse2 = false;
+bool have_sse42 = false, have_sse2 = false, have_pclmulqdq = false, have_sha = false, have_ssse3 = false, have_avx2 = false;
 uint64_t num_reads = 0;
 LIST_ENTRY uid_map_list, gid_map_list;
 LIST_ENTRY VcbList;
@@ -74,8 +74,15 @@ uint32_t mount_compress_force = 0;
 uint32_t mount_compress_type = 0;
 uint32_t mount_zlib_level = 3;
 uint32_t mount_zstd_level = 3;
+uint32_t mount_lzo_level = 1;
 uint32_t mount_flush_interval = 30;
 uint32_t mount_max_inline = 2048;
+uint32_t mount_node_cache_size = 32;
+uint32_t mount_decomp_cache_size = 16;
+uint32_t mount_max_read_ahead = 8;
+uint32_t mount_dirty_inode_limit = 16384;
+uint32_t mount_dirty_extent_limit = 65536;
+uint32_t mount_max_write_delay = 100;
 uint32_t mount_skip_balance = 0;
 uint32_t mount_no_barrier = 0;
 uint32_t mount_no_trim = 0;
@@ -94,6 +101,8 @@ tIoUnregisterPlugPlayNotificationEx fIoUnregisterPlugPlayNotificationEx;
 tFsRtlGetEcpListFromIrp fFsRtlGetEcpListFromIrp;
 tFsRtlGetNextExtraCreateParameter fFsRtlGetNextExtraCreateParameter;
 tFsRtlValidateReparsePointBuffer fFsRtlValidateReparsePointBuffer;
+tKeSaveExtendedProcessorState fKeSaveExtendedProcessorState;
+tKeRestoreExtendedProcessorState fKeRestoreExtendedProcessorState;
 bool diskacc = false;
 void *notification_entry = NULL, *notification_entry2 = NULL, *notification_entry3 = NULL;
 ERESOURCE pdo_list_lock, mapping_lock;
@@ -104,6 +113,8 @@ bool degraded_wait = true;
 KEVENT mountmgr_thread_event;
 bool shutting_down = false;
 ERESOURCE boot_lock;
+PKEVENT low_memory_event = NULL;
+static HANDLE low_memory_handle = NULL;
 
 #ifdef _DEBUG
 PFILE_OBJECT comfo = NULL;
@@ -283,6 +294,8 @@ static void __stdcall DriverUnload(_In_ PDRIVER_OBJECT DriverObject) {
 
     free_cache();
 
+    free_compression_contexts();
+
     IoUnregisterFileSystem(DriverObject->DeviceObject);
 
     if (notification_entry2) {
@@ -330,6 +343,9 @@ static void __stdcall DriverUnload(_In_ PDRIVER_OBJECT DriverObject) {
 
     // FIXME - free volumes and their devpaths
 
+    if (low_memory_handle)
+        ZwClose(low_memory_handle);
+
 #ifdef _DEBUG
     if (comfo)
         ObDereferenceObject(comfo);
@@ -552,8 +568,21 @@ static NTSTATUS __stdcall drv_flush_buffers(_In_ PDEVICE_OBJECT DeviceObject, _I
         goto end;
     }
 
+    // flushing the volume handle flushes everything, in with anyone else who's flushing
     if (fcb == Vcb->volume_fcb) {
-        Status = STATUS_SUCCESS;
+        if (Vcb->readonly)
+            Status = STATUS_SUCCESS;
+        else {
+            ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
+            flush_fcb_caches(Vcb);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+
+            Status = group_commit(Vcb, Irp);
+            if (!NT_SUCCESS(Status))
+                ERR("group_commit returned %08x\n", Status);
+        }
+
+        Irp->IoStatus.Status = Status;
         goto end;
     }
 
@@ -573,6 +602,15 @@ static NTSTATUS __stdcall drv_flush_buffers(_In_ PDEVICE_OBJECT DeviceObject, _I
         }
 
         Status = Irp->IoStatus.Status;
+
+        // make the metadata durable too, through the log tree if we can
+        if (NT_SUCCESS(Status)) {
+            Status = sync_fcb(Vcb, fcb, Irp);
+            if (!NT_SUCCESS(Status))
+                ERR("sync_fcb returned %08x\n", Status);
+
+            Irp->IoStatus.Status = Status;
+        }
     }
 
 end:
@@ -1211,6 +1249,10 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
         t->is_unique = true;
         t->uniqueness_determined = true;
         t->buf = NULL;
+        t->index = NULL;
+        t->index_len = 0;
+        t->index_alloc = 0;
+        t->index_valid = false;
     }
 
     ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
@@ -1652,9 +1694,13 @@ void mark_fcb_dirty(_In_ fcb* fcb) {
         ExAcquireResourceExclusiveLite(&fcb->Vcb->dirty_fcbs_lock, true);
         InsertTailList(&fcb->Vcb->dirty_fcbs, &fcb->list_entry_dirty);
         ExReleaseResourceLite(&fcb->Vcb->dirty_fcbs_lock);
+
+        InterlockedIncrement(&fcb->Vcb->writeback.dirty_inodes);
     }
 
     fcb->Vcb->need_write = true;
+
+    check_writeback(fcb->Vcb);
 }
 
 void mark_fileref_dirty(_In_ file_ref* fileref) {
@@ -1665,9 +1711,13 @@ void mark_fileref_dirty(_In_ file_ref* fileref) {
         ExAcquireResourceExclusiveLite(&fileref->fcb->Vcb->dirty_filerefs_lock, true);
         InsertTailList(&fileref->fcb->Vcb->dirty_filerefs, &fileref->list_entry_dirty);
         ExReleaseResourceLite(&fileref->fcb->Vcb->dirty_filerefs_lock);
+
+        InterlockedIncrement(&fileref->fcb->Vcb->writeback.dirty_inodes);
     }
 
     fileref->fcb->Vcb->need_write = true;
+
+    check_writeback(fileref->fcb->Vcb);
 }
 
 #ifdef DEBUG_FCB_REFCOUNTS
@@ -2007,23 +2057,38 @@ void uninit(_In_ device_extension* Vcb) {
 
     for (i = 0; i < Vcb->calcthreads.num_threads; i++) {
         Vcb->calcthreads.threads[i].quit = true;
+        KeSetEvent(&Vcb->calcthreads.threads[i].event, 0, false);
     }
 
-    KeSetEvent(&Vcb->calcthreads.event, 0, false);
-
     for (i = 0; i < Vcb->calcthreads.num_threads; i++) {
         KeWaitForSingleObject(&Vcb->calcthreads.threads[i].finished, Executive, KernelMode, false, NULL);
 
         ZwClose(Vcb->calcthreads.threads[i].handle);
     }
 
-    ExDeleteResourceLite(&Vcb->calcthreads.lock);
     ExFreePool(Vcb->calcthreads.threads);
 
     time.QuadPart = 0;
     KeSetTimer(&Vcb->flush_thread_timer, time, NULL); // trigger the timer early
     KeWaitForSingleObject(&Vcb->flush_thread_finished, Executive, KernelMode, false, NULL);
 
+    TRACE("node cache: %I64u hits, %I64u misses\n", Vcb->node_cache.hits, Vcb->node_cache.misses);
+    free_node_cache(Vcb);
+
+    TRACE("decompression cache: %I64u hits, %I64u misses, %I64u us saved\n", Vcb->decomp_cache.hits, Vcb->decomp_cache.misses,
+          Vcb->decomp_cache.time_saved * 1000000 / Vcb->decomp_cache.freq.QuadPart);
+    free_decomp_cache(Vcb);
+
+    if (Vcb->commit.num_commits > 0) {
+        TRACE("group commit: %I64u commits, %I64u requests, %u max coalesced, %I64u us mean latency\n", Vcb->commit.num_commits,
+              Vcb->commit.num_requests, Vcb->commit.max_coalesced,
+              Vcb->commit.total_latency * 1000000 / Vcb->commit.freq.QuadPart / Vcb->commit.num_commits);
+    }
+
+    TRACE("writeback: %I64u early commits, %I64u writers throttled\n", Vcb->writeback.early_commits, Vcb->writeback.throttled);
+
+    free_log_tree(Vcb);
+
     reap_fcb(Vcb->volume_fcb);
     reap_fcb(Vcb->dummy_fcb);
 
@@ -2067,6 +2132,13 @@ void uninit(_In_ device_extension* Vcb) {
             ExFreePool(s);
         }
 
+        while (!IsListEmpty(&c->pinned)) {
+            LIST_ENTRY* le2 = RemoveHeadList(&c->pinned);
+            space* s = CONTAINING_RECORD(le2, space, list_entry);
+
+            ExFreePool(s);
+        }
+
         if (c->devices)
             ExFreePool(c->devices);
 
@@ -2082,6 +2154,8 @@ void uninit(_In_ device_extension* Vcb) {
         ExFreePool(c);
     }
 
+    free_chunk_map(Vcb);
+
     // FIXME - free any open fcbs?
 
     while (!IsListEmpty(&Vcb->devices)) {
@@ -2110,6 +2184,7 @@ void uninit(_In_ device_extension* Vcb) {
     ExDeleteResourceLite(&Vcb->load_lock);
     ExDeleteResourceLite(&Vcb->tree_lock);
     ExDeleteResourceLite(&Vcb->chunk_lock);
+    ExDeleteResourceLite(&Vcb->devices_lock);
     ExDeleteResourceLite(&Vcb->dirty_fcbs_lock);
     ExDeleteResourceLite(&Vcb->dirty_filerefs_lock);
     ExDeleteResourceLite(&Vcb->dirty_subvols_lock);
@@ -2757,8 +2832,6 @@ static NTSTATUS read_superblock(_In_ device_extension* Vcb, _In_ PDEVICE_OBJECT
     valid_superblocks = 0;
 
     while (superblock_addrs[i] > 0) {
-        uint32_t crc32;
-
         if (i > 0 && superblock_addrs[i] + to_read > length)
             break;
 
@@ -2778,10 +2851,8 @@ static NTSTATUS read_superblock(_In_ device_extension* Vcb, _In_ PDEVICE_OBJECT
         } else {
             TRACE("got superblock %u!\n", i);
 
-            crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&sb->uuid, (ULONG)sizeof(superblock) - sizeof(sb->checksum));
-
-            if (crc32 != *((uint32_t*)sb->checksum))
-                WARN("crc32 was %08x, expected %08x\n", crc32, *((uint32_t*)sb->checksum));
+            if (!check_superblock_checksum(sb))
+                WARN("superblock checksum error\n");
             else if (sb->sector_size == 0)
                 WARN("superblock sector size was 0\n");
             else if (sb->node_size < sizeof(tree_header) + sizeof(internal_node) || sb->node_size > 0x10000)
@@ -3585,7 +3656,9 @@ static NTSTATUS load_chunk_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) dev
 
                 InitializeListHead(&c->space);
                 InitializeListHead(&c->space_size);
+                c->space_tree = c->space_size_tree = NULL;
                 InitializeListHead(&c->deleting);
+                InitializeListHead(&c->pinned);
                 InitializeListHead(&c->changed_extents);
 
                 InitializeListHead(&c->range_locks);
@@ -3599,6 +3672,15 @@ static NTSTATUS load_chunk_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) dev
 
                 c->last_stripe = 0;
 
+                Status = chunk_map_insert(Vcb, c);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("chunk_map_insert returned %08x\n", Status);
+                    ExFreePool(c->devices);
+                    ExFreePool(c->chunk_item);
+                    ExFreePool(c);
+                    return Status;
+                }
+
                 InsertTailList(&Vcb->chunks, &c->list_entry);
 
                 c->list_entry_balance.Flink = NULL;
@@ -3979,17 +4061,20 @@ static NTSTATUS create_calc_threads(_In_ PDEVICE_OBJECT DeviceObject) {
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    InitializeListHead(&Vcb->calcthreads.job_list);
-    ExInitializeResourceLite(&Vcb->calcthreads.lock);
-    KeInitializeEvent(&Vcb->calcthreads.event, NotificationEvent, false);
+    Vcb->calcthreads.next_thread = 0;
 
     RtlZeroMemory(Vcb->calcthreads.threads, sizeof(drv_calc_thread) * Vcb->calcthreads.num_threads);
 
     for (i = 0; i < Vcb->calcthreads.num_threads; i++) {
-        NTSTATUS Status;
-
         Vcb->calcthreads.threads[i].DeviceObject = DeviceObject;
+        InitializeListHead(&Vcb->calcthreads.threads[i].job_list);
+        ExInitializeFastMutex(&Vcb->calcthreads.threads[i].lock);
+        KeInitializeEvent(&Vcb->calcthreads.threads[i].event, SynchronizationEvent, false);
         KeInitializeEvent(&Vcb->calcthreads.threads[i].finished, NotificationEvent, false);
+    }
+
+    for (i = 0; i < Vcb->calcthreads.num_threads; i++) {
+        NTSTATUS Status;
 
         Status = PsCreateSystemThread(&Vcb->calcthreads.threads[i].handle, 0, NULL, NULL, NULL, calc_thread, &Vcb->calcthreads.threads[i]);
         if (!NT_SUCCESS(Status)) {
@@ -3998,11 +4083,10 @@ static NTSTATUS create_calc_threads(_In_ PDEVICE_OBJECT DeviceObject) {
             ERR("PsCreateSystemThread returned %08x\n", Status);
 
             for (j = 0; j < i; j++) {
-                Vcb->calcthreads.threads[i].quit = true;
+                Vcb->calcthreads.threads[j].quit = true;
+                KeSetEvent(&Vcb->calcthreads.threads[j].event, 0, false);
             }
 
-            KeSetEvent(&Vcb->calcthreads.event, 0, false);
-
             return Status;
         }
     }
@@ -4131,7 +4215,6 @@ static NTSTATUS check_mount_device(_In_ PDEVICE_OBJECT DeviceObject, _Out_ bool*
     NTSTATUS Status;
     ULONG to_read;
     superblock* sb;
-    uint32_t crc32;
     UNICODE_STRING pnp_name;
     const GUID* guid;
 
@@ -4154,10 +4237,8 @@ static NTSTATUS check_mount_device(_In_ PDEVICE_OBJECT DeviceObject, _Out_ bool*
         goto end;
     }
 
-    crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&sb->uuid, (ULONG)sizeof(superblock) - sizeof(sb->checksum));
-
-    if (crc32 != *((uint32_t*)sb->checksum)) {
-        WARN("crc32 was %08x, expected %08x\n", crc32, *((uint32_t*)sb->checksum));
+    if (!check_superblock_checksum(sb)) {
+        WARN("superblock checksum error\n");
         Status = STATUS_SUCCESS;
         goto end;
     }
@@ -4218,14 +4299,10 @@ static bool still_has_superblock(_In_ PDEVICE_OBJECT device, _In_ PFILE_OBJECT f
         TRACE("not a BTRFS volume\n");
         ExFreePool(sb);
         return false;
-    } else {
-        uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&sb->uuid, (ULONG)sizeof(superblock) - sizeof(sb->checksum));
-
-        if (crc32 != *((uint32_t*)sb->checksum)) {
-            WARN("crc32 was %08x, expected %08x\n", crc32, *((uint32_t*)sb->checksum));
-            ExFreePool(sb);
-            return false;
-        }
+    } else if (!check_superblock_checksum(sb)) {
+        WARN("superblock checksum error\n");
+        ExFreePool(sb);
+        return false;
     }
 
     device2 = device;
@@ -4395,6 +4472,7 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     ExInitializeResourceLite(&Vcb->fcb_lock);
     ExInitializeResourceLite(&Vcb->fileref_lock);
     ExInitializeResourceLite(&Vcb->chunk_lock);
+    ExInitializeResourceLite(&Vcb->devices_lock);
     ExInitializeResourceLite(&Vcb->dirty_fcbs_lock);
     ExInitializeResourceLite(&Vcb->dirty_filerefs_lock);
     ExInitializeResourceLite(&Vcb->dirty_subvols_lock);
@@ -4447,6 +4525,29 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
+    switch (Vcb->superblock.csum_type) {
+        case CSUM_TYPE_CRC32C:
+            Vcb->csum_size = sizeof(uint32_t);
+            break;
+
+        case CSUM_TYPE_XXHASH:
+            Vcb->csum_size = sizeof(uint64_t);
+            break;
+
+        case CSUM_TYPE_SHA256:
+            Vcb->csum_size = SHA256_HASH_SIZE;
+            break;
+
+        case CSUM_TYPE_BLAKE2:
+            Vcb->csum_size = BLAKE2_HASH_SIZE;
+            break;
+
+        default:
+            WARN("cannot mount because of unsupported csum type (%x)\n", Vcb->superblock.csum_type);
+            Status = STATUS_UNRECOGNIZED_VOLUME;
+            goto exit;
+    }
+
     Vcb->readonly = false;
     if (Vcb->superblock.compat_ro_flags & ~COMPAT_RO_SUPPORTED) {
         WARN("mounting read-only because of unsupported flags (%I64x)\n", Vcb->superblock.compat_ro_flags & ~COMPAT_RO_SUPPORTED);
@@ -4456,6 +4557,8 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     if (Vcb->options.readonly)
         Vcb->readonly = true;
 
+    RtlCopyMemory(&Vcb->log.committed_sb, &Vcb->superblock, sizeof(superblock));
+
     Vcb->superblock.generation++;
     Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_MIXED_BACKREF;
 
@@ -4496,6 +4599,7 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
 
     InitializeListHead(&Vcb->roots);
     InitializeListHead(&Vcb->drop_roots);
+    InitializeListHead(&Vcb->commit_tree_writes);
 
     Vcb->log_to_phys_loaded = false;
 
@@ -4522,9 +4626,17 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     InitializeListHead(&Vcb->dirty_filerefs);
     InitializeListHead(&Vcb->dirty_subvols);
     InitializeListHead(&Vcb->send_ops);
+    InitializeListHead(&Vcb->log.inodes);
+    InitializeListHead(&Vcb->log.leaves);
 
     ExInitializeFastMutex(&Vcb->trees_list_mutex);
 
+    ExInitializeFastMutex(&Vcb->commit.mutex);
+    KeInitializeEvent(&Vcb->commit.event, NotificationEvent, false);
+    KeQueryPerformanceCounter(&Vcb->commit.freq);
+
+    KeInitializeTimer(&Vcb->flush_thread_timer);
+
     InitializeListHead(&Vcb->DirNotifyList);
     InitializeListHead(&Vcb->scrub.errors);
 
@@ -4541,6 +4653,18 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     ExInitializeNPagedLookasideList(&Vcb->fcb_np_lookaside, NULL, NULL, 0, sizeof(fcb_nonpaged), ALLOC_TAG, 0);
     init_lookaside = true;
 
+    Status = init_node_cache(Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_node_cache returned %08x\n", Status);
+        goto exit;
+    }
+
+    Status = init_decomp_cache(Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_decomp_cache returned %08x\n", Status);
+        goto exit;
+    }
+
     Vcb->Vpb = IrpSp->Parameters.MountVolume.Vpb;
 
     Status = load_chunk_root(Vcb, Irp);
@@ -4809,6 +4933,12 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
         goto exit;
     }
 
+    Status = replay_log_tree(Vcb, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("replay_log_tree returned %08x\n", Status);
+        goto exit;
+    }
+
     Status = registry_mark_volume_mounted(&Vcb->superblock.uuid);
     if (!NT_SUCCESS(Status))
         WARN("registry_mark_volume_mounted returned %08x\n", Status);
@@ -4846,6 +4976,9 @@ exit2:
                 ExDeleteNPagedLookasideList(&Vcb->range_lock_lookaside);
                 ExDeleteNPagedLookasideList(&Vcb->fileref_np_lookaside);
                 ExDeleteNPagedLookasideList(&Vcb->fcb_np_lookaside);
+
+                free_node_cache(Vcb);
+                free_decomp_cache(Vcb);
             }
 
             if (Vcb->root_file)
@@ -4866,6 +4999,8 @@ exit2:
             ExDeleteResourceLite(&Vcb->fcb_lock);
             ExDeleteResourceLite(&Vcb->fileref_lock);
             ExDeleteResourceLite(&Vcb->chunk_lock);
+            ExDeleteResourceLite(&Vcb->devices_lock);
+            free_chunk_map(Vcb);
             ExDeleteResourceLite(&Vcb->dirty_fcbs_lock);
             ExDeleteResourceLite(&Vcb->dirty_filerefs_lock);
             ExDeleteResourceLite(&Vcb->dirty_subvols_lock);
@@ -4898,7 +5033,6 @@ exit2:
 static NTSTATUS verify_device(_In_ device_extension* Vcb, _Inout_ device* dev) {
     NTSTATUS Status;
     superblock* sb;
-    uint32_t crc32;
     ULONG to_read, cc;
 
     if (!dev->devobj)
@@ -4970,10 +5104,7 @@ static NTSTATUS verify_device(_In_ device_extension* Vcb, _Inout_ device* dev) {
         return STATUS_WRONG_VOLUME;
     }
 
-    crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&sb->uuid, (ULONG)sizeof(superblock) - sizeof(sb->checksum));
-    TRACE("crc32 was %08x, expected %08x\n", crc32, *((uint32_t*)sb->checksum));
-
-    if (crc32 != *((uint32_t*)sb->checksum)) {
+    if (!check_superblock_checksum(sb)) {
         ERR("checksum error\n");
         ExFreePool(sb);
         return STATUS_WRONG_VOLUME;
@@ -5501,14 +5632,34 @@ static void init_serial(bool first_time) {
 
 static void check_cpu() {
     unsigned int cpuInfo[4];
+    bool have_sse41;
 #ifndef _MSC_VER
     __get_cpuid(1, &cpuInfo[0], &cpuInfo[1], &cpuInfo[2], &cpuInfo[3]);
     have_sse42 = cpuInfo[2] & bit_SSE4_2;
+    have_sse41 = cpuInfo[2] & bit_SSE4_1;
     have_sse2 = cpuInfo[3] & bit_SSE2;
+    have_pclmulqdq = cpuInfo[2] & bit_PCLMUL;
+    have_ssse3 = cpuInfo[2] & bit_SSSE3;
+
+    if (__get_cpuid_count(7, 0, &cpuInfo[0], &cpuInfo[1], &cpuInfo[2], &cpuInfo[3])) {
+        have_sha = have_sse41 && (cpuInfo[1] & bit_SHA);
+        have_avx2 = cpuInfo[1] & bit_AVX2;
+    }
 #else
    __cpuid(cpuInfo, 1);
    have_sse42 = cpuInfo[2] & (1 << 20);
+   have_sse41 = cpuInfo[2] & (1 << 19);
    have_sse2 = cpuInfo[3] & (1 << 26);
+   have_pclmulqdq = cpuInfo[2] & (1 << 1);
+   have_ssse3 = cpuInfo[2] & (1 << 9);
+
+   __cpuid(cpuInfo, 0);
+
+   if (cpuInfo[0] >= 7) {
+       __cpuidex(cpuInfo, 7, 0);
+       have_sha = have_sse41 && (cpuInfo[1] & (1 << 29));
+       have_avx2 = cpuInfo[1] & (1 << 5);
+   }
 #endif
 
     if (have_sse42)
@@ -5520,6 +5671,26 @@ static void check_cpu() {
         TRACE("SSE2 is supported\n");
     else
         TRACE("SSE2 is not supported\n");
+
+    if (have_pclmulqdq)
+        TRACE("PCLMULQDQ is supported\n");
+    else
+        TRACE("PCLMULQDQ is not supported\n");
+
+    if (have_sha)
+        TRACE("SHA extensions are supported\n");
+    else
+        TRACE("SHA extensions are not supported\n");
+
+    if (have_ssse3)
+        TRACE("SSSE3 is supported\n");
+    else
+        TRACE("SSSE3 is not supported\n");
+
+    if (have_avx2)
+        TRACE("AVX2 is supported\n");
+    else
+        TRACE("AVX2 is not supported\n");
 }
 
 #ifdef _DEBUG
@@ -5741,6 +5912,7 @@ NTSTATUS __stdcall DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_S
     PDEVICE_OBJECT DeviceObject;
     UNICODE_STRING device_nameW;
     UNICODE_STRING dosdevice_nameW;
+    UNICODE_STRING low_memoryW;
     control_device_extension* cde;
     bus_device_extension* bde;
     HANDLE regh;
@@ -5782,6 +5954,7 @@ NTSTATUS __stdcall DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_S
     TRACE("DriverEntry\n");
 
     check_cpu();
+    init_crc32c();
 
     if (WdmlibRtlIsNtDdiVersionAvailable(NTDDI_WIN8)) {
         UNICODE_STRING name;
@@ -5824,8 +5997,30 @@ NTSTATUS __stdcall DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_S
 
         RtlInitUnicodeString(&name, L"IoUnregisterPlugPlayNotificationEx");
         fIoUnregisterPlugPlayNotificationEx = (tIoUnregisterPlugPlayNotificationEx)MmGetSystemRoutineAddress(&name);
-    } else
+
+        RtlInitUnicodeString(&name, L"KeSaveExtendedProcessorState");
+        fKeSaveExtendedProcessorState = (tKeSaveExtendedProcessorState)MmGetSystemRoutineAddress(&name);
+
+        RtlInitUnicodeString(&name, L"KeRestoreExtendedProcessorState");
+        fKeRestoreExtendedProcessorState = (tKeRestoreExtendedProcessorState)MmGetSystemRoutineAddress(&name);
+
+        // AVX2 also needs the OS to have enabled the YMM state
+        if (have_avx2) {
+            tRtlGetEnabledExtendedFeatures fRtlGetEnabledExtendedFeatures;
+
+            RtlInitUnicodeString(&name, L"RtlGetEnabledExtendedFeatures");
+            fRtlGetEnabledExtendedFeatures = (tRtlGetEnabledExtendedFeatures)MmGetSystemRoutineAddress(&name);
+
+            if (!fRtlGetEnabledExtendedFeatures || !(fRtlGetEnabledExtendedFeatures(XSTATE_MASK_AVX) & XSTATE_MASK_AVX) ||
+                !fKeSaveExtendedProcessorState || !fKeRestoreExtendedProcessorState)
+                have_avx2 = false;
+        }
+    } else {
         fIoUnregisterPlugPlayNotificationEx = NULL;
+        fKeSaveExtendedProcessorState = NULL;
+        fKeRestoreExtendedProcessorState = NULL;
+        have_avx2 = false;
+    }
 
     if (WdmlibRtlIsNtDdiVersionAvailable(NTDDI_VISTA)) {
         UNICODE_STRING name;
@@ -5908,6 +6103,8 @@ NTSTATUS __stdcall DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_S
         return Status;
     }
 
+    init_compression_contexts();
+
     InitializeListHead(&VcbList);
     ExInitializeResourceLite(&global_loading_lock);
     ExInitializeResourceLite(&pdo_list_lock);
@@ -5986,6 +6183,13 @@ NTSTATUS __stdcall DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_S
     if (!NT_SUCCESS(Status))
         WARN("PsCreateSystemThread returned %08x\n", Status);
 
+    // signalled by the memory manager when memory is getting short, so we know to start commits early
+    RtlInitUnicodeString(&low_memoryW, L"\\KernelObjects\\LowMemoryCondition");
+
+    low_memory_event = IoCreateNotificationEvent(&low_memoryW, &low_memory_handle);
+    if (!low_memory_event)
+        WARN("IoCreateNotificationEvent failed\n");
+
     IoRegisterFileSystem(DeviceObject);
 
     IoRegisterBootDriverReinitialization(DriverObject, check_system_root, NULL);
@@ -64,6 +64,13 @@ static const uint64_t superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0
 
 #define BTRFS_ENCRYPTION_NONE   0
 
+#define CSUM_TYPE_CRC32C        0
+#define CSUM_TYPE_XXHASH        1
+#define CSUM_TYPE_SHA256        2
+#define CSUM_TYPE_BLAKE2        3
+
+#define MAX_HASH_SIZE           32
+
 #define BTRFS_ENCODING_NONE     0
 
 #define EXTENT_TYPE_INLINE      0
@@ -82,6 +89,7 @@ static const uint64_t superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0
 
 #define FREE_SPACE_CACHE_ID     0xFFFFFFFFFFFFFFF5
 #define EXTENT_CSUM_ID          0xFFFFFFFFFFFFFFF6
+#define TREE_LOG_ID             0xFFFFFFFFFFFFFFFA
 #define BALANCE_ITEM_ID         0xFFFFFFFFFFFFFFFC
 
 #define BTRFS_INODE_NODATASUM   0x001
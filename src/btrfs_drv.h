@@ -98,6 +98,8 @@
 #define MAX_EXTENT_SIZE 0x8000000 // 128 MB
 #define COMPRESSED_EXTENT_SIZE 0x20000 // 128 KB
 
+#define MAX_CSUM_SIZE (4096 - sizeof(tree_header) - sizeof(leaf_node))
+
 #define READ_AHEAD_GRANULARITY COMPRESSED_EXTENT_SIZE // really ought to be a multiple of COMPRESSED_EXTENT_SIZE
 
 #define IO_REPARSE_TAG_LXSS_SYMLINK 0xa000001d // undocumented?
@@ -197,15 +199,24 @@ typedef struct _fcb_nonpaged {
 
 struct _root;
 
+typedef struct _avl_node {
+    struct _avl_node* parent;
+    struct _avl_node* left;
+    struct _avl_node* right;
+    int height;
+} avl_node;
+
 typedef struct {
     uint64_t offset;
     uint16_t datalen;
     bool unique;
     bool ignore;
     bool inserted;
-    uint32_t* csum;
+    bool csum_used;
+    void* csum;
 
     LIST_ENTRY list_entry;
+    avl_node node;
 
     EXTENT_DATA extent_data;
 } extent;
@@ -269,8 +280,10 @@ typedef struct _fcb {
     ULONG atts;
     SHARE_ACCESS share_access;
     WCHAR* debug_desc;
-    bool csum_loaded;
+    bool csums_unloaded;
+    bool read_ahead_tree_lock;
     LIST_ENTRY extents;
+    avl_node* extent_tree;
     ANSI_STRING reparse_xattr;
     ANSI_STRING ea_xattr;
     ULONG ealen;
@@ -369,6 +382,10 @@ typedef struct _ccb {
     bool lxss;
     send_info* send;
     NTSTATUS send_status;
+    uint64_t read_ahead_next;
+    ULONG read_ahead_window;
+    bool read_ahead_disabled;
+    LONG read_ahead_busy;
 } ccb;
 
 struct _device_extension;
@@ -410,6 +427,10 @@ typedef struct _tree {
     tree_data* paritem;
     struct _root* root;
     LIST_ENTRY itemlist;
+    tree_data** index;
+    uint32_t index_len;
+    uint32_t index_alloc;
+    bool index_valid;
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_hash;
     uint64_t new_address;
@@ -421,6 +442,114 @@ typedef struct _tree {
     uint8_t* buf;
 } tree;
 
+typedef struct {
+    uint64_t address;
+    uint64_t generation;
+    LIST_ENTRY list_entry_hash;
+    LIST_ENTRY list_entry_lru;
+    uint8_t data[1];
+} node_cache_entry;
+
+#define NODE_CACHE_BUCKETS 1024
+#define TREE_READAHEAD_NODES 4
+
+typedef struct {
+    struct _device_extension* Vcb;
+    uint64_t address;
+    uint64_t generation;
+    KEVENT event;
+    LONG refcount;
+    LIST_ENTRY list_entry;
+    WORK_QUEUE_ITEM item;
+} tree_readahead;
+
+typedef struct {
+    FAST_MUTEX mutex;
+    LIST_ENTRY* hash;
+    LIST_ENTRY lru;
+    uint64_t size;
+    uint64_t max_size;
+    uint64_t hits;
+    uint64_t misses;
+    LIST_ENTRY readaheads;
+    ULONG num_readaheads;
+    KEVENT readaheads_done;
+} node_cache;
+
+typedef struct {
+    uint64_t address;
+    uint64_t generation;
+    uint32_t length;
+    LONGLONG decomp_time;
+    LIST_ENTRY list_entry_hash;
+    LIST_ENTRY list_entry_lru;
+    uint8_t data[1];
+} decomp_cache_entry;
+
+#define DECOMP_CACHE_BUCKETS 256
+
+typedef struct {
+    FAST_MUTEX mutex;
+    LIST_ENTRY* hash;
+    LIST_ENTRY lru;
+    uint64_t size;
+    uint64_t max_size;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t time_saved; // in performance counter ticks
+    LARGE_INTEGER freq;
+} decomp_cache;
+
+typedef struct {
+    FAST_MUTEX mutex;
+    KEVENT event;
+    bool running;
+    uint64_t started;
+    uint64_t completed;
+    NTSTATUS status;
+    ULONG waiting;
+    uint64_t num_commits;
+    uint64_t num_requests;
+    ULONG max_coalesced;
+    ULONG last_coalesced;
+    uint64_t total_latency; // in performance counter ticks
+    uint64_t max_latency;
+    uint64_t last_latency;
+    LARGE_INTEGER freq;
+} commit_queue;
+
+typedef struct {
+    LONG dirty_inodes;
+    LONG dirty_extents;
+    LONG kicked;
+    uint64_t early_commits;
+    uint64_t throttled;
+} writeback_state;
+
+typedef struct {
+    KEY key;
+    uint16_t size;
+    LIST_ENTRY list_entry;
+    uint8_t data[1];
+} log_item;
+
+typedef struct {
+    uint64_t subvol;
+    uint64_t inode;
+    LIST_ENTRY items;
+    LIST_ENTRY csums;
+    LIST_ENTRY list_entry;
+} log_inode;
+
+typedef struct {
+    superblock committed_sb; // what's on disk, which the log gets replayed on top of
+    BTRFS_UUID chunk_tree_uuid;
+    LIST_ENTRY inodes;
+    LIST_ENTRY leaves; // the leaves that are on disk now, so the unchanged ones can be reused
+    uint64_t* blocks;
+    ULONG num_blocks;
+} log_tree;
+
 typedef struct {
     ERESOURCE load_tree_lock;
 } root_nonpaged;
@@ -489,6 +618,8 @@ typedef struct {
     uint64_t size;
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_size;
+    avl_node node;
+    avl_node node_size;
 } space;
 
 typedef struct {
@@ -539,7 +670,10 @@ typedef struct {
     fcb* old_cache;
     LIST_ENTRY space;
     LIST_ENTRY space_size;
+    avl_node* space_tree;
+    avl_node* space_size_tree;
     LIST_ENTRY deleting;
+    LIST_ENTRY pinned;
     LIST_ENTRY changed_extents;
     LIST_ENTRY range_locks;
     ERESOURCE range_locks_lock;
@@ -563,6 +697,18 @@ typedef struct {
     LIST_ENTRY list_entry_balance;
 } chunk;
 
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    chunk* c;
+} chunk_map_entry;
+
+typedef struct _chunk_map {
+    struct _chunk_map* prev;
+    ULONG alloc;
+    chunk_map_entry entries[1];
+} chunk_map;
+
 typedef struct {
     uint64_t address;
     uint64_t size;
@@ -594,29 +740,67 @@ typedef struct {
     LIST_ENTRY list_entry;
 } sys_chunk;
 
+typedef enum {
+    calc_job_csum,
+    calc_job_check_csum,
+    calc_job_comp,
+    calc_job_read
+} calc_job_type;
+
+typedef struct {
+    uint8_t* in;
+    uint32_t inlen;
+    uint8_t* out;
+    uint32_t outlen;
+    uint32_t complen;
+    NTSTATUS Status;
+} calc_comp_piece;
+
 typedef struct {
+    fcb* fcb;
+    extent* ext;
+    uint64_t off;
+    uint32_t read;
+    uint8_t* data;
+    void* csum;
+    bool direct;
+    PIRP Irp;
+    NTSTATUS Status;
+    LIST_ENTRY list_entry;
+} read_part;
+
+typedef struct {
+    calc_job_type type;
     uint8_t* data;
-    uint32_t* csum;
-    uint32_t sectors;
+    void* csum;
+    uint8_t compression;
+    calc_comp_piece* pieces;
+    read_part** read_parts;
+    uint32_t sectors; // number of pieces for calc_job_comp and calc_job_read
+    uint32_t block;
     LONG pos, done;
+    LONG workers, max_workers;
+    bool error;
     KEVENT event;
     LONG refcount;
+    struct _drv_calc_thread* thread;
     LIST_ENTRY list_entry;
 } calc_job;
 
-typedef struct {
+typedef struct _drv_calc_thread {
     PDEVICE_OBJECT DeviceObject;
     HANDLE handle;
+    LIST_ENTRY job_list;
+    FAST_MUTEX lock;
+    KEVENT event;
     KEVENT finished;
     bool quit;
 } drv_calc_thread;
 
 typedef struct {
     ULONG num_threads;
-    LIST_ENTRY job_list;
-    ERESOURCE lock;
     drv_calc_thread* threads;
-    KEVENT event;
+    LONG next_thread;
 } drv_calc_threads;
 
 typedef struct {
@@ -627,8 +811,15 @@ typedef struct {
     bool readonly;
     uint32_t zlib_level;
     uint32_t zstd_level;
+    uint32_t lzo_level;
     uint32_t flush_interval;
     uint32_t max_inline;
+    uint32_t node_cache_size;
+    uint32_t decomp_cache_size;
+    uint32_t max_read_ahead;
+    uint32_t dirty_inode_limit;
+    uint32_t dirty_extent_limit;
+    uint32_t max_write_delay;
     uint64_t subvol_id;
     bool skip_balance;
     bool no_barrier;
@@ -719,6 +910,10 @@ typedef struct _device_extension {
 #endif
     uint64_t devices_loaded;
     superblock superblock;
+    superblock commit_sb;
+    LONG commit_pending;
+    LIST_ENTRY commit_tree_writes;
+    uint16_t csum_size;
     bool readonly;
     bool removing;
     bool locked;
@@ -760,6 +955,11 @@ typedef struct _device_extension {
     LIST_ENTRY trees_hash;
     LIST_ENTRY* trees_ptrs[256];
     FAST_MUTEX trees_list_mutex;
+    node_cache node_cache;
+    decomp_cache decomp_cache;
+    log_tree log;
+    commit_queue commit;
+    writeback_state writeback;
     LIST_ENTRY all_fcbs;
     LIST_ENTRY dirty_fcbs;
     ERESOURCE dirty_fcbs_lock;
@@ -768,6 +968,10 @@ typedef struct _device_extension {
     LIST_ENTRY dirty_subvols;
     ERESOURCE dirty_subvols_lock;
     ERESOURCE chunk_lock;
+    ERESOURCE devices_lock;
+    chunk_map* chunk_map;
+    ULONG chunk_map_len;
+    volatile LONG chunk_map_seq;
     HANDLE flush_thread_handle;
     KTIMER flush_thread_timer;
     KEVENT flush_thread_finished;
@@ -1118,8 +1322,15 @@ extern uint32_t mount_compress_force;
 extern uint32_t mount_compress_type;
 extern uint32_t mount_zlib_level;
 extern uint32_t mount_zstd_level;
+extern uint32_t mount_lzo_level;
 extern uint32_t mount_flush_interval;
 extern uint32_t mount_max_inline;
+extern uint32_t mount_node_cache_size;
+extern uint32_t mount_decomp_cache_size;
+extern uint32_t mount_max_read_ahead;
+extern uint32_t mount_dirty_inode_limit;
+extern uint32_t mount_dirty_extent_limit;
+extern uint32_t mount_max_write_delay;
 extern uint32_t mount_skip_balance;
 extern uint32_t mount_no_barrier;
 extern uint32_t mount_no_trim;
@@ -1127,6 +1338,7 @@ extern uint32_t mount_clear_cache;
 extern uint32_t mount_allow_degraded;
 extern uint32_t mount_readonly;
 extern uint32_t no_pnp;
+extern PKEVENT low_memory_event;
 
 #ifdef _DEBUG
 
@@ -1175,8 +1387,17 @@ void _free_fcb(_Inout_ fcb* fcb, _In_ const char* func);
 void init_fast_io_dispatch(FAST_IO_DISPATCH** fiod);
 
 // in crc32c.c
+void init_crc32c();
 uint32_t calc_crc32c(_In_ uint32_t seed, _In_reads_bytes_(msglen) uint8_t* msg, _In_ ULONG msglen);
 
+// in sha256.c
+#define SHA256_HASH_SIZE 32
+void calc_sha256(uint8_t* hash, const void* input, size_t len);
+
+// in blake2b.c
+#define BLAKE2_HASH_SIZE 32
+void blake2b(void* out, size_t outlen, const void* in, size_t inlen);
+
 typedef struct {
     LIST_ENTRY* list;
     LIST_ENTRY* list_size;
@@ -1236,6 +1457,11 @@ void add_rollback(_In_ LIST_ENTRY* rollback, _In_ enum rollback_type type, _In_
 NTSTATUS commit_batch_list(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* batchlist, PIRP Irp);
 void clear_batch_list(device_extension* Vcb, LIST_ENTRY* batchlist);
 NTSTATUS skip_to_difference(device_extension* Vcb, traverse_ptr* tp, traverse_ptr* tp2, bool* ended1, bool* ended2);
+NTSTATUS init_node_cache(device_extension* Vcb);
+void free_node_cache(device_extension* Vcb);
+void flush_node_cache(device_extension* Vcb);
+void node_cache_add(device_extension* Vcb, uint64_t address, uint8_t* buf);
+void node_cache_remove(device_extension* Vcb, uint64_t address);
 
 // in search.c
 NTSTATUS remove_drive_letter(PDEVICE_OBJECT mountmgr, PUNICODE_STRING devpath);
@@ -1269,6 +1495,9 @@ NTSTATUS truncate_file(fcb* fcb, uint64_t end, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS extend_file(fcb* fcb, file_ref* fileref, uint64_t end, bool prealloc, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, uint64_t end_data, PIRP Irp, LIST_ENTRY* rollback);
 chunk* get_chunk_from_address(device_extension* Vcb, uint64_t address);
+NTSTATUS chunk_map_insert(device_extension* Vcb, chunk* c);
+void chunk_map_remove(device_extension* Vcb, chunk* c);
+void free_chunk_map(device_extension* Vcb);
 NTSTATUS alloc_chunk(device_extension* Vcb, uint64_t flags, chunk** pc, bool full_size);
 NTSTATUS write_data(_In_ device_extension* Vcb, _In_ uint64_t address, _In_reads_bytes_(length) void* data, _In_ uint32_t length, _In_ write_data_context* wtc,
                     _In_opt_ PIRP Irp, _In_opt_ chunk* c, _In_ bool file_write, _In_ uint64_t irp_offset, _In_ ULONG priority);
@@ -1289,11 +1518,14 @@ NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void
 bool find_data_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t length, uint64_t* address);
 void get_raid56_lock_range(chunk* c, uint64_t address, uint64_t length, uint64_t* lockaddr, uint64_t* locklen);
 NTSTATUS calc_csum(_In_ device_extension* Vcb, _In_reads_bytes_(sectors*Vcb->superblock.sector_size) uint8_t* data,
-                   _In_ uint32_t sectors, _Out_writes_bytes_(sectors*sizeof(uint32_t)) uint32_t* csum);
+                   _In_ uint32_t sectors, _Out_writes_bytes_(sectors*Vcb->csum_size) void* csum);
 void add_insert_extent_rollback(LIST_ENTRY* rollback, fcb* fcb, extent* ext);
 NTSTATUS add_extent_to_fcb(_In_ fcb* fcb, _In_ uint64_t offset, _In_reads_bytes_(edsize) EXTENT_DATA* ed, _In_ uint16_t edsize,
-                           _In_ bool unique, _In_opt_ _When_(return >= 0, __drv_aliasesMem) uint32_t* csum, _In_ LIST_ENTRY* rollback);
-void add_extent(_In_ fcb* fcb, _In_ LIST_ENTRY* prevextle, _In_ __drv_aliasesMem extent* newext);
+                           _In_ bool unique, _In_opt_ _When_(return >= 0, __drv_aliasesMem) void* csum, _In_ LIST_ENTRY* rollback);
+void add_extent(_In_ fcb* fcb, _In_ __drv_aliasesMem extent* newext);
+void index_fcb_extent(fcb* fcb, extent* ext);
+void unindex_fcb_extent(fcb* fcb, extent* ext);
+LIST_ENTRY* find_fcb_extent(fcb* fcb, uint64_t offset);
 
 // in dirctrl.c
 
@@ -1363,7 +1595,9 @@ NTSTATUS open_fileref(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusiv
                       _In_ bool case_sensitive, _In_opt_ PIRP Irp);
 NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb,
                   root* subvol, uint64_t inode, uint8_t type, PANSI_STRING utf8, bool always_add_hl, fcb* parent, fcb** pfcb, POOL_TYPE pooltype, PIRP Irp);
-NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, uint32_t* csum, uint64_t start, uint64_t length, PIRP Irp);
+NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, void* csum, uint64_t start, uint64_t length, PIRP Irp);
+NTSTATUS load_extent_csum(device_extension* Vcb, fcb* fcb, extent* ext, PIRP Irp);
+void fcb_load_csums(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, PIRP Irp);
 NTSTATUS load_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, bool ignore_size, PIRP Irp);
 NTSTATUS add_dir_child(fcb* fcb, uint64_t inode, bool subvol, PANSI_STRING utf8, PUNICODE_STRING name, uint8_t type, dir_child** pdc);
 NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb,
@@ -1381,6 +1615,7 @@ void do_unlock_volume(device_extension* Vcb);
 void trim_whole_device(device* dev);
 void flush_subvol_fcbs(root* subvol);
 bool fcb_is_inline(fcb* fcb);
+void flush_fcb_caches(device_extension* Vcb);
 
 // in flushthread.c
 
@@ -1393,14 +1628,20 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp);
 NTSTATUS write_data_phys(_In_ PDEVICE_OBJECT device, _In_ PFILE_OBJECT fileobj, _In_ uint64_t address,
                          _In_reads_bytes_(length) void* data, _In_ uint32_t length);
 bool is_tree_unique(device_extension* Vcb, tree* t, PIRP Irp);
-NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, bool no_free);
-void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, uint32_t* csum, PIRP Irp);
+NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes);
+void free_tree_writes(LIST_ENTRY* tree_writes);
+NTSTATUS add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, void* csum, PIRP Irp);
 bool find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t* address);
 void add_trim_entry_avoid_sb(device_extension* Vcb, device* dev, uint64_t address, uint64_t size);
 NTSTATUS insert_tree_item_batch(LIST_ENTRY* batchlist, device_extension* Vcb, root* r, uint64_t objid, uint8_t objtype, uint64_t offset,
                                 _In_opt_ _When_(return >= 0, __drv_aliasesMem) void* data, uint16_t datalen, enum batch_operation operation);
 NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* ps);
 NTSTATUS update_dev_item(device_extension* Vcb, device* device, PIRP Irp);
+NTSTATUS write_superblock_copies(device_extension* Vcb, superblock* sb);
+void flush_disk_caches(device_extension* Vcb);
+NTSTATUS group_commit(device_extension* Vcb, PIRP Irp);
+void check_writeback(device_extension* Vcb);
+void throttle_writer(device_extension* Vcb);
 
 // in read.c
 
@@ -1408,14 +1649,27 @@ _Dispatch_type_(IRP_MJ_READ)
 _Function_class_(DRIVER_DISPATCH)
 NTSTATUS __stdcall drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 
-NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t length, _In_reads_bytes_opt_(length*sizeof(uint32_t)/Vcb->superblock.sector_size) uint32_t* csum,
+NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t length, _In_reads_bytes_opt_(length*Vcb->csum_size/Vcb->superblock.sector_size) void* csum,
                    _In_ bool is_tree, _Out_writes_bytes_(length) uint8_t* buf, _In_opt_ chunk* c, _Out_opt_ chunk** pc, _In_opt_ PIRP Irp, _In_ uint64_t generation, _In_ bool file_read,
                    _In_ ULONG priority);
 NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULONG* pbr, PIRP Irp);
+NTSTATUS read_file_part(read_part* rp);
 NTSTATUS read_stream(fcb* fcb, uint8_t* data, uint64_t start, ULONG length, ULONG* pbr);
 NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read);
-NTSTATUS check_csum(device_extension* Vcb, uint8_t* data, uint32_t sectors, uint32_t* csum);
+bool acquire_fcb_for_read(fcb* fcb, bool wait, bool* acquired_tree_lock);
+void update_read_ahead(PFILE_OBJECT FileObject, uint64_t start, ULONG length);
+NTSTATUS check_csum(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum);
+void get_sector_csum(device_extension* Vcb, void* buf, void* csum);
+bool check_sector_csum(device_extension* Vcb, void* buf, void* csum);
+void get_tree_checksum(device_extension* Vcb, tree_header* th, void* csum);
+bool check_tree_checksum(device_extension* Vcb, tree_header* th);
+void calc_superblock_checksum(superblock* sb);
+bool check_superblock_checksum(superblock* sb);
 void raid6_recover2(uint8_t* sectors, uint16_t num_stripes, ULONG sector_size, uint16_t missing1, uint16_t missing2, uint8_t* out);
+NTSTATUS init_decomp_cache(device_extension* Vcb);
+void free_decomp_cache(device_extension* Vcb);
+void flush_decomp_cache(device_extension* Vcb);
+void decomp_cache_remove(device_extension* Vcb, uint64_t address);
 
 // in pnp.c
 
@@ -1426,6 +1680,11 @@ NTSTATUS __stdcall drv_pnp(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS pnp_surprise_removal(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS pnp_query_remove_device(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 
+// in avl.c
+void avl_link(avl_node** root, avl_node* n, avl_node* parent, avl_node** link);
+void avl_remove(avl_node** root, avl_node* n);
+avl_node* avl_next(avl_node* n);
+
 // in free-space.c
 NTSTATUS load_cache_chunk(device_extension* Vcb, chunk* c, PIRP Irp);
 NTSTATUS clear_free_space_cache(device_extension* Vcb, LIST_ENTRY* batchlist, PIRP Irp);
@@ -1433,6 +1692,9 @@ NTSTATUS allocate_cache(device_extension* Vcb, bool* changed, PIRP Irp, LIST_ENT
 NTSTATUS update_chunk_caches(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS update_chunk_caches_tree(device_extension* Vcb, PIRP Irp);
 NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t offset, uint64_t size);
+void index_space_entry(space* s, LIST_ENTRY* list_size);
+space* find_space_entry(chunk* c, uint64_t address);
+space* find_space_best_fit(chunk* c, uint64_t length);
 void space_list_add(chunk* c, uint64_t address, uint64_t length, LIST_ENTRY* rollback);
 void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address, uint64_t length, chunk* c, LIST_ENTRY* rollback);
 void space_list_subtract(chunk* c, bool deleting, uint64_t address, uint64_t length, LIST_ENTRY* rollback);
@@ -1471,14 +1733,26 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb);
 void watch_registry(HANDLE regh);
 
 // in compress.c
+void init_compression_contexts();
+void free_compression_contexts();
 NTSTATUS zlib_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen);
 NTSTATUS lzo_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t inpageoff);
 NTSTATUS zstd_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen);
-NTSTATUS write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, bool* compressed, PIRP Irp, LIST_ENTRY* rollback);
+bool compression_worthwhile(const uint8_t* data, uint32_t len);
+uint8_t get_compression_type(fcb* fcb);
+uint32_t get_compression_buffer_size(uint8_t type, uint32_t inlen);
+NTSTATUS compress_data(device_extension* Vcb, uint8_t type, uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t* complen);
+NTSTATUS write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, uint8_t type, uint8_t* comp_data, uint32_t complen,
+                              PIRP Irp, LIST_ENTRY* rollback);
 
 // in galois.c
 void galois_double(uint8_t* data, uint32_t len);
+void galois_double_xor(uint8_t* data, uint8_t* in, uint32_t len);
+void galois_mul(uint8_t* data, uint8_t c, uint32_t len);
+void galois_mul_xor(uint8_t* out, uint8_t* in, uint8_t c, uint32_t len);
 void galois_divpower(uint8_t* data, uint8_t div, uint32_t readlen);
+void galois_recover2(uint8_t* p, uint8_t* q, uint8_t* pxy, uint8_t* qxy, uint16_t x, uint16_t y, uint32_t len);
+void do_xor_multi(uint8_t* out, uint8_t** in, uint16_t num_in, uint32_t len);
 uint8_t gpow2(uint8_t e);
 uint8_t gmul(uint8_t a, uint8_t b);
 uint8_t gdiv(uint8_t a, uint8_t b);
@@ -1494,8 +1768,17 @@ NTSTATUS __stdcall drv_device_control(IN PDEVICE_OBJECT DeviceObject, IN PIRP Ir
 _Function_class_(KSTART_ROUTINE)
 void __stdcall calc_thread(void* context);
 
-NTSTATUS add_calc_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, uint32_t* csum, calc_job** pcj);
+NTSTATUS add_calc_job(device_extension* Vcb, calc_job_type type, uint8_t* data, uint32_t sectors, void* csum, calc_job** pcj);
 void free_calc_job(calc_job* cj);
+NTSTATUS do_calc_job(device_extension* Vcb, calc_job_type type, uint8_t* data, uint32_t sectors, void* csum);
+NTSTATUS do_calc_job_comp(device_extension* Vcb, uint8_t compression, calc_comp_piece* pieces, uint32_t num_pieces);
+NTSTATUS do_calc_job_read(device_extension* Vcb, read_part** parts, uint32_t num_parts);
+
+// in log-tree.c
+NTSTATUS sync_fcb(device_extension* Vcb, fcb* fcb, PIRP Irp);
+void clear_log_tree(device_extension* Vcb);
+void free_log_tree(device_extension* Vcb);
+NTSTATUS replay_log_tree(device_extension* Vcb, PIRP Irp);
 
 // in balance.c
 NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode);
@@ -1555,7 +1838,7 @@ void __stdcall check_system_root(PDRIVER_OBJECT DriverObject, PVOID Context, ULO
 // based on function in sys/sysmacros.h
 #define makedev(major, minor) (((minor) & 0xFF) | (((major) & 0xFFF) << 8) | (((uint64_t)((minor) & ~0xFF)) << 12) | (((uint64_t)((major) & ~0xFFF)) << 32))
 
-#define fast_io_possible(fcb) (!FsRtlAreThereCurrentFileLocks(&fcb->lock) && !fcb->Vcb->readonly ? FastIoIsPossible : FastIoIsQuestionable)
+#define fast_io_possible(fcb) (!FsRtlAreThereCurrentFileLocks(&fcb->lock) && !fcb->Vcb->readonly && !fcb->csums_unloaded ? FastIoIsPossible : FastIoIsQuestionable)
 
 static __inline void print_open_trees(device_extension* Vcb) {
     LIST_ENTRY* le = Vcb->trees.Flink;
@@ -1740,6 +2023,12 @@ typedef NTSTATUS (*tFsRtlGetNextExtraCreateParameter)(PECP_LIST EcpList, PVOID C
 
 typedef NTSTATUS (*tFsRtlValidateReparsePointBuffer)(ULONG BufferLength, PREPARSE_DATA_BUFFER ReparseBuffer);
 
+typedef NTSTATUS (*tKeSaveExtendedProcessorState)(ULONG64 Mask, PXSTATE_SAVE XStateSave);
+
+typedef VOID (*tKeRestoreExtendedProcessorState)(PXSTATE_SAVE XStateSave);
+
+typedef ULONG64 (*tRtlGetEnabledExtendedFeatures)(ULONG64 FeatureMask);
+
 #ifndef _MSC_VER
 PEPROCESS PsGetThreadProcess(_In_ PETHREAD Thread); // not in mingw
 #endif
@@ -36,6 +36,7 @@
 #define FSCTL_BTRFS_SEND_SUBVOL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x846, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_READ_SEND_BUFFER CTL_CODE(FILE_DEVICE_UNKNOWN, 0x847, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_RESIZE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x848, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_COMMIT_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x849, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 
 typedef struct {
     uint64_t subvol;
@@ -278,3 +279,13 @@ typedef struct {
     uint64_t device;
     uint64_t size;
 } btrfs_resize;
+
+typedef struct {
+    uint64_t num_commits;
+    uint64_t num_requests;
+    uint32_t max_coalesced;
+    uint32_t last_coalesced;
+    uint64_t total_latency; // in microseconds
+    uint64_t max_latency;
+    uint64_t last_latency;
+} btrfs_commit_stats;
@@ -59,12 +59,15 @@ static void __stdcall release_from_lazy_write(PVOID Context) {
 static BOOLEAN __stdcall acquire_for_read_ahead(PVOID Context, BOOLEAN Wait) {
     PFILE_OBJECT FileObject = Context;
     fcb* fcb = FileObject->FsContext;
+    bool acquired_tree_lock;
 
     TRACE("(%p, %u)\n", Context, Wait);
 
-    if (!ExAcquireResourceSharedLite(fcb->Header.Resource, Wait))
+    if (!acquire_fcb_for_read(fcb, Wait, &acquired_tree_lock))
         return false;
 
+    fcb->read_ahead_tree_lock = acquired_tree_lock;
+
     IoSetTopLevelIrp((PIRP)FSRTL_CACHE_TOP_LEVEL_IRP);
 
     return true;
@@ -73,11 +76,18 @@ static BOOLEAN __stdcall acquire_for_read_ahead(PVOID Context, BOOLEAN Wait) {
 static void __stdcall release_from_read_ahead(PVOID Context) {
     PFILE_OBJECT FileObject = Context;
     fcb* fcb = FileObject->FsContext;
+    bool release_tree_lock;
 
     TRACE("(%p)\n", Context);
 
+    release_tree_lock = fcb->read_ahead_tree_lock;
+    fcb->read_ahead_tree_lock = false;
+
     ExReleaseResourceLite(fcb->Header.Resource);
 
+    if (release_tree_lock)
+        ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+
     if (IoGetTopLevelIrp() == (PIRP)FSRTL_CACHE_TOP_LEVEL_IRP)
         IoSetTopLevelIrp(NULL);
 }
@@ -19,7 +19,41 @@
 
 #define SECTOR_BLOCK 16
 
-NTSTATUS add_calc_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, uint32_t* csum, calc_job** pcj) {
+// the most extents a single read_file will have in flight at once
+#define READ_QUEUE_DEPTH 8
+
+static void queue_calc_job(device_extension* Vcb, calc_job* cj) {
+    drv_calc_thread* thread;
+    ULONG i, num, start;
+
+    cj->pos = 0;
+    cj->done = 0;
+    cj->error = false;
+    cj->refcount = 1;
+    cj->workers = 0;
+    KeInitializeEvent(&cj->event, NotificationEvent, false);
+
+    start = (ULONG)InterlockedIncrement(&Vcb->calcthreads.next_thread) % Vcb->calcthreads.num_threads;
+    thread = &Vcb->calcthreads.threads[start];
+
+    cj->thread = thread;
+
+    ExAcquireFastMutex(&thread->lock);
+    InsertTailList(&thread->job_list, &cj->list_entry);
+    ExReleaseFastMutex(&thread->lock);
+
+    // wake up as many threads as there are pieces - the others will steal it from this queue
+    num = min(Vcb->calcthreads.num_threads, (cj->sectors + cj->block - 1) / cj->block);
+
+    if (cj->max_workers != 0)
+        num = min(num, (ULONG)cj->max_workers);
+
+    for (i = 0; i < num; i++) {
+        KeSetEvent(&Vcb->calcthreads.threads[(start + i) % Vcb->calcthreads.num_threads].event, 0, false);
+    }
+}
+
+NTSTATUS add_calc_job(device_extension* Vcb, calc_job_type type, uint8_t* data, uint32_t sectors, void* csum, calc_job** pcj) {
     calc_job* cj;
 
     cj = ExAllocatePoolWithTag(NonPagedPool, sizeof(calc_job), ALLOC_TAG);
@@ -28,22 +62,19 @@ NTSTATUS add_calc_job(device_extension* Vcb, uint8_t* data, uint32_t sectors, ui
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    cj->type = type;
     cj->data = data;
     cj->sectors = sectors;
     cj->csum = csum;
-    cj->pos = 0;
-    cj->done = 0;
-    cj->refcount = 1;
-    KeInitializeEvent(&cj->event, NotificationEvent, false);
-
-    ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, true);
-
-    InsertTailList(&Vcb->calcthreads.job_list, &cj->list_entry);
+    cj->pieces = NULL;
+    cj->read_parts = NULL;
+    cj->max_workers = 0;
 
-    KeSetEvent(&Vcb->calcthreads.event, 0, false);
-    KeClearEvent(&Vcb->calcthreads.event);
+    // Aim for about four pieces per thread, so that a thread which finishes early
+    // can take work from one which is lagging behind.
+    cj->block = max(SECTOR_BLOCK, sectors / (Vcb->calcthreads.num_threads * 4));
 
-    ExReleaseResourceLite(&Vcb->calcthreads.lock);
+    queue_calc_job(Vcb, cj);
 
     *pcj = cj;
 
@@ -57,72 +88,246 @@ void free_calc_job(calc_job* cj) {
         ExFreePool(cj);
 }
 
-static bool do_calc(device_extension* Vcb, calc_job* cj) {
-    LONG pos, done;
-    uint32_t* csum;
-    uint8_t* data;
-    ULONG blocksize, i;
+static void do_calc(device_extension* Vcb, calc_job* cj) {
+    while (true) {
+        LONG pos, done;
+        uint8_t* csum;
+        uint8_t* data;
+        ULONG blocksize, i;
+
+        pos = InterlockedExchangeAdd(&cj->pos, cj->block);
+
+        if ((uint32_t)pos >= cj->sectors)
+            return;
 
-    pos = InterlockedIncrement(&cj->pos) - 1;
+        blocksize = min(cj->block, cj->sectors - pos);
 
-    if ((uint32_t)pos * SECTOR_BLOCK >= cj->sectors)
-        return false;
+        // if we've taken the last piece, nobody else needs to be able to find the job
+        if ((uint32_t)pos + blocksize == cj->sectors) {
+            ExAcquireFastMutex(&cj->thread->lock);
+            RemoveEntryList(&cj->list_entry);
+            ExReleaseFastMutex(&cj->thread->lock);
+        }
+
+        switch (cj->type) {
+            case calc_job_csum:
+                csum = (uint8_t*)cj->csum + (pos * Vcb->csum_size);
+                data = cj->data + (pos * Vcb->superblock.sector_size);
 
-    csum = &cj->csum[pos * SECTOR_BLOCK];
-    data = cj->data + (pos * SECTOR_BLOCK * Vcb->superblock.sector_size);
+                for (i = 0; i < blocksize; i++) {
+                    get_sector_csum(Vcb, data, csum);
+                    csum += Vcb->csum_size;
+                    data += Vcb->superblock.sector_size;
+                }
+                break;
 
-    blocksize = min(SECTOR_BLOCK, cj->sectors - (pos * SECTOR_BLOCK));
-    for (i = 0; i < blocksize; i++) {
-        *csum = ~calc_crc32c(0xffffffff, data, Vcb->superblock.sector_size);
-        csum++;
-        data += Vcb->superblock.sector_size;
+            case calc_job_check_csum:
+                csum = (uint8_t*)cj->csum + (pos * Vcb->csum_size);
+                data = cj->data + (pos * Vcb->superblock.sector_size);
+
+                for (i = 0; i < blocksize && !cj->error; i++) {
+                    if (!check_sector_csum(Vcb, data, csum))
+                        cj->error = true;
+
+                    csum += Vcb->csum_size;
+                    data += Vcb->superblock.sector_size;
+                }
+                break;
+
+            case calc_job_comp:
+                for (i = 0; i < blocksize; i++) {
+                    calc_comp_piece* cp = &cj->pieces[pos + i];
+
+                    if (!Vcb->options.compress_force && !compression_worthwhile(cp->in, cp->inlen)) {
+                        cp->complen = 0;
+                        cp->Status = STATUS_SUCCESS;
+                        continue;
+                    }
+
+                    cp->Status = compress_data(Vcb, cj->compression, cp->in, cp->inlen, cp->out, cp->outlen, &cp->complen);
+
+                    if (!NT_SUCCESS(cp->Status))
+                        cj->error = true;
+                }
+                break;
+
+            case calc_job_read:
+                for (i = 0; i < blocksize; i++) {
+                    read_part* rp = cj->read_parts[pos + i];
+
+                    rp->Status = read_file_part(rp);
+
+                    if (!NT_SUCCESS(rp->Status))
+                        cj->error = true;
+                }
+                break;
+        }
+
+        done = InterlockedExchangeAdd(&cj->done, blocksize) + blocksize;
+
+        if ((uint32_t)done == cj->sectors)
+            KeSetEvent(&cj->event, 0, false);
     }
+}
+
+static calc_job* get_calc_job(device_extension* Vcb, drv_calc_thread* thread) {
+    ULONG i, start = (ULONG)(thread - Vcb->calcthreads.threads);
 
-    done = InterlockedIncrement(&cj->done);
+    // look at our own queue first, then try the others
+    for (i = 0; i < Vcb->calcthreads.num_threads; i++) {
+        drv_calc_thread* t = &Vcb->calcthreads.threads[(start + i) % Vcb->calcthreads.num_threads];
+        LIST_ENTRY* le;
 
-    if ((uint32_t)done * SECTOR_BLOCK >= cj->sectors) {
-        ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, true);
-        RemoveEntryList(&cj->list_entry);
-        ExReleaseResourceLite(&Vcb->calcthreads.lock);
+        ExAcquireFastMutex(&t->lock);
+
+        le = t->job_list.Flink;
+        while (le != &t->job_list) {
+            calc_job* cj = CONTAINING_RECORD(le, calc_job, list_entry);
+
+            if ((uint32_t)cj->pos < cj->sectors && (cj->max_workers == 0 || cj->workers < cj->max_workers)) {
+                InterlockedIncrement(&cj->refcount);
+                InterlockedIncrement(&cj->workers);
+                ExReleaseFastMutex(&t->lock);
+                return cj;
+            }
 
-        KeSetEvent(&cj->event, 0, false);
+            le = le->Flink;
+        }
+
+        ExReleaseFastMutex(&t->lock);
     }
 
-    return true;
+    return NULL;
 }
 
-_Function_class_(KSTART_ROUTINE)
-void __stdcall calc_thread(void* context) {
-    drv_calc_thread* thread = context;
-    device_extension* Vcb = thread->DeviceObject->DeviceExtension;
+NTSTATUS do_calc_job(device_extension* Vcb, calc_job_type type, uint8_t* data, uint32_t sectors, void* csum) {
+    NTSTATUS Status;
+    calc_job* cj;
 
-    ObReferenceObject(thread->DeviceObject);
+    Status = add_calc_job(Vcb, type, data, sectors, csum, &cj);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_calc_job returned %08x\n", Status);
+        return Status;
+    }
 
-    while (true) {
-        KeWaitForSingleObject(&Vcb->calcthreads.event, Executive, KernelMode, false, NULL);
+    // do some of the work ourselves rather than just waiting
+    do_calc(Vcb, cj);
+
+    KeWaitForSingleObject(&cj->event, Executive, KernelMode, false, NULL);
+
+    Status = cj->error ? STATUS_CRC_ERROR : STATUS_SUCCESS;
+
+    free_calc_job(cj);
 
-        while (true) {
-            calc_job* cj;
-            bool b;
+    return Status;
+}
 
-            ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, true);
+// Compresses each of the pieces, spreading them over the calc threads. The caller
+// is expected to write them out in order afterwards.
+NTSTATUS do_calc_job_comp(device_extension* Vcb, uint8_t compression, calc_comp_piece* pieces, uint32_t num_pieces) {
+    NTSTATUS Status;
+    calc_job* cj;
+    uint32_t i;
 
-            if (IsListEmpty(&Vcb->calcthreads.job_list)) {
-                ExReleaseResourceLite(&Vcb->calcthreads.lock);
+    cj = ExAllocatePoolWithTag(NonPagedPool, sizeof(calc_job), ALLOC_TAG);
+    if (!cj) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    cj->type = calc_job_comp;
+    cj->data = NULL;
+    cj->csum = NULL;
+    cj->compression = compression;
+    cj->pieces = pieces;
+    cj->read_parts = NULL;
+    cj->sectors = num_pieces;
+    cj->block = 1;
+    cj->max_workers = 0;
+
+    queue_calc_job(Vcb, cj);
+
+    do_calc(Vcb, cj);
+
+    KeWaitForSingleObject(&cj->event, Executive, KernelMode, false, NULL);
+
+    Status = STATUS_SUCCESS;
+
+    if (cj->error) {
+        for (i = 0; i < num_pieces; i++) {
+            if (!NT_SUCCESS(pieces[i].Status)) {
+                Status = pieces[i].Status;
                 break;
             }
+        }
+    }
 
-            cj = CONTAINING_RECORD(Vcb->calcthreads.job_list.Flink, calc_job, list_entry);
-            cj->refcount++;
+    free_calc_job(cj);
 
-            ExReleaseResourceLite(&Vcb->calcthreads.lock);
+    return Status;
+}
 
-            b = do_calc(Vcb, cj);
+// Reads the parts of a file that read_file needs from disk, several at a time, so that
+// fragmented files aren't read one extent's round trip after another. Each part is checked
+// and decompressed by whichever thread read it.
+NTSTATUS do_calc_job_read(device_extension* Vcb, read_part** parts, uint32_t num_parts) {
+    NTSTATUS Status;
+    calc_job* cj;
+    uint32_t i;
 
-            free_calc_job(cj);
+    cj = ExAllocatePoolWithTag(NonPagedPool, sizeof(calc_job), ALLOC_TAG);
+    if (!cj) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    cj->type = calc_job_read;
+    cj->data = NULL;
+    cj->csum = NULL;
+    cj->pieces = NULL;
+    cj->read_parts = parts;
+    cj->sectors = num_parts;
+    cj->block = 1;
+    cj->max_workers = READ_QUEUE_DEPTH - 1; // we're doing some ourselves as well
+
+    queue_calc_job(Vcb, cj);
+
+    do_calc(Vcb, cj);
+
+    KeWaitForSingleObject(&cj->event, Executive, KernelMode, false, NULL);
 
-            if (!b)
+    Status = STATUS_SUCCESS;
+
+    if (cj->error) {
+        for (i = 0; i < num_parts; i++) {
+            if (!NT_SUCCESS(parts[i]->Status)) {
+                Status = parts[i]->Status;
                 break;
+            }
+        }
+    }
+
+    free_calc_job(cj);
+
+    return Status;
+}
+
+_Function_class_(KSTART_ROUTINE)
+void __stdcall calc_thread(void* context) {
+    drv_calc_thread* thread = context;
+    device_extension* Vcb = thread->DeviceObject->DeviceExtension;
+
+    ObReferenceObject(thread->DeviceObject);
+
+    while (true) {
+        calc_job* cj;
+
+        KeWaitForSingleObject(&thread->event, Executive, KernelMode, false, NULL);
+
+        while ((cj = get_calc_job(Vcb, thread))) {
+            do_calc(Vcb, cj);
+            InterlockedDecrement(&cj->workers);
+            free_calc_job(cj);
         }
 
         if (thread->quit)
@@ -20,11 +20,11 @@
 // Portions of the LZO decompression code here were cribbed from code in
 // libavcodec, also under the LGPL. Thank you, Reimar Doeffinger.
 
-// The LZO compression code comes from v0.22 of lzo, written way back in
+// The LZO compressor originally came from v0.22 of lzo, written way back in
 // 1996, and available here:
 // https://www.ibiblio.org/pub/historic-linux/ftp-archives/sunsite.unc.edu/Sep-29-1996/libs/lzo-0.22.tar.gz
-// Modern versions of lzo are licensed under the GPL, but the very oldest
-// versions are under the LGPL and hence okay to use here.
+// It has since been replaced with a hash-chain match finder, but still produces
+// the same LZO1X streams that Linux expects.
 
 #include "btrfs_drv.h"
 
@@ -48,37 +48,27 @@ typedef struct {
     uint8_t* out;
     uint32_t outlen;
     uint32_t outpos;
-    bool error;
     void* wrkmem;
 } lzo_stream;
 
-#define LZO1X_MEM_COMPRESS ((uint32_t) (16384L * sizeof(uint8_t*)))
+#define LZO_HASH_BITS 12
+// hashes the first three bytes of v, so that we can find M2 matches of length 3
+#define LZO_HASH(v) ((((v) << 8) * 2654435761u) >> (32 - LZO_HASH_BITS))
 
-#define M1_MAX_OFFSET 0x0400
-#define M2_MAX_OFFSET 0x0800
-#define M3_MAX_OFFSET 0x4000
-#define M4_MAX_OFFSET 0xbfff
+#define LZO_MAX_LEVEL 9
+#define LZO_MAX_INSERT_LEN 32
 
-#define MX_MAX_OFFSET (M1_MAX_OFFSET + M2_MAX_OFFSET)
+typedef struct {
+    uint16_t head[1 << LZO_HASH_BITS];
+    uint16_t chain[LZO_PAGE_SIZE];
+} lzo_dict;
 
-#define M1_MARKER 0
-#define M2_MARKER 64
-#define M3_MARKER 32
-#define M4_MARKER 16
+#define LZO1X_MEM_COMPRESS sizeof(lzo_dict)
 
-#define _DV2(p, shift1, shift2) (((( (uint32_t)(p[2]) << shift1) ^ p[1]) << shift2) ^ p[0])
-#define DVAL_NEXT(dv, p) dv ^= p[-1]; dv = (((dv) >> 5) ^ ((uint32_t)(p[2]) << (2*5)))
-#define _DV(p, shift) _DV2(p, shift, shift)
-#define DVAL_FIRST(dv, p) dv = _DV((p), 5)
-#define _DINDEX(dv, p) ((40799u * (dv)) >> 5)
-#define DINDEX(dv, p) (((_DINDEX(dv, p)) & 0x3fff) << 0)
-#define UPDATE_D(dict, cycle, dv, p) dict[DINDEX(dv, p)] = (p)
-#define UPDATE_I(dict, cycle, index, p) dict[index] = (p)
+#define M2_MAX_OFFSET 0x0800
 
-#define LZO_CHECK_MPOS_NON_DET(m_pos, m_off, in, ip, max_offset) \
-    ((void*) m_pos < (void*) in || \
-    (m_off = (uint8_t*) ip - (uint8_t*) m_pos) <= 0 || \
-    m_off > max_offset)
+#define M3_MARKER 32
+#define M4_MARKER 16
 
 #define LZO_BYTE(x) ((unsigned char) (x))
 
@@ -92,178 +82,240 @@ static void zstd_free(void* opaque, void* address);
 
 ZSTD_customMem zstd_mem = { .customAlloc = zstd_malloc, .customFree = zstd_free, .opaque = NULL };
 
-static uint8_t lzo_nextbyte(lzo_stream* stream) {
-    uint8_t c;
+// Decompression works a token at a time: the lengths are bounds-checked once, and then
+// the bytes are copied without any further checks. Wherever there's at least eight bytes
+// of slack at the end of both buffers, copies are done eight bytes at a time, possibly
+// writing a few bytes past the end of the run, which get overwritten by whatever comes next.
 
-    if (stream->inpos >= stream->inlen) {
-        stream->error = true;
-        return 0;
-    }
+#define LZO_COPY_SLACK sizeof(uint64_t)
 
-    c = stream->in[stream->inpos];
-    stream->inpos++;
+static __inline void lzo_copy8(uint8_t* dest, const uint8_t* src) {
+    uint64_t v;
 
-    return c;
+    RtlCopyMemory(&v, src, sizeof(uint64_t));
+    RtlCopyMemory(dest, &v, sizeof(uint64_t));
 }
 
-static int lzo_len(lzo_stream* stream, int byte, int mask) {
-    int len = byte & mask;
+static __inline void lzo_copy_literal(uint8_t* op, const uint8_t* ip, uint32_t len, size_t inroom, size_t outroom) {
+    if (len <= 32 && inroom >= len + LZO_COPY_SLACK && outroom >= len + LZO_COPY_SLACK) {
+        uint8_t* end = op + len;
 
-    if (len == 0) {
-        while (!(byte = lzo_nextbyte(stream))) {
-            if (stream->error) return 0;
-
-            len += 255;
-        }
+        do {
+            lzo_copy8(op, ip);
+            op += sizeof(uint64_t);
+            ip += sizeof(uint64_t);
+        } while (op < end);
+    } else
+        RtlCopyMemory(op, ip, len);
+}
 
-        len += mask + byte;
-    }
+static __inline void lzo_copy_match(uint8_t* op, uint32_t back, uint32_t len, size_t outroom) {
+    const uint8_t* src = op - back;
 
-    return len;
-}
+    // if the distance is less than eight the source and destination overlap within
+    // a single word, so we have to go byte by byte - unless it's a run of one byte
+    if (back >= sizeof(uint64_t) && outroom >= len + LZO_COPY_SLACK) {
+        uint8_t* end = op + len;
 
-static void lzo_copy(lzo_stream* stream, int len) {
-    if (stream->inpos + len > stream->inlen) {
-        stream->error = true;
-        return;
+        do {
+            lzo_copy8(op, src);
+            op += sizeof(uint64_t);
+            src += sizeof(uint64_t);
+        } while (op < end);
+    } else if (back == 1)
+        RtlFillMemory(op, len, *src);
+    else {
+        while (len > 0) {
+            *op = *src;
+            op++;
+            src++;
+            len--;
+        }
     }
+}
 
-    if (stream->outpos + len > stream->outlen) {
-        stream->error = true;
-        return;
-    }
+// Reads the extended length of a literal run or match, where a zero in the bottom
+// bits of the instruction means that the length follows as a series of zero bytes,
+// each worth 255, and a final non-zero byte.
+static __inline bool lzo_len(const uint8_t** ipp, const uint8_t* ip_end, uint32_t byte, uint32_t mask, uint32_t* len) {
+    const uint8_t* ip = *ipp;
+    uint32_t l = byte & mask;
+
+    if (l == 0) {
+        while (ip < ip_end && *ip == 0) {
+            l += 255;
+            ip++;
+        }
 
-    do {
-        stream->out[stream->outpos] = stream->in[stream->inpos];
-        stream->inpos++;
-        stream->outpos++;
-        len--;
-    } while (len > 0);
-}
+        if (ip == ip_end)
+            return false;
 
-static void lzo_copyback(lzo_stream* stream, uint32_t back, int len) {
-    if (stream->outpos < back) {
-        stream->error = true;
-        return;
+        l += mask + *ip;
+        ip++;
     }
 
-    if (stream->outpos + len > stream->outlen) {
-        stream->error = true;
-        return;
-    }
+    *ipp = ip;
+    *len = l;
 
-    do {
-        stream->out[stream->outpos] = stream->out[stream->outpos - back];
-        stream->outpos++;
-        len--;
-    } while (len > 0);
+    return true;
 }
 
 static NTSTATUS do_lzo_decompress(lzo_stream* stream) {
-    uint8_t byte;
-    uint32_t len, back;
-    bool backcopy = false;
+    const uint8_t* ip = stream->in;
+    const uint8_t* ip_end = stream->in + stream->inlen;
+    uint8_t* op = stream->out;
+    uint8_t* op_end = stream->out + stream->outlen;
+    uint32_t byte, len, back, state;
+
+    // state is the number of literals copied after the last match, or 4 after a literal run -
+    // this decides what an instruction byte less than 16 means
 
-    stream->error = false;
+    if (ip == ip_end)
+        return STATUS_INTERNAL_ERROR;
 
-    byte = lzo_nextbyte(stream);
-    if (stream->error) return STATUS_INTERNAL_ERROR;
+    byte = *ip;
+    ip++;
 
     if (byte > 17) {
-        lzo_copy(stream, min((uint8_t)(byte - 17), (uint32_t)(stream->outlen - stream->outpos)));
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+        len = byte - 17;
+        state = len < 4 ? len : 4;
 
-        if (stream->outlen == stream->outpos)
-            return STATUS_SUCCESS;
+        len = min(len, (uint32_t)(op_end - op));
 
-        byte = lzo_nextbyte(stream);
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+        if ((size_t)(ip_end - ip) < len)
+            return STATUS_INTERNAL_ERROR;
 
-        if (byte < 16) return STATUS_INTERNAL_ERROR;
-    }
+        lzo_copy_literal(op, ip, len, ip_end - ip, op_end - op);
+        ip += len;
+        op += len;
 
-    while (1) {
-        if (byte >> 4) {
-            backcopy = true;
-            if (byte >> 6) {
-                len = (byte >> 5) - 1;
-                back = (lzo_nextbyte(stream) << 3) + ((byte >> 2) & 7) + 1;
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-            } else if (byte >> 5) {
-                len = lzo_len(stream, byte, 31);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-
-                byte = lzo_nextbyte(stream);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-
-                back = (lzo_nextbyte(stream) << 6) + (byte >> 2) + 1;
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-            } else {
-                len = lzo_len(stream, byte, 7);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-
-                back = (1 << 14) + ((byte & 8) << 11);
-
-                byte = lzo_nextbyte(stream);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-
-                back += (lzo_nextbyte(stream) << 6) + (byte >> 2);
-                if (stream->error) return STATUS_INTERNAL_ERROR;
-
-                if (back == (1 << 14)) {
-                    if (len != 1)
-                        return STATUS_INTERNAL_ERROR;
-                    break;
-                }
+        if (op == op_end)
+            goto end;
+
+        if (ip == ip_end)
+            return STATUS_INTERNAL_ERROR;
+
+        byte = *ip;
+        ip++;
+    } else
+        state = 0;
+
+    while (true) {
+        if (byte >= 64) { // M2: 3 to 8 bytes, up to 2 KB back
+            if (ip == ip_end)
+                return STATUS_INTERNAL_ERROR;
+
+            len = (byte >> 5) - 1;
+            back = (*ip << 3) + ((byte >> 2) & 7) + 1;
+            ip++;
+        } else if (byte >= 32) { // M3: up to 16 KB back
+            if (!lzo_len(&ip, ip_end, byte, 31, &len))
+                return STATUS_INTERNAL_ERROR;
+
+            if (ip_end - ip < 2)
+                return STATUS_INTERNAL_ERROR;
+
+            byte = ip[0];
+            back = (ip[1] << 6) + (byte >> 2) + 1;
+            ip += 2;
+        } else if (byte >= 16) { // M4: 16 KB to 48 KB back, or the end-of-stream marker
+            if (!lzo_len(&ip, ip_end, byte, 7, &len))
+                return STATUS_INTERNAL_ERROR;
+
+            if (ip_end - ip < 2)
+                return STATUS_INTERNAL_ERROR;
+
+            back = (1 << 14) + ((byte & 8) << 11);
+            byte = ip[0];
+            back += (ip[1] << 6) + (byte >> 2);
+            ip += 2;
+
+            if (back == (1 << 14)) {
+                if (len != 1)
+                    return STATUS_INTERNAL_ERROR;
+
+                break;
             }
-        } else if (backcopy) {
-            len = 0;
-            back = (lzo_nextbyte(stream) << 2) + (byte >> 2) + 1;
-            if (stream->error) return STATUS_INTERNAL_ERROR;
-        } else {
-            len = lzo_len(stream, byte, 15);
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+        } else if (state == 0) { // literal run
+            if (!lzo_len(&ip, ip_end, byte, 15, &len))
+                return STATUS_INTERNAL_ERROR;
 
-            lzo_copy(stream, min(len + 3, stream->outlen - stream->outpos));
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+            len = min(len + 3, (uint32_t)(op_end - op));
 
-            if (stream->outlen == stream->outpos)
-                return STATUS_SUCCESS;
+            if ((size_t)(ip_end - ip) < len)
+                return STATUS_INTERNAL_ERROR;
+
+            lzo_copy_literal(op, ip, len, ip_end - ip, op_end - op);
+            ip += len;
+            op += len;
 
-            byte = lzo_nextbyte(stream);
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+            if (op == op_end)
+                goto end;
 
-            if (byte >> 4)
-                continue;
+            if (ip == ip_end)
+                return STATUS_INTERNAL_ERROR;
+
+            byte = *ip;
+            ip++;
+            state = 4;
+
+            continue;
+        } else if (state == 4) { // M1 after a literal run: 3 bytes, 2 KB to 3 KB back
+            if (ip == ip_end)
+                return STATUS_INTERNAL_ERROR;
 
             len = 1;
-            back = (1 << 11) + (lzo_nextbyte(stream) << 2) + (byte >> 2) + 1;
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+            back = (1 << 11) + (*ip << 2) + (byte >> 2) + 1;
+            ip++;
+        } else { // M1: 2 bytes, up to 1 KB back
+            if (ip == ip_end)
+                return STATUS_INTERNAL_ERROR;
 
-            break;
+            len = 0;
+            back = (*ip << 2) + (byte >> 2) + 1;
+            ip++;
         }
 
-        lzo_copyback(stream, back, min(len + 2, stream->outlen - stream->outpos));
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+        if ((size_t)(op - stream->out) < back)
+            return STATUS_INTERNAL_ERROR;
+
+        len = min(len + 2, (uint32_t)(op_end - op));
 
-        if (stream->outlen == stream->outpos)
-            return STATUS_SUCCESS;
+        lzo_copy_match(op, back, len, op_end - op);
+        op += len;
 
-        len = byte & 3;
+        if (op == op_end)
+            goto end;
 
-        if (len) {
-            lzo_copy(stream, min(len, stream->outlen - stream->outpos));
-            if (stream->error) return STATUS_INTERNAL_ERROR;
+        // up to three literals follow a match, given by the bottom bits of its last byte
 
-            if (stream->outlen == stream->outpos)
-                return STATUS_SUCCESS;
-        } else
-            backcopy = !backcopy;
+        state = byte & 3;
+
+        if (state > 0) {
+            len = min(state, (uint32_t)(op_end - op));
+
+            if ((size_t)(ip_end - ip) < len)
+                return STATUS_INTERNAL_ERROR;
+
+            lzo_copy_literal(op, ip, len, ip_end - ip, op_end - op);
+            ip += len;
+            op += len;
+
+            if (op == op_end)
+                goto end;
+        }
+
+        if (ip == ip_end)
+            return STATUS_INTERNAL_ERROR;
 
-        byte = lzo_nextbyte(stream);
-        if (stream->error) return STATUS_INTERNAL_ERROR;
+        byte = *ip;
+        ip++;
     }
 
+end:
+    stream->inpos = (uint32_t)(ip - stream->in);
+    stream->outpos = (uint32_t)(op - stream->out);
+
     return STATUS_SUCCESS;
 }
 
@@ -325,497 +377,576 @@ static void zlib_free(void* opaque, void* ptr) {
     ExFreePool(ptr);
 }
 
-NTSTATUS zlib_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen) {
-    z_stream c_stream;
-    int ret;
+// Idle compression and decompression streams, kept so that we don't have to allocate
+// and initialize hundreds of KB of state for every extent. They're shared between all
+// volumes, and reset before being handed out again.
+
+typedef struct {
+    uint8_t type;
+    bool decompress;
+    unsigned int level;
+    z_stream zs;
+    ZSTD_CStream* zcs;
+    ZSTD_DStream* zds;
+    void* lzo_wrkmem;
+    LIST_ENTRY list_entry;
+} comp_context;
+
+static LIST_ENTRY comp_contexts;
+static ULONG num_comp_contexts, max_comp_contexts;
+static FAST_MUTEX comp_contexts_mutex;
+
+void init_compression_contexts() {
+    InitializeListHead(&comp_contexts);
+    ExInitializeFastMutex(&comp_contexts_mutex);
+
+    num_comp_contexts = 0;
+    max_comp_contexts = get_num_of_processors() * 2;
+}
 
-    c_stream.zalloc = zlib_alloc;
-    c_stream.zfree = zlib_free;
-    c_stream.opaque = (voidpf)0;
+static void free_comp_context(comp_context* ctx) {
+    if (ctx->type == BTRFS_COMPRESSION_ZLIB) {
+        if (ctx->decompress)
+            inflateEnd(&ctx->zs);
+        else
+            deflateEnd(&ctx->zs);
+    } else if (ctx->type == BTRFS_COMPRESSION_ZSTD) {
+        if (ctx->decompress)
+            ZSTD_freeDStream(ctx->zds);
+        else
+            ZSTD_freeCStream(ctx->zcs);
+    } else if (ctx->type == BTRFS_COMPRESSION_LZO)
+        ExFreePool(ctx->lzo_wrkmem);
 
-    ret = inflateInit(&c_stream);
+    ExFreePool(ctx);
+}
 
-    if (ret != Z_OK) {
-        ERR("inflateInit returned %08x\n", ret);
-        return STATUS_INTERNAL_ERROR;
+void free_compression_contexts() {
+    while (!IsListEmpty(&comp_contexts)) {
+        comp_context* ctx = CONTAINING_RECORD(RemoveHeadList(&comp_contexts), comp_context, list_entry);
+
+        free_comp_context(ctx);
     }
 
-    c_stream.next_in = inbuf;
-    c_stream.avail_in = inlen;
+    num_comp_contexts = 0;
+}
 
-    c_stream.next_out = outbuf;
-    c_stream.avail_out = outlen;
+static comp_context* create_comp_context(uint8_t type, bool decompress, unsigned int level) {
+    comp_context* ctx;
+    int ret;
 
-    do {
-        ret = inflate(&c_stream, Z_NO_FLUSH);
+    ctx = ExAllocatePoolWithTag(PagedPool, sizeof(comp_context), ALLOC_TAG);
+    if (!ctx) {
+        ERR("out of memory\n");
+        return NULL;
+    }
 
-        if (ret != Z_OK && ret != Z_STREAM_END) {
-            ERR("inflate returned %08x\n", ret);
-            inflateEnd(&c_stream);
-            return STATUS_INTERNAL_ERROR;
+    ctx->type = type;
+    ctx->decompress = decompress;
+    ctx->level = level;
+
+    if (type == BTRFS_COMPRESSION_ZLIB) {
+        ctx->zs.zalloc = zlib_alloc;
+        ctx->zs.zfree = zlib_free;
+        ctx->zs.opaque = (voidpf)0;
+
+        if (decompress) {
+            ret = inflateInit(&ctx->zs);
+
+            if (ret != Z_OK) {
+                ERR("inflateInit returned %08x\n", ret);
+                ExFreePool(ctx);
+                return NULL;
+            }
+        } else {
+            ret = deflateInit(&ctx->zs, level);
+
+            if (ret != Z_OK) {
+                ERR("deflateInit returned %08x\n", ret);
+                ExFreePool(ctx);
+                return NULL;
+            }
         }
+    } else if (type == BTRFS_COMPRESSION_LZO) {
+        ctx->lzo_wrkmem = ExAllocatePoolWithTag(PagedPool, LZO1X_MEM_COMPRESS, ALLOC_TAG);
 
-        if (c_stream.avail_out == 0)
-            break;
-    } while (ret != Z_STREAM_END);
+        if (!ctx->lzo_wrkmem) {
+            ERR("out of memory\n");
+            ExFreePool(ctx);
+            return NULL;
+        }
+    } else {
+        if (decompress) {
+            ctx->zds = ZSTD_createDStream_advanced(zstd_mem);
 
-    ret = inflateEnd(&c_stream);
+            if (!ctx->zds) {
+                ERR("ZSTD_createDStream failed.\n");
+                ExFreePool(ctx);
+                return NULL;
+            }
+        } else {
+            ctx->zcs = ZSTD_createCStream_advanced(zstd_mem);
 
-    if (ret != Z_OK) {
-        ERR("inflateEnd returned %08x\n", ret);
-        return STATUS_INTERNAL_ERROR;
+            if (!ctx->zcs) {
+                ERR("ZSTD_createCStream failed.\n");
+                ExFreePool(ctx);
+                return NULL;
+            }
+        }
     }
 
-    // FIXME - if we're short, should we zero the end of outbuf so we don't leak information into userspace?
-
-    return STATUS_SUCCESS;
+    return ctx;
 }
 
-static NTSTATUS zlib_write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, bool* compressed, PIRP Irp, LIST_ENTRY* rollback) {
-    NTSTATUS Status;
-    uint8_t compression;
-    uint32_t comp_length;
-    uint8_t* comp_data;
-    uint32_t out_left;
+static comp_context* get_comp_context(uint8_t type, bool decompress, unsigned int level) {
     LIST_ENTRY* le;
-    chunk* c;
-    z_stream c_stream;
-    int ret;
 
-    comp_data = ExAllocatePoolWithTag(PagedPool, (uint32_t)(end_data - start_data), ALLOC_TAG);
-    if (!comp_data) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+    if (decompress)
+        level = 0;
+
+    ExAcquireFastMutex(&comp_contexts_mutex);
+
+    le = comp_contexts.Flink;
+    while (le != &comp_contexts) {
+        comp_context* ctx = CONTAINING_RECORD(le, comp_context, list_entry);
+
+        if (ctx->type == type && ctx->decompress == decompress && ctx->level == level) {
+            RemoveEntryList(&ctx->list_entry);
+            num_comp_contexts--;
+
+            ExReleaseFastMutex(&comp_contexts_mutex);
+
+            // zstd streams get reset by their init functions, which reuse the existing workspace
+            if (type == BTRFS_COMPRESSION_ZLIB) {
+                int ret = decompress ? inflateReset(&ctx->zs) : deflateReset(&ctx->zs);
+
+                if (ret != Z_OK) {
+                    ERR("zlib reset returned %08x\n", ret);
+                    free_comp_context(ctx);
+                    return create_comp_context(type, decompress, level);
+                }
+            }
+
+            return ctx;
+        }
+
+        le = le->Flink;
     }
 
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        return Status;
+    ExReleaseFastMutex(&comp_contexts_mutex);
+
+    return create_comp_context(type, decompress, level);
+}
+
+// Puts a stream back on the idle list - if it's in an unknown state after an error, we free it instead.
+static void put_comp_context(comp_context* ctx, bool reuse) {
+    comp_context* old = NULL;
+
+    if (!reuse) {
+        free_comp_context(ctx);
+        return;
     }
 
-    c_stream.zalloc = zlib_alloc;
-    c_stream.zfree = zlib_free;
-    c_stream.opaque = (voidpf)0;
+    ExAcquireFastMutex(&comp_contexts_mutex);
 
-    ret = deflateInit(&c_stream, fcb->Vcb->options.zlib_level);
+    InsertHeadList(&comp_contexts, &ctx->list_entry);
+    num_comp_contexts++;
 
-    if (ret != Z_OK) {
-        ERR("deflateInit returned %08x\n", ret);
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+    if (num_comp_contexts > max_comp_contexts) {
+        old = CONTAINING_RECORD(RemoveTailList(&comp_contexts), comp_context, list_entry);
+        num_comp_contexts--;
     }
 
-    c_stream.avail_in = (uint32_t)(end_data - start_data);
-    c_stream.next_in = data;
-    c_stream.avail_out = (uint32_t)(end_data - start_data);
-    c_stream.next_out = comp_data;
+    ExReleaseFastMutex(&comp_contexts_mutex);
+
+    if (old)
+        free_comp_context(old);
+}
+
+NTSTATUS zlib_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen) {
+    comp_context* ctx;
+    z_stream* c_stream;
+    int ret;
+
+    ctx = get_comp_context(BTRFS_COMPRESSION_ZLIB, true, 0);
+    if (!ctx)
+        return STATUS_INTERNAL_ERROR;
+
+    c_stream = &ctx->zs;
+
+    c_stream->next_in = inbuf;
+    c_stream->avail_in = inlen;
+
+    c_stream->next_out = outbuf;
+    c_stream->avail_out = outlen;
 
     do {
-        ret = deflate(&c_stream, Z_FINISH);
+        ret = inflate(c_stream, Z_NO_FLUSH);
 
-        if (ret == Z_STREAM_ERROR) {
-            ERR("deflate returned %x\n", ret);
-            ExFreePool(comp_data);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            ERR("inflate returned %08x\n", ret);
+            put_comp_context(ctx, false);
             return STATUS_INTERNAL_ERROR;
         }
-    } while (c_stream.avail_in > 0 && c_stream.avail_out > 0);
 
-    out_left = c_stream.avail_out;
+        if (c_stream->avail_out == 0)
+            break;
+    } while (ret != Z_STREAM_END);
+
+    put_comp_context(ctx, true);
+
+    // FIXME - if we're short, should we zero the end of outbuf so we don't leak information into userspace?
+
+    return STATUS_SUCCESS;
+}
 
-    ret = deflateEnd(&c_stream);
+static NTSTATUS zlib_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, unsigned int level, uint32_t* complen) {
+    comp_context* ctx;
+    z_stream* c_stream;
+    int ret;
 
-    if (ret != Z_OK) {
-        ERR("deflateEnd returned %08x\n", ret);
-        ExFreePool(comp_data);
+    ctx = get_comp_context(BTRFS_COMPRESSION_ZLIB, false, level);
+    if (!ctx)
         return STATUS_INTERNAL_ERROR;
-    }
 
-    if (out_left < fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
+    c_stream = &ctx->zs;
 
-        comp_length = (uint32_t)(end_data - start_data);
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
+    c_stream->avail_in = inlen;
+    c_stream->next_in = inbuf;
+    c_stream->avail_out = outlen;
+    c_stream->next_out = outbuf;
 
-        *compressed = false;
-    } else {
-        uint32_t cl;
+    do {
+        ret = deflate(c_stream, Z_FINISH);
 
-        compression = BTRFS_COMPRESSION_ZLIB;
-        cl = (uint32_t)(end_data - start_data - out_left);
-        comp_length = (uint32_t)sector_align(cl, fcb->Vcb->superblock.sector_size);
+        if (ret == Z_STREAM_ERROR) {
+            ERR("deflate returned %x\n", ret);
+            put_comp_context(ctx, false);
+            return STATUS_INTERNAL_ERROR;
+        }
+    } while (c_stream->avail_in > 0 && c_stream->avail_out > 0);
 
-        RtlZeroMemory(comp_data + cl, comp_length - cl);
+    // if we ran out of space, the data isn't worth compressing
+    *complen = ret == Z_STREAM_END ? outlen - c_stream->avail_out : 0;
 
-        *compressed = true;
-    }
+    // deflateReset copes with unfinished streams, so we can reuse this either way
+    put_comp_context(ctx, true);
 
-    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, true);
+    return STATUS_SUCCESS;
+}
 
-    le = fcb->Vcb->chunks.Flink;
-    while (le != &fcb->Vcb->chunks) {
-        c = CONTAINING_RECORD(le, chunk, list_entry);
+static __inline uint32_t lzo_read32(const uint8_t* p) {
+    uint32_t v;
 
-        if (!c->readonly && !c->reloc) {
-            acquire_chunk_lock(c, fcb->Vcb);
+    RtlCopyMemory(&v, p, sizeof(uint32_t));
 
-            if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-                if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, false, comp_data, Irp, rollback, compression, end_data - start_data, false, 0)) {
-                    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    return v;
+}
 
-                    if (compression != BTRFS_COMPRESSION_NONE)
-                        ExFreePool(comp_data);
+static __inline uint64_t lzo_read64(const uint8_t* p) {
+    uint64_t v;
 
-                    return STATUS_SUCCESS;
-                }
-            }
+    RtlCopyMemory(&v, p, sizeof(uint64_t));
 
-            release_chunk_lock(c, fcb->Vcb);
-        }
+    return v;
+}
 
-        le = le->Flink;
+// Returns the number of the lowest set bit, which on little-endian is the first byte that
+// differs in two words XORed together (times eight). v must be non-zero.
+static __inline unsigned int lzo_lowest_bit(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long index;
+
+#ifdef _WIN64
+    _BitScanForward64(&index, v);
+#else
+    if (!_BitScanForward(&index, (uint32_t)v)) {
+        _BitScanForward(&index, (uint32_t)(v >> 32));
+        index += 32;
     }
+#endif
 
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    return index;
+#else
+    return __builtin_ctzll(v);
+#endif
+}
 
-    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, true);
+// Returns how many bytes at m and ip are the same, stopping at end.
+static __inline uint32_t lzo_match_len(const uint8_t* m, const uint8_t* ip, const uint8_t* end) {
+    const uint8_t* start = ip;
 
-    Status = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags, &c, false);
+    while ((size_t)(end - ip) >= sizeof(uint64_t)) {
+        uint64_t diff = lzo_read64(m) ^ lzo_read64(ip);
 
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+        if (diff != 0)
+            return (uint32_t)(ip - start) + (lzo_lowest_bit(diff) / 8);
 
-    if (!NT_SUCCESS(Status)) {
-        ERR("alloc_chunk returned %08x\n", Status);
+        m += sizeof(uint64_t);
+        ip += sizeof(uint64_t);
+    }
 
-        if (compression != BTRFS_COMPRESSION_NONE)
-            ExFreePool(comp_data);
+    while (ip < end && *m == *ip) {
+        m++;
+        ip++;
+    }
 
-        return Status;
+    return (uint32_t)(ip - start);
+}
+
+// Long lengths are stored after the instruction byte as a run of zeroes worth 255 each,
+// followed by the remainder.
+static __inline uint8_t* lzo_store_extra_length(uint8_t* op, uint32_t len) {
+    while (len > 255) {
+        len -= 255;
+        *op = 0;
+        op++;
     }
 
-    if (c) {
-        acquire_chunk_lock(c, fcb->Vcb);
+    *op = LZO_BYTE(len);
+    op++;
 
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, false, comp_data, Irp, rollback, compression, end_data - start_data, false, 0)) {
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
+    return op;
+}
 
-                return STATUS_SUCCESS;
-            }
-        }
+// Short runs are copied sixteen bytes at a time, which can write past the end of the run -
+// this is fine, as the output buffer is sized for lzo_max_outlen, which has far more slack
+// than the worst case of a page of literals.
+static uint8_t* lzo_store_literals(uint8_t* op, uint8_t* out, const uint8_t* ii, uint32_t t, const uint8_t* in_end) {
+    if (op == out && t <= 238) {
+        *op = LZO_BYTE(17 + t);
+        op++;
+    } else if (t <= 3) // stored in the bottom bits of the previous match
+        op[-2] |= LZO_BYTE(t);
+    else if (t <= 18) {
+        *op = LZO_BYTE(t - 3);
+        op++;
+    } else {
+        *op = 0;
+        op = lzo_store_extra_length(op + 1, t - 18);
+    }
 
-        release_chunk_lock(c, fcb->Vcb);
+    if (t <= 16 && in_end - ii >= 16) {
+        lzo_copy8(op, ii);
+        lzo_copy8(op + 8, ii + 8);
+    } else
+        RtlCopyMemory(op, ii, t);
+
+    return op + t;
+}
+
+static uint8_t* lzo_store_match(uint8_t* op, uint32_t m_len, uint32_t m_off) {
+    m_off--;
+
+    if (m_len <= 8 && m_off < M2_MAX_OFFSET) {
+        op[0] = LZO_BYTE(((m_len - 1) << 5) | ((m_off & 7) << 2));
+        op[1] = LZO_BYTE(m_off >> 3);
+
+        return op + 2;
     }
 
-    WARN("couldn't find any data chunks with %I64x bytes free\n", comp_length);
+    if (m_len <= 33) {
+        *op = LZO_BYTE(M3_MARKER | (m_len - 2));
+        op++;
+    } else {
+        *op = M3_MARKER;
+        op = lzo_store_extra_length(op + 1, m_len - 33);
+    }
 
-    if (compression != BTRFS_COMPRESSION_NONE)
-        ExFreePool(comp_data);
+    op[0] = LZO_BYTE((m_off & 63) << 2);
+    op[1] = LZO_BYTE(m_off >> 6);
 
-    return STATUS_DISK_FULL;
+    return op + 2;
 }
 
-static NTSTATUS lzo_do_compress(const uint8_t* in, uint32_t in_len, uint8_t* out, uint32_t* out_len, void* wrkmem) {
-    const uint8_t* ip;
-    uint32_t dv;
-    uint8_t* op;
+// Compresses a single page into an LZO1X stream, minus the end marker. Candidate matches are
+// found through a hash of the next four bytes, which heads a chain of earlier positions with
+// the same hash. The level is how far down the chain we look: level 1 only tries the most
+// recent position, which is roughly what LZO1X-1 does, and every level above that doubles
+// the search depth and also indexes the positions inside each short match.
+static NTSTATUS lzo_do_compress(const uint8_t* in, uint32_t in_len, uint8_t* out, uint32_t* out_len, void* wrkmem, uint32_t level) {
+    lzo_dict* dict = (lzo_dict*)wrkmem;
+    const uint8_t* ip = in;
+    const uint8_t* ii = in;
     const uint8_t* in_end = in + in_len;
-    const uint8_t* ip_end = in + in_len - 9 - 4;
-    const uint8_t* ii;
-    const uint8_t** dict = (const uint8_t**)wrkmem;
-
-    op = out;
-    ip = in;
-    ii = ip;
-
-    DVAL_FIRST(dv, ip); UPDATE_D(dict, cycle, dv, ip); ip++;
-    DVAL_NEXT(dv, ip);  UPDATE_D(dict, cycle, dv, ip); ip++;
-    DVAL_NEXT(dv, ip);  UPDATE_D(dict, cycle, dv, ip); ip++;
-    DVAL_NEXT(dv, ip);  UPDATE_D(dict, cycle, dv, ip); ip++;
-
-    while (1) {
-        const uint8_t* m_pos;
-        uint32_t m_len;
-        ptrdiff_t m_off;
-        uint32_t lit, dindex;
-
-        dindex = DINDEX(dv, ip);
-        m_pos = dict[dindex];
-        UPDATE_I(dict, cycle, dindex, ip);
-
-        if (!LZO_CHECK_MPOS_NON_DET(m_pos, m_off, in, ip, M4_MAX_OFFSET) && m_pos[0] == ip[0] && m_pos[1] == ip[1] && m_pos[2] == ip[2]) {
-            lit = (uint32_t)(ip - ii);
-            m_pos += 3;
-            if (m_off <= M2_MAX_OFFSET)
-                goto match;
-
-            if (lit == 3) { /* better compression, but slower */
-                if (op - 2 <= out)
-                    return STATUS_INTERNAL_ERROR;
+    const uint8_t* ip_limit;
+    uint8_t* op = out;
+    uint32_t max_chain;
 
-                op[-2] |= LZO_BYTE(3);
-                *op++ = *ii++; *op++ = *ii++; *op++ = *ii++;
-                goto code_match;
-            }
+    if (in_len > LZO_PAGE_SIZE)
+        return STATUS_INTERNAL_ERROR;
 
-            if (*m_pos == ip[3])
-                goto match;
-        }
+    if (level < 1)
+        level = 1;
+    else if (level > LZO_MAX_LEVEL)
+        level = LZO_MAX_LEVEL;
 
-        /* a literal */
-        ++ip;
-        if (ip >= ip_end)
-            break;
-        DVAL_NEXT(dv, ip);
-        continue;
+    max_chain = 1 << (level - 1);
 
-        /* a match */
-match:
-        /* store current literal run */
-        if (lit > 0) {
-            uint32_t t = lit;
+    RtlZeroMemory(dict->head, sizeof(dict->head));
 
-            if (t <= 3) {
-                if (op - 2 <= out)
-                    return STATUS_INTERNAL_ERROR;
+    // we need four bytes to look anything up, so the tail always goes out as literals
+    ip_limit = in + (in_len >= sizeof(uint32_t) ? (in_len - sizeof(uint32_t) + 1) : 0);
 
-                op[-2] |= LZO_BYTE(t);
-            } else if (t <= 18)
-                *op++ = LZO_BYTE(t - 3);
-            else {
-                uint32_t tt = t - 18;
+    while (ip < ip_limit) {
+        uint32_t seq = lzo_read32(ip);
+        uint32_t h = LZO_HASH(seq);
+        uint32_t pos = (uint32_t)(ip - in);
+        uint16_t cand = dict->head[h];
+        uint32_t best_len = 0, best_off = 0, depth = max_chain;
 
-                *op++ = 0;
-                while (tt > 255) {
-                    tt -= 255;
-                    *op++ = 0;
-                }
+        // positions are stored plus one, so that zero means an empty slot
+        dict->head[h] = (uint16_t)(pos + 1);
 
-                if (tt <= 0)
-                    return STATUS_INTERNAL_ERROR;
+        if (max_chain > 1)
+            dict->chain[pos] = cand;
+
+        while (cand != 0) {
+            const uint8_t* m = in + cand - 1;
+            uint32_t off = (uint32_t)(ip - m);
+            uint32_t diff = lzo_read32(m) ^ seq;
+            uint32_t len;
+
+            // three-byte matches are only worth it if they're close enough for M2
+            if (diff == 0)
+                len = sizeof(uint32_t) + lzo_match_len(m + sizeof(uint32_t), ip + sizeof(uint32_t), in_end);
+            else if ((diff & 0xffffff) == 0 && off <= M2_MAX_OFFSET)
+                len = 3;
+            else
+                len = 0;
 
-                *op++ = LZO_BYTE(tt);
+            if (len > best_len) {
+                best_len = len;
+                best_off = off;
+
+                if (ip + len == in_end)
+                    break;
             }
 
-            do {
-                *op++ = *ii++;
-            } while (--t > 0);
+            depth--;
+
+            if (depth == 0)
+                break;
+
+            cand = dict->chain[cand - 1];
         }
 
+        if (best_len == 0) {
+            // skip ahead faster the longer we go without finding anything, as in LZO1X-1 -
+            // the higher the level, the longer it takes to kick in
+            uint32_t step = 1 + (uint32_t)((ip - ii) >> (4 + level));
 
-        /* code the match */
-code_match:
-        if (ii != ip)
-            return STATUS_INTERNAL_ERROR;
+            if ((size_t)(ip_limit - ip) <= step)
+                break;
 
-        ip += 3;
-        if (*m_pos++ != *ip++ || *m_pos++ != *ip++ || *m_pos++ != *ip++ ||
-            *m_pos++ != *ip++ || *m_pos++ != *ip++ || *m_pos++ != *ip++) {
-            --ip;
-            m_len = (uint32_t)(ip - ii);
+            ip += step;
+            continue;
+        }
 
-            if (m_len < 3 || m_len > 8)
-                return STATUS_INTERNAL_ERROR;
+        if (ip > ii)
+            op = lzo_store_literals(op, out, ii, (uint32_t)(ip - ii), in_end);
 
-            if (m_off <= M2_MAX_OFFSET) {
-                m_off -= 1;
-                *op++ = LZO_BYTE(((m_len - 1) << 5) | ((m_off & 7) << 2));
-                *op++ = LZO_BYTE(m_off >> 3);
-            } else if (m_off <= M3_MAX_OFFSET) {
-                m_off -= 1;
-                *op++ = LZO_BYTE(M3_MARKER | (m_len - 2));
-                goto m3_m4_offset;
-            } else {
-                m_off -= 0x4000;
-
-                if (m_off <= 0 || m_off > 0x7fff)
-                    return STATUS_INTERNAL_ERROR;
+        op = lzo_store_match(op, best_len, best_off);
 
-                *op++ = LZO_BYTE(M4_MARKER | ((m_off & 0x4000) >> 11) | (m_len - 2));
-                goto m3_m4_offset;
-            }
-        } else {
-            const uint8_t* end;
-            end = in_end;
-            while (ip < end && *m_pos == *ip)
-                m_pos++, ip++;
-            m_len = (uint32_t)(ip - ii);
+        // as with zlib, long matches aren't worth indexing - they're usually runs
+        if (level > 1 && best_len <= LZO_MAX_INSERT_LEN) {
+            const uint8_t* end = ip + best_len;
 
-            if (m_len < 3)
-                return STATUS_INTERNAL_ERROR;
+            ip++;
 
-            if (m_off <= M3_MAX_OFFSET) {
-                m_off -= 1;
-                if (m_len <= 33)
-                    *op++ = LZO_BYTE(M3_MARKER | (m_len - 2));
-                else {
-                    m_len -= 33;
-                    *op++ = M3_MARKER | 0;
-                    goto m3_m4_len;
-                }
-            } else {
-                m_off -= 0x4000;
+            while (ip < end && ip < ip_limit) {
+                h = LZO_HASH(lzo_read32(ip));
+                pos = (uint32_t)(ip - in);
 
-                if (m_off <= 0 || m_off > 0x7fff)
-                    return STATUS_INTERNAL_ERROR;
+                dict->chain[pos] = dict->head[h];
+                dict->head[h] = (uint16_t)(pos + 1);
 
-                if (m_len <= 9)
-                    *op++ = LZO_BYTE(M4_MARKER | ((m_off & 0x4000) >> 11) | (m_len - 2));
-                else {
-                    m_len -= 9;
-                    *op++ = LZO_BYTE(M4_MARKER | ((m_off & 0x4000) >> 11));
-m3_m4_len:
-                    while (m_len > 255) {
-                        m_len -= 255;
-                        *op++ = 0;
-                    }
-
-                    if (m_len <= 0)
-                        return STATUS_INTERNAL_ERROR;
-
-                    *op++ = LZO_BYTE(m_len);
-                }
+                ip++;
             }
 
-m3_m4_offset:
-            *op++ = LZO_BYTE((m_off & 63) << 2);
-            *op++ = LZO_BYTE(m_off >> 6);
-        }
+            ip = end;
+        } else
+            ip += best_len;
 
         ii = ip;
-        if (ip >= ip_end)
-            break;
-        DVAL_FIRST(dv, ip);
     }
 
-    /* store final literal run */
-    if (in_end - ii > 0) {
-        uint32_t t = (uint32_t)(in_end - ii);
-
-        if (op == out && t <= 238)
-            *op++ = LZO_BYTE(17 + t);
-        else if (t <= 3)
-            op[-2] |= LZO_BYTE(t);
-        else if (t <= 18)
-            *op++ = LZO_BYTE(t - 3);
-        else {
-            uint32_t tt = t - 18;
-
-            *op++ = 0;
-            while (tt > 255) {
-                tt -= 255;
-                *op++ = 0;
-            }
-
-            if (tt <= 0)
-                return STATUS_INTERNAL_ERROR;
-
-            *op++ = LZO_BYTE(tt);
-        }
-
-        do {
-            *op++ = *ii++;
-        } while (--t > 0);
-    }
+    if (in_end > ii)
+        op = lzo_store_literals(op, out, ii, (uint32_t)(in_end - ii), in_end);
 
     *out_len = (uint32_t)(op - out);
 
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS lzo1x_1_compress(lzo_stream* stream) {
-    uint8_t *op = stream->out;
-    NTSTATUS Status = STATUS_SUCCESS;
+static NTSTATUS lzo1x_compress(lzo_stream* stream, uint32_t level) {
+    NTSTATUS Status;
+    uint8_t* op;
 
-    if (stream->inlen <= 0)
-        stream->outlen = 0;
-    else if (stream->inlen <= 9 + 4) {
-        *op++ = LZO_BYTE(17 + stream->inlen);
+    Status = lzo_do_compress(stream->in, stream->inlen, stream->out, &stream->outlen, stream->wrkmem, level);
+    if (!NT_SUCCESS(Status))
+        return Status;
 
-        stream->inpos = 0;
-        do {
-            *op++ = stream->in[stream->inpos];
-            stream->inpos++;
-        } while (stream->inlen < stream->inpos);
-        stream->outlen = (uint32_t)(op - stream->out);
-    } else
-        Status = lzo_do_compress(stream->in, stream->inlen, stream->out, &stream->outlen, stream->wrkmem);
-
-    if (Status == STATUS_SUCCESS) {
-        op = stream->out + stream->outlen;
-        *op++ = M4_MARKER | 1;
-        *op++ = 0;
-        *op++ = 0;
-        stream->outlen += 3;
-    }
+    op = stream->out + stream->outlen;
+    *op++ = M4_MARKER | 1;
+    *op++ = 0;
+    *op++ = 0;
+    stream->outlen += 3;
 
-    return Status;
+    return STATUS_SUCCESS;
 }
 
 static __inline uint32_t lzo_max_outlen(uint32_t inlen) {
     return inlen + (inlen / 16) + 64 + 3; // formula comes from LZO.FAQ
 }
 
-static NTSTATUS lzo_write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, bool* compressed, PIRP Irp, LIST_ENTRY* rollback) {
-    NTSTATUS Status;
-    uint8_t compression;
-    uint64_t comp_length;
-    ULONG comp_data_len, num_pages, i;
-    uint8_t* comp_data;
-    bool skip_compression = false;
-    lzo_stream stream;
-    uint32_t* out_size;
-    LIST_ENTRY* le;
-    chunk* c;
-
-    num_pages = (ULONG)((sector_align(end_data - start_data, LZO_PAGE_SIZE)) / LZO_PAGE_SIZE);
+static __inline uint32_t lzo_comp_buffer_size(uint32_t inlen) {
+    ULONG num_pages = (ULONG)(sector_align(inlen, LZO_PAGE_SIZE) / LZO_PAGE_SIZE);
 
     // Four-byte overall header
     // Another four-byte header page
     // Each page has a maximum size of lzo_max_outlen(LZO_PAGE_SIZE)
     // Plus another four bytes for possible padding
-    comp_data_len = sizeof(uint32_t) + ((lzo_max_outlen(LZO_PAGE_SIZE) + (2 * sizeof(uint32_t))) * num_pages);
+    return sizeof(uint32_t) + ((lzo_max_outlen(LZO_PAGE_SIZE) + (2 * sizeof(uint32_t))) * num_pages);
+}
 
-    comp_data = ExAllocatePoolWithTag(PagedPool, comp_data_len, ALLOC_TAG);
-    if (!comp_data) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+static NTSTATUS lzo_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t level, uint32_t* complen) {
+    NTSTATUS Status;
+    ULONG num_pages, i;
+    lzo_stream stream;
+    uint32_t* out_size;
+    comp_context* ctx;
+
+    if (outlen < lzo_comp_buffer_size(inlen)) {
+        ERR("output buffer too small (%x < %x)\n", outlen, lzo_comp_buffer_size(inlen));
+        return STATUS_BUFFER_TOO_SMALL;
     }
 
-    stream.wrkmem = ExAllocatePoolWithTag(PagedPool, LZO1X_MEM_COMPRESS, ALLOC_TAG);
-    if (!stream.wrkmem) {
-        ERR("out of memory\n");
-        ExFreePool(comp_data);
+    num_pages = (ULONG)(sector_align(inlen, LZO_PAGE_SIZE) / LZO_PAGE_SIZE);
+
+    ctx = get_comp_context(BTRFS_COMPRESSION_LZO, false, 0);
+    if (!ctx)
         return STATUS_INSUFFICIENT_RESOURCES;
-    }
 
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        ExFreePool(stream.wrkmem);
-        return Status;
-    }
+    stream.wrkmem = ctx->lzo_wrkmem;
 
-    out_size = (uint32_t*)comp_data;
+    out_size = (uint32_t*)outbuf;
     *out_size = sizeof(uint32_t);
 
-    stream.in = data;
-    stream.out = comp_data + (2 * sizeof(uint32_t));
+    stream.in = inbuf;
+    stream.out = outbuf + (2 * sizeof(uint32_t));
 
     for (i = 0; i < num_pages; i++) {
         uint32_t* pagelen = (uint32_t*)(stream.out - sizeof(uint32_t));
 
-        stream.inlen = (uint32_t)min(LZO_PAGE_SIZE, end_data - start_data - (i * LZO_PAGE_SIZE));
+        stream.inlen = (uint32_t)min(LZO_PAGE_SIZE, inlen - (i * LZO_PAGE_SIZE));
 
-        Status = lzo1x_1_compress(&stream);
+        Status = lzo1x_compress(&stream, level);
         if (!NT_SUCCESS(Status)) {
-            ERR("lzo1x_1_compress returned %08x\n", Status);
-            skip_compression = true;
-            break;
+            ERR("lzo1x_compress returned %08x\n", Status);
+            put_comp_context(ctx, true);
+            *complen = 0;
+            return STATUS_SUCCESS;
         }
 
         *pagelen = stream.outlen;
@@ -831,189 +962,329 @@ static NTSTATUS lzo_write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_t
         }
     }
 
-    ExFreePool(stream.wrkmem);
+    put_comp_context(ctx, true);
 
-    if (skip_compression || *out_size >= end_data - start_data - fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
+    *complen = *out_size;
 
-        comp_length = end_data - start_data;
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
+    return STATUS_SUCCESS;
+}
 
-        *compressed = false;
-    } else {
-        compression = BTRFS_COMPRESSION_LZO;
-        comp_length = sector_align(*out_size, fcb->Vcb->superblock.sector_size);
+static NTSTATUS zstd_compress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t level, uint32_t* complen) {
+    comp_context* ctx;
+    ZSTD_CStream* stream;
+    size_t init_res, written;
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    ZSTD_parameters params;
 
-        RtlZeroMemory(comp_data + *out_size, (ULONG)(comp_length - *out_size));
+    ctx = get_comp_context(BTRFS_COMPRESSION_ZSTD, false, level);
+    if (!ctx)
+        return STATUS_INTERNAL_ERROR;
 
-        *compressed = true;
-    }
+    stream = ctx->zcs;
 
-    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, true);
+    params = ZSTD_getParams(level, inlen, 0);
 
-    le = fcb->Vcb->chunks.Flink;
-    while (le != &fcb->Vcb->chunks) {
-        c = CONTAINING_RECORD(le, chunk, list_entry);
+    if (params.cParams.windowLog > ZSTD_BTRFS_MAX_WINDOWLOG)
+        params.cParams.windowLog = ZSTD_BTRFS_MAX_WINDOWLOG;
 
-        if (!c->readonly && !c->reloc) {
-            acquire_chunk_lock(c, fcb->Vcb);
+    init_res = ZSTD_initCStream_advanced(stream, NULL, 0, params, inlen);
 
-            if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-                if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, false, comp_data, Irp, rollback, compression, end_data - start_data, false, 0)) {
-                    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    if (ZSTD_isError(init_res)) {
+        ERR("ZSTD_initCStream_advanced failed: %s\n", ZSTD_getErrorName(init_res));
+        put_comp_context(ctx, false);
+        return STATUS_INTERNAL_ERROR;
+    }
 
-                    if (compression != BTRFS_COMPRESSION_NONE)
-                        ExFreePool(comp_data);
+    input.src = inbuf;
+    input.size = inlen;
+    input.pos = 0;
 
-                    return STATUS_SUCCESS;
-                }
-            }
+    output.dst = outbuf;
+    output.size = outlen;
+    output.pos = 0;
 
-            release_chunk_lock(c, fcb->Vcb);
+    while (input.pos < input.size && output.pos < output.size) {
+        written = ZSTD_compressStream(stream, &output, &input);
+
+        if (ZSTD_isError(written)) {
+            ERR("ZSTD_compressStream failed: %s\n", ZSTD_getErrorName(written));
+            put_comp_context(ctx, false);
+            return STATUS_INTERNAL_ERROR;
         }
+    }
 
-        le = le->Flink;
+    written = ZSTD_endStream(stream, &output);
+    if (ZSTD_isError(written)) {
+        ERR("ZSTD_endStream failed: %s\n", ZSTD_getErrorName(written));
+        put_comp_context(ctx, false);
+        return STATUS_INTERNAL_ERROR;
     }
 
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    put_comp_context(ctx, true);
 
-    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, true);
+    // if there's anything left to flush, we ran out of space
+    *complen = input.pos == input.size && written == 0 ? (uint32_t)output.pos : 0;
 
-    Status = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags, &c, false);
+    return STATUS_SUCCESS;
+}
 
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+// Compressibility heuristic, run on each extent before we try to compress it. This
+// looks at a sample of the data - 16 bytes out of every 256 - and is loosely based
+// on the one Linux uses (fs/btrfs/compression.c).
 
-    if (!NT_SUCCESS(Status)) {
-        ERR("alloc_chunk returned %08x\n", Status);
+#define HEUR_SAMPLE_STRIDE 256
+#define HEUR_SAMPLE_SIZE 16
+#define HEUR_MIN_LEN 4096
 
-        if (compression != BTRFS_COMPRESSION_NONE)
-            ExFreePool(comp_data);
+#define HEUR_BYTE_SET_SMALL 64
+#define HEUR_CORE_SET_LOW 64
+#define HEUR_CORE_SET_HIGH 200
+#define HEUR_ENTROPY_HIGH 80 // percent of 8 bits per byte
 
-        return Status;
-    }
+#define HEUR_LZ_WINDOW 4096
+#define HEUR_LZ_HASH_BITS 9
+#define HEUR_LZ_MIN_MATCH 4
 
-    if (c) {
-        acquire_chunk_lock(c, fcb->Vcb);
+// four times the base-2 logarithm, rounded down
+static unsigned int ilog2_w(uint32_t v) {
+    uint64_t v4 = (uint64_t)v * v * v * v;
+    unsigned int l = 0;
 
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, false, comp_data, Irp, rollback, compression, end_data - start_data, false, 0)) {
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
+    while (v4 >>= 1) {
+        l++;
+    }
 
-                return STATUS_SUCCESS;
-            }
-        }
+    return l;
+}
 
-        release_chunk_lock(c, fcb->Vcb);
+// the first half of the sample is the same as the second, e.g. zeroes or a repeated pattern
+static bool heur_repeated_pattern(const uint8_t* data, uint32_t num_samples) {
+    uint32_t i, half = num_samples / 2;
+
+    for (i = 0; i < half; i++) {
+        if (RtlCompareMemory(data + (i * HEUR_SAMPLE_STRIDE), data + ((i + half) * HEUR_SAMPLE_STRIDE), HEUR_SAMPLE_SIZE) != HEUR_SAMPLE_SIZE)
+            return false;
     }
 
-    WARN("couldn't find any data chunks with %I64x bytes free\n", comp_length);
+    return true;
+}
 
-    if (compression != BTRFS_COMPRESSION_NONE)
-        ExFreePool(comp_data);
+// Shannon entropy of the sample, as a percentage of 8 bits per byte
+static unsigned int heur_entropy(const uint32_t* counts, uint32_t sample_len) {
+    unsigned int i, base = ilog2_w(sample_len);
+    uint64_t sum = 0;
 
-    return STATUS_DISK_FULL;
+    for (i = 0; i < 256; i++) {
+        if (counts[i] > 0)
+            sum += counts[i] * (base - ilog2_w(counts[i]));
+    }
+
+    sum /= sample_len;
+
+    return (unsigned int)(sum * 100 / (8 * 4));
 }
 
-static NTSTATUS zstd_write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, bool* compressed, PIRP Irp, LIST_ENTRY* rollback) {
-    NTSTATUS Status;
-    uint8_t compression;
-    uint32_t comp_length;
-    uint8_t* comp_data;
-    uint32_t out_left;
-    LIST_ENTRY* le;
-    chunk* c;
-    ZSTD_CStream* stream;
-    size_t init_res, written;
-    ZSTD_inBuffer input;
-    ZSTD_outBuffer output;
-    ZSTD_parameters params;
+// the number of distinct byte values making up 90% of the sample
+static unsigned int heur_core_set(uint32_t* counts, uint32_t sample_len) {
+    unsigned int i, j, n = 0;
+    uint32_t total = 0;
 
-    comp_data = ExAllocatePoolWithTag(PagedPool, (uint32_t)(end_data - start_data), ALLOC_TAG);
-    if (!comp_data) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    // sort the non-zero counts into descending order - there are at most 256 of them
+    for (i = 0; i < 256; i++) {
+        uint32_t c = counts[i];
 
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        return Status;
+        if (c == 0)
+            continue;
+
+        j = n;
+        while (j > 0 && counts[j - 1] < c) {
+            counts[j] = counts[j - 1];
+            j--;
+        }
+
+        counts[j] = c;
+        n++;
     }
 
-    stream = ZSTD_createCStream_advanced(zstd_mem);
+    for (i = 0; i < n; i++) {
+        total += counts[i];
 
-    if (!stream) {
-        ERR("ZSTD_createCStream failed.\n");
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+        if (total * 10 >= sample_len * 9)
+            return i + 1;
     }
 
-    params = ZSTD_getParams(fcb->Vcb->options.zstd_level, (uint32_t)(end_data - start_data), 0);
+    return n;
+}
 
-    if (params.cParams.windowLog > ZSTD_BTRFS_MAX_WINDOWLOG)
-        params.cParams.windowLog = ZSTD_BTRFS_MAX_WINDOWLOG;
+// A quick LZ-style pass over a few KB in the middle of the extent, catching data which has
+// an even spread of byte values but still contains a lot of repeated strings.
+static bool heur_lz_probe(const uint8_t* data, uint32_t len) {
+    uint16_t table[1 << HEUR_LZ_HASH_BITS];
+    const uint8_t *start, *ip, *end;
+    uint32_t matched = 0;
 
-    init_res = ZSTD_initCStream_advanced(stream, NULL, 0, params, (uint32_t)(end_data - start_data));
+    if (len > HEUR_LZ_WINDOW) {
+        start = data + ((len - HEUR_LZ_WINDOW) / 2);
+        len = HEUR_LZ_WINDOW;
+    } else
+        start = data;
 
-    if (ZSTD_isError(init_res)) {
-        ERR("ZSTD_initCStream_advanced failed: %s\n", ZSTD_getErrorName(init_res));
-        ZSTD_freeCStream(stream);
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+    RtlZeroMemory(table, sizeof(table));
+
+    ip = start + 1;
+    end = start + len - sizeof(uint32_t);
+
+    while (ip <= end) {
+        uint32_t v = *(uint32_t*)ip;
+        unsigned int h = (v * 2654435761u) >> (32 - HEUR_LZ_HASH_BITS);
+        const uint8_t* ref = start + table[h];
+
+        table[h] = (uint16_t)(ip - start);
+
+        if (ref < ip && *(uint32_t*)ref == v) {
+            const uint8_t* ip2 = ip + HEUR_LZ_MIN_MATCH;
+
+            ref += HEUR_LZ_MIN_MATCH;
+
+            while (ip2 < start + len && *ip2 == *ref) {
+                ip2++;
+                ref++;
+            }
+
+            matched += (uint32_t)(ip2 - ip);
+            ip = ip2;
+        } else
+            ip++;
     }
 
-    input.src = data;
-    input.size = (uint32_t)(end_data - start_data);
-    input.pos = 0;
+    // worth it if at least an eighth of the window is covered by matches
+    return matched >= len / 8;
+}
 
-    output.dst = comp_data;
-    output.size = (uint32_t)(end_data - start_data);
-    output.pos = 0;
+bool compression_worthwhile(const uint8_t* data, uint32_t len) {
+    uint32_t counts[256];
+    uint32_t num_samples, sample_len, i, j;
+    unsigned int byte_set, entropy, core_set;
 
-    while (input.pos < input.size && output.pos < output.size) {
-        written = ZSTD_compressStream(stream, &output, &input);
+    if (len < HEUR_MIN_LEN)
+        return true;
 
-        if (ZSTD_isError(written)) {
-            ERR("ZSTD_compressStream failed: %s\n", ZSTD_getErrorName(written));
-            ZSTD_freeCStream(stream);
-            ExFreePool(comp_data);
-            return STATUS_INTERNAL_ERROR;
+    num_samples = len / HEUR_SAMPLE_STRIDE;
+    sample_len = num_samples * HEUR_SAMPLE_SIZE;
+
+    if (heur_repeated_pattern(data, num_samples))
+        return true;
+
+    RtlZeroMemory(counts, sizeof(counts));
+
+    for (i = 0; i < num_samples; i++) {
+        const uint8_t* s = data + (i * HEUR_SAMPLE_STRIDE);
+
+        for (j = 0; j < HEUR_SAMPLE_SIZE; j++) {
+            counts[s[j]]++;
         }
     }
 
-    written = ZSTD_endStream(stream, &output);
-    if (ZSTD_isError(written)) {
-        ERR("ZSTD_endStream failed: %s\n", ZSTD_getErrorName(written));
-        ZSTD_freeCStream(stream);
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+    byte_set = 0;
+    for (i = 0; i < 256; i++) {
+        if (counts[i] > 0)
+            byte_set++;
     }
 
-    ZSTD_freeCStream(stream);
+    // text and the like
+    if (byte_set < HEUR_BYTE_SET_SMALL)
+        return true;
 
-    out_left = output.size - output.pos;
+    entropy = heur_entropy(counts, sample_len);
+    core_set = heur_core_set(counts, sample_len); // sorts counts
 
-    if (out_left < fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
+    if (core_set <= HEUR_CORE_SET_LOW)
+        return true;
 
-        comp_length = (uint32_t)(end_data - start_data);
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
+    // If the bytes are evenly spread, this looks like already-compressed or encrypted data,
+    // but check for repeated strings before we give up on it.
+    if (core_set >= HEUR_CORE_SET_HIGH || entropy >= HEUR_ENTROPY_HIGH)
+        return heur_lz_probe(data, len);
 
-        *compressed = false;
-    } else {
-        uint32_t cl;
+    return true;
+}
+
+uint8_t get_compression_type(fcb* fcb) {
+    uint8_t type;
+
+    if (fcb->Vcb->options.compress_type != 0 && fcb->prop_compression == PropCompression_None)
+        type = fcb->Vcb->options.compress_type;
+    else {
+        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD) && fcb->prop_compression == PropCompression_ZSTD)
+            type = BTRFS_COMPRESSION_ZSTD;
+        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD && fcb->prop_compression != PropCompression_Zlib && fcb->prop_compression != PropCompression_LZO)
+            type = BTRFS_COMPRESSION_ZSTD;
+        else if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO) && fcb->prop_compression == PropCompression_LZO)
+            type = BTRFS_COMPRESSION_LZO;
+        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO && fcb->prop_compression != PropCompression_Zlib)
+            type = BTRFS_COMPRESSION_LZO;
+        else
+            type = BTRFS_COMPRESSION_ZLIB;
+    }
+
+    if (type == BTRFS_COMPRESSION_ZSTD)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+    else if (type == BTRFS_COMPRESSION_LZO)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
+
+    return type;
+}
+
+uint32_t get_compression_buffer_size(uint8_t type, uint32_t inlen) {
+    if (type == BTRFS_COMPRESSION_LZO)
+        return lzo_comp_buffer_size(inlen);
+    else
+        return inlen;
+}
+
+// Thread-safe, so can be called from the calc threads. Sets complen to 0 if the
+// compressed data would be larger than outlen.
+NTSTATUS compress_data(device_extension* Vcb, uint8_t type, uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen, uint32_t* complen) {
+    switch (type) {
+        case BTRFS_COMPRESSION_ZLIB:
+            return zlib_compress(inbuf, inlen, outbuf, outlen, Vcb->options.zlib_level, complen);
+
+        case BTRFS_COMPRESSION_LZO:
+            return lzo_compress(inbuf, inlen, outbuf, outlen, Vcb->options.lzo_level, complen);
+
+        case BTRFS_COMPRESSION_ZSTD:
+            return zstd_compress(inbuf, inlen, outbuf, outlen, Vcb->options.zstd_level, complen);
+
+        default:
+            ERR("unsupported compression type %x\n", type);
+            return STATUS_NOT_SUPPORTED;
+    }
+}
 
-        compression = BTRFS_COMPRESSION_ZSTD;
-        cl = (uint32_t)(end_data - start_data - out_left);
-        comp_length = (uint32_t)sector_align(cl, fcb->Vcb->superblock.sector_size);
+NTSTATUS write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, uint8_t type, uint8_t* comp_data, uint32_t complen,
+                              PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    uint8_t compression;
+    uint64_t comp_length;
+    LIST_ENTRY* le;
+    chunk* c;
+
+    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08x\n", Status);
+        return Status;
+    }
 
-        RtlZeroMemory(comp_data + cl, comp_length - cl);
+    if (complen == 0 || complen + fcb->Vcb->superblock.sector_size > end_data - start_data) { // compressed extent would be larger than or same size as uncompressed extent
+        comp_length = end_data - start_data;
+        comp_data = data;
+        compression = BTRFS_COMPRESSION_NONE;
+    } else {
+        compression = type;
+        comp_length = sector_align(complen, fcb->Vcb->superblock.sector_size);
 
-        *compressed = true;
+        RtlZeroMemory(comp_data + complen, (ULONG)(comp_length - complen));
     }
 
     ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, true);
@@ -1028,10 +1299,6 @@ static NTSTATUS zstd_write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_
             if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
                 if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, false, comp_data, Irp, rollback, compression, end_data - start_data, false, 0)) {
                     ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-                    if (compression != BTRFS_COMPRESSION_NONE)
-                        ExFreePool(comp_data);
-
                     return STATUS_SUCCESS;
                 }
             }
@@ -1052,10 +1319,6 @@ static NTSTATUS zstd_write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_
 
     if (!NT_SUCCESS(Status)) {
         ERR("alloc_chunk returned %08x\n", Status);
-
-        if (compression != BTRFS_COMPRESSION_NONE)
-            ExFreePool(comp_data);
-
         return Status;
     }
 
@@ -1063,12 +1326,8 @@ static NTSTATUS zstd_write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_
         acquire_chunk_lock(c, fcb->Vcb);
 
         if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, false, comp_data, Irp, rollback, compression, end_data - start_data, false, 0)) {
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
-
+            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, false, comp_data, Irp, rollback, compression, end_data - start_data, false, 0))
                 return STATUS_SUCCESS;
-            }
         }
 
         release_chunk_lock(c, fcb->Vcb);
@@ -1076,40 +1335,9 @@ static NTSTATUS zstd_write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_
 
     WARN("couldn't find any data chunks with %I64x bytes free\n", comp_length);
 
-    if (compression != BTRFS_COMPRESSION_NONE)
-        ExFreePool(comp_data);
-
     return STATUS_DISK_FULL;
 }
 
-NTSTATUS write_compressed_bit(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, bool* compressed, PIRP Irp, LIST_ENTRY* rollback) {
-    uint8_t type;
-
-    if (fcb->Vcb->options.compress_type != 0 && fcb->prop_compression == PropCompression_None)
-        type = fcb->Vcb->options.compress_type;
-    else {
-        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD) && fcb->prop_compression == PropCompression_ZSTD)
-            type = BTRFS_COMPRESSION_ZSTD;
-        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD && fcb->prop_compression != PropCompression_Zlib && fcb->prop_compression != PropCompression_LZO)
-            type = BTRFS_COMPRESSION_ZSTD;
-        else if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO) && fcb->prop_compression == PropCompression_LZO)
-            type = BTRFS_COMPRESSION_LZO;
-        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO && fcb->prop_compression != PropCompression_Zlib)
-            type = BTRFS_COMPRESSION_LZO;
-        else
-            type = BTRFS_COMPRESSION_ZLIB;
-    }
-
-    if (type == BTRFS_COMPRESSION_ZSTD) {
-        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
-        return zstd_write_compressed_bit(fcb, start_data, end_data, data, compressed, Irp, rollback);
-    } else if (type == BTRFS_COMPRESSION_LZO) {
-        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
-        return lzo_write_compressed_bit(fcb, start_data, end_data, data, compressed, Irp, rollback);
-    } else
-        return zlib_write_compressed_bit(fcb, start_data, end_data, data, compressed, Irp, rollback);
-}
-
 static void* zstd_malloc(void* opaque, size_t size) {
     UNUSED(opaque);
 
@@ -1124,17 +1352,17 @@ static void zstd_free(void* opaque, void* address) {
 
 NTSTATUS zstd_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen) {
     NTSTATUS Status;
+    comp_context* ctx;
     ZSTD_DStream* stream;
     size_t init_res, read;
     ZSTD_inBuffer input;
     ZSTD_outBuffer output;
 
-    stream = ZSTD_createDStream_advanced(zstd_mem);
-
-    if (!stream) {
-        ERR("ZSTD_createDStream failed.\n");
+    ctx = get_comp_context(BTRFS_COMPRESSION_ZSTD, true, 0);
+    if (!ctx)
         return STATUS_INTERNAL_ERROR;
-    }
+
+    stream = ctx->zds;
 
     init_res = ZSTD_initDStream(stream);
 
@@ -1163,7 +1391,7 @@ NTSTATUS zstd_decompress(uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32
     Status = STATUS_SUCCESS;
 
 end:
-    ZSTD_freeDStream(stream);
+    put_comp_context(ctx, NT_SUCCESS(Status));
 
     return Status;
 }
@@ -17,10 +17,27 @@
 
 #include <windef.h>
 #include <smmintrin.h>
+#include <wmmintrin.h>
 #include <stdint.h>
 #include <stdbool.h>
 
-extern bool have_sse42;
+extern bool have_sse42, have_pclmulqdq;
+
+#define CRC32C_POLY     0x82f63b78
+
+// When the buffer is long enough, we run three CRC streams side by side so that
+// the CRC32 unit is kept busy, then combine them using carry-less multiplication.
+#define CRC32C_LONG     2048
+#define CRC32C_SHORT    256
+
+static uint32_t crc32c_table8[8][256];
+static uint32_t crc32c_shift_long[2], crc32c_shift_short[2];
+
+#ifdef _MSC_VER
+#define TARGET_PCLMUL
+#else
+#define TARGET_PCLMUL __attribute__((target("sse4.2,pclmul")))
+#endif
 
 static const uint32_t crctable[] = {
     0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
@@ -67,6 +84,93 @@ static const uint32_t crctable[] = {
     }                                                                   \
   } while(0)
 
+// returns x^n mod P, bit-reflected
+static uint32_t crc32c_xpow(uint32_t n) {
+    uint32_t r = 0x80000000;
+
+    while (n > 0) {
+        r = (r >> 1) ^ (r & 1 ? CRC32C_POLY : 0);
+        n--;
+    }
+
+    return r;
+}
+
+void init_crc32c() {
+    unsigned int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc32c_table8[0][i] = crctable[i];
+    }
+
+    for (j = 1; j < 8; j++) {
+        for (i = 0; i < 256; i++) {
+            crc32c_table8[j][i] = (crc32c_table8[j - 1][i] >> 8) ^ crctable[crc32c_table8[j - 1][i] & 0xff];
+        }
+    }
+
+    // The product of two 32-bit reflected values comes out one bit short, and
+    // the CRC32 instruction multiplies by a further x^32 when it reduces it.
+    crc32c_shift_long[0] = crc32c_xpow((CRC32C_LONG * 8) - 33);
+    crc32c_shift_long[1] = crc32c_xpow((CRC32C_LONG * 16) - 33);
+    crc32c_shift_short[0] = crc32c_xpow((CRC32C_SHORT * 8) - 33);
+    crc32c_shift_short[1] = crc32c_xpow((CRC32C_SHORT * 16) - 33);
+}
+
+// Advances crc over as many zero bytes as k represents.
+static TARGET_PCLMUL __inline uint32_t crc32c_shift(uint32_t crc, uint32_t k) {
+    __m128i p = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(k), 0);
+
+#ifdef _AMD64_
+    return (uint32_t)_mm_crc32_u64(0, _mm_cvtsi128_si64(p));
+#else
+    return _mm_crc32_u32(_mm_crc32_u32(0, _mm_cvtsi128_si32(p)), _mm_cvtsi128_si32(_mm_srli_si128(p, 4)));
+#endif
+}
+
+static TARGET_PCLMUL uint32_t crc32c_3way(const char** pbuf, ULONG* plen, ULONG block, uint32_t* shift, uint32_t crc) {
+    const char* buf = *pbuf;
+    ULONG len = *plen;
+
+    while (len >= block * 3) {
+#ifdef _AMD64_
+        const uint64_t* a = (const uint64_t*)buf;
+        const uint64_t* b = (const uint64_t*)(buf + block);
+        const uint64_t* c = (const uint64_t*)(buf + (block * 2));
+        uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+        ULONG i;
+
+        for (i = 0; i < block / sizeof(uint64_t); i++) {
+            crc0 = _mm_crc32_u64(crc0, a[i]);
+            crc1 = _mm_crc32_u64(crc1, b[i]);
+            crc2 = _mm_crc32_u64(crc2, c[i]);
+        }
+#else
+        const uint32_t* a = (const uint32_t*)buf;
+        const uint32_t* b = (const uint32_t*)(buf + block);
+        const uint32_t* c = (const uint32_t*)(buf + (block * 2));
+        uint32_t crc0 = crc, crc1 = 0, crc2 = 0;
+        ULONG i;
+
+        for (i = 0; i < block / sizeof(uint32_t); i++) {
+            crc0 = _mm_crc32_u32(crc0, a[i]);
+            crc1 = _mm_crc32_u32(crc1, b[i]);
+            crc2 = _mm_crc32_u32(crc2, c[i]);
+        }
+#endif
+
+        crc = crc32c_shift((uint32_t)crc0, shift[1]) ^ crc32c_shift((uint32_t)crc1, shift[0]) ^ (uint32_t)crc2;
+
+        buf += block * 3;
+        len -= block * 3;
+    }
+
+    *pbuf = buf;
+    *plen = len;
+
+    return crc;
+}
+
 static uint32_t crc32c_hw(const void *input, ULONG len, uint32_t crc) {
     const char* buf = (const char*)input;
 
@@ -82,6 +186,11 @@ static uint32_t crc32c_hw(const void *input, ULONG len, uint32_t crc) {
 #endif
     }
 
+    if (have_pclmulqdq) {
+        crc = crc32c_3way(&buf, &len, CRC32C_LONG, crc32c_shift_long, crc);
+        crc = crc32c_3way(&buf, &len, CRC32C_SHORT, crc32c_shift_short, crc);
+    }
+
 #ifdef _AMD64_
 #ifdef _MSC_VER
 #pragma warning(push)
@@ -107,19 +216,32 @@ static uint32_t crc32c_hw(const void *input, ULONG len, uint32_t crc) {
     return crc;
 }
 
-uint32_t calc_crc32c(_In_ uint32_t seed, _In_reads_bytes_(msglen) uint8_t* msg, _In_ ULONG msglen) {
-    uint32_t rem;
-    ULONG i;
+// slicing-by-8
+static uint32_t crc32c_sw(const uint8_t* msg, ULONG len, uint32_t crc) {
+    for (; (len > 0) && ((size_t)msg & ALIGN_MASK); len--, msg++) {
+        crc = crctable[(crc ^ *msg) & 0xff] ^ (crc >> 8);
+    }
 
-    if (have_sse42) {
-        return crc32c_hw(msg, msglen, seed);
-    } else {
-        rem = seed;
+    for (; len >= 8; len -= 8, msg += 8) {
+        uint32_t lo = *(uint32_t*)msg ^ crc;
+        uint32_t hi = *(uint32_t*)(msg + 4);
 
-        for (i = 0; i < msglen; i++) {
-            rem = crctable[(rem ^ msg[i]) & 0xff] ^ (rem >> 8);
-        }
+        crc = crc32c_table8[7][lo & 0xff] ^ crc32c_table8[6][(lo >> 8) & 0xff] ^
+              crc32c_table8[5][(lo >> 16) & 0xff] ^ crc32c_table8[4][lo >> 24] ^
+              crc32c_table8[3][hi & 0xff] ^ crc32c_table8[2][(hi >> 8) & 0xff] ^
+              crc32c_table8[1][(hi >> 16) & 0xff] ^ crc32c_table8[0][hi >> 24];
     }
 
-    return rem;
+    for (; len > 0; len--, msg++) {
+        crc = crctable[(crc ^ *msg) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+uint32_t calc_crc32c(_In_ uint32_t seed, _In_reads_bytes_(msglen) uint8_t* msg, _In_ ULONG msglen) {
+    if (have_sse42)
+        return crc32c_hw(msg, msglen, seed);
+    else
+        return crc32c_sw(msg, msglen, seed);
 }
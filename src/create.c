@@ -409,7 +409,7 @@ cleanup:
     return Status;
 }
 
-NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, uint32_t* csum, uint64_t start, uint64_t length, PIRP Irp) {
+NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, void* csum, uint64_t start, uint64_t length, PIRP Irp) {
     NTSTATUS Status;
     KEY searchkey;
     traverse_ptr tp, next_tp;
@@ -436,13 +436,13 @@ NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb
             else
                 j = ((start - tp.item->key.offset) / Vcb->superblock.sector_size) + i;
 
-            if (j * sizeof(uint32_t) > tp.item->size || tp.item->key.offset > start + (i * Vcb->superblock.sector_size)) {
+            if (j * Vcb->csum_size > tp.item->size || tp.item->key.offset > start + (i * Vcb->superblock.sector_size)) {
                 ERR("checksum not found for %I64x\n", start + (i * Vcb->superblock.sector_size));
                 return STATUS_INTERNAL_ERROR;
             }
 
-            readlen = (ULONG)min((tp.item->size / sizeof(uint32_t)) - j, length - i);
-            RtlCopyMemory(&csum[i], tp.item->data + (j * sizeof(uint32_t)), readlen * sizeof(uint32_t));
+            readlen = (ULONG)min((tp.item->size / Vcb->csum_size) - j, length - i);
+            RtlCopyMemory((uint8_t*)csum + (i * Vcb->csum_size), tp.item->data + (j * Vcb->csum_size), readlen * Vcb->csum_size);
             i += readlen;
 
             if (i == length)
@@ -463,6 +463,52 @@ NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb
     return STATUS_SUCCESS;
 }
 
+// Extents read from disk don't have their checksums loaded until something needs
+// them. Because they're in the checksum tree, evict_csums can also drop them
+// again at any point until the extent is next changed, so anything using
+// ext->csum of an extent which isn't marked as inserted has to call this first.
+// Readers only hold the FCB lock shared, so two of them can be here at once.
+NTSTATUS load_extent_csum(device_extension* Vcb, fcb* fcb, extent* ext, PIRP Irp) {
+    NTSTATUS Status;
+    EXTENT_DATA2* ed2;
+    uint64_t len;
+    void* csum;
+
+    if (ext->csum || ext->inserted || ext->extent_data.type != EXTENT_TYPE_REGULAR || fcb->inode_item.flags & BTRFS_INODE_NODATASUM)
+        return STATUS_SUCCESS;
+
+    ed2 = (EXTENT_DATA2*)ext->extent_data.data;
+
+    if (ed2->size == 0) // sparse
+        return STATUS_SUCCESS;
+
+    // Callers have to already have tree_lock, as we can't wait for it if we've got the FCB
+    // lock - see acquire_fcb_for_read.
+    ASSERT(ExIsResourceAcquiredSharedLite(&Vcb->tree_lock));
+
+    len = (ext->extent_data.compression == BTRFS_COMPRESSION_NONE ? ed2->num_bytes : ed2->size) / Vcb->superblock.sector_size;
+
+    csum = ExAllocatePoolWithTag(fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? NonPagedPool : PagedPool, (ULONG)(len * Vcb->csum_size), ALLOC_TAG);
+    if (!csum) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = load_csum(Vcb, csum, ed2->address + (ext->extent_data.compression == BTRFS_COMPRESSION_NONE ? ed2->offset : 0), len, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_csum returned %08x\n", Status);
+        ExFreePool(csum);
+        return Status;
+    }
+
+    ext->csum_used = true;
+
+    if (InterlockedCompareExchangePointer(&ext->csum, csum, NULL))
+        ExFreePool(csum);
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS load_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, bool ignore_size, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp, next_tp;
@@ -1113,7 +1159,12 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
             ext->inserted = false;
             ext->csum = NULL;
 
+            // checksums are loaded when they're first needed, by load_extent_csum
+            if (ed->type == EXTENT_TYPE_REGULAR && !(fcb->inode_item.flags & BTRFS_INODE_NODATASUM))
+                fcb->csums_unloaded = true;
+
             InsertTailList(&fcb->extents, &ext->list_entry);
+            index_fcb_extent(fcb, ext);
         }
     }
 
@@ -3384,45 +3435,31 @@ static NTSTATUS get_reparse_block(fcb* fcb, uint8_t** data) {
     return STATUS_SUCCESS;
 }
 
-static void fcb_load_csums(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, PIRP Irp) {
+// Loads all of a file's checksums. The paging file has them loaded up front, as we can't
+// do tree lookups in the middle of paging something in, and acquire_fcb_for_read loads them
+// so that the read itself doesn't need tree_lock. The caller has to hold the FCB lock exclusively.
+void fcb_load_csums(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, PIRP Irp) {
     LIST_ENTRY* le;
     NTSTATUS Status;
 
-    if (fcb->csum_loaded)
+    if (!fcb->csums_unloaded)
         return;
 
-    if (IsListEmpty(&fcb->extents) || fcb->inode_item.flags & BTRFS_INODE_NODATASUM)
-        goto end;
-
     le = fcb->extents.Flink;
     while (le != &fcb->extents) {
         extent* ext = CONTAINING_RECORD(le, extent, list_entry);
 
-        if (ext->extent_data.type == EXTENT_TYPE_REGULAR) {
-            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)&ext->extent_data.data[0];
-            uint64_t len;
-
-            len = (ext->extent_data.compression == BTRFS_COMPRESSION_NONE ? ed2->num_bytes : ed2->size) / Vcb->superblock.sector_size;
-
-            ext->csum = ExAllocatePoolWithTag(NonPagedPool, (ULONG)(len * sizeof(uint32_t)), ALLOC_TAG);
-            if (!ext->csum) {
-                ERR("out of memory\n");
-                goto end;
-            }
-
-            Status = load_csum(Vcb, ext->csum, ed2->address + (ext->extent_data.compression == BTRFS_COMPRESSION_NONE ? ed2->offset : 0), len, Irp);
-
-            if (!NT_SUCCESS(Status)) {
-                ERR("load_csum returned %08x\n", Status);
-                goto end;
-            }
+        Status = load_extent_csum(Vcb, fcb, ext, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_extent_csum returned %08x\n", Status);
+            return;
         }
 
         le = le->Flink;
     }
 
-end:
-    fcb->csum_loaded = true;
+    fcb->csums_unloaded = false;
+    fcb->Header.IsFastIoPossible = fast_io_possible(fcb);
 }
 
 static NTSTATUS open_file2(device_extension* Vcb, ULONG RequestedDisposition, POOL_TYPE pool_type, file_ref* fileref, ACCESS_MASK* granted_access,
@@ -4510,9 +4547,11 @@ exit:
             fcb2 = ccb2->fileref->parent->fcb;
         }
 
-        ExAcquireResourceExclusiveLite(fcb2->Header.Resource, true);
-        fcb_load_csums(Vcb, fcb2, Irp);
-        ExReleaseResourceLite(fcb2->Header.Resource);
+        if (fcb2->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE) {
+            ExAcquireResourceExclusiveLite(fcb2->Header.Resource, true);
+            fcb_load_csums(Vcb, fcb2, Irp);
+            ExReleaseResourceLite(fcb2->Header.Resource);
+        }
     } else if (Status != STATUS_REPARSE && Status != STATUS_OBJECT_NAME_NOT_FOUND && Status != STATUS_OBJECT_PATH_NOT_FOUND)
         TRACE("returning %08x\n", Status);
 
@@ -4638,6 +4677,9 @@ NTSTATUS __stdcall drv_create(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
         goto exit;
     }
 
+    if (top_level && !Vcb->readonly)
+        throttle_writer(Vcb);
+
     ExAcquireResourceSharedLite(&Vcb->load_lock, true);
     locked = true;
 
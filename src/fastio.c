@@ -174,13 +174,17 @@ static BOOLEAN __stdcall fast_io_check_if_possible(PFILE_OBJECT FileObject, PLAR
     fcb* fcb = FileObject->FsContext;
     LARGE_INTEGER len2;
 
-    UNUSED(Wait);
     UNUSED(IoStatus);
     UNUSED(DeviceObject);
 
     len2.QuadPart = Length;
 
     if (CheckForReadOperation) {
+        // FsRtlCopyRead only takes the FCB lock, but we might need tree_lock to load checksums
+        // if it has to wait for a page to be read in - see fast_io_read
+        if (fcb->csums_unloaded && Wait)
+            return false;
+
         if (FsRtlFastCheckLockForRead(&fcb->lock, FileOffset, &len2, LockKey, FileObject, PsGetCurrentProcess()))
             return true;
     } else {
@@ -334,6 +338,26 @@ static NTSTATUS __stdcall fast_io_release_for_ccflush(PFILE_OBJECT FileObject, P
     return STATUS_SUCCESS;
 }
 
+_Function_class_(FAST_IO_READ)
+static BOOLEAN __stdcall fast_io_read(PFILE_OBJECT FileObject, PLARGE_INTEGER FileOffset, ULONG Length, BOOLEAN Wait, ULONG LockKey, PVOID Buffer, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) {
+    fcb* fcb = FileObject->FsContext;
+    BOOLEAN ret;
+
+    // The checksums are only needed on a cache miss, so if any are missing we can still
+    // serve whatever's already in the cache - CcCopyRead won't fault pages in if it can't
+    // wait, and we'll get an IRP for the rest, which can take tree_lock first.
+    if (fcb->csums_unloaded)
+        Wait = false;
+
+    ret = FsRtlCopyRead(FileObject, FileOffset, Length, Wait, LockKey, Buffer, IoStatus, DeviceObject);
+
+    // if we turned it down, do_read will do this when the IRP comes in
+    if (ret)
+        update_read_ahead(FileObject, FileOffset->QuadPart, Length);
+
+    return ret;
+}
+
 _Function_class_(FAST_IO_WRITE)
 static BOOLEAN __stdcall fast_io_write(PFILE_OBJECT FileObject, PLARGE_INTEGER FileOffset, ULONG Length, BOOLEAN Wait, ULONG LockKey, PVOID Buffer, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) {
     fcb* fcb = FileObject->FsContext;
@@ -482,7 +506,7 @@ void init_fast_io_dispatch(FAST_IO_DISPATCH** fiod) {
     FastIoDispatch.SizeOfFastIoDispatch = sizeof(FAST_IO_DISPATCH);
 
     FastIoDispatch.FastIoCheckIfPossible = fast_io_check_if_possible;
-    FastIoDispatch.FastIoRead = FsRtlCopyRead;
+    FastIoDispatch.FastIoRead = fast_io_read;
     FastIoDispatch.FastIoWrite = fast_io_write;
     FastIoDispatch.FastIoQueryBasicInfo = fast_query_basic_info;
     FastIoDispatch.FastIoQueryStandardInfo = fast_query_standard_info;
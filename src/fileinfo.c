@@ -416,6 +416,7 @@ bool has_open_children(file_ref* fileref) {
 
 static NTSTATUS duplicate_fcb(fcb* oldfcb, fcb** pfcb) {
     device_extension* Vcb = oldfcb->Vcb;
+    NTSTATUS Status;
     fcb* fcb;
     LIST_ENTRY* le;
 
@@ -511,6 +512,14 @@ static NTSTATUS duplicate_fcb(fcb* oldfcb, fcb** pfcb) {
             ext2->ignore = false;
             ext2->inserted = true;
 
+            Status = load_extent_csum(Vcb, oldfcb, ext, NULL);
+            if (!NT_SUCCESS(Status)) {
+                ERR("load_extent_csum returned %08x\n", Status);
+                ExFreePool(ext2);
+                free_fcb(fcb);
+                return Status;
+            }
+
             if (ext->csum) {
                 ULONG len;
                 EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
@@ -520,7 +529,7 @@ static NTSTATUS duplicate_fcb(fcb* oldfcb, fcb** pfcb) {
                 else
                     len = (ULONG)ed2->size;
 
-                len = len * sizeof(uint32_t) / Vcb->superblock.sector_size;
+                len = len * Vcb->csum_size / Vcb->superblock.sector_size;
 
                 ext2->csum = ExAllocatePoolWithTag(PagedPool, len, ALLOC_TAG);
                 if (!ext2->csum) {
@@ -534,6 +543,7 @@ static NTSTATUS duplicate_fcb(fcb* oldfcb, fcb** pfcb) {
                 ext2->csum = NULL;
 
             InsertTailList(&fcb->extents, &ext2->list_entry);
+            index_fcb_extent(fcb, ext2);
         }
 
         le = le->Flink;
@@ -20,8 +20,6 @@
 #include <ntddscsi.h>
 #include <ntddstor.h>
 
-#define MAX_CSUM_SIZE (4096 - sizeof(tree_header) - sizeof(leaf_node))
-
 // #define DEBUG_WRITE_LOOPS
 
 typedef struct {
@@ -181,8 +179,8 @@ static void clean_space_cache_chunk(device_extension* Vcb, chunk* c) {
             type = BLOCK_FLAG_DUPLICATE;
     }
 
-    while (!IsListEmpty(&c->deleting)) {
-        space* s = CONTAINING_RECORD(c->deleting.Flink, space, list_entry);
+    while (!IsListEmpty(&c->pinned)) {
+        space* s = CONTAINING_RECORD(c->pinned.Flink, space, list_entry);
 
         if (Vcb->trim && !Vcb->options.no_trim && (!Vcb->options.no_barrier || !(c->chunk_item->type & BLOCK_FLAG_METADATA))) {
             CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
@@ -264,6 +262,8 @@ static void clean_space_cache_chunk(device_extension* Vcb, chunk* c) {
             // FIXME - RAID5(?), RAID6(?)
         }
 
+        space_list_add2(&c->space, &c->space_size, s->address, s->size, NULL, NULL);
+
         RemoveEntryList(&s->list_entry);
         ExFreePool(s);
     }
@@ -390,6 +390,39 @@ static void trim_emulation(device* dev) {
 }
 #endif
 
+// Moves the space freed by the transaction we're committing out of the way until its superblock
+// has been written, as until then the old trees still point to it. The free space cache may
+// already have merged it into c->space, so take it back out of there too.
+static void pin_freed_space(device_extension* Vcb) {
+    LIST_ENTRY* le;
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        acquire_chunk_lock(c, Vcb);
+
+        while (!IsListEmpty(&c->deleting)) {
+            space* s = CONTAINING_RECORD(RemoveHeadList(&c->deleting), space, list_entry);
+
+            space_list_subtract2(&c->space, &c->space_size, s->address, s->size, c, NULL);
+
+            InsertTailList(&c->pinned, &s->list_entry);
+        }
+
+        c->changed = false;
+        c->space_changed = false;
+
+        release_chunk_lock(c, Vcb);
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+}
+
 static void clean_space_cache(device_extension* Vcb) {
     LIST_ENTRY* le;
     chunk* c;
@@ -405,14 +438,9 @@ static void clean_space_cache(device_extension* Vcb) {
     while (le != &Vcb->chunks) {
         c = CONTAINING_RECORD(le, chunk, list_entry);
 
-        if (c->space_changed) {
+        if (!IsListEmpty(&c->pinned)) {
             acquire_chunk_lock(c, Vcb);
-
-            if (c->space_changed)
-                clean_space_cache_chunk(Vcb, c);
-
-            c->space_changed = false;
-
+            clean_space_cache_chunk(Vcb, c);
             release_chunk_lock(c, Vcb);
         }
 
@@ -719,7 +747,6 @@ static bool insert_tree_extent_skinny(device_extension* Vcb, uint8_t level, uint
 }
 
 bool find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t* address) {
-    LIST_ENTRY* le;
     space* s;
 
     TRACE("(%p, %I64x, %p)\n", Vcb, c->offset, address);
@@ -752,51 +779,22 @@ bool find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t* a
         }
     }
 
-    le = c->space.Flink;
-    while (le != &c->space) {
-        s = CONTAINING_RECORD(le, space, list_entry);
-
-        if (s->address <= c->last_alloc && s->address + s->size >= c->last_alloc + Vcb->superblock.node_size) {
-            *address = c->last_alloc;
-            c->last_alloc += Vcb->superblock.node_size;
-            return true;
-        }
+    s = find_space_entry(c, c->last_alloc + Vcb->superblock.node_size);
 
-        le = le->Flink;
-    }
-
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
-
-        if (s->size == Vcb->superblock.node_size) {
-            *address = s->address;
-            c->last_alloc = s->address + Vcb->superblock.node_size;
-            return true;
-        } else if (s->size < Vcb->superblock.node_size) {
-            if (le == c->space_size.Flink)
-                return false;
-
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
-
-            *address = s->address;
-            c->last_alloc = s->address + Vcb->superblock.node_size;
-
-            return true;
-        }
-
-        le = le->Flink;
+    if (s && s->address <= c->last_alloc) {
+        *address = c->last_alloc;
+        c->last_alloc += Vcb->superblock.node_size;
+        return true;
     }
 
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+    s = find_space_best_fit(c, Vcb->superblock.node_size);
+    if (!s)
+        return false;
 
-    if (s->size > Vcb->superblock.node_size) {
-        *address = s->address;
-        c->last_alloc = s->address + Vcb->superblock.node_size;
-        return true;
-    }
+    *address = s->address;
+    c->last_alloc = s->address + Vcb->superblock.node_size;
 
-    return false;
+    return true;
 }
 
 static bool insert_tree_extent(device_extension* Vcb, uint8_t level, uint64_t root_id, chunk* c, uint64_t* new_address, PIRP Irp, LIST_ENTRY* rollback) {
@@ -956,6 +954,8 @@ static NTSTATUS reduce_tree_extent(device_extension* Vcb, uint64_t address, tree
     if (rc == 1) {
         chunk* c = get_chunk_from_address(Vcb, address);
 
+        node_cache_remove(Vcb, address);
+
         if (c) {
             acquire_chunk_lock(c, Vcb);
 
@@ -1594,55 +1594,75 @@ static NTSTATUS update_root_root(device_extension* Vcb, bool no_cache, PIRP Irp,
     return STATUS_SUCCESS;
 }
 
-NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, bool no_free) {
+// The most we'll merge into a single write. Much beyond this there's nothing to be gained, and
+// it's the copy rather than the number of IRPs that starts to cost us.
+#define MAX_TREE_WRITE_RUN 0x100000
+
+typedef struct {
+    uint64_t address;
+    uint32_t length;
+    uint8_t* data;
+    bool allocated;
+} tree_write_run;
+
+static void free_tree_write_runs(tree_write_run* runs, ULONG num_runs) {
+    ULONG i;
+
+    for (i = 0; i < num_runs; i++) {
+        if (runs[i].allocated)
+            ExFreePool(runs[i].data);
+    }
+
+    ExFreePool(runs);
+}
+
+NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes) {
     chunk* c;
     LIST_ENTRY* le;
     tree_write* tw;
     NTSTATUS Status;
     ULONG i, num_bits;
+    uint32_t run_length;
     write_data_context* wtc;
+    tree_write_run* runs;
     ULONG bit_num = 0;
     bool raid56 = false;
 
-    // merge together runs
-    c = NULL;
+    // anything cached for these addresses is about to be out of date
     le = tree_writes->Flink;
     while (le != tree_writes) {
         tw = CONTAINING_RECORD(le, tree_write, list_entry);
 
-        if (!c || tw->address < c->offset || tw->address >= c->offset + c->chunk_item->size)
-            c = get_chunk_from_address(Vcb, tw->address);
-        else {
-            tree_write* tw2 = CONTAINING_RECORD(le->Blink, tree_write, list_entry);
-
-            if (tw->address == tw2->address + tw2->length) {
-                uint8_t* data = ExAllocatePoolWithTag(NonPagedPool, tw2->length + tw->length, ALLOC_TAG);
-
-                if (!data) {
-                    ERR("out of memory\n");
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
-
-                RtlCopyMemory(data, tw2->data, tw2->length);
-                RtlCopyMemory(&data[tw2->length], tw->data, tw->length);
-
-                if (!no_free)
-                    ExFreePool(tw2->data);
+        for (i = 0; i < tw->length; i += Vcb->superblock.node_size) {
+            node_cache_remove(Vcb, tw->address + i);
+        }
 
-                tw2->data = data;
-                tw2->length += tw->length;
+        le = le->Flink;
+    }
 
-                if (!no_free) // FIXME - what if we allocated this just now?
-                    ExFreePool(tw->data);
+    // work out where the runs of adjacent nodes are first, so that each node only gets copied once
+    c = NULL;
+    num_bits = 0;
+    run_length = 0;
+    le = tree_writes->Flink;
+    while (le != tree_writes) {
+        tw = CONTAINING_RECORD(le, tree_write, list_entry);
 
-                RemoveEntryList(&tw->list_entry);
-                ExFreePool(tw);
+        if (!c || tw->address < c->offset || tw->address >= c->offset + c->chunk_item->size) {
+            c = get_chunk_from_address(Vcb, tw->address);
+            num_bits++;
+            run_length = 0;
+        } else {
+            tree_write* tw2 = CONTAINING_RECORD(le->Blink, tree_write, list_entry);
 
-                le = tw2->list_entry.Flink;
-                continue;
+            if (tw->address != tw2->address + tw2->length || run_length + tw->length > MAX_TREE_WRITE_RUN) {
+                num_bits++;
+                run_length = 0;
             }
         }
 
+        run_length += tw->length;
+
         tw->c = c;
 
         if (c->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
@@ -1651,29 +1671,78 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, bool no_
         le = le->Flink;
     }
 
-    num_bits = 0;
+    runs = ExAllocatePoolWithTag(NonPagedPool, sizeof(tree_write_run) * num_bits, ALLOC_TAG);
+    if (!runs) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(runs, sizeof(tree_write_run) * num_bits);
 
+    num_bits = 0;
     le = tree_writes->Flink;
     while (le != tree_writes) {
+        tree_write_run* run = num_bits > 0 ? &runs[num_bits - 1] : NULL;
+
         tw = CONTAINING_RECORD(le, tree_write, list_entry);
 
-        num_bits++;
+        if (run && tw->c == CONTAINING_RECORD(le->Blink, tree_write, list_entry)->c &&
+            tw->address == run->address + run->length && run->length + tw->length <= MAX_TREE_WRITE_RUN) {
+            run->length += tw->length;
+        } else {
+            run = &runs[num_bits];
+            run->address = tw->address;
+            run->length = tw->length;
+            run->data = tw->data;
+            run->allocated = false;
+            num_bits++;
+        }
 
         le = le->Flink;
     }
 
+    le = tree_writes->Flink;
+    for (i = 0; i < num_bits; i++) {
+        tree_write_run* run = &runs[i];
+
+        tw = CONTAINING_RECORD(le, tree_write, list_entry);
+
+        if (run->length == tw->length) {
+            le = le->Flink;
+            continue;
+        }
+
+        run->data = ExAllocatePoolWithTag(NonPagedPool, run->length, ALLOC_TAG);
+
+        if (run->data) {
+            uint32_t off = 0;
+
+            run->allocated = true;
+
+            while (off < run->length) {
+                tw = CONTAINING_RECORD(le, tree_write, list_entry);
+
+                RtlCopyMemory(run->data + off, tw->data, tw->length);
+                off += tw->length;
+
+                le = le->Flink;
+            }
+        } else {
+            ERR("out of memory\n");
+            free_tree_write_runs(runs, num_bits);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
     wtc = ExAllocatePoolWithTag(NonPagedPool, sizeof(write_data_context) * num_bits, ALLOC_TAG);
     if (!wtc) {
         ERR("out of memory\n");
+        free_tree_write_runs(runs, num_bits);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    le = tree_writes->Flink;
-
-    while (le != tree_writes) {
-        tw = CONTAINING_RECORD(le, tree_write, list_entry);
-
-        TRACE("address: %I64x, size: %x\n", tw->address, tw->length);
+    for (bit_num = 0; bit_num < num_bits; bit_num++) {
+        TRACE("address: %I64x, size: %x\n", runs[bit_num].address, runs[bit_num].length);
 
         KeInitializeEvent(&wtc[bit_num].Event, NotificationEvent, false);
         InitializeListHead(&wtc[bit_num].stripes);
@@ -1681,8 +1750,10 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, bool no_
         wtc[bit_num].stripes_left = 0;
         wtc[bit_num].parity1 = wtc[bit_num].parity2 = wtc[bit_num].scratch = NULL;
         wtc[bit_num].mdl = wtc[bit_num].parity1_mdl = wtc[bit_num].parity2_mdl = NULL;
+    }
 
-        Status = write_data(Vcb, tw->address, tw->data, tw->length, &wtc[bit_num], NULL, NULL, false, 0, HighPagePriority);
+    for (bit_num = 0; bit_num < num_bits; bit_num++) {
+        Status = write_data(Vcb, runs[bit_num].address, runs[bit_num].data, runs[bit_num].length, &wtc[bit_num], NULL, NULL, false, 0, HighPagePriority);
         if (!NT_SUCCESS(Status)) {
             ERR("write_data returned %08x\n", Status);
 
@@ -1690,18 +1761,15 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, bool no_
                 free_write_data_stripes(&wtc[i]);
             }
             ExFreePool(wtc);
+            free_tree_write_runs(runs, num_bits);
 
             return Status;
         }
-
-        bit_num++;
-
-        le = le->Flink;
     }
 
+    // send everything off before waiting for any of it, so all the devices are kept busy
     for (i = 0; i < num_bits; i++) {
         if (wtc[i].stripes.Flink != &wtc[i].stripes) {
-            // launch writes and wait
             le = wtc[i].stripes.Flink;
             while (le != &wtc[i].stripes) {
                 write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
@@ -1739,6 +1807,7 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, bool no_
     }
 
     ExFreePool(wtc);
+    free_tree_write_runs(runs, num_bits);
 
     if (raid56) {
         c = NULL;
@@ -1779,19 +1848,29 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, bool no_
     return STATUS_SUCCESS;
 }
 
+void free_tree_writes(LIST_ENTRY* tree_writes) {
+    while (!IsListEmpty(tree_writes)) {
+        tree_write* tw = CONTAINING_RECORD(RemoveHeadList(tree_writes), tree_write, list_entry);
+
+        if (tw->data)
+            ExFreePool(tw->data);
+
+        ExFreePool(tw);
+    }
+}
+
+// Serializes the dirty trees into Vcb->commit_tree_writes. The actual I/O is done by
+// write_commit_trees, once tree_lock is no longer held exclusively.
 static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
     ULONG level;
     uint8_t *data, *body;
-    uint32_t crc32;
     NTSTATUS Status;
     LIST_ENTRY* le;
-    LIST_ENTRY tree_writes;
+    LIST_ENTRY* tree_writes = &Vcb->commit_tree_writes;
     tree_write* tw;
 
     TRACE("(%p)\n", Vcb);
 
-    InitializeListHead(&tree_writes);
-
     for (level = 0; level <= 255; level++) {
         bool nothing_found = true;
 
@@ -2002,10 +2081,7 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
                 }
             }
 
-            crc32 = calc_crc32c(0xffffffff, (uint8_t*)&((tree_header*)data)->fs_uuid, Vcb->superblock.node_size - sizeof(((tree_header*)data)->csum));
-            crc32 = ~crc32;
-            *((uint32_t*)data) = crc32;
-            TRACE("setting crc32 to %08x\n", crc32);
+            get_tree_checksum(Vcb, (tree_header*)data, ((tree_header*)data)->csum);
 
             tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
             if (!tw) {
@@ -2019,13 +2095,13 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
             tw->length = Vcb->superblock.node_size;
             tw->data = data;
 
-            if (IsListEmpty(&tree_writes))
-                InsertTailList(&tree_writes, &tw->list_entry);
+            if (IsListEmpty(tree_writes))
+                InsertTailList(tree_writes, &tw->list_entry);
             else {
                 bool inserted = false;
 
-                le2 = tree_writes.Flink;
-                while (le2 != &tree_writes) {
+                le2 = tree_writes->Flink;
+                while (le2 != tree_writes) {
                     tree_write* tw2 = CONTAINING_RECORD(le2, tree_write, list_entry);
 
                     if (tw2->address > tw->address) {
@@ -2038,33 +2114,48 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
                 }
 
                 if (!inserted)
-                    InsertTailList(&tree_writes, &tw->list_entry);
+                    InsertTailList(tree_writes, &tw->list_entry);
             }
         }
 
         le = le->Flink;
     }
 
-    Status = do_tree_writes(Vcb, &tree_writes, false);
+    return STATUS_SUCCESS;
+
+end:
+    free_tree_writes(tree_writes);
+
+    return Status;
+}
+
+static NTSTATUS write_commit_trees(device_extension* Vcb) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+
+    Status = do_tree_writes(Vcb, &Vcb->commit_tree_writes);
     if (!NT_SUCCESS(Status)) {
         ERR("do_tree_writes returned %08x\n", Status);
-        goto end;
+        free_tree_writes(&Vcb->commit_tree_writes);
+        return Status;
     }
 
-    Status = STATUS_SUCCESS;
-
-end:
-    while (!IsListEmpty(&tree_writes)) {
-        le = RemoveHeadList(&tree_writes);
-        tw = CONTAINING_RECORD(le, tree_write, list_entry);
+    // keep the new nodes around, so we don't have to read them back in after free_trees
+    le = Vcb->commit_tree_writes.Flink;
+    while (le != &Vcb->commit_tree_writes) {
+        tree_write* tw = CONTAINING_RECORD(le, tree_write, list_entry);
+        ULONG i;
 
-        if (tw->data)
-            ExFreePool(tw->data);
+        for (i = 0; i < tw->length; i += Vcb->superblock.node_size) {
+            node_cache_add(Vcb, tw->address + i, tw->data + i);
+        }
 
-        ExFreePool(tw);
+        le = le->Flink;
     }
 
-    return Status;
+    free_tree_writes(&Vcb->commit_tree_writes);
+
+    return STATUS_SUCCESS;
 }
 
 static void update_backup_superblock(device_extension* Vcb, superblock_backup* sb, PIRP Irp) {
@@ -2167,7 +2258,7 @@ static NTSTATUS __stdcall write_superblock_completion(PDEVICE_OBJECT DeviceObjec
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
-static NTSTATUS write_superblock(device_extension* Vcb, device* device, write_superblocks_context* context) {
+static NTSTATUS write_superblock(device_extension* Vcb, superblock* src, device* device, write_superblocks_context* context) {
     unsigned int i = 0;
 
     // All the documentation says that the Linux driver only writes one superblock
@@ -2176,7 +2267,6 @@ static NTSTATUS write_superblock(device_extension* Vcb, device* device, write_su
     while (superblock_addrs[i] > 0 && device->devitem.num_bytes >= superblock_addrs[i] + sizeof(superblock)) {
         ULONG sblen = (ULONG)sector_align(sizeof(superblock), Vcb->superblock.sector_size);
         superblock* sb;
-        uint32_t crc32;
         write_superblocks_stripe* stripe;
         PIO_STACK_LOCATION IrpSp;
 
@@ -2186,7 +2276,7 @@ static NTSTATUS write_superblock(device_extension* Vcb, device* device, write_su
             return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        RtlCopyMemory(sb, &Vcb->superblock, sizeof(superblock));
+        RtlCopyMemory(sb, src, sizeof(superblock));
 
         if (sblen > sizeof(superblock))
             RtlZeroMemory((uint8_t*)sb + sizeof(superblock), sblen - sizeof(superblock));
@@ -2194,8 +2284,7 @@ static NTSTATUS write_superblock(device_extension* Vcb, device* device, write_su
         RtlCopyMemory(&sb->dev_item, &device->devitem, sizeof(DEV_ITEM));
         sb->sb_phys_addr = superblock_addrs[i];
 
-        crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&sb->uuid, (ULONG)sizeof(superblock) - sizeof(sb->checksum));
-        RtlCopyMemory(&sb->checksum, &crc32, sizeof(uint32_t));
+        calc_superblock_checksum(sb);
 
         stripe = ExAllocatePoolWithTag(NonPagedPool, sizeof(write_superblocks_stripe), ALLOC_TAG);
         if (!stripe) {
@@ -2264,11 +2353,9 @@ static NTSTATUS write_superblock(device_extension* Vcb, device* device, write_su
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
+static void update_superblock_roots(device_extension* Vcb, PIRP Irp) {
     uint64_t i;
-    NTSTATUS Status;
     LIST_ENTRY* le;
-    write_superblocks_context context;
 
     TRACE("(%p)\n", Vcb);
 
@@ -2295,6 +2382,12 @@ static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
     }
 
     update_backup_superblock(Vcb, &Vcb->superblock.backup[BTRFS_NUM_BACKUP_ROOTS - 1], Irp);
+}
+
+NTSTATUS write_superblock_copies(device_extension* Vcb, superblock* sb) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    write_superblocks_context context;
 
     KeInitializeEvent(&context.Event, NotificationEvent, false);
     InitializeListHead(&context.stripes);
@@ -2305,7 +2398,7 @@ static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
         device* dev = CONTAINING_RECORD(le, device, list_entry);
 
         if (dev->devobj && !dev->readonly) {
-            Status = write_superblock(Vcb, dev, &context);
+            Status = write_superblock(Vcb, sb, dev, &context);
             if (!NT_SUCCESS(Status)) {
                 ERR("write_superblock returned %08x\n", Status);
                 goto end;
@@ -2532,6 +2625,7 @@ end:
     if (ce->count == 0 && !ce->superseded) {
         c->used -= ce->size;
         space_list_add(c, ce->address, ce->size, rollback);
+        decomp_cache_remove(Vcb, ce->address);
     }
 
     RemoveEntryList(&ce->list_entry);
@@ -2540,13 +2634,13 @@ end:
     return STATUS_SUCCESS;
 }
 
-void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, uint32_t* csum, PIRP Irp) {
+NTSTATUS add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, void* csum, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp, next_tp;
     NTSTATUS Status;
     uint64_t startaddr, endaddr;
     ULONG len;
-    uint32_t* checksums;
+    uint8_t* checksums;
     RTL_BITMAP bmp;
     ULONG* bmparr;
     ULONG runlength, index;
@@ -2564,44 +2658,44 @@ void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, u
         if (csum) { // not deleted
             ULONG length2 = length;
             uint64_t off = address;
-            uint32_t* data = csum;
+            uint8_t* data = csum;
 
             do {
-                uint16_t il = (uint16_t)min(length2, MAX_CSUM_SIZE / sizeof(uint32_t));
+                uint16_t il = (uint16_t)min(length2, MAX_CSUM_SIZE / Vcb->csum_size);
 
-                checksums = ExAllocatePoolWithTag(PagedPool, il * sizeof(uint32_t), ALLOC_TAG);
+                checksums = ExAllocatePoolWithTag(PagedPool, il * Vcb->csum_size, ALLOC_TAG);
                 if (!checksums) {
                     ERR("out of memory\n");
-                    return;
+                    return STATUS_INSUFFICIENT_RESOURCES;
                 }
 
-                RtlCopyMemory(checksums, data, il * sizeof(uint32_t));
+                RtlCopyMemory(checksums, data, il * Vcb->csum_size);
 
                 Status = insert_tree_item(Vcb, Vcb->checksum_root, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, off, checksums,
-                                          il * sizeof(uint32_t), NULL, Irp);
+                                          il * Vcb->csum_size, NULL, Irp);
                 if (!NT_SUCCESS(Status)) {
                     ERR("insert_tree_item returned %08x\n", Status);
                     ExFreePool(checksums);
-                    return;
+                    return Status;
                 }
 
                 length2 -= il;
 
                 if (length2 > 0) {
                     off += il * Vcb->superblock.sector_size;
-                    data += il;
+                    data += il * Vcb->csum_size;
                 }
             } while (length2 > 0);
         }
     } else if (!NT_SUCCESS(Status)) {
         ERR("find_item returned %08x\n", Status);
-        return;
+        return Status;
     } else {
         uint32_t tplen;
 
         // FIXME - check entry is TYPE_EXTENT_CSUM?
 
-        if (tp.item->key.offset < address && tp.item->key.offset + (tp.item->size * Vcb->superblock.sector_size / sizeof(uint32_t)) >= address)
+        if (tp.item->key.offset < address && tp.item->key.offset + (tp.item->size * Vcb->superblock.sector_size / Vcb->csum_size) >= address)
             startaddr = tp.item->key.offset;
         else
             startaddr = address;
@@ -2613,10 +2707,10 @@ void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, u
         Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, false, Irp);
         if (!NT_SUCCESS(Status)) {
             ERR("find_item returned %08x\n", Status);
-            return;
+            return Status;
         }
 
-        tplen = tp.item->size / sizeof(uint32_t);
+        tplen = tp.item->size / Vcb->csum_size;
 
         if (tp.item->key.offset + (tplen * Vcb->superblock.sector_size) >= address + (length * Vcb->superblock.sector_size))
             endaddr = tp.item->key.offset + (tplen * Vcb->superblock.sector_size);
@@ -2629,17 +2723,17 @@ void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, u
 
         len = (ULONG)((endaddr - startaddr) / Vcb->superblock.sector_size);
 
-        checksums = ExAllocatePoolWithTag(PagedPool, sizeof(uint32_t) * len, ALLOC_TAG);
+        checksums = ExAllocatePoolWithTag(PagedPool, Vcb->csum_size * len, ALLOC_TAG);
         if (!checksums) {
             ERR("out of memory\n");
-            return;
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
         bmparr = ExAllocatePoolWithTag(PagedPool, sizeof(ULONG) * ((len/8)+1), ALLOC_TAG);
         if (!bmparr) {
             ERR("out of memory\n");
             ExFreePool(checksums);
-            return;
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
         RtlInitializeBitMap(&bmp, bmparr, len);
@@ -2654,7 +2748,7 @@ void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, u
             ERR("find_item returned %08x\n", Status);
             ExFreePool(checksums);
             ExFreePool(bmparr);
-            return;
+            return Status;
         }
 
         // set bit = free space, cleared bit = allocated sector
@@ -2662,10 +2756,10 @@ void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, u
         while (tp.item->key.offset < endaddr) {
             if (tp.item->key.offset >= startaddr) {
                 if (tp.item->size > 0) {
-                    ULONG itemlen = (ULONG)min((len - (tp.item->key.offset - startaddr) / Vcb->superblock.sector_size) * sizeof(uint32_t), tp.item->size);
+                    ULONG itemlen = (ULONG)min((len - (tp.item->key.offset - startaddr) / Vcb->superblock.sector_size) * Vcb->csum_size, tp.item->size);
 
-                    RtlCopyMemory(&checksums[(tp.item->key.offset - startaddr) / Vcb->superblock.sector_size], tp.item->data, itemlen);
-                    RtlClearBits(&bmp, (ULONG)((tp.item->key.offset - startaddr) / Vcb->superblock.sector_size), itemlen / sizeof(uint32_t));
+                    RtlCopyMemory(checksums + ((tp.item->key.offset - startaddr) * Vcb->csum_size / Vcb->superblock.sector_size), tp.item->data, itemlen);
+                    RtlClearBits(&bmp, (ULONG)((tp.item->key.offset - startaddr) / Vcb->superblock.sector_size), itemlen / Vcb->csum_size);
                 }
 
                 Status = delete_tree_item(Vcb, &tp);
@@ -2673,7 +2767,7 @@ void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, u
                     ERR("delete_tree_item returned %08x\n", Status);
                     ExFreePool(checksums);
                     ExFreePool(bmparr);
-                    return;
+                    return Status;
                 }
             }
 
@@ -2686,7 +2780,7 @@ void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, u
         if (!csum) { // deleted
             RtlSetBits(&bmp, (ULONG)((address - startaddr) / Vcb->superblock.sector_size), length);
         } else {
-            RtlCopyMemory(&checksums[(address - startaddr) / Vcb->superblock.sector_size], csum, length * sizeof(uint32_t));
+            RtlCopyMemory(checksums + ((address - startaddr) * Vcb->csum_size / Vcb->superblock.sector_size), csum, length * Vcb->csum_size);
             RtlClearBits(&bmp, (ULONG)((address - startaddr) / Vcb->superblock.sector_size), length);
         }
 
@@ -2706,32 +2800,32 @@ void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, u
             do {
                 uint16_t rl;
                 uint64_t off;
-                uint32_t* data;
+                uint8_t* data;
 
-                if (runlength * sizeof(uint32_t) > MAX_CSUM_SIZE)
-                    rl = MAX_CSUM_SIZE / sizeof(uint32_t);
+                if (runlength * Vcb->csum_size > MAX_CSUM_SIZE)
+                    rl = (uint16_t)(MAX_CSUM_SIZE / Vcb->csum_size);
                 else
                     rl = (uint16_t)runlength;
 
-                data = ExAllocatePoolWithTag(PagedPool, sizeof(uint32_t) * rl, ALLOC_TAG);
+                data = ExAllocatePoolWithTag(PagedPool, Vcb->csum_size * rl, ALLOC_TAG);
                 if (!data) {
                     ERR("out of memory\n");
                     ExFreePool(bmparr);
                     ExFreePool(checksums);
-                    return;
+                    return STATUS_INSUFFICIENT_RESOURCES;
                 }
 
-                RtlCopyMemory(data, &checksums[index], sizeof(uint32_t) * rl);
+                RtlCopyMemory(data, checksums + (index * Vcb->csum_size), Vcb->csum_size * rl);
 
                 off = startaddr + UInt32x32To64(index, Vcb->superblock.sector_size);
 
-                Status = insert_tree_item(Vcb, Vcb->checksum_root, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, off, data, sizeof(uint32_t) * rl, NULL, Irp);
+                Status = insert_tree_item(Vcb, Vcb->checksum_root, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, off, data, Vcb->csum_size * rl, NULL, Irp);
                 if (!NT_SUCCESS(Status)) {
                     ERR("insert_tree_item returned %08x\n", Status);
                     ExFreePool(data);
                     ExFreePool(bmparr);
                     ExFreePool(checksums);
-                    return;
+                    return Status;
                 }
 
                 runlength -= rl;
@@ -2744,6 +2838,8 @@ void add_checksum_entry(device_extension* Vcb, uint64_t address, ULONG length, u
         ExFreePool(bmparr);
         ExFreePool(checksums);
     }
+
+    return STATUS_SUCCESS;
 }
 
 static NTSTATUS update_chunk_usage(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
@@ -2974,6 +3070,10 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     nt->is_unique = true;
     nt->list_entry_hash.Flink = NULL;
     nt->buf = NULL;
+    nt->index = NULL;
+    nt->index_len = 0;
+    nt->index_alloc = 0;
+    nt->index_valid = false;
     InitializeListHead(&nt->itemlist);
 
     oldlastitem = CONTAINING_RECORD(newfirstitem->list_entry.Blink, tree_data, list_entry);
@@ -2989,6 +3089,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     nt->size = t->size - size;
     t->size = size;
     t->header.num_items = numitems;
+    t->index_valid = false;
     nt->write = true;
 
     InsertTailList(&Vcb->trees, &nt->list_entry);
@@ -3041,6 +3142,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
         td->key = newfirstitem->key;
 
         InsertHeadList(&t->paritem->list_entry, &td->list_entry);
+        nt->parent->index_valid = false;
 
         td->ignore = false;
         td->inserted = true;
@@ -3094,6 +3196,10 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     pt->is_unique = true;
     pt->list_entry_hash.Flink = NULL;
     pt->buf = NULL;
+    pt->index = NULL;
+    pt->index_len = 0;
+    pt->index_alloc = 0;
+    pt->index_valid = false;
     InitializeListHead(&pt->itemlist);
 
     InsertTailList(&Vcb->trees, &pt->list_entry);
@@ -3349,6 +3455,8 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, bool* done,
         t->itemlist.Blink->Flink = &t->itemlist;
 
         next_tree->itemlist.Flink = next_tree->itemlist.Blink = &next_tree->itemlist;
+        t->index_valid = false;
+        next_tree->index_valid = false;
 
         next_tree->header.num_items = 0;
         next_tree->size = 0;
@@ -3384,6 +3492,7 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, bool* done,
         }
 
         RemoveEntryList(&nextparitem->list_entry);
+        next_tree->parent->index_valid = false;
         ExFreePool(next_tree->paritem);
         next_tree->paritem = NULL;
 
@@ -3416,6 +3525,8 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, bool* done,
             if (t->size + size < Vcb->superblock.node_size - sizeof(tree_header)) {
                 RemoveEntryList(&td->list_entry);
                 InsertTailList(&t->itemlist, &td->list_entry);
+                t->index_valid = false;
+                next_tree->index_valid = false;
 
                 if (next_tree->header.level > 0 && td->treeholder.tree) {
                     td->treeholder.tree->parent = t;
@@ -3660,6 +3771,7 @@ static NTSTATUS do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
                         }
 
                         RemoveEntryList(&t->paritem->list_entry);
+                        t->parent->index_valid = false;
                         ExFreePool(t->paritem);
                         t->paritem = NULL;
 
@@ -4840,9 +4952,14 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
 
                 if (ed2->size > 0) { // not sparse
                     if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE)
-                        add_checksum_entry(fcb->Vcb, ed2->address + ed2->offset, (ULONG)(ed2->num_bytes / fcb->Vcb->superblock.sector_size), ext->csum, Irp);
+                        Status = add_checksum_entry(fcb->Vcb, ed2->address + ed2->offset, (ULONG)(ed2->num_bytes / fcb->Vcb->superblock.sector_size), ext->csum, Irp);
                     else
-                        add_checksum_entry(fcb->Vcb, ed2->address, (ULONG)(ed2->size / fcb->Vcb->superblock.sector_size), ext->csum, Irp);
+                        Status = add_checksum_entry(fcb->Vcb, ed2->address, (ULONG)(ed2->size / fcb->Vcb->superblock.sector_size), ext->csum, Irp);
+
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("add_checksum_entry returned %08x\n", Status);
+                        goto end;
+                    }
                 }
             }
 
@@ -4870,29 +4987,42 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
                             nextext->offset == ext->offset + ed2->num_bytes && ned2->offset == ed2->offset + ed2->num_bytes) {
                             chunk* c;
 
-                            if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE && ext->csum) {
+                            if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE && ext->csum && nextext->csum) {
                                 ULONG len = (ULONG)((ed2->num_bytes + ned2->num_bytes) / fcb->Vcb->superblock.sector_size);
-                                uint32_t* csum;
+                                void* csum;
 
-                                csum = ExAllocatePoolWithTag(NonPagedPool, len * sizeof(uint32_t), ALLOC_TAG);
+                                csum = ExAllocatePoolWithTag(NonPagedPool, len * fcb->Vcb->csum_size, ALLOC_TAG);
                                 if (!csum) {
                                     ERR("out of memory\n");
                                     Status = STATUS_INSUFFICIENT_RESOURCES;
                                     goto end;
                                 }
 
-                                RtlCopyMemory(csum, ext->csum, (ULONG)(ed2->num_bytes * sizeof(uint32_t) / fcb->Vcb->superblock.sector_size));
-                                RtlCopyMemory(&csum[ed2->num_bytes / fcb->Vcb->superblock.sector_size], nextext->csum,
-                                              (ULONG)(ned2->num_bytes * sizeof(uint32_t) / fcb->Vcb->superblock.sector_size));
+                                RtlCopyMemory(csum, ext->csum, (ULONG)(ed2->num_bytes * fcb->Vcb->csum_size / fcb->Vcb->superblock.sector_size));
+                                RtlCopyMemory((uint8_t*)csum + (ed2->num_bytes * fcb->Vcb->csum_size / fcb->Vcb->superblock.sector_size), nextext->csum,
+                                              (ULONG)(ned2->num_bytes * fcb->Vcb->csum_size / fcb->Vcb->superblock.sector_size));
 
                                 ExFreePool(ext->csum);
                                 ext->csum = csum;
+                            } else if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE && ext->csum) {
+                                // one half's checksums aren't loaded - drop the other's, and load_extent_csum will fetch the lot
+                                ExFreePool(ext->csum);
+                                ext->csum = NULL;
+                            } else if (!ext->csum && nextext->csum) { // compressed, so both cover the whole extent
+                                ext->csum = nextext->csum;
+                                nextext->csum = NULL;
+                            }
+
+                            if (!ext->csum && ext->extent_data.type == EXTENT_TYPE_REGULAR && !(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
+                                fcb->csums_unloaded = true;
+                                fcb->Header.IsFastIoPossible = fast_io_possible(fcb);
                             }
 
                             ext->extent_data.generation = fcb->Vcb->superblock.generation;
                             ed2->num_bytes += ned2->num_bytes;
 
                             RemoveEntryList(&nextext->list_entry);
+                            unindex_fcb_extent(fcb, nextext);
 
                             if (nextext->csum)
                                 ExFreePool(nextext->csum);
@@ -4941,6 +5071,7 @@ NTSTATUS flush_fcb(fcb* fcb, bool cache, LIST_ENTRY* batchlist, PIRP Irp) {
             EXTENT_DATA* ed;
 
             ext->inserted = false;
+            ext->csum_used = true;
 
             if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES) && ext->offset > last_end) {
                 Status = insert_sparse_extent(fcb, batchlist, last_end, ext->offset - last_end);
@@ -5586,6 +5717,7 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
         remove_from_bootstrap(Vcb, 0x100, TYPE_CHUNK_ITEM, c->offset);
 
     RemoveEntryList(&c->list_entry);
+    chunk_map_remove(Vcb, c);
 
     // clear raid56 incompat flag if dropping last RAID5/6 chunk
 
@@ -5633,6 +5765,13 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
         ExFreePool(s);
     }
 
+    while (!IsListEmpty(&c->pinned)) {
+        space* s = CONTAINING_RECORD(c->pinned.Flink, space, list_entry);
+
+        RemoveEntryList(&s->list_entry);
+        ExFreePool(s);
+    }
+
     release_chunk_lock(c, Vcb);
 
     ExDeleteResourceLite(&c->partial_stripes_lock);
@@ -5875,11 +6014,22 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
     if (c->chunk_item->type & BLOCK_FLAG_RAID5) {
         if (c->devices[parity2]->devobj) {
             uint16_t i;
+            uint8_t** srcs;
+
+            srcs = ExAllocatePoolWithTag(PagedPool, sizeof(uint8_t*) * num_data_stripes, ALLOC_TAG);
+            if (!srcs) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
 
-            for (i = 1; i < c->chunk_item->num_stripes - 1; i++) {
-                do_xor(ps->data, ps->data + (i * stripe_length), stripe_length);
+            for (i = 0; i < num_data_stripes; i++) {
+                srcs[i] = ps->data + (i * stripe_length);
             }
 
+            do_xor_multi(ps->data, srcs, num_data_stripes, stripe_length);
+
+            ExFreePool(srcs);
+
             Status = write_data_phys(c->devices[parity2]->devobj, c->devices[parity2]->fileobj, cis[parity2].offset + startoff, ps->data, stripe_length);
             if (!NT_SUCCESS(Status)) {
                 ERR("write_data_phys returned %08x\n", Status);
@@ -5890,7 +6040,7 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
         uint16_t parity1 = (parity2 + c->chunk_item->num_stripes - 1) % c->chunk_item->num_stripes;
 
         if (c->devices[parity1]->devobj || c->devices[parity2]->devobj) {
-            uint8_t* scratch;
+            uint8_t *scratch, **srcs;
             uint16_t i;
 
             scratch = ExAllocatePoolWithTag(NonPagedPool, stripe_length * 2, ALLOC_TAG);
@@ -5899,23 +6049,29 @@ NTSTATUS flush_partial_stripe(device_extension* Vcb, chunk* c, partial_stripe* p
                 return STATUS_INSUFFICIENT_RESOURCES;
             }
 
-            i = c->chunk_item->num_stripes - 3;
+            srcs = ExAllocatePoolWithTag(PagedPool, sizeof(uint8_t*) * num_data_stripes, ALLOC_TAG);
+            if (!srcs) {
+                ERR("out of memory\n");
+                ExFreePool(scratch);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
 
-            while (true) {
-                if (i == c->chunk_item->num_stripes - 3) {
-                    RtlCopyMemory(scratch, ps->data + (i * stripe_length), stripe_length);
-                    RtlCopyMemory(scratch + stripe_length, ps->data + (i * stripe_length), stripe_length);
-                } else {
-                    do_xor(scratch, ps->data + (i * stripe_length), stripe_length);
+            for (i = 0; i < num_data_stripes; i++) {
+                srcs[i] = ps->data + (i * stripe_length);
+            }
 
-                    galois_double(scratch + stripe_length, stripe_length);
-                    do_xor(scratch + stripe_length, ps->data + (i * stripe_length), stripe_length);
-                }
+            do_xor_multi(scratch, srcs, num_data_stripes, stripe_length);
 
-                if (i == 0)
-                    break;
+            ExFreePool(srcs);
+
+            i = c->chunk_item->num_stripes - 3;
 
+            RtlCopyMemory(scratch + stripe_length, ps->data + (i * stripe_length), stripe_length);
+
+            while (i > 0) {
                 i--;
+
+                galois_double_xor(scratch + stripe_length, ps->data + (i * stripe_length), stripe_length);
             }
 
             if (c->devices[parity1]->devobj) {
@@ -6724,13 +6880,16 @@ static NTSTATUS flush_fileref(file_ref* fileref, LIST_ENTRY* batchlist, PIRP Irp
     return STATUS_SUCCESS;
 }
 
-static void flush_disk_caches(device_extension* Vcb) {
+void flush_disk_caches(device_extension* Vcb) {
     LIST_ENTRY* le;
     ioctl_context context;
     ULONG num;
 
     context.left = 0;
 
+    // sync_fcb can call us without tree_lock
+    ExAcquireResourceSharedLite(&Vcb->devices_lock, true);
+
     le = Vcb->devices.Flink;
 
     while (le != &Vcb->devices) {
@@ -6743,7 +6902,7 @@ static void flush_disk_caches(device_extension* Vcb) {
     }
 
     if (context.left == 0)
-        return;
+        goto end;
 
     num = 0;
 
@@ -6752,7 +6911,7 @@ static void flush_disk_caches(device_extension* Vcb) {
     context.stripes = ExAllocatePoolWithTag(NonPagedPool, sizeof(ioctl_context_stripe) * context.left, ALLOC_TAG);
     if (!context.stripes) {
         ERR("out of memory\n");
-        return;
+        goto end;
     }
 
     RtlZeroMemory(context.stripes, sizeof(ioctl_context_stripe) * context.left);
@@ -6806,6 +6965,9 @@ nextdev:
     KeWaitForSingleObject(&context.Event, Executive, KernelMode, false, NULL);
 
     ExFreePool(context.stripes);
+
+end:
+    ExReleaseResourceLite(&Vcb->devices_lock);
 }
 
 static NTSTATUS flush_changed_dev_stats(device_extension* Vcb, device* dev, PIRP Irp) {
@@ -7234,7 +7396,6 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     NTSTATUS Status;
     LIST_ENTRY *le, batchlist;
     bool cache_changed = false;
-    volume_device_extension* vde;
     bool no_cache = false;
 #ifdef DEBUG_FLUSH_TIMES
     uint64_t filerefs = 0, fcbs = 0;
@@ -7252,6 +7413,9 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     time1 = KeQueryPerformanceCounter(&freq);
 #endif
 
+    // everything in the log is about to be committed for real
+    clear_log_tree(Vcb);
+
     Status = check_for_orphans(Vcb, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("check_for_orphans returned %08x\n", Status);
@@ -7558,19 +7722,114 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 
     Vcb->superblock.cache_generation = Vcb->superblock.generation;
 
+    update_superblock_roots(Vcb, Irp);
+
+    // All that's left is to write the nodes and the superblock, which finish_commit does from
+    // commit_tree_writes and this copy, so that the next transaction can start while we're
+    // waiting for the disks.
+    RtlCopyMemory(&Vcb->commit_sb, &Vcb->superblock, sizeof(superblock));
+
+    pin_freed_space(Vcb);
+
+    Vcb->superblock.generation++;
+
+    Status = STATUS_SUCCESS;
+
+    le = Vcb->trees.Flink;
+    while (le != &Vcb->trees) {
+        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+
+        t->write = false;
+
+        le = le->Flink;
+    }
+
+    Vcb->need_write = false;
+
+    Vcb->writeback.dirty_inodes = 0;
+    Vcb->writeback.dirty_extents = 0;
+    Vcb->writeback.kicked = 0;
+
+    while (!IsListEmpty(&Vcb->drop_roots)) {
+        root* r = CONTAINING_RECORD(RemoveHeadList(&Vcb->drop_roots), root, list_entry);
+
+        ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
+        ExFreePool(r->nonpaged);
+        ExFreePool(r);
+    }
+
+end:
+    TRACE("do_write returning %08x\n", Status);
+
+    return Status;
+}
+
+static void drop_to_readonly(device_extension* Vcb) {
+    Vcb->readonly = true;
+    flush_node_cache(Vcb);
+    flush_decomp_cache(Vcb);
+    FsRtlNotifyVolumeEvent(Vcb->root_file, FSRTL_VOLUME_FORCED_CLOSED);
+}
+
+// Builds the trees for the current transaction in memory, then starts the next one.
+// Nothing goes to disk until finish_commit.
+static NTSTATUS start_commit(device_extension* Vcb, PIRP Irp) {
+    LIST_ENTRY rollback;
+    NTSTATUS Status;
+
+    InitializeListHead(&rollback);
+
+    // This has to be set before do_write2 clears the fcbs' dirty flags, so that sync_fcb
+    // knows a clean fcb mightn't be on disk yet.
+    InterlockedExchange(&Vcb->commit_pending, 1);
+
+    Status = do_write2(Vcb, Irp, &rollback);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("do_write2 returned %08x, dropping into readonly mode\n", Status);
+        InterlockedExchange(&Vcb->commit_pending, 0);
+        free_tree_writes(&Vcb->commit_tree_writes);
+        drop_to_readonly(Vcb);
+        do_rollback(Vcb, &rollback);
+    } else
+        clear_rollback(&rollback);
+
+    return Status;
+}
+
+// Writes the nodes and superblock saved by start_commit. This only needs tree_lock shared, so creates,
+// renames and the like can carry on with the next transaction while we wait for the disks.
+static NTSTATUS finish_commit(device_extension* Vcb) {
+    NTSTATUS Status;
+    volume_device_extension* vde;
+
+    Status = write_commit_trees(Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_commit_trees returned %08x, dropping into readonly mode\n", Status);
+        drop_to_readonly(Vcb);
+        return Status;
+    }
+
     if (!Vcb->options.no_barrier)
         flush_disk_caches(Vcb);
 
-    Status = write_superblocks(Vcb, Irp);
+    Status = write_superblock_copies(Vcb, &Vcb->commit_sb);
     if (!NT_SUCCESS(Status)) {
-        ERR("write_superblocks returned %08x\n", Status);
-        goto end;
+        // the old superblock's still good, but we've already moved on from it in memory
+        ERR("write_superblock_copies returned %08x, dropping into readonly mode\n", Status);
+        drop_to_readonly(Vcb);
+        return Status;
     }
 
+    RtlCopyMemory(&Vcb->log.committed_sb, &Vcb->commit_sb, sizeof(superblock));
+
+    InterlockedExchange(&Vcb->commit_pending, 0);
+
     vde = Vcb->vde;
 
     if (vde) {
         pdo_device_extension* pdode = vde->pdode;
+        LIST_ENTRY* le;
 
         ExAcquireResourceSharedLite(&pdode->child_lock, true);
 
@@ -7579,7 +7838,7 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         while (le != &pdode->children) {
             volume_child* vc = CONTAINING_RECORD(le, volume_child, list_entry);
 
-            vc->generation = Vcb->superblock.generation;
+            vc->generation = Vcb->commit_sb.generation;
             le = le->Flink;
         }
 
@@ -7588,80 +7847,274 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 
     clean_space_cache(Vcb);
 
-    le = Vcb->chunks.Flink;
-    while (le != &Vcb->chunks) {
-        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+    return STATUS_SUCCESS;
+}
 
-        c->changed = false;
-        c->space_changed = false;
+NTSTATUS do_write(device_extension* Vcb, PIRP Irp) {
+    NTSTATUS Status;
+
+    Status = start_commit(Vcb, Irp);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    return finish_commit(Vcb);
+}
+
+// Frees the checksums of extents that haven't been read since the last pass, so that they
+// don't pile up for big files. load_extent_csum will bring them back if they're wanted again.
+static void evict_csums(device_extension* Vcb) {
+    LIST_ENTRY* le;
+
+    acquire_fcb_lock_shared(Vcb);
+
+    le = Vcb->all_fcbs.Flink;
+    while (le != &Vcb->all_fcbs) {
+        struct _fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_all);
+
+        if (fcb->type == BTRFS_TYPE_FILE && !fcb->ads && !fcb->deleted && !(fcb->inode_item.flags & BTRFS_INODE_NODATASUM) &&
+            !(fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE) && ExAcquireResourceExclusiveLite(fcb->Header.Resource, false)) {
+            LIST_ENTRY* le2 = fcb->extents.Flink;
+            bool unloaded = false;
+
+            while (le2 != &fcb->extents) {
+                extent* ext = CONTAINING_RECORD(le2, extent, list_entry);
+
+                if (!ext->inserted && ext->extent_data.type == EXTENT_TYPE_REGULAR && ((EXTENT_DATA2*)ext->extent_data.data)->size != 0) {
+                    if (ext->csum && !ext->csum_used) {
+                        ExFreePool(ext->csum);
+                        ext->csum = NULL;
+                    }
+
+                    ext->csum_used = false;
+
+                    if (!ext->csum)
+                        unloaded = true;
+                }
+
+                le2 = le2->Flink;
+            }
+
+            fcb->csums_unloaded = unloaded;
+            fcb->Header.IsFastIoPossible = fast_io_possible(fcb);
+
+            ExReleaseResourceLite(fcb->Header.Resource);
+        }
 
         le = le->Flink;
     }
 
-    Vcb->superblock.generation++;
+    release_fcb_lock(Vcb);
+}
 
-    Status = STATUS_SUCCESS;
+static bool trees_dirty(device_extension* Vcb) {
+    LIST_ENTRY* le;
 
     le = Vcb->trees.Flink;
     while (le != &Vcb->trees) {
         tree* t = CONTAINING_RECORD(le, tree, list_entry);
 
-        t->write = false;
+        if (t->write)
+            return true;
 
         le = le->Flink;
     }
 
-    Vcb->need_write = false;
+    return false;
+}
 
-    while (!IsListEmpty(&Vcb->drop_roots)) {
-        root* r = CONTAINING_RECORD(RemoveHeadList(&Vcb->drop_roots), root, list_entry);
+static NTSTATUS commit_transaction(device_extension* Vcb, PIRP Irp) {
+    NTSTATUS Status;
+    bool committing = false;
 
-        ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
-        ExFreePool(r->nonpaged);
-        ExFreePool(r);
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
+
+    if (Vcb->need_write && !Vcb->readonly) {
+        Status = start_commit(Vcb, Irp);
+        committing = NT_SUCCESS(Status);
+    } else
+        Status = STATUS_SUCCESS;
+
+    // The new nodes aren't on disk yet, so the trees have to stay in memory until they are -
+    // anyone reading them before then would get whatever was there before.
+    if (!committing)
+        free_trees(Vcb);
+
+    // let everyone else back in while the trees and superblock are written - the next
+    // commit can't start until we've finished, as it needs tree_lock exclusively
+    if (committing) {
+        ExConvertExclusiveToSharedLite(&Vcb->tree_lock);
+
+        Status = finish_commit(Vcb);
     }
 
-end:
-    TRACE("do_write returning %08x\n", Status);
+    evict_csums(Vcb);
+
+#ifdef DEBUG_FLUSH_TIMES
+    ERR("node cache: %I64u hits, %I64u misses, %I64u bytes\n", Vcb->node_cache.hits, Vcb->node_cache.misses, Vcb->node_cache.size);
+    ERR("decompression cache: %I64u hits, %I64u misses, %I64u bytes, %I64u us saved\n", Vcb->decomp_cache.hits, Vcb->decomp_cache.misses,
+        Vcb->decomp_cache.size, Vcb->decomp_cache.time_saved * 1000000 / Vcb->decomp_cache.freq.QuadPart);
+
+    if (Vcb->commit.num_commits > 0) {
+        ERR("group commit: %I64u commits, %I64u requests, %u max coalesced, %I64u us mean latency, %I64u us max latency\n",
+            Vcb->commit.num_commits, Vcb->commit.num_requests, Vcb->commit.max_coalesced,
+            Vcb->commit.total_latency * 1000000 / Vcb->commit.freq.QuadPart / Vcb->commit.num_commits,
+            Vcb->commit.max_latency * 1000000 / Vcb->commit.freq.QuadPart);
+    }
+#endif
+
+    if (!NT_SUCCESS(Status))
+        ERR("do_write returned %08x\n", Status);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    // now the nodes are on disk, the trees can go, unless someone's already started changing them again
+    if (committing) {
+        ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
+
+        if (!trees_dirty(Vcb))
+            free_trees(Vcb);
+
+        ExReleaseResourceLite(&Vcb->tree_lock);
+    }
 
     return Status;
 }
 
-NTSTATUS do_write(device_extension* Vcb, PIRP Irp) {
-    LIST_ENTRY rollback;
+// Gets everything written so far onto the disk. Requests which come in while a commit is
+// running can't be satisfied by it, as it might have started before their changes were made,
+// so they wait and are all satisfied by the next one, which is run by whichever of them
+// notices first. This saves each caller taking tree_lock and committing in turn.
+NTSTATUS group_commit(device_extension* Vcb, PIRP Irp) {
     NTSTATUS Status;
+    uint64_t target;
 
-    InitializeListHead(&rollback);
+    ExAcquireFastMutex(&Vcb->commit.mutex);
 
-    Status = do_write2(Vcb, Irp, &rollback);
+    target = Vcb->commit.started + 1;
+    Vcb->commit.waiting++;
 
-    if (!NT_SUCCESS(Status)) {
-        ERR("do_write2 returned %08x, dropping into readonly mode\n", Status);
-        Vcb->readonly = true;
-        FsRtlNotifyVolumeEvent(Vcb->root_file, FSRTL_VOLUME_FORCED_CLOSED);
-        do_rollback(Vcb, &rollback);
-    } else
-        clear_rollback(&rollback);
+    while (Vcb->commit.completed < target) {
+        if (!Vcb->commit.running) {
+            uint64_t seq, latency;
+            ULONG coalesced;
+            LARGE_INTEGER time1, time2;
+
+            Vcb->commit.running = true;
+            seq = ++Vcb->commit.started;
+            coalesced = Vcb->commit.waiting;
+            Vcb->commit.waiting = 0;
+            KeClearEvent(&Vcb->commit.event);
+
+            ExReleaseFastMutex(&Vcb->commit.mutex);
+
+            time1 = KeQueryPerformanceCounter(NULL);
+            Status = commit_transaction(Vcb, Irp);
+            time2 = KeQueryPerformanceCounter(NULL);
+
+            ExAcquireFastMutex(&Vcb->commit.mutex);
+
+            Vcb->commit.running = false;
+            Vcb->commit.completed = seq;
+            Vcb->commit.status = Status;
+
+            latency = time2.QuadPart - time1.QuadPart;
+
+            Vcb->commit.num_commits++;
+            Vcb->commit.num_requests += coalesced;
+            Vcb->commit.total_latency += latency;
+            Vcb->commit.last_coalesced = coalesced;
+            Vcb->commit.last_latency = latency;
+
+            if (coalesced > Vcb->commit.max_coalesced)
+                Vcb->commit.max_coalesced = coalesced;
+
+            if (latency > Vcb->commit.max_latency)
+                Vcb->commit.max_latency = latency;
+
+            KeSetEvent(&Vcb->commit.event, 0, false);
+        } else {
+            ExReleaseFastMutex(&Vcb->commit.mutex);
+
+            KeWaitForSingleObject(&Vcb->commit.event, Executive, KernelMode, false, NULL);
+
+            ExAcquireFastMutex(&Vcb->commit.mutex);
+        }
+    }
+
+    Status = Vcb->commit.status;
+
+    ExReleaseFastMutex(&Vcb->commit.mutex);
 
     return Status;
 }
 
-static void do_flush(device_extension* Vcb) {
-    NTSTATUS Status;
+// if memory's short, commit once there's this much to write rather than waiting for the limits
+#define LOW_MEMORY_DIRTY_MIN 256
 
-    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
+// Called whenever something's made dirty. Rather than waiting for the flush interval, we start
+// a commit early if the transaction's got big or the system's running out of memory, so that
+// we don't end up with one enormous commit that stalls everything for seconds.
+void check_writeback(device_extension* Vcb) {
+    LONG inodes = Vcb->writeback.dirty_inodes, extents = Vcb->writeback.dirty_extents;
+    LARGE_INTEGER due_time;
 
-    if (Vcb->need_write && !Vcb->readonly)
-        Status = do_write(Vcb, NULL);
-    else
-        Status = STATUS_SUCCESS;
+    if (Vcb->writeback.kicked)
+        return;
 
-    free_trees(Vcb);
+    if ((Vcb->options.dirty_inode_limit == 0 || (ULONG)inodes < Vcb->options.dirty_inode_limit) &&
+        (Vcb->options.dirty_extent_limit == 0 || (ULONG)extents < Vcb->options.dirty_extent_limit) &&
+        (!low_memory_event || inodes + extents < LOW_MEMORY_DIRTY_MIN || !KeReadStateEvent(low_memory_event))) {
+        return;
+    }
 
-    if (!NT_SUCCESS(Status))
-        ERR("do_write returned %08x\n", Status);
+    if (InterlockedCompareExchange(&Vcb->writeback.kicked, 1, 0) != 0)
+        return;
 
-    ExReleaseResourceLite(&Vcb->tree_lock);
+    Vcb->writeback.early_commits++;
+
+    due_time.QuadPart = 0;
+    KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL); // wake the flush thread now
+
+    TRACE("starting commit early (%i inodes, %i extents)\n", inodes, extents);
+}
+
+// returns how far count is past twice the limit, as a percentage capped at 100
+static ULONG over_limit(LONG count, uint32_t limit) {
+    uint64_t threshold = (uint64_t)limit * 2;
+
+    if (limit == 0 || count <= 0 || (uint64_t)count <= threshold)
+        return 0;
+
+    return (ULONG)min(((uint64_t)count - threshold) * 100 / threshold, 100);
+}
+
+// Called before writes and creates, without any locks held. Once there's more than twice
+// the dirty limit outstanding the commits aren't keeping up, so we slow down writers in
+// proportion to how far over they've gone, up to MaxWriteDelay milliseconds.
+void throttle_writer(device_extension* Vcb) {
+    ULONG pc, delay;
+    LARGE_INTEGER time;
+
+    if (Vcb->options.max_write_delay == 0)
+        return;
+
+    pc = max(over_limit(Vcb->writeback.dirty_inodes, Vcb->options.dirty_inode_limit),
+             over_limit(Vcb->writeback.dirty_extents, Vcb->options.dirty_extent_limit));
+
+    if (pc == 0)
+        return;
+
+    delay = Vcb->options.max_write_delay * pc / 100;
+
+    if (delay == 0)
+        return;
+
+    check_writeback(Vcb);
+
+    Vcb->writeback.throttled++;
+
+    time.QuadPart = (LONGLONG)delay * -10000;
+    KeDelayExecutionThread(KernelMode, false, &time);
 }
 
 _Function_class_(KSTART_ROUTINE)
@@ -7672,8 +8125,6 @@ void __stdcall flush_thread(void* context) {
 
     ObReferenceObject(devobj);
 
-    KeInitializeTimer(&Vcb->flush_thread_timer);
-
     due_time.QuadPart = (uint64_t)Vcb->options.flush_interval * -10000000;
 
     KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
@@ -7684,8 +8135,16 @@ void __stdcall flush_thread(void* context) {
         if (!(devobj->Vpb->Flags & VPB_MOUNTED) || Vcb->removing)
             break;
 
-        if (!Vcb->locked)
-            do_flush(Vcb);
+        if (!Vcb->locked) {
+            // if there's nothing to write, don't hold everyone up by taking tree_lock
+            if (Vcb->need_write)
+                group_commit(Vcb, NULL);
+            else
+                evict_csums(Vcb);
+        }
+
+        // the commit might have been skipped or failed, so let check_writeback try again
+        InterlockedExchange(&Vcb->writeback.kicked, 0);
 
         KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
     }
@@ -186,6 +186,115 @@ NTSTATUS clear_free_space_cache(device_extension* Vcb, LIST_ENTRY* batchlist, PI
     return Status;
 }
 
+// The free space of each chunk is kept in two lists, one by address and one by
+// size, so that it can be walked in order. Each list is also indexed by an AVL
+// tree (avl.c), so that we can find where to start without walking the whole
+// thing. list_size is only ever non-NULL for a chunk's own lists, c->space and
+// c->space_size, which is how we get from it to the trees.
+
+static __inline chunk* space_list_chunk(LIST_ENTRY* list_size) {
+    return CONTAINING_RECORD(list_size, chunk, space_size);
+}
+
+// sorted by size descending, then by address
+static __inline bool space_size_before(space* s, space* s2) {
+    return s->size > s2->size || (s->size == s2->size && s->address < s2->address);
+}
+
+static void order_space_entry(space* s, LIST_ENTRY* list_size) {
+    chunk* c = space_list_chunk(list_size);
+    avl_node** link = &c->space_size_tree;
+    avl_node *parent = NULL, *next;
+
+    while (*link) {
+        parent = *link;
+
+        if (space_size_before(s, CONTAINING_RECORD(parent, space, node_size)))
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    avl_link(&c->space_size_tree, &s->node_size, parent, link);
+
+    next = avl_next(&s->node_size);
+
+    if (next)
+        InsertTailList(&CONTAINING_RECORD(next, space, node_size)->list_entry_size, &s->list_entry_size);
+    else
+        InsertTailList(list_size, &s->list_entry_size);
+}
+
+static void remove_space_size(space* s, LIST_ENTRY* list_size) {
+    RemoveEntryList(&s->list_entry_size);
+    avl_remove(&space_list_chunk(list_size)->space_size_tree, &s->node_size);
+}
+
+// Adds an entry, already in the address list, to the indices and to the size list.
+void index_space_entry(space* s, LIST_ENTRY* list_size) {
+    chunk* c = space_list_chunk(list_size);
+    avl_node** link = &c->space_tree;
+    avl_node* parent = NULL;
+
+    while (*link) {
+        parent = *link;
+
+        if (s->address < CONTAINING_RECORD(parent, space, node)->address)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    avl_link(&c->space_tree, &s->node, parent, link);
+
+    order_space_entry(s, list_size);
+}
+
+static void remove_space_entry(space* s, LIST_ENTRY* list_size) {
+    RemoveEntryList(&s->list_entry);
+
+    if (list_size) {
+        avl_remove(&space_list_chunk(list_size)->space_tree, &s->node);
+        remove_space_size(s, list_size);
+    }
+}
+
+// Returns the first entry in c->space which ends at or after address.
+space* find_space_entry(chunk* c, uint64_t address) {
+    avl_node* n = c->space_tree;
+    space* ret = NULL;
+
+    while (n) {
+        space* s = CONTAINING_RECORD(n, space, node);
+
+        if (s->address + s->size >= address) {
+            ret = s;
+            n = n->left;
+        } else
+            n = n->right;
+    }
+
+    return ret;
+}
+
+// Returns the smallest entry in c->space which is at least length bytes long.
+space* find_space_best_fit(chunk* c, uint64_t length) {
+    avl_node* n = c->space_size_tree;
+    space* ret = NULL;
+
+    while (n) {
+        space* s = CONTAINING_RECORD(n, space, node_size);
+
+        if (s->size >= length) {
+            ret = s;
+            n = n->right;
+        } else
+            n = n->left;
+    }
+
+    return ret;
+}
+
 NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t offset, uint64_t size) {
     space* s;
 
@@ -224,32 +333,8 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t offse
     }
 
 size:
-    if (!list_size)
-        return STATUS_SUCCESS;
-
-    if (IsListEmpty(list_size))
-        InsertTailList(list_size, &s->list_entry_size);
-    else {
-        space* s2 = CONTAINING_RECORD(list_size->Blink, space, list_entry_size);
-
-        if (s2->size >= size)
-            InsertTailList(list_size, &s->list_entry_size);
-        else {
-            LIST_ENTRY* le;
-
-            le = list_size->Flink;
-            while (le != list_size) {
-                s2 = CONTAINING_RECORD(le, space, list_entry_size);
-
-                if (s2->size <= size) {
-                    InsertHeadList(le->Blink, &s->list_entry_size);
-                    return STATUS_SUCCESS;
-                }
-
-                le = le->Flink;
-            }
-        }
-    }
+    if (list_size)
+        index_space_entry(s, list_size);
 
     return STATUS_SUCCESS;
 }
@@ -295,30 +380,6 @@ static void load_free_space_bitmap(device_extension* Vcb, chunk* c, uint64_t off
     }
 }
 
-static void order_space_entry(space* s, LIST_ENTRY* list_size) {
-    LIST_ENTRY* le;
-
-    if (IsListEmpty(list_size)) {
-        InsertHeadList(list_size, &s->list_entry_size);
-        return;
-    }
-
-    le = list_size->Flink;
-
-    while (le != list_size) {
-        space* s2 = CONTAINING_RECORD(le, space, list_entry_size);
-
-        if (s2->size <= s->size) {
-            InsertHeadList(le->Blink, &s->list_entry_size);
-            return;
-        }
-
-        le = le->Flink;
-    }
-
-    InsertTailList(list_size, &s->list_entry_size);
-}
-
 typedef struct {
     uint64_t stripe;
     LIST_ENTRY list_entry;
@@ -666,11 +727,10 @@ NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, bool load
             if (s2->address == s->address + s->size) {
                 s->size += s2->size;
 
-                RemoveEntryList(&s2->list_entry);
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_entry(s2, &c->space_size);
                 ExFreePool(s2);
 
-                RemoveEntryList(&s->list_entry_size);
+                remove_space_size(s, &c->space_size);
                 order_space_entry(s, &c->space_size);
 
                 le2 = le;
@@ -722,6 +782,9 @@ clearcache:
         le = le2;
     }
 
+    c->space_tree = NULL;
+    c->space_size_tree = NULL;
+
     return STATUS_NOT_FOUND;
 }
 
@@ -865,11 +928,10 @@ static NTSTATUS load_stored_free_space_tree(device_extension* Vcb, chunk* c, PIR
             if (s2->address == s->address + s->size) {
                 s->size += s2->size;
 
-                RemoveEntryList(&s2->list_entry);
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_entry(s2, &c->space_size);
                 ExFreePool(s2);
 
-                RemoveEntryList(&s->list_entry_size);
+                remove_space_size(s, &c->space_size);
                 order_space_entry(s, &c->space_size);
 
                 le2 = le;
@@ -939,7 +1001,7 @@ static NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp)
                     s->size = tp.item->key.obj_id - lastaddr;
                     InsertTailList(&c->space, &s->list_entry);
 
-                    order_space_entry(s, &c->space_size);
+                    index_space_entry(s, &c->space_size);
 
                     TRACE("(%I64x,%I64x)\n", s->address, s->size);
                 }
@@ -967,7 +1029,7 @@ static NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp)
             s->size = c->offset + c->chunk_item->size - lastaddr;
             InsertTailList(&c->space, &s->list_entry);
 
-            order_space_entry(s, &c->space_size);
+            index_space_entry(s, &c->space_size);
 
             TRACE("(%I64x,%I64x)\n", s->address, s->size);
         }
@@ -1053,7 +1115,7 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, bool* chan
 
     num_entries = 0;
 
-    // num_entries is the number of entries in c->space and c->deleting - it might
+    // num_entries is the number of entries in c->space, c->deleting and c->pinned - it might
     // be slightly higher then what we end up writing, but doing it this way is much
     // quicker and simpler.
     if (!IsListEmpty(&c->space)) {
@@ -1074,6 +1136,15 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, bool* chan
         }
     }
 
+    if (!IsListEmpty(&c->pinned)) {
+        le = c->pinned.Flink;
+        while (le != &c->pinned) {
+            num_entries++;
+
+            le = le->Flink;
+        }
+    }
+
     new_cache_size = sizeof(uint64_t) + (num_entries * sizeof(FREE_SPACE_ENTRY));
 
     num_sectors = (uint32_t)sector_align(new_cache_size, Vcb->superblock.sector_size) / Vcb->superblock.sector_size;
@@ -1456,7 +1527,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
         InsertTailList(list, &s->list_entry);
 
         if (list_size)
-            InsertTailList(list_size, &s->list_entry_size);
+            index_space_entry(s, list_size);
 
         if (rollback)
             add_rollback_space(rollback, true, list, list_size, address, length, c);
@@ -1464,7 +1535,13 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
         return;
     }
 
-    le = list->Flink;
+    if (list_size) {
+        s = find_space_entry(space_list_chunk(list_size), address);
+
+        le = s ? &s->list_entry : list->Blink;
+    } else
+        le = list->Flink;
+
     do {
         s2 = CONTAINING_RECORD(le, space, list_entry);
 
@@ -1488,10 +1565,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
                         s2->address = s3->address;
                         s2->size += s3->size;
 
-                        RemoveEntryList(&s3->list_entry);
-
-                        if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                        remove_space_entry(s3, list_size);
 
                         ExFreePool(s3);
                     } else
@@ -1511,10 +1585,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
                     if (s3->address <= s2->address + s2->size) {
                         s2->size = max(s2->size, s3->address + s3->size - s2->address);
 
-                        RemoveEntryList(&s3->list_entry);
-
-                        if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                        remove_space_entry(s3, list_size);
 
                         ExFreePool(s3);
                     } else
@@ -1523,7 +1594,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
             }
 
             if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_size(s2, list_size);
                 order_space_entry(s2, list_size);
             }
 
@@ -1545,10 +1616,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
                     s2->address = s3->address;
                     s2->size += s3->size;
 
-                    RemoveEntryList(&s3->list_entry);
-
-                    if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                    remove_space_entry(s3, list_size);
 
                     ExFreePool(s3);
                 } else
@@ -1556,7 +1624,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
             }
 
             if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_size(s2, list_size);
                 order_space_entry(s2, list_size);
             }
 
@@ -1576,10 +1644,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
                 if (s3->address <= s2->address + s2->size) {
                     s2->size = max(s2->size, s3->address + s3->size - s2->address);
 
-                    RemoveEntryList(&s3->list_entry);
-
-                    if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                    remove_space_entry(s3, list_size);
 
                     ExFreePool(s3);
                 } else
@@ -1587,7 +1652,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
             }
 
             if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_size(s2, list_size);
                 order_space_entry(s2, list_size);
             }
 
@@ -1611,7 +1676,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
             InsertHeadList(s2->list_entry.Blink, &s->list_entry);
 
             if (list_size)
-                order_space_entry(s, list_size);
+                index_space_entry(s, list_size);
 
             return;
         }
@@ -1624,7 +1689,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
         s2->size += length;
 
         if (list_size) {
-            RemoveEntryList(&s2->list_entry_size);
+            remove_space_size(s2, list_size);
             order_space_entry(s2, list_size);
         }
 
@@ -1644,7 +1709,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t address,
     InsertTailList(list, &s->list_entry);
 
     if (list_size)
-        order_space_entry(s, list_size);
+        index_space_entry(s, list_size);
 
     if (rollback)
         add_rollback_space(rollback, true, list, list_size, address, length, c);
@@ -1665,6 +1730,22 @@ static void space_list_merge(LIST_ENTRY* spacelist, LIST_ENTRY* spacelist_size,
     }
 }
 
+// Undoes space_list_merge for c->pinned. The old log tree's blocks get pinned before the cache is
+// written, and as the commit's superblock won't point to the log they need to be free in the cache,
+// but they mustn't go in c->space for good until the superblock's on the disk.
+static void space_list_unmerge(LIST_ENTRY* spacelist, LIST_ENTRY* spacelist_size, LIST_ENTRY* pinned, chunk* c) {
+    LIST_ENTRY* le;
+
+    le = pinned->Flink;
+    while (le != pinned) {
+        space* s = CONTAINING_RECORD(le, space, list_entry);
+
+        space_list_subtract2(spacelist, spacelist_size, s->address, s->size, c, NULL);
+
+        le = le->Flink;
+    }
+}
+
 static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME* now, LIST_ENTRY* batchlist, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     KEY searchkey;
@@ -1689,6 +1770,8 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
     num_sectors = (uint32_t)(c->cache->inode_item.st_size / Vcb->superblock.sector_size);
     off = (sizeof(uint32_t) * num_sectors) + sizeof(uint64_t);
 
+    space_list_merge(&c->space, &c->space_size, &c->pinned);
+
     le = c->space.Flink;
     while (le != &c->space) {
         FREE_SPACE_ENTRY* fse;
@@ -1710,6 +1793,8 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
         le = le->Flink;
     }
 
+    space_list_unmerge(&c->space, &c->space_size, &c->pinned, c);
+
     // update INODE_ITEM
 
     c->cache->inode_item.generation = Vcb->superblock.generation;
@@ -1803,6 +1888,7 @@ static NTSTATUS update_chunk_cache_tree(device_extension* Vcb, chunk* c, LIST_EN
     }
 
     space_list_merge(&c->space, &c->space_size, &c->deleting);
+    space_list_merge(&c->space, &c->space_size, &c->pinned);
 
     fsi->count = 0;
     fsi->flags = 0;
@@ -1817,6 +1903,7 @@ static NTSTATUS update_chunk_cache_tree(device_extension* Vcb, chunk* c, LIST_EN
                                         NULL, 0, Batch_Insert);
         if (!NT_SUCCESS(Status)) {
             ERR("insert_tree_item_batch returned %08x\n", Status);
+            space_list_unmerge(&c->space, &c->space_size, &c->pinned, c);
             ExFreePool(fsi);
             return Status;
         }
@@ -1824,6 +1911,8 @@ static NTSTATUS update_chunk_cache_tree(device_extension* Vcb, chunk* c, LIST_EN
         le = le->Flink;
     }
 
+    space_list_unmerge(&c->space, &c->space_size, &c->pinned, c);
+
     Status = insert_tree_item_batch(batchlist, Vcb, Vcb->space_root, c->offset, TYPE_FREE_SPACE_INFO, c->chunk_item->size,
                                     NULL, 0, Batch_DeleteFreeSpace);
     if (!NT_SUCCESS(Status)) {
@@ -1971,7 +2060,13 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
     if (IsListEmpty(list))
         return;
 
-    le = list->Flink;
+    if (list_size) {
+        s = find_space_entry(space_list_chunk(list_size), address);
+
+        le = s ? &s->list_entry : list;
+    } else
+        le = list->Flink;
+
     while (le != list) {
         s2 = CONTAINING_RECORD(le, space, list_entry);
         le2 = le->Flink;
@@ -1983,10 +2078,7 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
             if (rollback)
                 add_rollback_space(rollback, false, list, list_size, s2->address, s2->size, c);
 
-            RemoveEntryList(&s2->list_entry);
-
-            if (list_size)
-                RemoveEntryList(&s2->list_entry_size);
+            remove_space_entry(s2, list_size);
 
             ExFreePool(s2);
         } else if (address + length > s2->address && address + length < s2->address + s2->size) {
@@ -2009,9 +2101,9 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
                 s2->address = address + length;
 
                 if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
+                    remove_space_size(s2, list_size);
                     order_space_entry(s2, list_size);
-                    order_space_entry(s, list_size);
+                    index_space_entry(s, list_size);
                 }
 
                 return;
@@ -2023,7 +2115,7 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
                 s2->address = address + length;
 
                 if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
+                    remove_space_size(s2, list_size);
                     order_space_entry(s2, list_size);
                 }
             }
@@ -2034,7 +2126,7 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, uint64_t addr
             s2->size = address - s2->address;
 
             if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_size(s2, list_size);
                 order_space_entry(s2, list_size);
             }
         }
@@ -2052,4 +2144,10 @@ void space_list_subtract(chunk* c, bool deleting, uint64_t address, uint64_t len
     c->space_changed = true;
 
     space_list_subtract2(list, deleting ? NULL : &c->space_size, address, length, c, rollback);
+
+    // Updating the free space cache merges c->deleting into c->space, so what we've just
+    // allocated might have been freed earlier in this transaction. Take it out of c->deleting
+    // too, or it'll be handed back as free space once the commit's finished.
+    if (!deleting)
+        space_list_subtract2(&c->deleting, NULL, address, length, c, rollback);
 }
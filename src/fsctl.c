@@ -180,7 +180,7 @@ static NTSTATUS snapshot_tree_copy(device_extension* Vcb, uint64_t addr, root* s
         }
     }
 
-    *((uint32_t*)buf) = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
+    get_tree_checksum(Vcb, th, th->csum);
 
     KeInitializeEvent(&wtc.Event, NotificationEvent, false);
     InitializeListHead(&wtc.stripes);
@@ -1499,6 +1499,32 @@ end:
     return Status;
 }
 
+static NTSTATUS get_commit_stats(device_extension* Vcb, void* data, ULONG length, PIRP Irp) {
+    btrfs_commit_stats* bcs = (btrfs_commit_stats*)data;
+    uint64_t freq;
+
+    if (length < sizeof(btrfs_commit_stats) || !data)
+        return STATUS_INVALID_PARAMETER;
+
+    freq = Vcb->commit.freq.QuadPart;
+
+    ExAcquireFastMutex(&Vcb->commit.mutex);
+
+    bcs->num_commits = Vcb->commit.num_commits;
+    bcs->num_requests = Vcb->commit.num_requests;
+    bcs->max_coalesced = Vcb->commit.max_coalesced;
+    bcs->last_coalesced = Vcb->commit.last_coalesced;
+    bcs->total_latency = Vcb->commit.total_latency * 1000000 / freq;
+    bcs->max_latency = Vcb->commit.max_latency * 1000000 / freq;
+    bcs->last_latency = Vcb->commit.last_latency * 1000000 / freq;
+
+    ExReleaseFastMutex(&Vcb->commit.mutex);
+
+    Irp->IoStatus.Information = sizeof(btrfs_commit_stats);
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS get_usage(device_extension* Vcb, void* data, ULONG length, PIRP Irp) {
     btrfs_usage* usage = (btrfs_usage*)data;
     btrfs_usage* lastbue = NULL;
@@ -2076,13 +2102,29 @@ end:
     return Status;
 }
 
+// Adds start to end to the output of FSCTL_QUERY_ALLOCATED_RANGES, unless it's
+// empty. Returns false if there's no room for it.
+static bool add_allocated_range(FILE_ALLOCATED_RANGE_BUFFER* ranges, ULONG* i, ULONG outbuflen, uint64_t start, uint64_t end) {
+    if (end <= start)
+        return true;
+
+    if ((*i + 1) * sizeof(FILE_ALLOCATED_RANGE_BUFFER) > outbuflen)
+        return false;
+
+    ranges[*i].FileOffset.QuadPart = start;
+    ranges[*i].Length.QuadPart = end - start;
+    (*i)++;
+
+    return true;
+}
+
 static NTSTATUS query_ranges(PFILE_OBJECT FileObject, FILE_ALLOCATED_RANGE_BUFFER* inbuf, ULONG inbuflen, void* outbuf, ULONG outbuflen, ULONG_PTR* retlen) {
     NTSTATUS Status;
     fcb* fcb;
     LIST_ENTRY* le;
     FILE_ALLOCATED_RANGE_BUFFER* ranges = outbuf;
     ULONG i = 0;
-    uint64_t last_start, last_end;
+    uint64_t range_start, range_end, last_start, last_end;
 
     TRACE("FSCTL_QUERY_ALLOCATED_RANGES\n");
 
@@ -2094,6 +2136,12 @@ static NTSTATUS query_ranges(PFILE_OBJECT FileObject, FILE_ALLOCATED_RANGE_BUFFE
     if (!inbuf || inbuflen < sizeof(FILE_ALLOCATED_RANGE_BUFFER) || !outbuf)
         return STATUS_INVALID_PARAMETER;
 
+    if (inbuf->FileOffset.QuadPart < 0 || inbuf->Length.QuadPart < 0 || inbuf->Length.QuadPart > MAXLONGLONG - inbuf->FileOffset.QuadPart)
+        return STATUS_INVALID_PARAMETER;
+
+    range_start = inbuf->FileOffset.QuadPart;
+    range_end = range_start + inbuf->Length.QuadPart;
+
     fcb = FileObject->FsContext;
 
     if (!fcb) {
@@ -2121,7 +2169,7 @@ static NTSTATUS query_ranges(PFILE_OBJECT FileObject, FILE_ALLOCATED_RANGE_BUFFE
 
     }
 
-    le = fcb->extents.Flink;
+    le = find_fcb_extent(fcb, range_start);
 
     last_start = 0;
     last_end = 0;
@@ -2133,16 +2181,13 @@ static NTSTATUS query_ranges(PFILE_OBJECT FileObject, FILE_ALLOCATED_RANGE_BUFFE
             EXTENT_DATA2* ed2 = (ext->extent_data.type == EXTENT_TYPE_REGULAR || ext->extent_data.type == EXTENT_TYPE_PREALLOC) ? (EXTENT_DATA2*)ext->extent_data.data : NULL;
             uint64_t len = ed2 ? ed2->num_bytes : ext->extent_data.decoded_size;
 
+            if (ext->offset >= range_end)
+                break;
+
             if (ext->offset > last_end) { // first extent after a hole
-                if (last_end > last_start) {
-                    if ((i + 1) * sizeof(FILE_ALLOCATED_RANGE_BUFFER) <= outbuflen) {
-                        ranges[i].FileOffset.QuadPart = last_start;
-                        ranges[i].Length.QuadPart = min(fcb->inode_item.st_size, last_end) - last_start;
-                        i++;
-                    } else {
-                        Status = STATUS_BUFFER_TOO_SMALL;
-                        goto end;
-                    }
+                if (!add_allocated_range(ranges, &i, outbuflen, max(last_start, range_start), min(min(fcb->inode_item.st_size, last_end), range_end))) {
+                    Status = STATUS_BUFFER_TOO_SMALL;
+                    goto end;
                 }
 
                 last_start = ext->offset;
@@ -2154,15 +2199,9 @@ static NTSTATUS query_ranges(PFILE_OBJECT FileObject, FILE_ALLOCATED_RANGE_BUFFE
         le = le->Flink;
     }
 
-    if (last_end > last_start) {
-        if ((i + 1) * sizeof(FILE_ALLOCATED_RANGE_BUFFER) <= outbuflen) {
-            ranges[i].FileOffset.QuadPart = last_start;
-            ranges[i].Length.QuadPart = min(fcb->inode_item.st_size, last_end) - last_start;
-            i++;
-        } else {
-            Status = STATUS_BUFFER_TOO_SMALL;
-            goto end;
-        }
+    if (!add_allocated_range(ranges, &i, outbuflen, max(last_start, range_start), min(min(fcb->inode_item.st_size, last_end), range_end))) {
+        Status = STATUS_BUFFER_TOO_SMALL;
+        goto end;
     }
 
     Status = STATUS_SUCCESS;
@@ -2209,7 +2248,7 @@ static NTSTATUS get_object_id(device_extension* Vcb, PFILE_OBJECT FileObject, FI
     return STATUS_SUCCESS;
 }
 
-static void flush_fcb_caches(device_extension* Vcb) {
+void flush_fcb_caches(device_extension* Vcb) {
     LIST_ENTRY* le;
 
     le = Vcb->all_fcbs.Flink;
@@ -2271,17 +2310,11 @@ static NTSTATUS lock_volume(device_extension* Vcb, PIRP Irp) {
 
     flush_fcb_caches(Vcb);
 
-    if (Vcb->need_write && !Vcb->readonly)
-        Status = do_write(Vcb, Irp);
-    else
-        Status = STATUS_SUCCESS;
-
-    free_trees(Vcb);
-
     ExReleaseResourceLite(&Vcb->tree_lock);
 
+    Status = group_commit(Vcb, Irp);
     if (!NT_SUCCESS(Status)) {
-        ERR("do_write returned %08x\n", Status);
+        ERR("group_commit returned %08x\n", Status);
         goto end;
     }
 
@@ -2615,7 +2648,6 @@ static NTSTATUS is_device_part_of_mounted_btrfs_raid(PDEVICE_OBJECT devobj, PFIL
     NTSTATUS Status;
     ULONG to_read;
     superblock* sb;
-    uint32_t crc32;
     BTRFS_UUID fsuuid, devuuid;
     LIST_ENTRY* le;
 
@@ -2640,9 +2672,7 @@ static NTSTATUS is_device_part_of_mounted_btrfs_raid(PDEVICE_OBJECT devobj, PFIL
         return STATUS_SUCCESS;
     }
 
-    crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&sb->uuid, (ULONG)sizeof(superblock) - sizeof(sb->checksum));
-
-    if (crc32 != *((uint32_t*)sb->checksum)) {
+    if (!check_superblock_checksum(sb)) {
         TRACE("device has Btrfs magic, but invalid superblock checksum\n");
         ExFreePool(sb);
         return STATUS_SUCCESS;
@@ -3078,7 +3108,10 @@ static NTSTATUS add_device(device_extension* Vcb, PIRP Irp, KPROCESSOR_MODE proc
     Vcb->superblock.num_devices++;
     Vcb->superblock.total_bytes += size;
     Vcb->devices_loaded++;
+
+    ExAcquireResourceExclusiveLite(&Vcb->devices_lock, true);
     InsertTailList(&Vcb->devices, &dev->list_entry);
+    ExReleaseResourceLite(&Vcb->devices_lock);
 
     // FIXME - send notification that volume size has increased
 
@@ -3466,9 +3499,7 @@ static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject
 
         ExFreePool(data2);
     } else {
-        LIST_ENTRY* lastextle;
-
-        le = sourcefcb->extents.Flink;
+        le = find_fcb_extent(sourcefcb, ded->SourceFileOffset.QuadPart);
         while (le != &sourcefcb->extents) {
             extent* ext = CONTAINING_RECORD(le, extent, list_entry);
 
@@ -3489,6 +3520,12 @@ static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject
                         continue;
                     }
 
+                    Status = load_extent_csum(Vcb, sourcefcb, ext, Irp);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("load_extent_csum returned %08x\n", Status);
+                        goto end;
+                    }
+
                     ext2 = ExAllocatePoolWithTag(PagedPool, extlen, ALLOC_TAG);
                     if (!ext2) {
                         ERR("out of memory\n");
@@ -3528,7 +3565,7 @@ static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject
 
                     if (ext->csum) {
                         if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE) {
-                            ext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2d->num_bytes * sizeof(uint32_t) / Vcb->superblock.sector_size), ALLOC_TAG);
+                            ext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2d->num_bytes * Vcb->csum_size / Vcb->superblock.sector_size), ALLOC_TAG);
                             if (!ext2->csum) {
                                 ERR("out of memory\n");
                                 Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -3536,10 +3573,10 @@ static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject
                                 goto end;
                             }
 
-                            RtlCopyMemory(ext2->csum, &ext->csum[(ed2d->offset - ed2s->offset) / Vcb->superblock.sector_size],
-                                          (ULONG)(ed2d->num_bytes * sizeof(uint32_t) / Vcb->superblock.sector_size));
+                            RtlCopyMemory(ext2->csum, (uint8_t*)ext->csum + ((ed2d->offset - ed2s->offset) * Vcb->csum_size / Vcb->superblock.sector_size),
+                                          (ULONG)(ed2d->num_bytes * Vcb->csum_size / Vcb->superblock.sector_size));
                         } else {
-                            ext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2d->size * sizeof(uint32_t) / Vcb->superblock.sector_size), ALLOC_TAG);
+                            ext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2d->size * Vcb->csum_size / Vcb->superblock.sector_size), ALLOC_TAG);
                             if (!ext2->csum) {
                                 ERR("out of memory\n");
                                 Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -3547,7 +3584,7 @@ static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject
                                 goto end;
                             }
 
-                            RtlCopyMemory(ext2->csum, ext->csum, (ULONG)(ed2s->size * sizeof(uint32_t) / Vcb->superblock.sector_size));
+                            RtlCopyMemory(ext2->csum, ext->csum, (ULONG)(ed2s->size * Vcb->csum_size / Vcb->superblock.sector_size));
                         }
                     } else
                         ext2->csum = NULL;
@@ -3616,12 +3653,10 @@ static NTSTATUS duplicate_extents(device_extension* Vcb, PFILE_OBJECT FileObject
             le = le->Flink;
         }
 
-        lastextle = &fcb->extents;
         while (!IsListEmpty(&newexts)) {
             extent* ext = CONTAINING_RECORD(RemoveHeadList(&newexts), extent, list_entry);
 
-            add_extent(fcb, lastextle, ext);
-            lastextle = &ext->list_entry;
+            add_extent(fcb, ext);
         }
     }
 
@@ -5450,6 +5485,11 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, uint32_t type) {
                                    IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp);
             break;
 
+        case FSCTL_BTRFS_GET_COMMIT_STATS:
+            Status = get_commit_stats(DeviceObject->DeviceExtension, map_user_buffer(Irp, NormalPagePriority),
+                                      IrpSp->Parameters.FileSystemControl.OutputBufferLength, Irp);
+            break;
+
         default:
             WARN("unknown control code %x (DeviceType = %x, Access = %x, Function = %x, Method = %x)\n",
                           IrpSp->Parameters.FileSystemControl.FsControlCode, (IrpSp->Parameters.FileSystemControl.FsControlCode & 0xff0000) >> 16,
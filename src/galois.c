@@ -17,6 +17,24 @@
 
 #include "btrfs_drv.h"
 
+#ifndef _MSC_VER
+#include <immintrin.h>
+#else
+#include <intrin.h>
+#endif
+
+#ifdef _MSC_VER
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#else
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+extern bool have_ssse3, have_avx2;
+extern tKeSaveExtendedProcessorState fKeSaveExtendedProcessorState;
+extern tKeRestoreExtendedProcessorState fKeRestoreExtendedProcessorState;
+
 static const uint8_t glog[] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
                              0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
                              0x9d, 0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23,
@@ -51,21 +69,6 @@ static const uint8_t gilog[] = {0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6,
                               0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51, 0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
                               0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8, 0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf};
 
-// divides the bytes in data by 2^div
-void galois_divpower(uint8_t* data, uint8_t div, uint32_t len) {
-    while (len > 0) {
-        if (data[0] != 0) {
-            if (gilog[data[0]] <= div)
-                data[0] = glog[(gilog[data[0]] + (255 - div)) % 255];
-            else
-                data[0] = glog[(gilog[data[0]] - div) % 255];
-        }
-
-        data++;
-        len--;
-    }
-}
-
 uint8_t gpow2(uint8_t e) {
     return glog[e%255];
 }
@@ -95,47 +98,436 @@ uint8_t gdiv(uint8_t a, uint8_t b) {
 // https://www.kernel.org/pub/linux/kernel/people/hpa/raid6.pdf
 
 #ifdef _AMD64_
-__inline static uint64_t galois_double_mask64(uint64_t v) {
-    v &= 0x8080808080808080;
-    return (v << 1) - (v >> 7);
-}
+typedef uint64_t galois_word;
 #else
-__inline static uint32_t galois_double_mask32(uint32_t v) {
-    v &= 0x80808080;
-    return (v << 1) - (v >> 7);
-}
+typedef uint32_t galois_word;
 #endif
 
-void galois_double(uint8_t* data, uint32_t len) {
-    // FIXME - SIMD?
+#define GALOIS_REPEAT(b) ((galois_word)0x0101010101010101ULL * (b))
 
-#ifdef _AMD64_
-    while (len > sizeof(uint64_t)) {
-        uint64_t v = *((uint64_t*)data), vv;
+// multiplies each byte in the word by 2
+__inline static galois_word galois_double_word(galois_word v) {
+    galois_word hi = v & GALOIS_REPEAT(0x80);
 
-        vv = (v << 1) & 0xfefefefefefefefe;
-        vv ^= galois_double_mask64(v) & 0x1d1d1d1d1d1d1d1d;
-        *((uint64_t*)data) = vv;
+    return ((v << 1) & GALOIS_REPEAT(0xfe)) ^ (((hi << 1) - (hi >> 7)) & GALOIS_REPEAT(0x1d));
+}
+
+__inline static uint8_t galois_double_byte(uint8_t v) {
+    return (uint8_t)((v << 1) ^ ((v & 0x80) ? 0x1d : 0));
+}
 
-        data += sizeof(uint64_t);
-        len -= sizeof(uint64_t);
+// AVX state has to be saved explicitly in kernel mode, so only bother for big enough buffers
+#define GALOIS_AVX2_MIN_LEN 512
+
+static bool galois_avx2_begin(uint32_t len, XSTATE_SAVE* save) {
+    if (!have_avx2 || len < GALOIS_AVX2_MIN_LEN)
+        return false;
+
+    return NT_SUCCESS(fKeSaveExtendedProcessorState(XSTATE_MASK_AVX, save));
+}
+
+static TARGET_AVX2 uint32_t galois_double_xor_avx2(uint8_t* data, const uint8_t* in, uint32_t len) {
+    __m256i poly = _mm256_set1_epi8(0x1d);
+    __m256i zero = _mm256_setzero_si256();
+    uint32_t done = 0;
+
+    while (len >= 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*)data);
+        __m256i hi = _mm256_cmpgt_epi8(zero, v);
+
+        v = _mm256_xor_si256(_mm256_add_epi8(v, v), _mm256_and_si256(hi, poly));
+
+        if (in) {
+            v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i*)in));
+            in += 32;
+        }
+
+        _mm256_storeu_si256((__m256i*)data, v);
+
+        data += 32;
+        len -= 32;
+        done += 32;
     }
-#else
-    while (len > sizeof(uint32_t)) {
-        uint32_t v = *((uint32_t*)data), vv;
 
-        vv = (v << 1) & 0xfefefefe;
-        vv ^= galois_double_mask32(v) & 0x1d1d1d1d;
-        *((uint32_t*)data) = vv;
+    return done;
+}
+
+static uint32_t galois_double_xor_sse2(uint8_t* data, const uint8_t* in, uint32_t len) {
+    __m128i poly = _mm_set1_epi8(0x1d);
+    __m128i zero = _mm_setzero_si128();
+    uint32_t done = 0;
+
+    while (len >= 16) {
+        __m128i v = _mm_loadu_si128((__m128i*)data);
+        __m128i hi = _mm_cmpgt_epi8(zero, v);
+
+        v = _mm_xor_si128(_mm_add_epi8(v, v), _mm_and_si128(hi, poly));
+
+        if (in) {
+            v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i*)in));
+            in += 16;
+        }
+
+        _mm_storeu_si128((__m128i*)data, v);
 
-        data += sizeof(uint32_t);
-        len -= sizeof(uint32_t);
+        data += 16;
+        len -= 16;
+        done += 16;
+    }
+
+    return done;
+}
+
+// Sets data to (2 * data) + in, or just 2 * data if in is NULL. This is the step used
+// to build the RAID6 Q syndrome by Horner's rule.
+static void galois_double_xor_int(uint8_t* data, const uint8_t* in, uint32_t len) {
+    uint32_t done = 0;
+    XSTATE_SAVE save;
+
+    if (galois_avx2_begin(len, &save)) {
+        done = galois_double_xor_avx2(data, in, len);
+        fKeRestoreExtendedProcessorState(&save);
+    } else if (have_sse2)
+        done = galois_double_xor_sse2(data, in, len);
+
+    data += done;
+    len -= done;
+
+    if (in)
+        in += done;
+
+    while (len >= sizeof(galois_word)) {
+        galois_word v = galois_double_word(*((galois_word*)data));
+
+        if (in) {
+            v ^= *((galois_word*)in);
+            in += sizeof(galois_word);
+        }
+
+        *((galois_word*)data) = v;
+
+        data += sizeof(galois_word);
+        len -= sizeof(galois_word);
     }
-#endif
 
     while (len > 0) {
-        data[0] = (data[0] << 1) ^ ((data[0] & 0x80) ? 0x1d : 0);
+        data[0] = galois_double_byte(data[0]);
+
+        if (in) {
+            data[0] ^= in[0];
+            in++;
+        }
+
         data++;
         len--;
     }
 }
+
+void galois_double(uint8_t* data, uint32_t len) {
+    galois_double_xor_int(data, NULL, len);
+}
+
+void galois_double_xor(uint8_t* data, uint8_t* in, uint32_t len) {
+    galois_double_xor_int(data, in, len);
+}
+
+// Beyond this, the parity won't still be in cache by the time it's written, so don't pollute it
+#define XOR_STREAM_MIN_LEN 65536
+
+static TARGET_AVX2 uint32_t do_xor_multi_avx2(uint8_t* out, uint8_t** in, uint16_t num_in, uint32_t len) {
+    bool stream = len >= XOR_STREAM_MIN_LEN && ((uintptr_t)out & 0x1f) == 0;
+    uint32_t done = 0;
+    uint16_t j;
+
+    while (len - done >= 128) {
+        __m256i x1 = _mm256_loadu_si256((const __m256i*)(in[0] + done));
+        __m256i x2 = _mm256_loadu_si256((const __m256i*)(in[0] + done + 32));
+        __m256i x3 = _mm256_loadu_si256((const __m256i*)(in[0] + done + 64));
+        __m256i x4 = _mm256_loadu_si256((const __m256i*)(in[0] + done + 96));
+
+        for (j = 1; j < num_in; j++) {
+            x1 = _mm256_xor_si256(x1, _mm256_loadu_si256((const __m256i*)(in[j] + done)));
+            x2 = _mm256_xor_si256(x2, _mm256_loadu_si256((const __m256i*)(in[j] + done + 32)));
+            x3 = _mm256_xor_si256(x3, _mm256_loadu_si256((const __m256i*)(in[j] + done + 64)));
+            x4 = _mm256_xor_si256(x4, _mm256_loadu_si256((const __m256i*)(in[j] + done + 96)));
+        }
+
+        if (stream) {
+            _mm256_stream_si256((__m256i*)(out + done), x1);
+            _mm256_stream_si256((__m256i*)(out + done + 32), x2);
+            _mm256_stream_si256((__m256i*)(out + done + 64), x3);
+            _mm256_stream_si256((__m256i*)(out + done + 96), x4);
+        } else {
+            _mm256_storeu_si256((__m256i*)(out + done), x1);
+            _mm256_storeu_si256((__m256i*)(out + done + 32), x2);
+            _mm256_storeu_si256((__m256i*)(out + done + 64), x3);
+            _mm256_storeu_si256((__m256i*)(out + done + 96), x4);
+        }
+
+        done += 128;
+    }
+
+    if (stream)
+        _mm_sfence();
+
+    return done;
+}
+
+static uint32_t do_xor_multi_sse2(uint8_t* out, uint8_t** in, uint16_t num_in, uint32_t len) {
+    bool stream = len >= XOR_STREAM_MIN_LEN && ((uintptr_t)out & 0xf) == 0;
+    uint32_t done = 0;
+    uint16_t j;
+
+    while (len - done >= 64) {
+        __m128i x1 = _mm_loadu_si128((const __m128i*)(in[0] + done));
+        __m128i x2 = _mm_loadu_si128((const __m128i*)(in[0] + done + 16));
+        __m128i x3 = _mm_loadu_si128((const __m128i*)(in[0] + done + 32));
+        __m128i x4 = _mm_loadu_si128((const __m128i*)(in[0] + done + 48));
+
+        for (j = 1; j < num_in; j++) {
+            x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)(in[j] + done)));
+            x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i*)(in[j] + done + 16)));
+            x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i*)(in[j] + done + 32)));
+            x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i*)(in[j] + done + 48)));
+        }
+
+        if (stream) {
+            _mm_stream_si128((__m128i*)(out + done), x1);
+            _mm_stream_si128((__m128i*)(out + done + 16), x2);
+            _mm_stream_si128((__m128i*)(out + done + 32), x3);
+            _mm_stream_si128((__m128i*)(out + done + 48), x4);
+        } else {
+            _mm_storeu_si128((__m128i*)(out + done), x1);
+            _mm_storeu_si128((__m128i*)(out + done + 16), x2);
+            _mm_storeu_si128((__m128i*)(out + done + 32), x3);
+            _mm_storeu_si128((__m128i*)(out + done + 48), x4);
+        }
+
+        done += 64;
+    }
+
+    if (stream)
+        _mm_sfence();
+
+    return done;
+}
+
+// Sets out to the XOR of the num_in buffers in in, reading each only once rather than
+// making a pass over out for every buffer. out may be the same as in[0].
+void do_xor_multi(uint8_t* out, uint8_t** in, uint16_t num_in, uint32_t len) {
+    uint32_t done = 0;
+    uint16_t j;
+    XSTATE_SAVE save;
+
+    if (num_in == 0) {
+        RtlZeroMemory(out, len);
+        return;
+    } else if (num_in == 1) {
+        if (out != in[0])
+            RtlCopyMemory(out, in[0], len);
+
+        return;
+    }
+
+    if (galois_avx2_begin(len, &save)) {
+        done = do_xor_multi_avx2(out, in, num_in, len);
+        fKeRestoreExtendedProcessorState(&save);
+    } else if (have_sse2)
+        done = do_xor_multi_sse2(out, in, num_in, len);
+
+    while (len - done >= sizeof(galois_word)) {
+        galois_word v = *((galois_word*)(in[0] + done));
+
+        for (j = 1; j < num_in; j++) {
+            v ^= *((galois_word*)(in[j] + done));
+        }
+
+        *((galois_word*)(out + done)) = v;
+
+        done += sizeof(galois_word);
+    }
+
+    while (done < len) {
+        uint8_t v = in[0][done];
+
+        for (j = 1; j < num_in; j++) {
+            v ^= in[j][done];
+        }
+
+        out[done] = v;
+
+        done++;
+    }
+}
+
+// Multiplication by a constant c is done by splitting each byte into nibbles, and looking up
+// c * lo and c * (hi << 4) in two sixteen-byte tables. This is a single PSHUFB each on SSSE3.
+
+static TARGET_AVX2 uint32_t galois_mul_avx2(uint8_t* out, const uint8_t* in, const uint8_t* tables, uint32_t len, bool accumulate) {
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tables));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(tables + 16)));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    uint32_t done = 0;
+
+    while (len >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)in);
+        __m256i r;
+
+        r = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(v, mask)),
+                             _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask)));
+
+        if (accumulate)
+            r = _mm256_xor_si256(r, _mm256_loadu_si256((__m256i*)out));
+
+        _mm256_storeu_si256((__m256i*)out, r);
+
+        in += 32;
+        out += 32;
+        len -= 32;
+        done += 32;
+    }
+
+    return done;
+}
+
+static TARGET_SSSE3 uint32_t galois_mul_ssse3(uint8_t* out, const uint8_t* in, const uint8_t* tables, uint32_t len, bool accumulate) {
+    __m128i lo = _mm_loadu_si128((const __m128i*)tables);
+    __m128i hi = _mm_loadu_si128((const __m128i*)(tables + 16));
+    __m128i mask = _mm_set1_epi8(0x0f);
+    uint32_t done = 0;
+
+    while (len >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)in);
+        __m128i r;
+
+        r = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(v, mask)),
+                          _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+
+        if (accumulate)
+            r = _mm_xor_si128(r, _mm_loadu_si128((__m128i*)out));
+
+        _mm_storeu_si128((__m128i*)out, r);
+
+        in += 16;
+        out += 16;
+        len -= 16;
+        done += 16;
+    }
+
+    return done;
+}
+
+// out = c * in, or out ^= c * in if accumulate is set. out and in may be the same buffer.
+static void galois_mul_int(uint8_t* out, const uint8_t* in, uint8_t c, uint32_t len, bool accumulate) {
+    uint8_t tables[32];
+    uint32_t done = 0;
+    unsigned int i;
+    XSTATE_SAVE save;
+
+    if (c == 0) {
+        if (!accumulate)
+            RtlZeroMemory(out, len);
+
+        return;
+    }
+
+    if (c == 1) {
+        if (accumulate)
+            do_xor(out, (uint8_t*)in, len);
+        else if (out != in)
+            RtlCopyMemory(out, in, len);
+
+        return;
+    }
+
+    for (i = 0; i < 16; i++) {
+        tables[i] = gmul(c, (uint8_t)i);
+        tables[i + 16] = gmul(c, (uint8_t)(i << 4));
+    }
+
+    if (galois_avx2_begin(len, &save)) {
+        done = galois_mul_avx2(out, in, tables, len, accumulate);
+        fKeRestoreExtendedProcessorState(&save);
+    } else if (have_ssse3)
+        done = galois_mul_ssse3(out, in, tables, len, accumulate);
+
+    in += done;
+    out += done;
+    len -= done;
+
+    // SWAR fallback - shift and add, a word at a time
+    while (len >= sizeof(galois_word)) {
+        galois_word v = *((galois_word*)in), r = 0;
+        uint8_t cc = c;
+
+        while (true) {
+            if (cc & 1)
+                r ^= v;
+
+            cc >>= 1;
+
+            if (cc == 0)
+                break;
+
+            v = galois_double_word(v);
+        }
+
+        if (accumulate)
+            r ^= *((galois_word*)out);
+
+        *((galois_word*)out) = r;
+
+        in += sizeof(galois_word);
+        out += sizeof(galois_word);
+        len -= sizeof(galois_word);
+    }
+
+    while (len > 0) {
+        uint8_t r = tables[in[0] & 0xf] ^ tables[16 + (in[0] >> 4)];
+
+        if (accumulate)
+            out[0] ^= r;
+        else
+            out[0] = r;
+
+        in++;
+        out++;
+        len--;
+    }
+}
+
+void galois_mul(uint8_t* data, uint8_t c, uint32_t len) {
+    galois_mul_int(data, data, c, len, false);
+}
+
+void galois_mul_xor(uint8_t* out, uint8_t* in, uint8_t c, uint32_t len) {
+    galois_mul_int(out, in, c, len, true);
+}
+
+// divides the bytes in data by 2^div
+void galois_divpower(uint8_t* data, uint8_t div, uint32_t len) {
+    galois_mul(data, gpow2(255 - div), len);
+}
+
+// Recovers the two missing data stripes x and y, given P and Q and the partial syndromes pxy and qxy
+// calculated with Dx and Dy set to zero. On return qxy holds Dx and pxy holds Dy.
+void galois_recover2(uint8_t* p, uint8_t* q, uint8_t* pxy, uint8_t* qxy, uint16_t x, uint16_t y, uint32_t len) {
+    uint8_t gyx, gx, denom, a, b;
+
+    gyx = gpow2(y > x ? (y-x) : (255-x+y));
+    gx = gpow2(255-x);
+
+    denom = gdiv(1, gyx ^ 1);
+    a = gmul(gyx, denom);
+    b = gmul(gx, denom);
+
+    do_xor(pxy, p, len);
+    do_xor(qxy, q, len);
+
+    // Dx = a(P + Pxy) + b(Q + Qxy)
+    galois_mul(qxy, b, len);
+    galois_mul_xor(qxy, pxy, a, len);
+
+    // Dy = (P + Pxy) + Dx
+    do_xor(pxy, qxy, len);
+}
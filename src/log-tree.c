@@ -0,0 +1,1844 @@
+/* Copyright (c) Mark Harmstone 2016-17
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+
+// The log tree lets us make a file durable on IRP_MJ_FLUSH_BUFFERS without committing
+// the whole transaction. We keep the items of every inode that's been flushed since the
+// last commit, and on each flush write them out as one log tree per subvolume, plus a
+// log root tree pointing to these, and then rewrite the last committed superblock with
+// log_tree_addr set. This is the same format Linux uses, so either driver can replay it.
+//
+// Only the extents that have changed since the last commit get logged, and leaves which
+// are the same as last time are reused, so a flush normally only writes the leaves of the
+// file being flushed, the few nodes above them, and the superblock.
+//
+// Blocks of the log aren't in the extent tree - they're taken straight out of the chunks'
+// free space, and go back into c->deleting once they're finished with.
+
+typedef struct {
+    KEY key;
+    uint16_t size;
+    uint8_t* data;
+} log_entry;
+
+typedef struct {
+    uint64_t* addresses;
+    ULONG num;
+    ULONG max;
+} address_list;
+
+typedef struct {
+    root* subvol;
+    LIST_ENTRY items;
+    LIST_ENTRY list_entry;
+} replay_root;
+
+typedef struct {
+    uint64_t subvol;
+    KEY firstkey;
+    uint64_t address;
+    uint8_t* data;
+    LIST_ENTRY list_entry;
+} log_leaf;
+
+typedef struct {
+    address_list blocks;
+    LIST_ENTRY leaves;
+    LIST_ENTRY tree_writes;
+    uint64_t address;
+    uint8_t level;
+} log_write;
+
+static NTSTATUS add_address(address_list* al, uint64_t address) {
+    if (al->num == al->max) {
+        ULONG max = al->max == 0 ? 16 : al->max * 2;
+        uint64_t* addresses;
+
+        addresses = ExAllocatePoolWithTag(PagedPool, max * sizeof(uint64_t), ALLOC_TAG);
+        if (!addresses) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if (al->addresses) {
+            RtlCopyMemory(addresses, al->addresses, al->num * sizeof(uint64_t));
+            ExFreePool(al->addresses);
+        }
+
+        al->addresses = addresses;
+        al->max = max;
+    }
+
+    al->addresses[al->num] = address;
+    al->num++;
+
+    return STATUS_SUCCESS;
+}
+
+static bool find_address(address_list* al, uint64_t address) {
+    ULONG i;
+
+    for (i = 0; i < al->num; i++) {
+        if (al->addresses[i] == address)
+            return true;
+    }
+
+    return false;
+}
+
+// If pin is set, the superblock on the disk still points to the log, so the blocks go in c->pinned
+// rather than c->deleting - clean_space_cache releases them once the commit's superblock is written.
+static void free_log_blocks(device_extension* Vcb, uint64_t* blocks, ULONG num_blocks, bool pin) {
+    ULONG i;
+
+    for (i = 0; i < num_blocks; i++) {
+        chunk* c = get_chunk_from_address(Vcb, blocks[i]);
+
+        if (!c) {
+            ERR("could not find chunk for address %I64x\n", blocks[i]);
+            continue;
+        }
+
+        acquire_chunk_lock(c, Vcb);
+
+        if (pin) {
+            c->changed = true;
+            c->space_changed = true;
+
+            space_list_add2(&c->pinned, NULL, blocks[i], Vcb->superblock.node_size, c, NULL);
+        } else
+            space_list_add(c, blocks[i], Vcb->superblock.node_size, NULL);
+
+        release_chunk_lock(c, Vcb);
+    }
+}
+
+// as free_log_blocks, but leaving alone anything that's also in keep
+static void free_unused_log_blocks(device_extension* Vcb, uint64_t* blocks, ULONG num_blocks, uint64_t* keep, ULONG num_keep) {
+    ULONG i, j;
+
+    for (i = 0; i < num_blocks; i++) {
+        for (j = 0; j < num_keep; j++) {
+            if (keep[j] == blocks[i])
+                break;
+        }
+
+        if (j == num_keep)
+            free_log_blocks(Vcb, &blocks[i], 1, false);
+    }
+}
+
+static void free_log_leaves(LIST_ENTRY* leaves) {
+    while (!IsListEmpty(leaves)) {
+        log_leaf* leaf = CONTAINING_RECORD(RemoveHeadList(leaves), log_leaf, list_entry);
+
+        ExFreePool(leaf->data);
+        ExFreePool(leaf);
+    }
+}
+
+static void free_log_items(LIST_ENTRY* items) {
+    while (!IsListEmpty(items)) {
+        log_item* item = CONTAINING_RECORD(RemoveHeadList(items), log_item, list_entry);
+
+        ExFreePool(item);
+    }
+}
+
+static void free_log_inode(log_inode* li) {
+    free_log_items(&li->items);
+    free_log_items(&li->csums);
+    ExFreePool(li);
+}
+
+void free_log_tree(device_extension* Vcb) {
+    while (!IsListEmpty(&Vcb->log.inodes)) {
+        log_inode* li = CONTAINING_RECORD(RemoveHeadList(&Vcb->log.inodes), log_inode, list_entry);
+
+        free_log_inode(li);
+    }
+
+    free_log_leaves(&Vcb->log.leaves);
+
+    if (Vcb->log.blocks) {
+        ExFreePool(Vcb->log.blocks);
+        Vcb->log.blocks = NULL;
+    }
+
+    Vcb->log.num_blocks = 0;
+}
+
+// called at the start of each commit - the superblock we're about to write won't point to the log
+void clear_log_tree(device_extension* Vcb) {
+    if (Vcb->log.num_blocks > 0)
+        free_log_blocks(Vcb, Vcb->log.blocks, Vcb->log.num_blocks, true);
+
+    free_log_tree(Vcb);
+}
+
+static log_item* add_log_item(LIST_ENTRY* list, uint64_t obj_id, uint8_t obj_type, uint64_t offset, void* data, uint16_t size) {
+    log_item* item;
+
+    item = ExAllocatePoolWithTag(PagedPool, offsetof(log_item, data[0]) + size, ALLOC_TAG);
+    if (!item) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+
+    item->key.obj_id = obj_id;
+    item->key.obj_type = obj_type;
+    item->key.offset = offset;
+    item->size = size;
+
+    if (size > 0)
+        RtlCopyMemory(item->data, data, size);
+
+    InsertTailList(list, &item->list_entry);
+
+    return item;
+}
+
+static NTSTATUS log_hole(device_extension* Vcb, log_inode* li, uint64_t start, uint64_t length) {
+    EXTENT_DATA* ed;
+    EXTENT_DATA2* ed2;
+    uint8_t buf[offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2)];
+
+    ed = (EXTENT_DATA*)buf;
+    ed->generation = Vcb->superblock.generation;
+    ed->decoded_size = length;
+    ed->compression = BTRFS_COMPRESSION_NONE;
+    ed->encryption = BTRFS_ENCRYPTION_NONE;
+    ed->encoding = BTRFS_ENCODING_NONE;
+    ed->type = EXTENT_TYPE_REGULAR;
+
+    ed2 = (EXTENT_DATA2*)ed->data;
+    ed2->address = 0;
+    ed2->size = 0;
+    ed2->offset = 0;
+    ed2->num_bytes = length;
+
+    if (!add_log_item(&li->items, li->inode, TYPE_EXTENT_DATA, start, buf, sizeof(buf)))
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS log_csums(device_extension* Vcb, log_inode* li, uint64_t address, ULONG sectors, uint8_t* csum) {
+    ULONG max_sectors = (ULONG)(MAX_CSUM_SIZE / Vcb->csum_size);
+
+    while (sectors > 0) {
+        ULONG num = min(sectors, max_sectors);
+
+        if (!add_log_item(&li->csums, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, address, csum, (uint16_t)(num * Vcb->csum_size)))
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        address += (uint64_t)num * Vcb->superblock.sector_size;
+        csum += num * Vcb->csum_size;
+        sectors -= num;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Returns false if the fcb has changes that we can't express in the log, in which case the caller
+// falls back to a full commit. We only log an inode's INODE_ITEM and EXTENT_DATAs, so it has to be
+// already on disk with the same links it has now.
+static bool can_log_fcb(device_extension* Vcb, fcb* fcb, PIRP Irp) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp;
+    LIST_ENTRY* le;
+
+    if (fcb->created || fcb->ads || fcb->type == BTRFS_TYPE_DIRECTORY)
+        return false;
+
+    if (fcb->sd_dirty || fcb->atts_changed || fcb->reparse_xattr_changed || fcb->ea_changed || fcb->prop_compression_changed || fcb->xattrs_changed)
+        return false;
+
+    if (fcb->fileref && fcb->fileref->dirty)
+        return false;
+
+    // subvol created in this transaction
+    if (fcb->subvol->root_item.otransid == Vcb->superblock.generation)
+        return false;
+
+    // RAID5 and RAID6 writes can sit in the partial stripes until the commit
+    if ((Vcb->metadata_flags | Vcb->data_flags) & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
+        return false;
+
+    searchkey.obj_id = fcb->inode;
+    searchkey.obj_type = TYPE_INODE_ITEM;
+    searchkey.offset = 0xffffffffffffffff;
+
+    Status = find_item(Vcb, fcb->subvol, &tp, &searchkey, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return false;
+    }
+
+    if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type || tp.item->size < sizeof(INODE_ITEM))
+        return false;
+
+    if (((INODE_ITEM*)tp.item->data)->st_nlink != fcb->inode_item.st_nlink)
+        return false;
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore && ext->extent_data.type != EXTENT_TYPE_INLINE) {
+            EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->extent_data.data;
+
+            if (ed2->size != 0) {
+                chunk* c = get_chunk_from_address(Vcb, ed2->address);
+
+                // a new chunk won't be in the chunk tree that replay sees
+                if (!c || c->created || c->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
+                    return false;
+
+                if (ext->inserted && ext->extent_data.type == EXTENT_TYPE_REGULAR && !ext->csum && !(fcb->inode_item.flags & BTRFS_INODE_NODATASUM))
+                    return false;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    return true;
+}
+
+static NTSTATUS log_fcb(device_extension* Vcb, fcb* fcb, log_inode** pli) {
+    NTSTATUS Status;
+    log_inode* li;
+    log_item* ii;
+    LIST_ENTRY* le;
+    uint64_t last_end = 0;
+    bool prealloc = false, extents_inline = false;
+
+    li = ExAllocatePoolWithTag(PagedPool, sizeof(log_inode), ALLOC_TAG);
+    if (!li) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    li->subvol = fcb->subvol->id;
+    li->inode = fcb->inode;
+    InitializeListHead(&li->items);
+    InitializeListHead(&li->csums);
+
+    ii = add_log_item(&li->items, fcb->inode, TYPE_INODE_ITEM, 0, &fcb->inode_item, sizeof(INODE_ITEM));
+    if (!ii) {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+
+        if (!ext->ignore) {
+            EXTENT_DATA* ed = &ext->extent_data;
+
+            // Linux logs holes explicitly even with NO_HOLES, and replays the EXTENT_DATAs range by range
+            if (ext->offset > last_end) {
+                Status = log_hole(Vcb, li, last_end, ext->offset - last_end);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("log_hole returned %08x\n", Status);
+                    goto end;
+                }
+            }
+
+            // Anything that isn't inserted is the same as in the last commit, and replay leaves
+            // alone any range the log doesn't mention. Anything that's been removed since leaves
+            // a gap, which gets logged as a hole.
+            if (ext->inserted && !add_log_item(&li->items, fcb->inode, TYPE_EXTENT_DATA, ext->offset, ed, ext->datalen)) {
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
+            }
+
+            if (ed->type == EXTENT_TYPE_INLINE) {
+                extents_inline = true;
+                last_end = ext->offset + ed->decoded_size;
+            } else {
+                EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+
+                if (ed->type == EXTENT_TYPE_PREALLOC)
+                    prealloc = true;
+
+                last_end = ext->offset + ed2->num_bytes;
+
+                // extents written since the last commit don't have their checksums in the csum tree yet
+                if (ext->inserted && ext->csum && ed->type == EXTENT_TYPE_REGULAR && ed2->size != 0) {
+                    if (ed->compression == BTRFS_COMPRESSION_NONE)
+                        Status = log_csums(Vcb, li, ed2->address + ed2->offset, (ULONG)(ed2->num_bytes / Vcb->superblock.sector_size), ext->csum);
+                    else
+                        Status = log_csums(Vcb, li, ed2->address, (ULONG)(ed2->size / Vcb->superblock.sector_size), ext->csum);
+
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("log_csums returned %08x\n", Status);
+                        goto end;
+                    }
+                }
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    if (!extents_inline && sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size) > last_end) {
+        Status = log_hole(Vcb, li, last_end, sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size) - last_end);
+        if (!NT_SUCCESS(Status)) {
+            ERR("log_hole returned %08x\n", Status);
+            goto end;
+        }
+    }
+
+    // flush_fcb does the same when it writes the INODE_ITEM
+    if (prealloc)
+        ((INODE_ITEM*)ii->data)->flags |= BTRFS_INODE_PREALLOC;
+    else
+        ((INODE_ITEM*)ii->data)->flags &= ~BTRFS_INODE_PREALLOC;
+
+    *pli = li;
+
+    return STATUS_SUCCESS;
+
+end:
+    free_log_inode(li);
+
+    return Status;
+}
+
+// Keeps Vcb->log.inodes sorted by subvol and inode. Returns the entry li replaced, if any, so
+// that the caller can put it back if the new log doesn't make it to the disk.
+static log_inode* replace_log_inode(device_extension* Vcb, log_inode* li) {
+    LIST_ENTRY* le;
+
+    le = Vcb->log.inodes.Flink;
+    while (le != &Vcb->log.inodes) {
+        log_inode* li2 = CONTAINING_RECORD(le, log_inode, list_entry);
+
+        if (li2->subvol == li->subvol && li2->inode == li->inode) {
+            InsertHeadList(le->Blink, &li->list_entry);
+            RemoveEntryList(&li2->list_entry);
+            return li2;
+        } else if (li2->subvol > li->subvol || (li2->subvol == li->subvol && li2->inode > li->inode)) {
+            InsertHeadList(le->Blink, &li->list_entry);
+            return NULL;
+        }
+
+        le = le->Flink;
+    }
+
+    InsertTailList(&Vcb->log.inodes, &li->list_entry);
+
+    return NULL;
+}
+
+// undoes replace_log_inode
+static void restore_log_inode(log_inode* li, log_inode* old_li) {
+    if (old_li)
+        InsertHeadList(li->list_entry.Blink, &old_li->list_entry);
+
+    RemoveEntryList(&li->list_entry);
+    free_log_inode(li);
+}
+
+static NTSTATUS alloc_log_block(device_extension* Vcb, address_list* blocks, uint64_t* address) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+
+    ExAcquireResourceExclusiveLite(&Vcb->chunk_lock, true);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        // the block has to be somewhere the committed chunk tree knows about
+        if (!c->readonly && !c->reloc && !c->created && c->chunk_item->type == Vcb->metadata_flags) {
+            acquire_chunk_lock(c, Vcb);
+
+            if (find_metadata_address_in_chunk(Vcb, c, address)) {
+                Status = add_address(blocks, *address);
+
+                if (NT_SUCCESS(Status))
+                    space_list_subtract(c, false, *address, Vcb->superblock.node_size, NULL);
+
+                release_chunk_lock(c, Vcb);
+                ExReleaseResourceLite(&Vcb->chunk_lock);
+
+                return Status;
+            }
+
+            release_chunk_lock(c, Vcb);
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    return STATUS_DISK_FULL;
+}
+
+static NTSTATUS queue_log_node(device_extension* Vcb, log_write* lw, uint8_t* data, uint8_t level, uint32_t num_items, uint64_t* address) {
+    NTSTATUS Status;
+    tree_header* th = (tree_header*)data;
+    tree_write* tw;
+    LIST_ENTRY* le;
+
+    Status = alloc_log_block(Vcb, &lw->blocks, address);
+    if (!NT_SUCCESS(Status)) {
+        ERR("alloc_log_block returned %08x\n", Status);
+        return Status;
+    }
+
+    th->fs_uuid = Vcb->superblock.uuid;
+    th->address = *address;
+    th->flags = HEADER_FLAG_WRITTEN | HEADER_FLAG_MIXED_BACKREF;
+    th->chunk_tree_uuid = Vcb->log.chunk_tree_uuid;
+    th->generation = Vcb->superblock.generation;
+    th->tree_id = TREE_LOG_ID;
+    th->num_items = num_items;
+    th->level = level;
+
+    get_tree_checksum(Vcb, th, th->csum);
+
+    tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
+    if (!tw) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    tw->address = *address;
+    tw->length = Vcb->superblock.node_size;
+
+    tw->data = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+    if (!tw->data) {
+        ERR("out of memory\n");
+        ExFreePool(tw);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(tw->data, data, Vcb->superblock.node_size);
+
+    // do_tree_writes wants them in order, so it can merge adjacent nodes - the blocks
+    // usually come out of the chunks in order, so start looking at the end
+    le = lw->tree_writes.Blink;
+    while (le != &lw->tree_writes && CONTAINING_RECORD(le, tree_write, list_entry)->address > tw->address) {
+        le = le->Blink;
+    }
+
+    InsertHeadList(le, &tw->list_entry);
+
+    return STATUS_SUCCESS;
+}
+
+// Builds the internal nodes above the num_nodes nodes given, until there's only one left at the top.
+static NTSTATUS write_log_internal(device_extension* Vcb, log_write* lw, internal_node* nodes, ULONG num_nodes, uint8_t* data,
+                                   uint64_t* address, uint8_t* level) {
+    NTSTATUS Status;
+    ULONG per_node = (Vcb->superblock.node_size - sizeof(tree_header)) / sizeof(internal_node);
+    uint8_t lev = 0;
+
+    while (num_nodes > 1) {
+        ULONG out = 0, i;
+
+        lev++;
+
+        for (i = 0; i < num_nodes; i += per_node) {
+            ULONG num = min(per_node, num_nodes - i);
+            KEY firstkey = nodes[i].key;
+
+            RtlZeroMemory(data, Vcb->superblock.node_size);
+            RtlCopyMemory(data + sizeof(tree_header), &nodes[i], num * sizeof(internal_node));
+
+            Status = queue_log_node(Vcb, lw, data, lev, num, &nodes[out].address);
+            if (!NT_SUCCESS(Status)) {
+                ERR("queue_log_node returned %08x\n", Status);
+                return Status;
+            }
+
+            nodes[out].key = firstkey;
+            nodes[out].generation = Vcb->superblock.generation;
+            out++;
+        }
+
+        num_nodes = out;
+    }
+
+    *address = nodes[0].address;
+    *level = lev;
+
+    return STATUS_SUCCESS;
+}
+
+// Packs entries into data, starting at *pos. If old is given, this stops at the first key of any of the old
+// leaves, so that the leaf boundaries stay where they were and a change only affects the leaf it's in.
+static uint32_t pack_log_leaf(device_extension* Vcb, log_entry* entries, ULONG num_entries, ULONG* pos, uint8_t* data,
+                              LIST_ENTRY* old_leaves, LIST_ENTRY* old, uint64_t subvol) {
+    leaf_node* ln = (leaf_node*)(data + sizeof(tree_header));
+    uint8_t* dataptr = data + Vcb->superblock.node_size;
+    ULONG space = Vcb->superblock.node_size - sizeof(tree_header);
+    ULONG i = *pos;
+    uint32_t num = 0;
+
+    RtlZeroMemory(data, Vcb->superblock.node_size);
+
+    while (i < num_entries && sizeof(leaf_node) + entries[i].size <= space) {
+        if (num > 0 && old) {
+            while (old != old_leaves && CONTAINING_RECORD(old, log_leaf, list_entry)->subvol == subvol &&
+                   keycmp(CONTAINING_RECORD(old, log_leaf, list_entry)->firstkey, entries[i].key) == -1) {
+                old = old->Flink;
+            }
+
+            if (old != old_leaves && CONTAINING_RECORD(old, log_leaf, list_entry)->subvol == subvol &&
+                keycmp(CONTAINING_RECORD(old, log_leaf, list_entry)->firstkey, entries[i].key) == 0)
+                break;
+        }
+
+        dataptr -= entries[i].size;
+
+        ln[num].key = entries[i].key;
+        ln[num].offset = (uint32_t)(dataptr - (uint8_t*)ln);
+        ln[num].size = entries[i].size;
+
+        if (entries[i].size > 0)
+            RtlCopyMemory(dataptr, entries[i].data, entries[i].size);
+
+        space -= sizeof(leaf_node) + entries[i].size;
+        num++;
+        i++;
+    }
+
+    *pos = i;
+
+    return num;
+}
+
+// Writes the log root tree, which only has a few items, so always gets written from scratch.
+static NTSTATUS write_log_tree(device_extension* Vcb, log_write* lw, log_entry* entries, ULONG num_entries, uint64_t* address, uint8_t* level) {
+    NTSTATUS Status;
+    internal_node* nodes;
+    ULONG num_nodes = 0, i = 0;
+    uint8_t* data;
+
+    nodes = ExAllocatePoolWithTag(PagedPool, sizeof(internal_node) * max(num_entries, 1), ALLOC_TAG);
+    if (!nodes) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    data = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+    if (!data) {
+        ERR("out of memory\n");
+        ExFreePool(nodes);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    do {
+        uint32_t num = pack_log_leaf(Vcb, entries, num_entries, &i, data, NULL, NULL, 0);
+
+        if (num == 0 && i < num_entries) {
+            ERR("item (%I64x,%x,%I64x) too large for leaf\n", entries[i].key.obj_id, entries[i].key.obj_type, entries[i].key.offset);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        if (num > 0)
+            nodes[num_nodes].key = ((leaf_node*)(data + sizeof(tree_header)))[0].key;
+        else
+            RtlZeroMemory(&nodes[num_nodes].key, sizeof(KEY));
+
+        Status = queue_log_node(Vcb, lw, data, 0, num, &nodes[num_nodes].address);
+        if (!NT_SUCCESS(Status)) {
+            ERR("queue_log_node returned %08x\n", Status);
+            goto end;
+        }
+
+        nodes[num_nodes].generation = Vcb->superblock.generation;
+        num_nodes++;
+    } while (i < num_entries);
+
+    Status = write_log_internal(Vcb, lw, nodes, num_nodes, data, address, level);
+    if (!NT_SUCCESS(Status))
+        ERR("write_log_internal returned %08x\n", Status);
+
+end:
+    ExFreePool(data);
+    ExFreePool(nodes);
+
+    return Status;
+}
+
+// Builds the leaves of one subvolume's log tree. Any leaf which comes out the same as one
+// that's already on disk is reused rather than written again.
+static NTSTATUS write_log_leaves(device_extension* Vcb, log_write* lw, uint64_t subvol, log_entry* entries, ULONG num_entries,
+                                 uint64_t* address, uint8_t* level) {
+    NTSTATUS Status;
+    internal_node* nodes;
+    ULONG num_nodes = 0, i = 0;
+    uint8_t* data;
+    LIST_ENTRY *old_leaves = &Vcb->log.leaves, *old;
+    ULONG body_size = Vcb->superblock.node_size - sizeof(tree_header);
+
+    nodes = ExAllocatePoolWithTag(PagedPool, sizeof(internal_node) * max(num_entries, 1), ALLOC_TAG);
+    if (!nodes) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    data = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+    if (!data) {
+        ERR("out of memory\n");
+        ExFreePool(nodes);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    old = old_leaves->Flink;
+    while (old != old_leaves && CONTAINING_RECORD(old, log_leaf, list_entry)->subvol < subvol) {
+        old = old->Flink;
+    }
+
+    do {
+        log_leaf *leaf, *match = NULL;
+        KEY firstkey;
+        uint32_t num;
+
+        if (i < num_entries)
+            firstkey = entries[i].key;
+        else
+            RtlZeroMemory(&firstkey, sizeof(KEY));
+
+        while (old != old_leaves) {
+            log_leaf* ol = CONTAINING_RECORD(old, log_leaf, list_entry);
+            int cmp;
+
+            if (ol->subvol != subvol) {
+                old = old_leaves;
+                break;
+            }
+
+            cmp = keycmp(ol->firstkey, firstkey);
+
+            if (cmp == 1)
+                break;
+            else if (cmp == 0)
+                match = ol;
+
+            old = old->Flink;
+        }
+
+        num = pack_log_leaf(Vcb, entries, num_entries, &i, data, old_leaves, old, subvol);
+
+        if (num == 0 && i < num_entries) {
+            ERR("item (%I64x,%x,%I64x) too large for leaf\n", entries[i].key.obj_id, entries[i].key.obj_type, entries[i].key.offset);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        leaf = ExAllocatePoolWithTag(PagedPool, sizeof(log_leaf), ALLOC_TAG);
+        if (!leaf) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        leaf->data = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+        if (!leaf->data) {
+            ERR("out of memory\n");
+            ExFreePool(leaf);
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        leaf->subvol = subvol;
+        leaf->firstkey = firstkey;
+
+        if (match && ((tree_header*)match->data)->num_items == num &&
+            RtlCompareMemory(match->data + sizeof(tree_header), data + sizeof(tree_header), body_size) == body_size) {
+            Status = add_address(&lw->blocks, match->address);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_address returned %08x\n", Status);
+                ExFreePool(leaf->data);
+                ExFreePool(leaf);
+                goto end;
+            }
+
+            leaf->address = match->address;
+            RtlCopyMemory(leaf->data, match->data, Vcb->superblock.node_size);
+        } else {
+            Status = queue_log_node(Vcb, lw, data, 0, num, &leaf->address);
+            if (!NT_SUCCESS(Status)) {
+                ERR("queue_log_node returned %08x\n", Status);
+                ExFreePool(leaf->data);
+                ExFreePool(leaf);
+                goto end;
+            }
+
+            RtlCopyMemory(leaf->data, data, Vcb->superblock.node_size);
+        }
+
+        InsertTailList(&lw->leaves, &leaf->list_entry);
+
+        nodes[num_nodes].key = firstkey;
+        nodes[num_nodes].address = leaf->address;
+        nodes[num_nodes].generation = Vcb->superblock.generation;
+        num_nodes++;
+    } while (i < num_entries);
+
+    Status = write_log_internal(Vcb, lw, nodes, num_nodes, data, address, level);
+    if (!NT_SUCCESS(Status))
+        ERR("write_log_internal returned %08x\n", Status);
+
+end:
+    ExFreePool(data);
+    ExFreePool(nodes);
+
+    return Status;
+}
+
+// Writes the log tree of one subvolume, i.e. the run of Vcb->log.inodes starting at *ple.
+static NTSTATUS write_subvol_log(device_extension* Vcb, log_write* lw, LIST_ENTRY** ple, uint64_t* address, uint8_t* level) {
+    NTSTATUS Status;
+    LIST_ENTRY *le, *le2;
+    uint64_t subvol = CONTAINING_RECORD(*ple, log_inode, list_entry)->subvol;
+    ULONG num_items = 0, num_csums = 0, num_entries = 0, i, j;
+    log_entry* entries;
+    log_item** csums;
+    uint64_t covered = 0;
+
+    le = *ple;
+    while (le != &Vcb->log.inodes) {
+        log_inode* li = CONTAINING_RECORD(le, log_inode, list_entry);
+
+        if (li->subvol != subvol)
+            break;
+
+        le2 = li->items.Flink;
+        while (le2 != &li->items) {
+            num_items++;
+            le2 = le2->Flink;
+        }
+
+        le2 = li->csums.Flink;
+        while (le2 != &li->csums) {
+            num_csums++;
+            le2 = le2->Flink;
+        }
+
+        le = le->Flink;
+    }
+
+    entries = ExAllocatePoolWithTag(PagedPool, sizeof(log_entry) * max(num_items + num_csums, 1), ALLOC_TAG);
+    if (!entries) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (num_csums > 0) {
+        csums = ExAllocatePoolWithTag(PagedPool, sizeof(log_item*) * num_csums, ALLOC_TAG);
+        if (!csums) {
+            ERR("out of memory\n");
+            ExFreePool(entries);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    } else
+        csums = NULL;
+
+    // The inodes are in order, and so are their items. EXTENT_CSUM_ID is higher than any inode
+    // number, so the checksums go at the end, sorted by address.
+
+    num_csums = 0;
+
+    le = *ple;
+    while (le != &Vcb->log.inodes) {
+        log_inode* li = CONTAINING_RECORD(le, log_inode, list_entry);
+
+        if (li->subvol != subvol)
+            break;
+
+        le2 = li->items.Flink;
+        while (le2 != &li->items) {
+            log_item* item = CONTAINING_RECORD(le2, log_item, list_entry);
+
+            entries[num_entries].key = item->key;
+            entries[num_entries].size = item->size;
+            entries[num_entries].data = item->data;
+            num_entries++;
+
+            le2 = le2->Flink;
+        }
+
+        le2 = li->csums.Flink;
+        while (le2 != &li->csums) {
+            log_item* item = CONTAINING_RECORD(le2, log_item, list_entry);
+
+            j = num_csums;
+            while (j > 0 && csums[j - 1]->key.offset > item->key.offset) {
+                csums[j] = csums[j - 1];
+                j--;
+            }
+
+            csums[j] = item;
+            num_csums++;
+
+            le2 = le2->Flink;
+        }
+
+        le = le->Flink;
+    }
+
+    *ple = le;
+
+    // Reflinked extents can appear in more than one inode - trim the overlaps, as the
+    // checksum items mustn't cover the same sector twice.
+
+    for (i = 0; i < num_csums; i++) {
+        uint64_t start = csums[i]->key.offset;
+        uint64_t end = start + (csums[i]->size / Vcb->csum_size * Vcb->superblock.sector_size);
+        ULONG skip = 0;
+
+        if (end <= covered)
+            continue;
+
+        if (start < covered)
+            skip = (ULONG)((covered - start) / Vcb->superblock.sector_size);
+
+        entries[num_entries].key = csums[i]->key;
+        entries[num_entries].key.offset = start + ((uint64_t)skip * Vcb->superblock.sector_size);
+        entries[num_entries].size = (uint16_t)(csums[i]->size - (skip * Vcb->csum_size));
+        entries[num_entries].data = csums[i]->data + (skip * Vcb->csum_size);
+        num_entries++;
+
+        covered = end;
+    }
+
+    Status = write_log_leaves(Vcb, lw, subvol, entries, num_entries, address, level);
+    if (!NT_SUCCESS(Status))
+        ERR("write_log_leaves returned %08x\n", Status);
+
+    if (csums)
+        ExFreePool(csums);
+
+    ExFreePool(entries);
+
+    return Status;
+}
+
+static void free_log_write(device_extension* Vcb, log_write* lw) {
+    free_tree_writes(&lw->tree_writes);
+    free_log_leaves(&lw->leaves);
+
+    if (lw->blocks.addresses) {
+        // Blocks we're reusing from the log that's on disk now have to stay where they are. If we
+        // failed partway through the superblock writes the new log might be on disk somewhere,
+        // so the rest go into c->deleting rather than straight back.
+        free_unused_log_blocks(Vcb, lw->blocks.addresses, lw->blocks.num, Vcb->log.blocks, Vcb->log.num_blocks);
+
+        ExFreePool(lw->blocks.addresses);
+        lw->blocks.addresses = NULL;
+    }
+}
+
+// Builds the new log in memory. Only the leaves which have changed since the last time
+// need writing, along with the nodes above them - finish_log does the I/O, which doesn't
+// need tree_lock held exclusively.
+static NTSTATUS write_log(device_extension* Vcb, log_write* lw) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    ULONG num_subvols = 0, i;
+    log_entry* entries = NULL;
+    ROOT_ITEM* ris = NULL;
+    uint64_t address;
+    uint8_t level;
+
+    lw->blocks.addresses = NULL;
+    lw->blocks.num = lw->blocks.max = 0;
+    InitializeListHead(&lw->leaves);
+    InitializeListHead(&lw->tree_writes);
+
+    le = Vcb->log.inodes.Flink;
+    while (le != &Vcb->log.inodes) {
+        log_inode* li = CONTAINING_RECORD(le, log_inode, list_entry);
+
+        if (le == Vcb->log.inodes.Flink || CONTAINING_RECORD(le->Blink, log_inode, list_entry)->subvol != li->subvol)
+            num_subvols++;
+
+        le = le->Flink;
+    }
+
+    entries = ExAllocatePoolWithTag(PagedPool, sizeof(log_entry) * num_subvols, ALLOC_TAG);
+    if (!entries) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    ris = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM) * num_subvols, ALLOC_TAG);
+    if (!ris) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    RtlZeroMemory(ris, sizeof(ROOT_ITEM) * num_subvols);
+
+    // one tree for each subvolume
+
+    i = 0;
+    le = Vcb->log.inodes.Flink;
+    while (le != &Vcb->log.inodes) {
+        uint64_t subvol = CONTAINING_RECORD(le, log_inode, list_entry)->subvol;
+
+        Status = write_subvol_log(Vcb, lw, &le, &address, &level);
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_subvol_log returned %08x\n", Status);
+            goto end;
+        }
+
+        // the same as what Linux puts in its log roots
+        ris[i].inode.generation = 1;
+        ris[i].inode.st_size = 3;
+        ris[i].inode.st_nlink = 1;
+        ris[i].inode.st_blocks = Vcb->superblock.node_size;
+        ris[i].inode.st_mode = __S_IFDIR | 0755;
+        ris[i].generation = Vcb->superblock.generation;
+        ris[i].generation2 = Vcb->superblock.generation;
+        ris[i].block_number = address;
+        ris[i].root_level = level;
+        ris[i].num_references = 1;
+
+        entries[i].key.obj_id = TREE_LOG_ID;
+        entries[i].key.obj_type = TYPE_ROOT_ITEM;
+        entries[i].key.offset = subvol;
+        entries[i].size = sizeof(ROOT_ITEM);
+        entries[i].data = (uint8_t*)&ris[i];
+        i++;
+    }
+
+    // and the log root tree pointing to them
+
+    Status = write_log_tree(Vcb, lw, entries, num_subvols, &lw->address, &lw->level);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_log_tree returned %08x\n", Status);
+        goto end;
+    }
+
+    Status = STATUS_SUCCESS;
+
+end:
+    if (!NT_SUCCESS(Status))
+        free_log_write(Vcb, lw);
+
+    if (ris)
+        ExFreePool(ris);
+
+    if (entries)
+        ExFreePool(entries);
+
+    return Status;
+}
+
+// Writes out what write_log built, then points the superblock at it. The caller only needs tree_lock
+// shared - nothing else touches the log without having it exclusively.
+static NTSTATUS finish_log(device_extension* Vcb, log_write* lw) {
+    NTSTATUS Status;
+    superblock* sb;
+
+    Status = do_tree_writes(Vcb, &lw->tree_writes);
+    if (!NT_SUCCESS(Status)) {
+        ERR("do_tree_writes returned %08x\n", Status);
+        goto end;
+    }
+
+    if (!Vcb->options.no_barrier)
+        flush_disk_caches(Vcb);
+
+    sb = ExAllocatePoolWithTag(PagedPool, sizeof(superblock), ALLOC_TAG);
+    if (!sb) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    RtlCopyMemory(sb, &Vcb->log.committed_sb, sizeof(superblock));
+    sb->log_tree_addr = lw->address;
+    sb->log_root_level = lw->level;
+
+    Status = write_superblock_copies(Vcb, sb);
+
+    ExFreePool(sb);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_superblock_copies returned %08x\n", Status);
+        goto end;
+    }
+
+    // the parts of the old log we didn't reuse aren't referenced any more
+
+    if (Vcb->log.num_blocks > 0) {
+        free_unused_log_blocks(Vcb, Vcb->log.blocks, Vcb->log.num_blocks, lw->blocks.addresses, lw->blocks.num);
+        ExFreePool(Vcb->log.blocks);
+    }
+
+    Vcb->log.blocks = lw->blocks.addresses;
+    Vcb->log.num_blocks = lw->blocks.num;
+    lw->blocks.addresses = NULL;
+
+    free_log_leaves(&Vcb->log.leaves);
+
+    while (!IsListEmpty(&lw->leaves)) {
+        InsertTailList(&Vcb->log.leaves, RemoveHeadList(&lw->leaves));
+    }
+
+end:
+    free_log_write(Vcb, lw);
+
+    return Status;
+}
+
+static bool log_items_equal(LIST_ENTRY* items1, LIST_ENTRY* items2) {
+    LIST_ENTRY *le1 = items1->Flink, *le2 = items2->Flink;
+
+    while (le1 != items1 && le2 != items2) {
+        log_item* item1 = CONTAINING_RECORD(le1, log_item, list_entry);
+        log_item* item2 = CONTAINING_RECORD(le2, log_item, list_entry);
+
+        if (keycmp(item1->key, item2->key) || item1->size != item2->size)
+            return false;
+
+        if (item1->size > 0 && RtlCompareMemory(item1->data, item2->data, item1->size) != item1->size)
+            return false;
+
+        le1 = le1->Flink;
+        le2 = le2->Flink;
+    }
+
+    return le1 == items1 && le2 == items2;
+}
+
+// Returns true if the log already has exactly these items for the inode.
+static bool already_logged(device_extension* Vcb, log_inode* li) {
+    LIST_ENTRY* le;
+
+    le = Vcb->log.inodes.Flink;
+    while (le != &Vcb->log.inodes) {
+        log_inode* li2 = CONTAINING_RECORD(le, log_inode, list_entry);
+
+        if (li2->subvol == li->subvol && li2->inode == li->inode)
+            return log_items_equal(&li->items, &li2->items) && log_items_equal(&li->csums, &li2->csums);
+
+        le = le->Flink;
+    }
+
+    return false;
+}
+
+NTSTATUS sync_fcb(device_extension* Vcb, fcb* fcb, PIRP Irp) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    log_inode *li = NULL, *old_li = NULL;
+    log_write lw;
+    bool clean, commit = false;
+
+    if (Vcb->readonly || is_subvol_readonly(fcb->subvol, Irp))
+        return STATUS_SUCCESS;
+
+    // Nothing to log - the data is on its way to the disk, and the metadata's already there, unless
+    // a commit is still writing it. This doesn't need tree_lock, so it doesn't have to wait for anyone.
+    ExAcquireResourceSharedLite(fcb->Header.Resource, true);
+    clean = fcb->deleted || !fcb->dirty;
+    ExReleaseResourceLite(fcb->Header.Resource);
+
+    if (clean && InterlockedCompareExchange(&Vcb->commit_pending, 0, 0) == 0) {
+        if (!Vcb->options.no_barrier)
+            flush_disk_caches(Vcb);
+
+        return STATUS_SUCCESS;
+    }
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, true);
+    ExAcquireResourceSharedLite(fcb->Header.Resource, true);
+
+    // a commit might have finished while we were waiting for tree_lock
+    if (fcb->deleted || !fcb->dirty) {
+        ExReleaseResourceLite(fcb->Header.Resource);
+        ExReleaseResourceLite(&Vcb->tree_lock);
+
+        if (!Vcb->options.no_barrier)
+            flush_disk_caches(Vcb);
+
+        return STATUS_SUCCESS;
+    }
+
+    if (!can_log_fcb(Vcb, fcb, Irp))
+        commit = true;
+    else {
+        Status = log_fcb(Vcb, fcb, &li);
+        if (!NT_SUCCESS(Status)) {
+            ERR("log_fcb returned %08x\n", Status);
+            commit = true;
+        }
+    }
+
+    ExReleaseResourceLite(fcb->Header.Resource);
+
+    // nothing's changed since the last time the file was logged
+    if (!commit && already_logged(Vcb, li)) {
+        free_log_inode(li);
+
+        ExReleaseResourceLite(&Vcb->tree_lock);
+
+        if (!Vcb->options.no_barrier)
+            flush_disk_caches(Vcb);
+
+        return STATUS_SUCCESS;
+    }
+
+    if (!commit) {
+        old_li = replace_log_inode(Vcb, li);
+
+        Status = write_log(Vcb, &lw);
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_log returned %08x\n", Status);
+            restore_log_inode(li, old_li);
+            commit = true;
+        }
+    }
+
+    // let everyone else back in while we wait for the disks
+    if (!commit) {
+        ExConvertExclusiveToSharedLite(&Vcb->tree_lock);
+
+        Status = finish_log(Vcb, &lw);
+        if (!NT_SUCCESS(Status)) {
+            ERR("finish_log returned %08x\n", Status);
+
+            // Nobody else can look at the log until we release tree_lock, so they'll never see li,
+            // and already_logged can't mistake it for something that's on the disk.
+            restore_log_inode(li, old_li);
+            commit = true;
+        } else if (old_li)
+            free_log_inode(old_li);
+    }
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    // share the commit with anyone else flushing at the same time
+    if (commit) {
+        Status = group_commit(Vcb, Irp);
+        if (!NT_SUCCESS(Status))
+            ERR("group_commit returned %08x\n", Status);
+    }
+
+    return Status;
+}
+
+static NTSTATUS load_log_node(device_extension* Vcb, uint64_t address, uint8_t level, LIST_ENTRY* items, address_list* blocks, PIRP Irp) {
+    NTSTATUS Status;
+    uint8_t* buf;
+    tree_header* th;
+    ULONG i;
+
+    buf = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+    if (!buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = read_data(Vcb, address, Vcb->superblock.node_size, NULL, true, buf, NULL, NULL, Irp, 0, false, NormalPagePriority);
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_data returned %08x\n", Status);
+        goto end;
+    }
+
+    th = (tree_header*)buf;
+
+    if (th->address != address || th->tree_id != TREE_LOG_ID || th->level != level || th->generation != Vcb->log.committed_sb.generation + 1) {
+        ERR("log tree block %I64x is invalid (address %I64x, tree %I64x, level %x, generation %I64x)\n", address, th->address,
+            th->tree_id, th->level, th->generation);
+        Status = STATUS_INTERNAL_ERROR;
+        goto end;
+    }
+
+    Status = add_address(blocks, address);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_address returned %08x\n", Status);
+        goto end;
+    }
+
+    if (level == 0) {
+        leaf_node* ln = (leaf_node*)(buf + sizeof(tree_header));
+
+        if (th->num_items > (Vcb->superblock.node_size - sizeof(tree_header)) / sizeof(leaf_node)) {
+            ERR("log tree block %I64x has too many items (%u)\n", address, th->num_items);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        for (i = 0; i < th->num_items; i++) {
+            if (ln[i].size > 0xffff || (uint64_t)ln[i].offset + ln[i].size > Vcb->superblock.node_size - sizeof(tree_header)) {
+                ERR("log tree block %I64x: item %u is out of bounds\n", address, i);
+                Status = STATUS_INTERNAL_ERROR;
+                goto end;
+            }
+
+            if (!add_log_item(items, ln[i].key.obj_id, ln[i].key.obj_type, ln[i].key.offset, (uint8_t*)ln + ln[i].offset, (uint16_t)ln[i].size)) {
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
+            }
+        }
+    } else {
+        internal_node* in = (internal_node*)(buf + sizeof(tree_header));
+
+        if (th->num_items > (Vcb->superblock.node_size - sizeof(tree_header)) / sizeof(internal_node)) {
+            ERR("log tree block %I64x has too many items (%u)\n", address, th->num_items);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        for (i = 0; i < th->num_items; i++) {
+            Status = load_log_node(Vcb, in[i].address, level - 1, items, blocks, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("load_log_node returned %08x\n", Status);
+                goto end;
+            }
+        }
+    }
+
+    Status = STATUS_SUCCESS;
+
+end:
+    ExFreePool(buf);
+
+    return Status;
+}
+
+static bool item_on_disk(device_extension* Vcb, root* r, KEY* key, PIRP Irp) {
+    NTSTATUS Status;
+    traverse_ptr tp;
+
+    Status = find_item(Vcb, r, &tp, key, false, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return false;
+    }
+
+    return !keycmp(tp.item->key, *key);
+}
+
+// We can only replay what we write ourselves: INODE_ITEMs and EXTENT_DATAs of existing files, and
+// checksums. Linux also logs the INODE_REFs, which are fine so long as they're already on disk.
+static bool can_replay_log(device_extension* Vcb, replay_root* rr, PIRP Irp) {
+    LIST_ENTRY* le;
+    uint64_t inode = 0;
+
+    le = rr->items.Flink;
+    while (le != &rr->items) {
+        log_item* item = CONTAINING_RECORD(le, log_item, list_entry);
+
+        switch (item->key.obj_type) {
+            case TYPE_INODE_ITEM: {
+                KEY searchkey;
+                traverse_ptr tp;
+                NTSTATUS Status;
+
+                if (item->size < sizeof(INODE_ITEM) || (((INODE_ITEM*)item->data)->st_mode & __S_IFMT) != __S_IFREG)
+                    return false;
+
+                searchkey = item->key;
+                searchkey.offset = 0xffffffffffffffff;
+
+                Status = find_item(Vcb, rr->subvol, &tp, &searchkey, false, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("error - find_item returned %08x\n", Status);
+                    return false;
+                }
+
+                if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type)
+                    return false;
+
+                inode = item->key.obj_id;
+                break;
+            }
+
+            case TYPE_EXTENT_DATA:
+                if (item->key.obj_id != inode)
+                    return false;
+                break;
+
+            case TYPE_INODE_REF:
+            case TYPE_INODE_EXTREF:
+                if (!item_on_disk(Vcb, rr->subvol, &item->key, Irp))
+                    return false;
+                break;
+
+            case TYPE_EXTENT_CSUM:
+                if (item->key.obj_id != EXTENT_CSUM_ID || item->size % Vcb->csum_size != 0)
+                    return false;
+                break;
+
+            default:
+                return false;
+        }
+
+        le = le->Flink;
+    }
+
+    return true;
+}
+
+static bool extent_on_disk(device_extension* Vcb, uint64_t address, uint64_t size, PIRP Irp) {
+    KEY searchkey;
+
+    searchkey.obj_id = address;
+    searchkey.obj_type = TYPE_EXTENT_ITEM;
+    searchkey.offset = size;
+
+    return item_on_disk(Vcb, Vcb->extent_root, &searchkey, Irp);
+}
+
+// Fills in the checksums for the sectors at address. Anything written since the last commit has its
+// checksums in the log; anything else was written before it, so is in the csum tree.
+static NTSTATUS get_replay_csums(device_extension* Vcb, LIST_ENTRY* items, uint64_t address, ULONG sectors, uint8_t* csum, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    RTL_BITMAP bmp;
+    ULONG* bmparr;
+    ULONG runlength, index;
+    uint64_t end = address + ((uint64_t)sectors * Vcb->superblock.sector_size);
+
+    bmparr = ExAllocatePoolWithTag(PagedPool, sizeof(ULONG) * ((sectors/8)+1), ALLOC_TAG);
+    if (!bmparr) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlInitializeBitMap(&bmp, bmparr, sectors);
+    RtlClearAllBits(&bmp);
+
+    // EXTENT_CSUM_ID sorts after all the inodes, so the EXTENT_CSUMs are at the end of the list
+    le = items->Blink;
+    while (le != items) {
+        log_item* item = CONTAINING_RECORD(le, log_item, list_entry);
+        uint64_t item_end;
+
+        if (item->key.obj_id != EXTENT_CSUM_ID || item->key.obj_type != TYPE_EXTENT_CSUM)
+            break;
+
+        item_end = item->key.offset + ((uint64_t)(item->size / Vcb->csum_size) * Vcb->superblock.sector_size);
+
+        if (item->key.offset < end && item_end > address) {
+            uint64_t start2 = max(item->key.offset, address);
+            uint64_t end2 = min(item_end, end);
+            ULONG off = (ULONG)((start2 - address) / Vcb->superblock.sector_size);
+            ULONG num = (ULONG)((end2 - start2) / Vcb->superblock.sector_size);
+
+            RtlCopyMemory(csum + (off * Vcb->csum_size), item->data + ((start2 - item->key.offset) / Vcb->superblock.sector_size * Vcb->csum_size),
+                          num * Vcb->csum_size);
+            RtlSetBits(&bmp, off, num);
+        }
+
+        le = le->Blink;
+    }
+
+    runlength = RtlFindFirstRunClear(&bmp, &index);
+
+    while (runlength != 0) {
+        Status = load_csum(Vcb, csum + (index * Vcb->csum_size), address + ((uint64_t)index * Vcb->superblock.sector_size), runlength, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_csum returned %08x\n", Status);
+            ExFreePool(bmparr);
+            return Status;
+        }
+
+        runlength = RtlFindNextForwardRunClear(&bmp, index + runlength, &index);
+    }
+
+    ExFreePool(bmparr);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS replay_extent(device_extension* Vcb, fcb* fcb, log_item* item, LIST_ENTRY* items, address_list* allocated, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    EXTENT_DATA* ed = (EXTENT_DATA*)item->data;
+    EXTENT_DATA2* ed2 = NULL;
+    uint64_t len;
+    void* csum = NULL;
+
+    if (item->size < offsetof(EXTENT_DATA, data[0])) {
+        ERR("EXTENT_DATA was %u bytes\n", item->size);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    if (ed->type == EXTENT_TYPE_INLINE)
+        len = ed->decoded_size;
+    else {
+        if (item->size < offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2)) {
+            ERR("EXTENT_DATA was %u bytes\n", item->size);
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        ed2 = (EXTENT_DATA2*)ed->data;
+        len = ed2->num_bytes;
+    }
+
+    Status = excise_extents(Vcb, fcb, item->key.offset, item->key.offset + len, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08x\n", Status);
+        return Status;
+    }
+
+    if (ed2 && ed2->size != 0) {
+        chunk* c = get_chunk_from_address(Vcb, ed2->address);
+        bool no_csum = fcb->inode_item.flags & BTRFS_INODE_NODATASUM;
+
+        if (!c) {
+            ERR("get_chunk_from_address(%I64x) failed\n", ed2->address);
+            return STATUS_INTERNAL_ERROR;
+        }
+
+        if (extent_on_disk(Vcb, ed2->address, ed2->size, Irp)) {
+            Status = update_changed_extent_ref(Vcb, c, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, item->key.offset - ed2->offset, 1,
+                                               no_csum, false, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("update_changed_extent_ref returned %08x\n", Status);
+                return Status;
+            }
+        } else {
+            // written after the last commit, so we need to allocate it as insert_extent_chunk would have done
+            if (!find_address(allocated, ed2->address)) {
+                Status = add_address(allocated, ed2->address);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("add_address returned %08x\n", Status);
+                    return Status;
+                }
+
+                acquire_chunk_lock(c, Vcb);
+
+                if (!c->cache_loaded) {
+                    Status = load_cache_chunk(Vcb, c, NULL);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("load_cache_chunk returned %08x\n", Status);
+                        release_chunk_lock(c, Vcb);
+                        return Status;
+                    }
+                }
+
+                c->used += ed2->size;
+                space_list_subtract(c, false, ed2->address, ed2->size, rollback);
+
+                release_chunk_lock(c, Vcb);
+            }
+
+            ExAcquireResourceExclusiveLite(&c->changed_extents_lock, true);
+            add_changed_extent_ref(c, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, item->key.offset - ed2->offset, 1, no_csum);
+            ExReleaseResourceLite(&c->changed_extents_lock);
+        }
+
+        // The extent's marked as inserted, so reads won't look for its checksums anywhere else,
+        // and flush_fcb will write them to the csum tree.
+        if (!no_csum && ed->type == EXTENT_TYPE_REGULAR) {
+            uint64_t start = ed->compression == BTRFS_COMPRESSION_NONE ? (ed2->address + ed2->offset) : ed2->address;
+            ULONG sectors = (ULONG)((ed->compression == BTRFS_COMPRESSION_NONE ? ed2->num_bytes : ed2->size) / Vcb->superblock.sector_size);
+
+            csum = ExAllocatePoolWithTag(PagedPool, sectors * Vcb->csum_size, ALLOC_TAG);
+            if (!csum) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            Status = get_replay_csums(Vcb, items, start, sectors, csum, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("get_replay_csums returned %08x\n", Status);
+                ExFreePool(csum);
+                return Status;
+            }
+        }
+    }
+
+    Status = add_extent_to_fcb(fcb, item->key.offset, ed, item->size, false, csum, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_extent_to_fcb returned %08x\n", Status);
+
+        if (csum)
+            ExFreePool(csum);
+
+        return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS replay_inode(device_extension* Vcb, root* subvol, LIST_ENTRY** ple, LIST_ENTRY* items, address_list* allocated,
+                             PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    log_item* ii = CONTAINING_RECORD(*ple, log_item, list_entry);
+    LIST_ENTRY* le;
+    fcb* fcb;
+    uint32_t nlink;
+
+    acquire_fcb_lock_exclusive(Vcb);
+
+    Status = open_fcb(Vcb, subvol, ii->key.obj_id, BTRFS_TYPE_FILE, NULL, false, NULL, &fcb, PagedPool, Irp);
+
+    release_fcb_lock(Vcb);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("open_fcb returned %08x\n", Status);
+        return Status;
+    }
+
+    le = (*ple)->Flink;
+    while (le != items) {
+        log_item* item = CONTAINING_RECORD(le, log_item, list_entry);
+
+        if (item->key.obj_id != ii->key.obj_id)
+            break;
+
+        if (item->key.obj_type == TYPE_EXTENT_DATA) {
+            Status = replay_extent(Vcb, fcb, item, items, allocated, Irp, rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("replay_extent returned %08x\n", Status);
+                goto end;
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    *ple = le;
+
+    Status = excise_extents(Vcb, fcb, sector_align(((INODE_ITEM*)ii->data)->st_size, Vcb->superblock.sector_size), 0xffffffffffffffff, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08x\n", Status);
+        goto end;
+    }
+
+    // links aren't replayed, so keep what's on disk
+    nlink = fcb->inode_item.st_nlink;
+    RtlCopyMemory(&fcb->inode_item, ii->data, sizeof(INODE_ITEM));
+    fcb->inode_item.st_nlink = nlink;
+
+    fcb->Header.AllocationSize.QuadPart = sector_align(fcb->inode_item.st_size, Vcb->superblock.sector_size);
+    fcb->Header.FileSize.QuadPart = fcb->inode_item.st_size;
+    fcb->Header.ValidDataLength.QuadPart = fcb->inode_item.st_size;
+
+    fcb->inode_item_changed = true;
+    fcb->extents_changed = true;
+    mark_fcb_dirty(fcb);
+
+    Status = STATUS_SUCCESS;
+
+end:
+    free_fcb(fcb);
+
+    return Status;
+}
+
+static NTSTATUS replay_subvol_log(device_extension* Vcb, replay_root* rr, address_list* allocated, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+
+    le = rr->items.Flink;
+    while (le != &rr->items) {
+        log_item* item = CONTAINING_RECORD(le, log_item, list_entry);
+
+        if (item->key.obj_type == TYPE_INODE_ITEM) {
+            Status = replay_inode(Vcb, rr->subvol, &le, &rr->items, allocated, Irp, rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("replay_inode returned %08x\n", Status);
+                return Status;
+            }
+
+            continue;
+        }
+
+        le = le->Flink;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static void reserve_log_blocks(device_extension* Vcb, address_list* blocks) {
+    ULONG i;
+
+    for (i = 0; i < blocks->num; i++) {
+        chunk* c = get_chunk_from_address(Vcb, blocks->addresses[i]);
+
+        if (!c) {
+            ERR("could not find chunk for address %I64x\n", blocks->addresses[i]);
+            continue;
+        }
+
+        acquire_chunk_lock(c, Vcb);
+
+        if (!c->cache_loaded) {
+            NTSTATUS Status = load_cache_chunk(Vcb, c, NULL);
+
+            if (!NT_SUCCESS(Status))
+                ERR("load_cache_chunk returned %08x\n", Status);
+        }
+
+        space_list_subtract(c, false, blocks->addresses[i], Vcb->superblock.node_size, NULL);
+
+        release_chunk_lock(c, Vcb);
+    }
+}
+
+// Called from mount_vol. If anything goes wrong we leave the log alone and mount read-only, so
+// nothing on disk is lost.
+NTSTATUS replay_log_tree(device_extension* Vcb, PIRP Irp) {
+    NTSTATUS Status;
+    LIST_ENTRY roots, log_roots, rollback, *le;
+    address_list blocks, allocated;
+
+    Vcb->log.chunk_tree_uuid = Vcb->chunk_root->treeholder.tree->header.chunk_tree_uuid;
+
+    if (Vcb->superblock.log_tree_addr == 0)
+        return STATUS_SUCCESS;
+
+    if (Vcb->readonly) {
+        WARN("not replaying log tree on read-only volume\n");
+        return STATUS_SUCCESS;
+    }
+
+    InitializeListHead(&roots);
+    InitializeListHead(&log_roots);
+    InitializeListHead(&rollback);
+
+    blocks.addresses = allocated.addresses = NULL;
+    blocks.num = blocks.max = allocated.num = allocated.max = 0;
+
+    Status = load_log_node(Vcb, Vcb->superblock.log_tree_addr, Vcb->superblock.log_root_level, &log_roots, &blocks, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_log_node returned %08x\n", Status);
+        goto end;
+    }
+
+    le = log_roots.Flink;
+    while (le != &log_roots) {
+        log_item* item = CONTAINING_RECORD(le, log_item, list_entry);
+        ROOT_ITEM* ri = (ROOT_ITEM*)item->data;
+        replay_root* rr;
+        LIST_ENTRY* le2;
+
+        if (item->key.obj_id != TREE_LOG_ID || item->key.obj_type != TYPE_ROOT_ITEM || item->size < offsetof(ROOT_ITEM, root_level) + sizeof(uint8_t)) {
+            ERR("unexpected item (%I64x,%x,%I64x) in log root tree\n", item->key.obj_id, item->key.obj_type, item->key.offset);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        rr = ExAllocatePoolWithTag(PagedPool, sizeof(replay_root), ALLOC_TAG);
+        if (!rr) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        rr->subvol = NULL;
+        InitializeListHead(&rr->items);
+        InsertTailList(&roots, &rr->list_entry);
+
+        le2 = Vcb->roots.Flink;
+        while (le2 != &Vcb->roots) {
+            root* r = CONTAINING_RECORD(le2, root, list_entry);
+
+            if (r->id == item->key.offset) {
+                rr->subvol = r;
+                break;
+            }
+
+            le2 = le2->Flink;
+        }
+
+        if (!rr->subvol) {
+            ERR("could not find subvol %I64x\n", item->key.offset);
+            Status = STATUS_INTERNAL_ERROR;
+            goto end;
+        }
+
+        Status = load_log_node(Vcb, ri->block_number, ri->root_level, &rr->items, &blocks, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_log_node returned %08x\n", Status);
+            goto end;
+        }
+
+        if (!can_replay_log(Vcb, rr, Irp)) {
+            WARN("log tree for subvol %I64x has items we can't replay\n", item->key.offset);
+            Status = STATUS_NOT_SUPPORTED;
+            goto end;
+        }
+
+        le = le->Flink;
+    }
+
+    le = roots.Flink;
+    while (le != &roots) {
+        replay_root* rr = CONTAINING_RECORD(le, replay_root, list_entry);
+
+        Status = replay_subvol_log(Vcb, rr, &allocated, Irp, &rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("replay_subvol_log returned %08x\n", Status);
+            do_rollback(Vcb, &rollback);
+            goto end;
+        }
+
+        le = le->Flink;
+    }
+
+    clear_rollback(&rollback);
+
+    // Keep the log's blocks until the commit below has replaced the superblock, in case we crash halfway through.
+    reserve_log_blocks(Vcb, &blocks);
+
+    Vcb->log.blocks = blocks.addresses;
+    Vcb->log.num_blocks = blocks.num;
+    blocks.addresses = NULL;
+
+    Vcb->superblock.log_tree_addr = 0;
+    Vcb->superblock.log_root_level = 0;
+
+    Status = do_write(Vcb, Irp);
+    if (!NT_SUCCESS(Status))
+        ERR("do_write returned %08x\n", Status);
+
+end:
+    if (!NT_SUCCESS(Status)) {
+        WARN("could not replay log tree, mounting read-only\n");
+        Vcb->readonly = true;
+    }
+
+    while (!IsListEmpty(&roots)) {
+        replay_root* rr = CONTAINING_RECORD(RemoveHeadList(&roots), replay_root, list_entry);
+
+        free_log_items(&rr->items);
+        ExFreePool(rr);
+    }
+
+    free_log_items(&log_roots);
+
+    if (blocks.addresses)
+        ExFreePool(blocks.addresses);
+
+    if (allocated.addresses)
+        ExFreePool(allocated.addresses);
+
+    return STATUS_SUCCESS;
+}
@@ -16,6 +16,7 @@
  * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include "btrfs_drv.h"
+#include "zstd/xxhash.h"
 
 enum read_data_status {
     ReadDataStatus_Pending,
@@ -49,7 +50,7 @@ typedef struct {
     uint64_t type;
     uint32_t sector_size;
     uint16_t firstoff, startoffstripe, sectors_per_stripe;
-    uint32_t* csum;
+    void* csum;
     bool tree;
     read_data_stripe* stripes;
     uint8_t* va;
@@ -82,53 +83,93 @@ static NTSTATUS __stdcall read_data_completion(PDEVICE_OBJECT DeviceObject, PIRP
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
-NTSTATUS check_csum(device_extension* Vcb, uint8_t* data, uint32_t sectors, uint32_t* csum) {
-    NTSTATUS Status;
-    calc_job* cj;
-    uint32_t* csum2;
-
-    // From experimenting, it seems that 40 sectors is roughly the crossover
-    // point where offloading the crc32 calculation becomes worth it.
+// Returns the size of the checksum written, or 0 if csum_type isn't one we know about.
+static ULONG calc_checksum(uint16_t csum_type, uint8_t* data, ULONG len, void* csum) {
+    switch (csum_type) {
+        case CSUM_TYPE_CRC32C:
+            *(uint32_t*)csum = ~calc_crc32c(0xffffffff, data, len);
+            return sizeof(uint32_t);
 
-    if (sectors < 40 || get_num_of_processors() < 2) {
-        ULONG j;
+        case CSUM_TYPE_XXHASH:
+            *(uint64_t*)csum = XXH64(data, len, 0);
+            return sizeof(uint64_t);
 
-        for (j = 0; j < sectors; j++) {
-            uint32_t crc32 = ~calc_crc32c(0xffffffff, data + (j * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
+        case CSUM_TYPE_SHA256:
+            calc_sha256(csum, data, len);
+            return SHA256_HASH_SIZE;
 
-            if (crc32 != csum[j]) {
-                return STATUS_CRC_ERROR;
-            }
-        }
+        case CSUM_TYPE_BLAKE2:
+            blake2b(csum, BLAKE2_HASH_SIZE, data, len);
+            return BLAKE2_HASH_SIZE;
 
-        return STATUS_SUCCESS;
+        default:
+            return 0;
     }
+}
 
-    csum2 = ExAllocatePoolWithTag(PagedPool, sizeof(uint32_t) * sectors, ALLOC_TAG);
-    if (!csum2) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+void get_sector_csum(device_extension* Vcb, void* buf, void* csum) {
+    calc_checksum(Vcb->superblock.csum_type, buf, Vcb->superblock.sector_size, csum);
+}
 
-    Status = add_calc_job(Vcb, data, sectors, csum2, &cj);
-    if (!NT_SUCCESS(Status)) {
-        ERR("add_calc_job returned %08x\n", Status);
-        ExFreePool(csum2);
-        return Status;
+bool check_sector_csum(device_extension* Vcb, void* buf, void* csum) {
+    uint8_t hash[MAX_HASH_SIZE];
+
+    get_sector_csum(Vcb, buf, hash);
+
+    return RtlCompareMemory(hash, csum, Vcb->csum_size) == Vcb->csum_size;
+}
+
+void get_tree_checksum(device_extension* Vcb, tree_header* th, void* csum) {
+    calc_checksum(Vcb->superblock.csum_type, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum), csum);
+}
+
+bool check_tree_checksum(device_extension* Vcb, tree_header* th) {
+    uint8_t hash[MAX_HASH_SIZE];
+
+    get_tree_checksum(Vcb, th, hash);
+
+    if (RtlCompareMemory(hash, th->csum, Vcb->csum_size) != Vcb->csum_size) {
+        WARN("checksum error in tree %I64x\n", th->address);
+        return false;
     }
 
-    KeWaitForSingleObject(&cj->event, Executive, KernelMode, false, NULL);
+    return true;
+}
 
-    if (RtlCompareMemory(csum2, csum, sectors * sizeof(uint32_t)) != sectors * sizeof(uint32_t)) {
-        free_calc_job(cj);
-        ExFreePool(csum2);
-        return STATUS_CRC_ERROR;
+void calc_superblock_checksum(superblock* sb) {
+    calc_checksum(sb->csum_type, (uint8_t*)&sb->uuid, (ULONG)sizeof(superblock) - sizeof(sb->checksum), sb->checksum);
+}
+
+bool check_superblock_checksum(superblock* sb) {
+    uint8_t hash[MAX_HASH_SIZE];
+    ULONG size;
+
+    size = calc_checksum(sb->csum_type, (uint8_t*)&sb->uuid, (ULONG)sizeof(superblock) - sizeof(sb->checksum), hash);
+
+    if (size == 0) {
+        WARN("unrecognized csum type %x\n", sb->csum_type);
+        return false;
     }
 
-    free_calc_job(cj);
-    ExFreePool(csum2);
+    return RtlCompareMemory(hash, sb->checksum, size) == size;
+}
 
-    return STATUS_SUCCESS;
+NTSTATUS check_csum(device_extension* Vcb, uint8_t* data, uint32_t sectors, void* csum) {
+    // From experimenting, it seems that 40 sectors is roughly the crossover
+    // point where offloading the checksum calculation becomes worth it.
+
+    if (sectors < 40 || get_num_of_processors() < 2) {
+        ULONG j;
+
+        for (j = 0; j < sectors; j++) {
+            if (!check_sector_csum(Vcb, data + (j * Vcb->superblock.sector_size), (uint8_t*)csum + (j * Vcb->csum_size)))
+                return STATUS_CRC_ERROR;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    return do_calc_job(Vcb, calc_job_check_csum, data, sectors, csum);
 }
 
 static NTSTATUS read_data_dup(device_extension* Vcb, uint8_t* buf, uint64_t addr, read_data_context* context, CHUNK_ITEM* ci,
@@ -155,11 +196,8 @@ static NTSTATUS read_data_dup(device_extension* Vcb, uint8_t* buf, uint64_t addr
 
     if (context->tree) {
         tree_header* th = (tree_header*)buf;
-        uint32_t crc32;
 
-        crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, context->buflen - sizeof(th->csum));
-
-        if (th->address != context->address || crc32 != *((uint32_t*)th->csum)) {
+        if (th->address != context->address || !check_tree_checksum(Vcb, th)) {
             checksum_error = true;
             log_device_error(Vcb, devices[stripe], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
         } else if (generation != 0 && th->generation != generation) {
@@ -202,9 +240,9 @@ static NTSTATUS read_data_dup(device_extension* Vcb, uint8_t* buf, uint64_t addr
                     WARN("sync_read_phys returned %08x\n", Status);
                     log_device_error(Vcb, devices[j], BTRFS_DEV_STAT_READ_ERRORS);
                 } else {
-                    uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&t2->fs_uuid, Vcb->superblock.node_size - sizeof(t2->csum));
+                    bool checksum_ok = check_tree_checksum(Vcb, t2);
 
-                    if (t2->address == addr && crc32 == *((uint32_t*)t2->csum) && (generation == 0 || t2->generation == generation)) {
+                    if (t2->address == addr && checksum_ok && (generation == 0 || t2->generation == generation)) {
                         RtlCopyMemory(buf, t2, Vcb->superblock.node_size);
                         ERR("recovering from checksum error at %I64x, device %I64x\n", addr, devices[stripe]->devitem.dev_id);
                         recovered = true;
@@ -219,7 +257,7 @@ static NTSTATUS read_data_dup(device_extension* Vcb, uint8_t* buf, uint64_t addr
                         }
 
                         break;
-                    } else if (t2->address != addr || crc32 != *((uint32_t*)t2->csum))
+                    } else if (t2->address != addr || !checksum_ok)
                         log_device_error(Vcb, devices[j], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
                     else
                         log_device_error(Vcb, devices[j], BTRFS_DEV_STAT_GENERATION_ERRORS);
@@ -245,9 +283,7 @@ static NTSTATUS read_data_dup(device_extension* Vcb, uint8_t* buf, uint64_t addr
         }
 
         for (i = 0; i < sectors; i++) {
-            uint32_t crc32 = ~calc_crc32c(0xffffffff, buf + (i * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-
-            if (context->csum[i] != crc32) {
+            if (!check_sector_csum(Vcb, buf + (i * Vcb->superblock.sector_size), (uint8_t*)context->csum + (i * Vcb->csum_size))) {
                 bool recovered = false;
 
                 for (j = 0; j < ci->num_stripes; j++) {
@@ -259,9 +295,7 @@ static NTSTATUS read_data_dup(device_extension* Vcb, uint8_t* buf, uint64_t addr
                             WARN("sync_read_phys returned %08x\n", Status);
                             log_device_error(Vcb, devices[j], BTRFS_DEV_STAT_READ_ERRORS);
                         } else {
-                            uint32_t crc32b = ~calc_crc32c(0xffffffff, sector, Vcb->superblock.sector_size);
-
-                            if (crc32b == context->csum[i]) {
+                            if (check_sector_csum(Vcb, sector, (uint8_t*)context->csum + (i * Vcb->csum_size))) {
                                 RtlCopyMemory(buf + (i * Vcb->superblock.sector_size), sector, Vcb->superblock.sector_size);
                                 ERR("recovering from checksum error at %I64x, device %I64x\n", addr + UInt32x32To64(i, Vcb->superblock.sector_size), devices[stripe]->devitem.dev_id);
                                 recovered = true;
@@ -311,9 +345,9 @@ static NTSTATUS read_data_raid0(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
     if (context->tree) { // shouldn't happen, as trees shouldn't cross stripe boundaries
         tree_header* th = (tree_header*)buf;
-        uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
+        bool checksum_ok = check_tree_checksum(Vcb, th);
 
-        if (crc32 != *((uint32_t*)th->csum) || addr != th->address || (generation != 0 && generation != th->generation)) {
+        if (!checksum_ok || addr != th->address || (generation != 0 && generation != th->generation)) {
             uint64_t off;
             uint16_t stripe;
 
@@ -321,8 +355,7 @@ static NTSTATUS read_data_raid0(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
             ERR("unrecoverable checksum error at %I64x, device %I64x\n", addr, devices[stripe]->devitem.dev_id);
 
-            if (crc32 != *((uint32_t*)th->csum)) {
-                WARN("crc32 was %08x, expected %08x\n", crc32, *((uint32_t*)th->csum));
+            if (!checksum_ok) {
                 log_device_error(Vcb, devices[stripe], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
                 return STATUS_CRC_ERROR;
             } else if (addr != th->address) {
@@ -342,9 +375,7 @@ static NTSTATUS read_data_raid0(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
         if (Status == STATUS_CRC_ERROR) {
             for (i = 0; i < length / Vcb->superblock.sector_size; i++) {
-                uint32_t crc32 = ~calc_crc32c(0xffffffff, buf + (i * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-
-                if (context->csum[i] != crc32) {
+                if (!check_sector_csum(Vcb, buf + (i * Vcb->superblock.sector_size), (uint8_t*)context->csum + (i * Vcb->csum_size))) {
                     uint64_t off;
                     uint16_t stripe;
 
@@ -387,10 +418,8 @@ static NTSTATUS read_data_raid10(device_extension* Vcb, uint8_t* buf, uint64_t a
 
     if (context->tree) {
         tree_header* th = (tree_header*)buf;
-        uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-        if (crc32 != *((uint32_t*)th->csum)) {
-            WARN("crc32 was %08x, expected %08x\n", crc32, *((uint32_t*)th->csum));
+        if (!check_tree_checksum(Vcb, th)) {
             checksum_error = true;
             log_device_error(Vcb, devices[stripe], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
         } else if (addr != th->address) {
@@ -447,9 +476,9 @@ static NTSTATUS read_data_raid10(device_extension* Vcb, uint8_t* buf, uint64_t a
                     WARN("sync_read_phys returned %08x\n", Status);
                     log_device_error(Vcb, devices[stripe + j], BTRFS_DEV_STAT_READ_ERRORS);
                 } else {
-                    uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&t2->fs_uuid, Vcb->superblock.node_size - sizeof(t2->csum));
+                    bool checksum_ok = check_tree_checksum(Vcb, t2);
 
-                    if (t2->address == addr && crc32 == *((uint32_t*)t2->csum) && (generation == 0 || t2->generation == generation)) {
+                    if (t2->address == addr && checksum_ok && (generation == 0 || t2->generation == generation)) {
                         RtlCopyMemory(buf, t2, Vcb->superblock.node_size);
                         ERR("recovering from checksum error at %I64x, device %I64x\n", addr, devices[stripe + j]->devitem.dev_id);
                         recovered = true;
@@ -464,7 +493,7 @@ static NTSTATUS read_data_raid10(device_extension* Vcb, uint8_t* buf, uint64_t a
                         }
 
                         break;
-                    } else if (t2->address != addr || crc32 != *((uint32_t*)t2->csum))
+                    } else if (t2->address != addr || !checksum_ok)
                         log_device_error(Vcb, devices[stripe + j], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
                     else
                         log_device_error(Vcb, devices[stripe + j], BTRFS_DEV_STAT_GENERATION_ERRORS);
@@ -490,9 +519,7 @@ static NTSTATUS read_data_raid10(device_extension* Vcb, uint8_t* buf, uint64_t a
         }
 
         for (i = 0; i < sectors; i++) {
-            uint32_t crc32 = ~calc_crc32c(0xffffffff, buf + (i * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-
-            if (context->csum[i] != crc32) {
+            if (!check_sector_csum(Vcb, buf + (i * Vcb->superblock.sector_size), (uint8_t*)context->csum + (i * Vcb->csum_size))) {
                 uint64_t off;
                 uint16_t stripe2, badsubstripe = 0;
                 bool recovered = false;
@@ -519,9 +546,7 @@ static NTSTATUS read_data_raid10(device_extension* Vcb, uint8_t* buf, uint64_t a
                             WARN("sync_read_phys returned %08x\n", Status);
                             log_device_error(Vcb, devices[stripe2 + j], BTRFS_DEV_STAT_READ_ERRORS);
                         } else {
-                            uint32_t crc32b = ~calc_crc32c(0xffffffff, sector, Vcb->superblock.sector_size);
-
-                            if (crc32b == context->csum[i]) {
+                            if (check_sector_csum(Vcb, sector, (uint8_t*)context->csum + (i * Vcb->csum_size))) {
                                 RtlCopyMemory(buf + (i * Vcb->superblock.sector_size), sector, Vcb->superblock.sector_size);
                                 ERR("recovering from checksum error at %I64x, device %I64x\n", addr + UInt32x32To64(i, Vcb->superblock.sector_size), devices[stripe2 + j]->devitem.dev_id);
                                 recovered = true;
@@ -623,9 +648,8 @@ static NTSTATUS read_data_raid5(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
     if (context->tree) {
         tree_header* th = (tree_header*)buf;
-        uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-        if (addr != th->address || crc32 != *((uint32_t*)th->csum)) {
+        if (addr != th->address || !check_tree_checksum(Vcb, th)) {
             checksum_error = true;
             if (!no_success && !degraded)
                 log_device_error(Vcb, devices[stripe], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
@@ -702,9 +726,8 @@ static NTSTATUS read_data_raid5(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
         if (!failed) {
             tree_header* t3 = (tree_header*)t2;
-            uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&t3->fs_uuid, Vcb->superblock.node_size - sizeof(t3->csum));
 
-            if (t3->address == addr && crc32 == *((uint32_t*)t3->csum) && (generation == 0 || t3->generation == generation)) {
+            if (t3->address == addr && check_tree_checksum(Vcb, t3) && (generation == 0 || t3->generation == generation)) {
                 RtlCopyMemory(buf, t2, Vcb->superblock.node_size);
 
                 if (!degraded)
@@ -742,10 +765,6 @@ static NTSTATUS read_data_raid5(device_extension* Vcb, uint8_t* buf, uint64_t ad
         for (i = 0; i < sectors; i++) {
             uint16_t parity;
             uint64_t off;
-            uint32_t crc32;
-
-            if (context->csum)
-                crc32 = ~calc_crc32c(0xffffffff, buf + (i * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
 
             get_raid0_offset(addr - offset + UInt32x32To64(i, Vcb->superblock.sector_size), ci->stripe_length,
                              ci->num_stripes - 1, &off, &stripe);
@@ -754,7 +773,8 @@ static NTSTATUS read_data_raid5(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
             stripe = (parity + stripe + 1) % ci->num_stripes;
 
-            if (!devices[stripe] || !devices[stripe]->devobj || (context->csum && context->csum[i] != crc32)) {
+            if (!devices[stripe] || !devices[stripe]->devobj ||
+                (context->csum && !check_sector_csum(Vcb, buf + (i * Vcb->superblock.sector_size), (uint8_t*)context->csum + (i * Vcb->csum_size)))) {
                 bool recovered = false, first = true, failed = false;
 
                 if (devices[stripe] && devices[stripe]->devobj)
@@ -793,10 +813,7 @@ static NTSTATUS read_data_raid5(device_extension* Vcb, uint8_t* buf, uint64_t ad
                 }
 
                 if (!failed) {
-                    if (context->csum)
-                        crc32 = ~calc_crc32c(0xffffffff, sector, Vcb->superblock.sector_size);
-
-                    if (!context->csum || crc32 == context->csum[i]) {
+                    if (!context->csum || check_sector_csum(Vcb, sector, (uint8_t*)context->csum + (i * Vcb->csum_size))) {
                         RtlCopyMemory(buf + (i * Vcb->superblock.sector_size), sector, Vcb->superblock.sector_size);
 
                         if (!degraded)
@@ -844,10 +861,10 @@ void raid6_recover2(uint8_t* sectors, uint16_t num_stripes, ULONG sector_size, u
         do {
             stripe--;
 
-            galois_double(out, sector_size);
-
             if (stripe != missing)
-                do_xor(out, sectors + (stripe * sector_size), sector_size);
+                galois_double_xor(out, sectors + (stripe * sector_size), sector_size);
+            else
+                galois_double(out, sector_size);
         } while (stripe > 0);
 
         do_xor(out, sectors + ((num_stripes - 1) * sector_size), sector_size);
@@ -856,8 +873,7 @@ void raid6_recover2(uint8_t* sectors, uint16_t num_stripes, ULONG sector_size, u
             galois_divpower(out, (uint8_t)missing, sector_size);
     } else { // reconstruct from p and q
         uint16_t x, y, stripe;
-        uint8_t gyx, gx, denom, a, b, *p, *q, *pxy, *qxy;
-        uint32_t j;
+        uint8_t *pxy, *qxy;
 
         stripe = num_stripes - 3;
 
@@ -880,38 +896,20 @@ void raid6_recover2(uint8_t* sectors, uint16_t num_stripes, ULONG sector_size, u
         do {
             stripe--;
 
-            galois_double(qxy, sector_size);
-
             if (stripe != missing1 && stripe != missing2) {
-                do_xor(qxy, sectors + (stripe * sector_size), sector_size);
+                galois_double_xor(qxy, sectors + (stripe * sector_size), sector_size);
                 do_xor(pxy, sectors + (stripe * sector_size), sector_size);
-            } else if (stripe == missing1)
-                x = stripe;
-            else if (stripe == missing2)
-                y = stripe;
-        } while (stripe > 0);
-
-        gyx = gpow2(y > x ? (y-x) : (255-x+y));
-        gx = gpow2(255-x);
-
-        denom = gdiv(1, gyx ^ 1);
-        a = gmul(gyx, denom);
-        b = gmul(gx, denom);
-
-        p = sectors + ((num_stripes - 2) * sector_size);
-        q = sectors + ((num_stripes - 1) * sector_size);
-
-        for (j = 0; j < sector_size; j++) {
-            *qxy = gmul(a, *p ^ *pxy) ^ gmul(b, *q ^ *qxy);
+            } else {
+                galois_double(qxy, sector_size);
 
-            p++;
-            q++;
-            pxy++;
-            qxy++;
-        }
+                if (stripe == missing1)
+                    x = stripe;
+                else
+                    y = stripe;
+            }
+        } while (stripe > 0);
 
-        do_xor(out + sector_size, out, sector_size);
-        do_xor(out + sector_size, sectors + ((num_stripes - 2) * sector_size), sector_size);
+        galois_recover2(sectors + ((num_stripes - 2) * sector_size), sectors + ((num_stripes - 1) * sector_size), pxy, qxy, x, y, sector_size);
     }
 }
 
@@ -984,9 +982,8 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
     if (context->tree) {
         tree_header* th = (tree_header*)buf;
-        uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-        if (addr != th->address || crc32 != *((uint32_t*)th->csum)) {
+        if (addr != th->address || !check_tree_checksum(Vcb, th)) {
             checksum_error = true;
             if (!no_success && !degraded && devices[stripe])
                 log_device_error(Vcb, devices[stripe], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
@@ -1067,7 +1064,6 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
         if (!failed) {
             if (num_errors == 0) {
                 tree_header* th = (tree_header*)(sector + (stripe * Vcb->superblock.node_size));
-                uint32_t crc32;
 
                 RtlCopyMemory(sector + (stripe * Vcb->superblock.node_size), sector + ((ci->num_stripes - 2) * Vcb->superblock.node_size),
                               Vcb->superblock.node_size);
@@ -1077,9 +1073,7 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
                         do_xor(sector + (stripe * Vcb->superblock.node_size), sector + (j * Vcb->superblock.node_size), Vcb->superblock.node_size);
                 }
 
-                crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
-
-                if (th->address == addr && crc32 == *((uint32_t*)th->csum) && (generation == 0 || th->generation == generation)) {
+                if (th->address == addr && check_tree_checksum(Vcb, th) && (generation == 0 || th->generation == generation)) {
                     RtlCopyMemory(buf, sector + (stripe * Vcb->superblock.node_size), Vcb->superblock.node_size);
 
                     if (devices[physstripe] && devices[physstripe]->devobj)
@@ -1099,7 +1093,6 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
             }
 
             if (!recovered) {
-                uint32_t crc32;
                 tree_header* th = (tree_header*)(sector + (ci->num_stripes * Vcb->superblock.node_size));
                 bool read_q = false;
 
@@ -1117,18 +1110,14 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
                     if (num_errors == 1) {
                         raid6_recover2(sector, ci->num_stripes, Vcb->superblock.node_size, stripe, error_stripe, sector + (ci->num_stripes * Vcb->superblock.node_size));
 
-                        crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
-
-                        if (th->address == addr && crc32 == *((uint32_t*)th->csum) && (generation == 0 || th->generation == generation))
+                        if (th->address == addr && check_tree_checksum(Vcb, th) && (generation == 0 || th->generation == generation))
                             recovered = true;
                     } else {
                         for (j = 0; j < ci->num_stripes - 1; j++) {
                             if (j != stripe) {
                                 raid6_recover2(sector, ci->num_stripes, Vcb->superblock.node_size, stripe, j, sector + (ci->num_stripes * Vcb->superblock.node_size));
 
-                                crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
-
-                                if (th->address == addr && crc32 == *((uint32_t*)th->csum) && (generation == 0 || th->generation == generation)) {
+                                if (th->address == addr && check_tree_checksum(Vcb, th) && (generation == 0 || th->generation == generation)) {
                                     recovered = true;
                                     error_stripe = j;
                                     break;
@@ -1215,10 +1204,6 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
         for (i = 0; i < sectors; i++) {
             uint64_t off;
             uint16_t physstripe, parity1, parity2;
-            uint32_t crc32;
-
-            if (context->csum)
-                crc32 = ~calc_crc32c(0xffffffff, buf + (i * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
 
             get_raid0_offset(addr - offset + UInt32x32To64(i, Vcb->superblock.sector_size), ci->stripe_length,
                              ci->num_stripes - 2, &off, &stripe);
@@ -1228,7 +1213,8 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
             physstripe = (parity2 + stripe + 1) % ci->num_stripes;
 
-            if (!devices[physstripe] || !devices[physstripe]->devobj || (context->csum && context->csum[i] != crc32)) {
+            if (!devices[physstripe] || !devices[physstripe]->devobj ||
+                (context->csum && !check_sector_csum(Vcb, buf + (i * Vcb->superblock.sector_size), (uint8_t*)context->csum + (i * Vcb->csum_size)))) {
                 uint16_t k, error_stripe;
                 bool recovered = false, failed = false;
                 ULONG num_errors = 0;
@@ -1277,10 +1263,7 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
                                 do_xor(sector + (stripe * Vcb->superblock.sector_size), sector + (j * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
                         }
 
-                        if (context->csum)
-                            crc32 = ~calc_crc32c(0xffffffff, sector + (stripe * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-
-                        if (!context->csum || crc32 == context->csum[i]) {
+                        if (!context->csum || check_sector_csum(Vcb, sector + (stripe * Vcb->superblock.sector_size), (uint8_t*)context->csum + (i * Vcb->csum_size))) {
                             RtlCopyMemory(buf + (i * Vcb->superblock.sector_size), sector + (stripe * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
 
                             if (devices[physstripe] && devices[physstripe]->devobj)
@@ -1319,20 +1302,14 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
 
                                 if (!devices[physstripe] || !devices[physstripe]->devobj)
                                     recovered = true;
-                                else {
-                                    crc32 = ~calc_crc32c(0xffffffff, sector + (ci->num_stripes * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-
-                                    if (crc32 == context->csum[i])
-                                        recovered = true;
-                                }
+                                else if (check_sector_csum(Vcb, sector + (ci->num_stripes * Vcb->superblock.sector_size), (uint8_t*)context->csum + (i * Vcb->csum_size)))
+                                    recovered = true;
                             } else {
                                 for (j = 0; j < ci->num_stripes - 1; j++) {
                                     if (j != stripe) {
                                         raid6_recover2(sector, ci->num_stripes, Vcb->superblock.sector_size, stripe, j, sector + (ci->num_stripes * Vcb->superblock.sector_size));
 
-                                        crc32 = ~calc_crc32c(0xffffffff, sector + (ci->num_stripes * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-
-                                        if (crc32 == context->csum[i]) {
+                                        if (check_sector_csum(Vcb, sector + (ci->num_stripes * Vcb->superblock.sector_size), (uint8_t*)context->csum + (i * Vcb->csum_size))) {
                                             recovered = true;
                                             error_stripe = j;
                                             break;
@@ -1416,7 +1393,7 @@ static NTSTATUS read_data_raid6(device_extension* Vcb, uint8_t* buf, uint64_t ad
     return STATUS_SUCCESS;
 }
 
-NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t length, _In_reads_bytes_opt_(length*sizeof(uint32_t)/Vcb->superblock.sector_size) uint32_t* csum,
+NTSTATUS read_data(_In_ device_extension* Vcb, _In_ uint64_t addr, _In_ uint32_t length, _In_reads_bytes_opt_(length*Vcb->csum_size/Vcb->superblock.sector_size) void* csum,
                    _In_ bool is_tree, _Out_writes_bytes_(length) uint8_t* buf, _In_opt_ chunk* c, _Out_opt_ chunk** pc, _In_opt_ PIRP Irp, _In_ uint64_t generation, _In_ bool file_read,
                    _In_ ULONG priority) {
     CHUNK_ITEM* ci;
@@ -2692,6 +2669,382 @@ NTSTATUS read_stream(fcb* fcb, uint8_t* data, uint64_t start, ULONG length, ULON
     return STATUS_SUCCESS;
 }
 
+NTSTATUS init_decomp_cache(device_extension* Vcb) {
+    decomp_cache* dc = &Vcb->decomp_cache;
+    unsigned int i;
+
+    ExInitializeFastMutex(&dc->mutex);
+    InitializeListHead(&dc->lru);
+
+    dc->size = 0;
+    dc->max_size = (uint64_t)Vcb->options.decomp_cache_size * 1048576;
+    dc->hits = 0;
+    dc->misses = 0;
+    dc->time_saved = 0;
+    KeQueryPerformanceCounter(&dc->freq);
+
+    dc->hash = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * DECOMP_CACHE_BUCKETS, ALLOC_TAG);
+    if (!dc->hash) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < DECOMP_CACHE_BUCKETS; i++) {
+        InitializeListHead(&dc->hash[i]);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static __inline LIST_ENTRY* decomp_cache_bucket(device_extension* Vcb, uint64_t address) {
+    return &Vcb->decomp_cache.hash[(address / Vcb->superblock.sector_size) % DECOMP_CACHE_BUCKETS];
+}
+
+static void decomp_cache_free_entry(decomp_cache* dc, decomp_cache_entry* dce) {
+    RemoveEntryList(&dce->list_entry_hash);
+    RemoveEntryList(&dce->list_entry_lru);
+
+    dc->size -= dce->length;
+
+    ExFreePool(dce);
+}
+
+void flush_decomp_cache(device_extension* Vcb) {
+    decomp_cache* dc = &Vcb->decomp_cache;
+
+    if (!dc->hash)
+        return;
+
+    ExAcquireFastMutex(&dc->mutex);
+
+    while (!IsListEmpty(&dc->lru)) {
+        decomp_cache_entry* dce = CONTAINING_RECORD(dc->lru.Flink, decomp_cache_entry, list_entry_lru);
+
+        decomp_cache_free_entry(dc, dce);
+    }
+
+    ExReleaseFastMutex(&dc->mutex);
+}
+
+void free_decomp_cache(device_extension* Vcb) {
+    if (!Vcb->decomp_cache.hash)
+        return;
+
+    flush_decomp_cache(Vcb);
+
+    ExFreePool(Vcb->decomp_cache.hash);
+    Vcb->decomp_cache.hash = NULL;
+}
+
+static decomp_cache_entry* decomp_cache_find(device_extension* Vcb, uint64_t address) {
+    LIST_ENTRY* bucket = decomp_cache_bucket(Vcb, address);
+    LIST_ENTRY* le;
+
+    le = bucket->Flink;
+    while (le != bucket) {
+        decomp_cache_entry* dce = CONTAINING_RECORD(le, decomp_cache_entry, list_entry_hash);
+
+        if (dce->address == address)
+            return dce;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+// Copies part of a decompressed extent out of the cache. Extents are never rewritten in
+// place, so an entry can only be stale if its address has been freed and reused - we drop
+// entries when that happens, and the generation check is a second line of defence.
+static bool decomp_cache_get(device_extension* Vcb, uint64_t address, uint64_t generation, uint8_t* buf, uint32_t off, uint32_t len) {
+    decomp_cache* dc = &Vcb->decomp_cache;
+    decomp_cache_entry* dce;
+
+    if (dc->max_size == 0)
+        return false;
+
+    ExAcquireFastMutex(&dc->mutex);
+
+    dce = decomp_cache_find(Vcb, address);
+
+    if (!dce || dce->generation != generation || off + len > dce->length) {
+        dc->misses++;
+        ExReleaseFastMutex(&dc->mutex);
+        return false;
+    }
+
+    RtlCopyMemory(buf, dce->data + off, len);
+
+    RemoveEntryList(&dce->list_entry_lru);
+    InsertHeadList(&dc->lru, &dce->list_entry_lru);
+
+    dc->hits++;
+    dc->time_saved += dce->decomp_time;
+
+    ExReleaseFastMutex(&dc->mutex);
+
+    return true;
+}
+
+static void decomp_cache_add(device_extension* Vcb, uint64_t address, uint64_t generation, uint8_t* buf, uint32_t len, LONGLONG decomp_time) {
+    decomp_cache* dc = &Vcb->decomp_cache;
+    decomp_cache_entry *dce, *old;
+
+    if (dc->max_size < len)
+        return;
+
+    dce = ExAllocatePoolWithTag(PagedPool, offsetof(decomp_cache_entry, data[0]) + len, ALLOC_TAG);
+    if (!dce) {
+        ERR("out of memory\n");
+        return;
+    }
+
+    dce->address = address;
+    dce->generation = generation;
+    dce->length = len;
+    dce->decomp_time = decomp_time;
+    RtlCopyMemory(dce->data, buf, len);
+
+    ExAcquireFastMutex(&dc->mutex);
+
+    old = decomp_cache_find(Vcb, address);
+    if (old)
+        decomp_cache_free_entry(dc, old);
+
+    InsertTailList(decomp_cache_bucket(Vcb, address), &dce->list_entry_hash);
+    InsertHeadList(&dc->lru, &dce->list_entry_lru);
+    dc->size += len;
+
+    while (dc->size > dc->max_size) {
+        decomp_cache_entry* lru = CONTAINING_RECORD(dc->lru.Blink, decomp_cache_entry, list_entry_lru);
+
+        decomp_cache_free_entry(dc, lru);
+    }
+
+    ExReleaseFastMutex(&dc->mutex);
+}
+
+void decomp_cache_remove(device_extension* Vcb, uint64_t address) {
+    decomp_cache* dc = &Vcb->decomp_cache;
+    decomp_cache_entry* dce;
+
+    if (dc->max_size == 0)
+        return;
+
+    ExAcquireFastMutex(&dc->mutex);
+
+    dce = decomp_cache_find(Vcb, address);
+
+    if (dce)
+        decomp_cache_free_entry(dc, dce);
+
+    ExReleaseFastMutex(&dc->mutex);
+}
+
+// Reads and decompresses one extent's worth of a read_file request. This can be called
+// from the calc threads, so it mustn't touch anything that needs the caller's locks.
+NTSTATUS read_file_part(read_part* rp) {
+    NTSTATUS Status;
+    fcb* fcb = rp->fcb;
+    EXTENT_DATA* ed = &rp->ext->extent_data;
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+    uint64_t off = rp->off;
+    uint32_t read = rp->read;
+    uint32_t to_read;
+    uint8_t* buf;
+    bool mdl = (rp->Irp && rp->Irp->MdlAddress) ? true : false;
+    bool buf_free, cache = false;
+    uint32_t bumpoff = 0;
+    uint64_t addr;
+    chunk* c;
+    POOL_TYPE pool_type = fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? NonPagedPool : PagedPool;
+
+    // If we're only reading part of the extent, decompress all of it and keep it
+    // around, as it's likely we'll be asked for the rest of it soon.
+    if (ed->compression != BTRFS_COMPRESSION_NONE && pool_type == PagedPool)
+        cache = (ed2->offset + off != 0 || read < ed->decoded_size) && ed->decoded_size <= COMPRESSED_EXTENT_SIZE;
+
+    if (ed->compression == BTRFS_COMPRESSION_NONE) {
+        addr = ed2->address + ed2->offset + off;
+        to_read = (uint32_t)sector_align(read, fcb->Vcb->superblock.sector_size);
+
+        if (addr % fcb->Vcb->superblock.sector_size > 0) {
+            bumpoff = addr % fcb->Vcb->superblock.sector_size;
+            addr -= bumpoff;
+            to_read = (uint32_t)sector_align(read + bumpoff, fcb->Vcb->superblock.sector_size);
+        }
+    } else {
+        addr = ed2->address;
+        to_read = (uint32_t)sector_align(ed2->size, fcb->Vcb->superblock.sector_size);
+    }
+
+    if (rp->direct) {
+        buf = rp->data;
+        buf_free = false;
+    } else {
+        buf = ExAllocatePoolWithTag(pool_type, to_read, ALLOC_TAG);
+        buf_free = true;
+
+        if (!buf) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        mdl = false;
+    }
+
+    c = get_chunk_from_address(fcb->Vcb, addr);
+
+    if (!c) {
+        ERR("get_chunk_from_address(%I64x) failed\n", addr);
+
+        if (buf_free)
+            ExFreePool(buf);
+
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    Status = read_data(fcb->Vcb, addr, to_read, rp->csum, false, buf, c, NULL, rp->Irp, 0, mdl,
+                       fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority);
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_data returned %08x\n", Status);
+
+        if (buf_free)
+            ExFreePool(buf);
+
+        return Status;
+    }
+
+    if (ed->compression == BTRFS_COMPRESSION_NONE) {
+        if (buf_free)
+            RtlCopyMemory(rp->data, buf + bumpoff, read);
+    } else {
+        uint8_t *decomp = NULL, *buf2;
+        ULONG outlen, inlen, off2;
+        uint32_t inpageoff = 0;
+        LARGE_INTEGER time1, time2;
+
+        off2 = (ULONG)(ed2->offset + off);
+        buf2 = buf;
+        inlen = (ULONG)ed2->size;
+
+        if (ed->compression == BTRFS_COMPRESSION_LZO) {
+            ULONG inoff = sizeof(uint32_t);
+
+            inlen -= sizeof(uint32_t);
+
+            // If reading a few sectors in, skip to the interesting bit
+            while (!cache && off2 > LZO_PAGE_SIZE) {
+                uint32_t partlen;
+
+                if (inlen < sizeof(uint32_t))
+                    break;
+
+                partlen = *(uint32_t*)(buf2 + inoff);
+
+                if (partlen < inlen) {
+                    off2 -= LZO_PAGE_SIZE;
+                    inoff += partlen + sizeof(uint32_t);
+                    inlen -= partlen + sizeof(uint32_t);
+
+                    if (LZO_PAGE_SIZE - (inoff % LZO_PAGE_SIZE) < sizeof(uint32_t))
+                        inoff = ((inoff / LZO_PAGE_SIZE) + 1) * LZO_PAGE_SIZE;
+                } else
+                    break;
+            }
+
+            buf2 = &buf2[inoff];
+            inpageoff = inoff % LZO_PAGE_SIZE;
+        }
+
+        if (cache) {
+            outlen = (ULONG)ed->decoded_size;
+
+            decomp = ExAllocatePoolWithTag(pool_type, outlen, ALLOC_TAG);
+            if (!decomp) {
+                ERR("out of memory\n");
+                ExFreePool(buf);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            time1 = KeQueryPerformanceCounter(NULL);
+        } else if (off2 != 0) {
+            outlen = off2 + min(read, (uint32_t)(ed2->num_bytes - off));
+
+            decomp = ExAllocatePoolWithTag(pool_type, outlen, ALLOC_TAG);
+            if (!decomp) {
+                ERR("out of memory\n");
+                ExFreePool(buf);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+        } else
+            outlen = min(read, (uint32_t)(ed2->num_bytes - off));
+
+        if (ed->compression == BTRFS_COMPRESSION_ZLIB) {
+            Status = zlib_decompress(buf2, inlen, decomp ? decomp : rp->data, outlen);
+
+            if (!NT_SUCCESS(Status)) {
+                ERR("zlib_decompress returned %08x\n", Status);
+                ExFreePool(buf);
+
+                if (decomp)
+                    ExFreePool(decomp);
+
+                return Status;
+            }
+        } else if (ed->compression == BTRFS_COMPRESSION_LZO) {
+            Status = lzo_decompress(buf2, inlen, decomp ? decomp : rp->data, outlen, inpageoff);
+
+            if (!NT_SUCCESS(Status)) {
+                ERR("lzo_decompress returned %08x\n", Status);
+                ExFreePool(buf);
+
+                if (decomp)
+                    ExFreePool(decomp);
+
+                return Status;
+            }
+        } else if (ed->compression == BTRFS_COMPRESSION_ZSTD) {
+            Status = zstd_decompress(buf2, inlen, decomp ? decomp : rp->data, outlen);
+
+            if (!NT_SUCCESS(Status)) {
+                ERR("zstd_decompress returned %08x\n", Status);
+                ExFreePool(buf);
+
+                if (decomp)
+                    ExFreePool(decomp);
+
+                return Status;
+            }
+        } else {
+            ERR("unsupported compression type %x\n", ed->compression);
+
+            ExFreePool(buf);
+
+            if (decomp)
+                ExFreePool(decomp);
+
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        if (cache) {
+            time2 = KeQueryPerformanceCounter(NULL);
+
+            decomp_cache_add(fcb->Vcb, ed2->address, ed->generation, decomp, outlen, time2.QuadPart - time1.QuadPart);
+        }
+
+        if (decomp) {
+            RtlCopyMemory(rp->data, decomp + off2, (size_t)min(read, ed2->num_bytes - off));
+            ExFreePool(decomp);
+        }
+    }
+
+    if (buf_free)
+        ExFreePool(buf);
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULONG* pbr, PIRP Irp) {
     NTSTATUS Status;
     EXTENT_DATA* ed;
@@ -2699,9 +3052,13 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
     uint64_t last_end;
     LIST_ENTRY* le;
     POOL_TYPE pool_type;
+    LIST_ENTRY parts;
+    uint32_t num_parts = 0;
 
     TRACE("(%p, %p, %I64x, %I64x, %p)\n", fcb, data, start, length, pbr);
 
+    InitializeListHead(&parts);
+
     if (pbr)
         *pbr = 0;
 
@@ -2713,7 +3070,7 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
 
     pool_type = fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? NonPagedPool : PagedPool;
 
-    le = fcb->extents.Flink;
+    le = find_fcb_extent(fcb, start);
 
     last_end = start;
 
@@ -2844,188 +3201,57 @@ NTSTATUS read_file(fcb* fcb, uint8_t* data, uint64_t start, uint64_t length, ULO
                 case EXTENT_TYPE_REGULAR:
                 {
                     uint64_t off = start + bytes_read - ext->offset;
-                    uint32_t to_read, read;
-                    uint8_t* buf;
-                    bool mdl = (Irp && Irp->MdlAddress) ? true : false;
-                    bool buf_free;
-                    uint32_t bumpoff = 0, *csum;
-                    uint64_t addr;
-                    chunk* c;
+                    uint32_t read;
+                    read_part* rp;
 
                     read = (uint32_t)(len - off);
                     if (read > length) read = (uint32_t)length;
 
-                    if (ed->compression == BTRFS_COMPRESSION_NONE) {
-                        addr = ed2->address + ed2->offset + off;
-                        to_read = (uint32_t)sector_align(read, fcb->Vcb->superblock.sector_size);
-
-                        if (addr % fcb->Vcb->superblock.sector_size > 0) {
-                            bumpoff = addr % fcb->Vcb->superblock.sector_size;
-                            addr -= bumpoff;
-                            to_read = (uint32_t)sector_align(read + bumpoff, fcb->Vcb->superblock.sector_size);
-                        }
-                    } else {
-                        addr = ed2->address;
-                        to_read = (uint32_t)sector_align(ed2->size, fcb->Vcb->superblock.sector_size);
-                    }
-
-                    if (ed->compression == BTRFS_COMPRESSION_NONE && start % fcb->Vcb->superblock.sector_size == 0 &&
-                        length % fcb->Vcb->superblock.sector_size == 0) {
-                        buf = data + bytes_read;
-                        buf_free = false;
-                    } else {
-                        buf = ExAllocatePoolWithTag(pool_type, to_read, ALLOC_TAG);
-                        buf_free = true;
-
-                        if (!buf) {
-                            ERR("out of memory\n");
-                            Status = STATUS_INSUFFICIENT_RESOURCES;
-                            goto exit;
-                        }
-
-                        mdl = false;
+                    if (ed->compression != BTRFS_COMPRESSION_NONE && pool_type == PagedPool &&
+                        decomp_cache_get(fcb->Vcb, ed2->address, ed->generation, data + bytes_read, (uint32_t)(ed2->offset + off), read)) {
+                        bytes_read += read;
+                        length -= read;
+                        break;
                     }
 
-                    c = get_chunk_from_address(fcb->Vcb, addr);
-
-                    if (!c) {
-                        ERR("get_chunk_from_address(%I64x) failed\n", addr);
-
-                        if (buf_free)
-                            ExFreePool(buf);
-
+                    // This has to happen here rather than in read_file_part, as we might need tree_lock.
+                    Status = load_extent_csum(fcb->Vcb, fcb, ext, Irp);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("load_extent_csum returned %08x\n", Status);
                         goto exit;
                     }
 
-                    if (ext->csum) {
-                        if (ed->compression == BTRFS_COMPRESSION_NONE)
-                            csum = &ext->csum[off / fcb->Vcb->superblock.sector_size];
-                        else
-                            csum = ext->csum;
-                    } else
-                        csum = NULL;
-
-                    Status = read_data(fcb->Vcb, addr, to_read, csum, false, buf, c, NULL, Irp, 0, mdl,
-                                       fcb && fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("read_data returned %08x\n", Status);
-
-                        if (buf_free)
-                            ExFreePool(buf);
-
+                    rp = ExAllocatePoolWithTag(pool_type, sizeof(read_part), ALLOC_TAG);
+                    if (!rp) {
+                        ERR("out of memory\n");
+                        Status = STATUS_INSUFFICIENT_RESOURCES;
                         goto exit;
                     }
 
-                    if (ed->compression == BTRFS_COMPRESSION_NONE) {
-                        if (buf_free)
-                            RtlCopyMemory(data + bytes_read, buf + bumpoff, read);
-                    } else {
-                        uint8_t *decomp = NULL, *buf2;
-                        ULONG outlen, inlen, off2;
-                        uint32_t inpageoff = 0;
-
-                        off2 = (ULONG)(ed2->offset + off);
-                        buf2 = buf;
-                        inlen = (ULONG)ed2->size;
-
-                        if (ed->compression == BTRFS_COMPRESSION_LZO) {
-                            ULONG inoff = sizeof(uint32_t);
-
-                            inlen -= sizeof(uint32_t);
-
-                            // If reading a few sectors in, skip to the interesting bit
-                            while (off2 > LZO_PAGE_SIZE) {
-                                uint32_t partlen;
-
-                                if (inlen < sizeof(uint32_t))
-                                    break;
-
-                                partlen = *(uint32_t*)(buf2 + inoff);
-
-                                if (partlen < inlen) {
-                                    off2 -= LZO_PAGE_SIZE;
-                                    inoff += partlen + sizeof(uint32_t);
-                                    inlen -= partlen + sizeof(uint32_t);
-
-                                    if (LZO_PAGE_SIZE - (inoff % LZO_PAGE_SIZE) < sizeof(uint32_t))
-                                        inoff = ((inoff / LZO_PAGE_SIZE) + 1) * LZO_PAGE_SIZE;
-                                } else
-                                    break;
-                            }
-
-                            buf2 = &buf2[inoff];
-                            inpageoff = inoff % LZO_PAGE_SIZE;
-                        }
-
-                        if (off2 != 0) {
-                            outlen = off2 + min(read, (uint32_t)(ed2->num_bytes - off));
-
-                            decomp = ExAllocatePoolWithTag(pool_type, outlen, ALLOC_TAG);
-                            if (!decomp) {
-                                ERR("out of memory\n");
-                                ExFreePool(buf);
-                                Status = STATUS_INSUFFICIENT_RESOURCES;
-                                goto exit;
-                            }
-                        } else
-                            outlen = min(read, (uint32_t)(ed2->num_bytes - off));
-
-                        if (ed->compression == BTRFS_COMPRESSION_ZLIB) {
-                            Status = zlib_decompress(buf2, inlen, decomp ? decomp : (data + bytes_read), outlen);
-
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("zlib_decompress returned %08x\n", Status);
-                                ExFreePool(buf);
-
-                                if (decomp)
-                                    ExFreePool(decomp);
-
-                                goto exit;
-                            }
-                        } else if (ed->compression == BTRFS_COMPRESSION_LZO) {
-                            Status = lzo_decompress(buf2, inlen, decomp ? decomp : (data + bytes_read), outlen, inpageoff);
-
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("lzo_decompress returned %08x\n", Status);
-                                ExFreePool(buf);
-
-                                if (decomp)
-                                    ExFreePool(decomp);
-
-                                goto exit;
-                            }
-                        } else if (ed->compression == BTRFS_COMPRESSION_ZSTD) {
-                            Status = zstd_decompress(buf2, inlen, decomp ? decomp : (data + bytes_read), outlen);
-
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("zstd_decompress returned %08x\n", Status);
-                                ExFreePool(buf);
-
-                                if (decomp)
-                                    ExFreePool(decomp);
-
-                                goto exit;
-                            }
-                        } else {
-                            ERR("unsupported compression type %x\n", ed->compression);
-                            Status = STATUS_NOT_SUPPORTED;
-
-                            ExFreePool(buf);
+                    rp->fcb = fcb;
+                    rp->ext = ext;
+                    rp->off = off;
+                    rp->read = read;
+                    rp->data = data + bytes_read;
+                    rp->Irp = Irp;
 
-                            if (decomp)
-                                ExFreePool(decomp);
+                    // We can read straight into the destination if we're not going to overrun it.
+                    rp->direct = ed->compression == BTRFS_COMPRESSION_NONE && start % fcb->Vcb->superblock.sector_size == 0 &&
+                                 length % fcb->Vcb->superblock.sector_size == 0 && read % fcb->Vcb->superblock.sector_size == 0 &&
+                                 (ed2->address + ed2->offset + off) % fcb->Vcb->superblock.sector_size == 0;
 
-                            goto exit;
-                        }
+                    if (ext->csum) {
+                        ext->csum_used = true;
 
-                        if (decomp) {
-                            RtlCopyMemory(data + bytes_read, decomp + off2, (size_t)min(read, ed2->num_bytes - off));
-                            ExFreePool(decomp);
-                        }
-                    }
+                        if (ed->compression == BTRFS_COMPRESSION_NONE)
+                            rp->csum = (uint8_t*)ext->csum + ((off / fcb->Vcb->superblock.sector_size) * fcb->Vcb->csum_size);
+                        else
+                            rp->csum = ext->csum;
+                    } else
+                        rp->csum = NULL;
 
-                    if (buf_free)
-                        ExFreePool(buf);
+                    InsertTailList(&parts, &rp->list_entry);
+                    num_parts++;
 
                     bytes_read += read;
                     length -= read;
@@ -3073,14 +3299,130 @@ nextitem:
         length -= read;
     }
 
+    // Now read everything that has to come off the disk. If there's more than one extent,
+    // we hand them to the calc threads so that the reads overlap - but not for the paging
+    // file, and not if we've been given a user-mode buffer, which only we can see.
+    if (num_parts > 1 && pool_type == PagedPool && (ULONG_PTR)data >= (ULONG_PTR)MM_SYSTEM_RANGE_START) {
+        read_part** rps;
+        uint32_t i = 0;
+
+        rps = ExAllocatePoolWithTag(PagedPool, sizeof(read_part*) * num_parts, ALLOC_TAG);
+        if (!rps) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+
+        le = parts.Flink;
+        while (le != &parts) {
+            rps[i] = CONTAINING_RECORD(le, read_part, list_entry);
+            i++;
+
+            le = le->Flink;
+        }
+
+        Status = do_calc_job_read(fcb->Vcb, rps, num_parts);
+
+        ExFreePool(rps);
+
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_calc_job_read returned %08x\n", Status);
+            goto exit;
+        }
+    } else {
+        le = parts.Flink;
+        while (le != &parts) {
+            read_part* rp = CONTAINING_RECORD(le, read_part, list_entry);
+
+            Status = read_file_part(rp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("read_file_part returned %08x\n", Status);
+                goto exit;
+            }
+
+            le = le->Flink;
+        }
+    }
+
     Status = STATUS_SUCCESS;
     if (pbr)
         *pbr = bytes_read;
 
 exit:
+    while (!IsListEmpty(&parts)) {
+        read_part* rp = CONTAINING_RECORD(RemoveHeadList(&parts), read_part, list_entry);
+
+        ExFreePool(rp);
+    }
+
     return Status;
 }
 
+// Adjusts how far ahead the Cache Manager reads for this file object, according to how it's
+// being read. Each read which carries on from where the last one finished doubles the
+// read-ahead granularity, up to the MaxReadAhead option, and each one which doesn't halves
+// it. If that takes it below the default, we turn read-ahead off altogether until the
+// next sequential read, as it would only be evicting useful pages.
+void update_read_ahead(PFILE_OBJECT FileObject, uint64_t start, ULONG length) {
+    fcb* fcb = FileObject->FsContext;
+    ccb* ccb = FileObject->FsContext2;
+    uint64_t max_size;
+    ULONG window, max_window;
+
+    if (!fcb || !ccb || !FileObject->PrivateCacheMap || fcb->Vcb->options.max_read_ahead == 0)
+        return;
+
+    // Reads on the same handle can come in at the same time, through fast I/O and IRPs. If
+    // someone else is already updating the window, just skip this one - it's only a guess anyway.
+    if (InterlockedCompareExchange(&ccb->read_ahead_busy, 1, 0) != 0)
+        return;
+
+    // leave alone anything opened with FILE_RANDOM_ACCESS
+    if (FileObject->Flags & FO_RANDOM_ACCESS && !ccb->read_ahead_disabled) {
+        InterlockedExchange(&ccb->read_ahead_busy, 0);
+        return;
+    }
+
+    // the granularity has to be a power of two
+    max_size = (uint64_t)min(fcb->Vcb->options.max_read_ahead, 1024) * 1048576;
+    max_window = READ_AHEAD_GRANULARITY;
+
+    while (max_window * 2 <= max_size) {
+        max_window *= 2;
+    }
+
+    window = ccb->read_ahead_window;
+
+    if (window == 0) // first read
+        window = READ_AHEAD_GRANULARITY;
+    else if (start == ccb->read_ahead_next) {
+        if (ccb->read_ahead_disabled) {
+            InterlockedAnd((LONG*)&FileObject->Flags, ~FO_RANDOM_ACCESS);
+            ccb->read_ahead_disabled = false;
+            window = READ_AHEAD_GRANULARITY;
+        } else if (window < max_window)
+            window *= 2;
+    } else if (!ccb->read_ahead_disabled) {
+        if (window > READ_AHEAD_GRANULARITY)
+            window /= 2;
+        else {
+            InterlockedOr((LONG*)&FileObject->Flags, FO_RANDOM_ACCESS);
+            ccb->read_ahead_disabled = true;
+        }
+    }
+
+    window = min(window, max_window);
+
+    if (window != ccb->read_ahead_window) {
+        CcSetReadAheadGranularity(FileObject, window);
+        ccb->read_ahead_window = window;
+    }
+
+    ccb->read_ahead_next = start + length;
+
+    InterlockedExchange(&ccb->read_ahead_busy, 0);
+}
+
 NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
     PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
     PFILE_OBJECT FileObject = IrpSp->FileObject;
@@ -3154,6 +3496,8 @@ NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
                 init_file_cache(FileObject, &ccfs);
             }
 
+            update_read_ahead(FileObject, start, length);
+
             if (IrpSp->MinorFunction & IRP_MN_MDL) {
                 CcMdlRead(FileObject,&IrpSp->Parameters.Read.ByteOffset, length, &Irp->MdlAddress, &Irp->IoStatus);
             } else {
@@ -3228,6 +3572,49 @@ NTSTATUS do_read(PIRP Irp, bool wait, ULONG* bytes_read) {
     }
 }
 
+// Acquires the FCB lock for a read. If any of the file's checksums haven't been
+// loaded yet, read_file would need tree_lock to look them up, which has to be
+// acquired before the FCB lock, as flushing does it that way round. Rather than
+// holding it for the whole read, we load the checksums now and let it go again -
+// *acquired_tree_lock is only set if that failed and the caller has to release it.
+bool acquire_fcb_for_read(fcb* fcb, bool wait, bool* acquired_tree_lock) {
+    device_extension* Vcb = fcb->Vcb;
+
+    *acquired_tree_lock = false;
+
+    while (true) {
+        if (fcb->csums_unloaded && !ExIsResourceAcquiredSharedLite(&Vcb->tree_lock)) {
+            if (!ExAcquireResourceSharedLite(&Vcb->tree_lock, wait))
+                return false;
+
+            if (!ExAcquireResourceExclusiveLite(fcb->Header.Resource, wait)) {
+                ExReleaseResourceLite(&Vcb->tree_lock);
+                return false;
+            }
+
+            fcb_load_csums(Vcb, fcb, NULL);
+
+            ExConvertExclusiveToSharedLite(fcb->Header.Resource);
+
+            // csums_unloaded only gets set with the FCB lock held exclusively, so it can't change now
+            if (fcb->csums_unloaded)
+                *acquired_tree_lock = true;
+            else
+                ExReleaseResourceLite(&Vcb->tree_lock);
+
+            return true;
+        }
+
+        if (!ExAcquireResourceSharedLite(fcb->Header.Resource, wait))
+            return false;
+
+        if (!fcb->csums_unloaded || ExIsResourceAcquiredSharedLite(&Vcb->tree_lock))
+            return true;
+
+        ExReleaseResourceLite(fcb->Header.Resource);
+    }
+}
+
 _Dispatch_type_(IRP_MJ_READ)
 _Function_class_(DRIVER_DISPATCH)
 NTSTATUS __stdcall drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
@@ -3239,7 +3626,7 @@ NTSTATUS __stdcall drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     bool top_level;
     fcb* fcb;
     ccb* ccb;
-    bool acquired_fcb_lock = false, wait;
+    bool acquired_fcb_lock = false, acquired_tree_lock = false, wait;
 
     FsRtlEnterFileSystem();
 
@@ -3316,7 +3703,7 @@ NTSTATUS __stdcall drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     }
 
     if (!ExIsResourceAcquiredSharedLite(fcb->Header.Resource)) {
-        if (!ExAcquireResourceSharedLite(fcb->Header.Resource, wait)) {
+        if (!acquire_fcb_for_read(fcb, wait, &acquired_tree_lock)) {
             Status = STATUS_PENDING;
             IoMarkIrpPending(Irp);
             goto exit;
@@ -3330,6 +3717,9 @@ NTSTATUS __stdcall drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     if (acquired_fcb_lock)
         ExReleaseResourceLite(fcb->Header.Resource);
 
+    if (acquired_tree_lock)
+        ExReleaseResourceLite(&Vcb->tree_lock);
+
 exit:
     if (FileObject->Flags & FO_SYNCHRONOUS_IO && !(Irp->Flags & IRP_PAGING_IO))
         FileObject->CurrentByteOffset.QuadPart = IrpSp->Parameters.Read.ByteOffset.QuadPart + (NT_SUCCESS(Status) ? bytes_read : 0);
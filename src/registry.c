@@ -37,7 +37,8 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     BTRFS_UUID* uuid = &Vcb->superblock.uuid;
     mount_options* options = &Vcb->options;
     UNICODE_STRING path, ignoreus, compressus, compressforceus, compresstypeus, readonlyus, zliblevelus, flushintervalus,
-                   maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, allowdegradedus, zstdlevelus;
+                   maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, allowdegradedus, zstdlevelus, nodecachesizeus,
+                   decompcachesizeus, lzolevelus, maxreadaheadus, dirtyinodelimitus, dirtyextentlimitus, maxwritedelayus;
     OBJECT_ATTRIBUTES oa;
     NTSTATUS Status;
     ULONG i, j, kvfilen, index, retlen;
@@ -50,8 +51,15 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     options->readonly = mount_readonly;
     options->zlib_level = mount_zlib_level;
     options->zstd_level = mount_zstd_level;
+    options->lzo_level = mount_lzo_level;
     options->flush_interval = mount_flush_interval;
     options->max_inline = min(mount_max_inline, Vcb->superblock.node_size - sizeof(tree_header) - sizeof(leaf_node) - sizeof(EXTENT_DATA) + 1);
+    options->node_cache_size = mount_node_cache_size;
+    options->decomp_cache_size = mount_decomp_cache_size;
+    options->max_read_ahead = mount_max_read_ahead;
+    options->dirty_inode_limit = mount_dirty_inode_limit;
+    options->dirty_extent_limit = mount_dirty_extent_limit;
+    options->max_write_delay = mount_max_write_delay;
     options->skip_balance = mount_skip_balance;
     options->no_barrier = mount_no_barrier;
     options->no_trim = mount_no_trim;
@@ -121,6 +129,13 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     RtlInitUnicodeString(&clearcacheus, L"ClearCache");
     RtlInitUnicodeString(&allowdegradedus, L"AllowDegraded");
     RtlInitUnicodeString(&zstdlevelus, L"ZstdLevel");
+    RtlInitUnicodeString(&nodecachesizeus, L"NodeCacheSize");
+    RtlInitUnicodeString(&decompcachesizeus, L"DecompressionCacheSize");
+    RtlInitUnicodeString(&lzolevelus, L"LzoLevel");
+    RtlInitUnicodeString(&maxreadaheadus, L"MaxReadAhead");
+    RtlInitUnicodeString(&dirtyinodelimitus, L"DirtyInodeLimit");
+    RtlInitUnicodeString(&dirtyextentlimitus, L"DirtyExtentLimit");
+    RtlInitUnicodeString(&maxwritedelayus, L"MaxWriteDelay");
 
     do {
         Status = ZwEnumerateValueKey(h, index, KeyValueFullInformation, kvfi, kvfilen, &retlen);
@@ -193,6 +208,34 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
                 DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
 
                 options->zstd_level = *val;
+            } else if (FsRtlAreNamesEqual(&nodecachesizeus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->node_cache_size = *val;
+            } else if (FsRtlAreNamesEqual(&decompcachesizeus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->decomp_cache_size = *val;
+            } else if (FsRtlAreNamesEqual(&lzolevelus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->lzo_level = *val;
+            } else if (FsRtlAreNamesEqual(&maxreadaheadus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->max_read_ahead = *val;
+            } else if (FsRtlAreNamesEqual(&dirtyinodelimitus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->dirty_inode_limit = *val;
+            } else if (FsRtlAreNamesEqual(&dirtyextentlimitus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->dirty_extent_limit = *val;
+            } else if (FsRtlAreNamesEqual(&maxwritedelayus, &us, true, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((uint8_t*)kvfi + kvfi->DataOffset);
+
+                options->max_write_delay = *val;
             }
         } else if (Status != STATUS_NO_MORE_ENTRIES) {
             ERR("ZwEnumerateValueKey returned %08x\n", Status);
@@ -209,6 +252,11 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     if (options->zstd_level > (uint32_t)ZSTD_maxCLevel())
         options->zstd_level = ZSTD_maxCLevel();
 
+    if (options->lzo_level < 1)
+        options->lzo_level = 1;
+    else if (options->lzo_level > 9)
+        options->lzo_level = 9;
+
     if (options->flush_interval == 0)
         options->flush_interval = mount_flush_interval;
 
@@ -805,6 +853,13 @@ void read_registry(PUNICODE_STRING regpath, bool refresh) {
     get_registry_value(h, L"AllowDegraded", REG_DWORD, &mount_allow_degraded, sizeof(mount_allow_degraded));
     get_registry_value(h, L"Readonly", REG_DWORD, &mount_readonly, sizeof(mount_readonly));
     get_registry_value(h, L"ZstdLevel", REG_DWORD, &mount_zstd_level, sizeof(mount_zstd_level));
+    get_registry_value(h, L"NodeCacheSize", REG_DWORD, &mount_node_cache_size, sizeof(mount_node_cache_size));
+    get_registry_value(h, L"DecompressionCacheSize", REG_DWORD, &mount_decomp_cache_size, sizeof(mount_decomp_cache_size));
+    get_registry_value(h, L"LzoLevel", REG_DWORD, &mount_lzo_level, sizeof(mount_lzo_level));
+    get_registry_value(h, L"MaxReadAhead", REG_DWORD, &mount_max_read_ahead, sizeof(mount_max_read_ahead));
+    get_registry_value(h, L"DirtyInodeLimit", REG_DWORD, &mount_dirty_inode_limit, sizeof(mount_dirty_inode_limit));
+    get_registry_value(h, L"DirtyExtentLimit", REG_DWORD, &mount_dirty_extent_limit, sizeof(mount_dirty_extent_limit));
+    get_registry_value(h, L"MaxWriteDelay", REG_DWORD, &mount_max_write_delay, sizeof(mount_max_write_delay));
 
     if (!refresh)
         get_registry_value(h, L"NoPNP", REG_DWORD, &no_pnp, sizeof(no_pnp));
@@ -29,7 +29,7 @@ typedef struct {
     IO_STATUS_BLOCK iosb;
     uint8_t* buf;
     bool csum_error;
-    uint32_t* bad_csums;
+    void* bad_csums;
 } scrub_context_stripe;
 
 typedef struct _scrub_context {
@@ -664,7 +664,7 @@ static NTSTATUS __stdcall scrub_read_completion(PDEVICE_OBJECT DeviceObject, PIR
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
-static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offset, uint32_t* csum, scrub_context* context) {
+static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offset, void* csum, scrub_context* context) {
     NTSTATUS Status;
     bool csum_error = false;
     ULONG i;
@@ -718,9 +718,8 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
                 } else {
                     for (j = 0; j < context->stripes[i].length / Vcb->superblock.node_size; j++) {
                         tree_header* th = (tree_header*)&context->stripes[i].buf[j * Vcb->superblock.node_size];
-                        uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-                        if (crc32 != *((uint32_t*)th->csum) || th->address != offset + UInt32x32To64(j, Vcb->superblock.node_size)) {
+                        if (!check_tree_checksum(Vcb, th) || th->address != offset + UInt32x32To64(j, Vcb->superblock.node_size)) {
                             context->stripes[i].csum_error = true;
                             csum_error = true;
                             log_device_error(Vcb, c->devices[i], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
@@ -742,7 +741,7 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
     for (i = 0; i < c->chunk_item->num_stripes; i++) {
         if (context->stripes[i].csum_error) {
             if (csum) {
-                context->stripes[i].bad_csums = ExAllocatePoolWithTag(PagedPool, context->stripes[i].length * sizeof(uint32_t) / Vcb->superblock.sector_size, ALLOC_TAG);
+                context->stripes[i].bad_csums = ExAllocatePoolWithTag(PagedPool, context->stripes[i].length * Vcb->csum_size / Vcb->superblock.sector_size, ALLOC_TAG);
                 if (!context->stripes[i].bad_csums) {
                     ERR("out of memory\n");
                     return STATUS_INSUFFICIENT_RESOURCES;
@@ -756,7 +755,7 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
             } else {
                 ULONG j;
 
-                context->stripes[i].bad_csums = ExAllocatePoolWithTag(PagedPool, context->stripes[i].length * sizeof(uint32_t) / Vcb->superblock.node_size, ALLOC_TAG);
+                context->stripes[i].bad_csums = ExAllocatePoolWithTag(PagedPool, context->stripes[i].length * Vcb->csum_size / Vcb->superblock.node_size, ALLOC_TAG);
                 if (!context->stripes[i].bad_csums) {
                     ERR("out of memory\n");
                     return STATUS_INSUFFICIENT_RESOURCES;
@@ -764,9 +763,8 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
 
                 for (j = 0; j < context->stripes[i].length / Vcb->superblock.node_size; j++) {
                     tree_header* th = (tree_header*)&context->stripes[i].buf[j * Vcb->superblock.node_size];
-                    uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-                    context->stripes[i].bad_csums[j] = crc32;
+                    get_tree_checksum(Vcb, th, (uint8_t*)context->stripes[i].bad_csums + (j * Vcb->csum_size));
                 }
             }
         }
@@ -791,7 +789,7 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
 
                     if (csum) {
                         for (j = 0; j < context->stripes[i].length / Vcb->superblock.sector_size; j++) {
-                            if (context->stripes[i].bad_csums[j] != csum[j]) {
+                            if (RtlCompareMemory((uint8_t*)context->stripes[i].bad_csums + (j * Vcb->csum_size), (uint8_t*)csum + (j * Vcb->csum_size), Vcb->csum_size) != Vcb->csum_size) {
                                 uint64_t addr = offset + UInt32x32To64(j, Vcb->superblock.sector_size);
 
                                 log_error(Vcb, addr, c->devices[i]->devitem.dev_id, false, true, false);
@@ -803,7 +801,7 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
                             tree_header* th = (tree_header*)&context->stripes[i].buf[j * Vcb->superblock.node_size];
                             uint64_t addr = offset + UInt32x32To64(j, Vcb->superblock.node_size);
 
-                            if (context->stripes[i].bad_csums[j] != *((uint32_t*)th->csum) || th->address != addr) {
+                            if (RtlCompareMemory((uint8_t*)context->stripes[i].bad_csums + (j * Vcb->csum_size), th->csum, Vcb->csum_size) != Vcb->csum_size || th->address != addr) {
                                 log_error(Vcb, addr, c->devices[i]->devitem.dev_id, true, true, false);
                                 log_device_error(Vcb, c->devices[i], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
                             }
@@ -838,13 +836,13 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
             if (c->devices[i]->devobj) {
                 if (csum) {
                     for (j = 0; j < context->stripes[i].length / Vcb->superblock.sector_size; j++) {
-                        if (context->stripes[i].bad_csums[j] != csum[j]) {
+                        if (RtlCompareMemory((uint8_t*)context->stripes[i].bad_csums + (j * Vcb->csum_size), (uint8_t*)csum + (j * Vcb->csum_size), Vcb->csum_size) != Vcb->csum_size) {
                             ULONG k;
                             uint64_t addr = offset + UInt32x32To64(j, Vcb->superblock.sector_size);
                             bool recovered = false;
 
                             for (k = 0; k < c->chunk_item->num_stripes; k++) {
-                                if (i != k && c->devices[k]->devobj && context->stripes[k].bad_csums[j] == csum[j]) {
+                                if (i != k && c->devices[k]->devobj && RtlCompareMemory((uint8_t*)context->stripes[k].bad_csums + (j * Vcb->csum_size), (uint8_t*)csum + (j * Vcb->csum_size), Vcb->csum_size) == Vcb->csum_size) {
                                     log_error(Vcb, addr, c->devices[i]->devitem.dev_id, false, true, false);
                                     log_device_error(Vcb, c->devices[i], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
 
@@ -867,7 +865,7 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
                         tree_header* th = (tree_header*)&context->stripes[i].buf[j * Vcb->superblock.node_size];
                         uint64_t addr = offset + UInt32x32To64(j, Vcb->superblock.node_size);
 
-                        if (context->stripes[i].bad_csums[j] != *((uint32_t*)th->csum) || th->address != addr) {
+                        if (RtlCompareMemory((uint8_t*)context->stripes[i].bad_csums + (j * Vcb->csum_size), th->csum, Vcb->csum_size) != Vcb->csum_size || th->address != addr) {
                             ULONG k;
                             bool recovered = false;
 
@@ -875,7 +873,7 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
                                 if (i != k && c->devices[k]->devobj) {
                                     tree_header* th2 = (tree_header*)&context->stripes[k].buf[j * Vcb->superblock.node_size];
 
-                                    if (context->stripes[k].bad_csums[j] == *((uint32_t*)th2->csum) && th2->address == addr) {
+                                    if (RtlCompareMemory((uint8_t*)context->stripes[k].bad_csums + (j * Vcb->csum_size), th2->csum, Vcb->csum_size) == Vcb->csum_size && th2->address == addr) {
                                         log_error(Vcb, addr, c->devices[i]->devitem.dev_id, true, true, false);
                                         log_device_error(Vcb, c->devices[i], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
 
@@ -920,7 +918,7 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
 
             if (csum) {
                 for (j = 0; j < context->stripes[i].length / Vcb->superblock.sector_size; j++) {
-                    if (context->stripes[i].bad_csums[j] != csum[j]) {
+                    if (RtlCompareMemory((uint8_t*)context->stripes[i].bad_csums + (j * Vcb->csum_size), (uint8_t*)csum + (j * Vcb->csum_size), Vcb->csum_size) != Vcb->csum_size) {
                         uint64_t addr = offset + UInt32x32To64(j, Vcb->superblock.sector_size);
 
                         log_error(Vcb, addr, c->devices[i]->devitem.dev_id, false, false, false);
@@ -931,7 +929,7 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
                     tree_header* th = (tree_header*)&context->stripes[i].buf[j * Vcb->superblock.node_size];
                     uint64_t addr = offset + UInt32x32To64(j, Vcb->superblock.node_size);
 
-                    if (context->stripes[i].bad_csums[j] != *((uint32_t*)th->csum) || th->address != addr)
+                    if (RtlCompareMemory((uint8_t*)context->stripes[i].bad_csums + (j * Vcb->csum_size), th->csum, Vcb->csum_size) != Vcb->csum_size || th->address != addr)
                         log_error(Vcb, addr, c->devices[i]->devitem.dev_id, true, false, false);
                 }
             }
@@ -941,7 +939,7 @@ static NTSTATUS scrub_extent_dup(device_extension* Vcb, chunk* c, uint64_t offse
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS scrub_extent_raid0(device_extension* Vcb, chunk* c, uint64_t offset, uint32_t length, uint16_t startoffstripe, uint32_t* csum, scrub_context* context) {
+static NTSTATUS scrub_extent_raid0(device_extension* Vcb, chunk* c, uint64_t offset, uint32_t length, uint16_t startoffstripe, void* csum, scrub_context* context) {
     ULONG j;
     uint16_t stripe;
     uint32_t pos, *stripeoff;
@@ -966,9 +964,7 @@ static NTSTATUS scrub_extent_raid0(device_extension* Vcb, chunk* c, uint64_t off
 
         if (csum) {
             for (j = 0; j < readlen; j += Vcb->superblock.sector_size) {
-                uint32_t crc32 = ~calc_crc32c(0xffffffff, context->stripes[stripe].buf + stripeoff[stripe], Vcb->superblock.sector_size);
-
-                if (crc32 != csum[pos / Vcb->superblock.sector_size]) {
+                if (!check_sector_csum(Vcb, context->stripes[stripe].buf + stripeoff[stripe], (uint8_t*)csum + ((pos / Vcb->superblock.sector_size) * Vcb->csum_size))) {
                     uint64_t addr = offset + pos;
 
                     log_error(Vcb, addr, c->devices[stripe]->devitem.dev_id, false, false, false);
@@ -981,10 +977,9 @@ static NTSTATUS scrub_extent_raid0(device_extension* Vcb, chunk* c, uint64_t off
         } else {
             for (j = 0; j < readlen; j += Vcb->superblock.node_size) {
                 tree_header* th = (tree_header*)(context->stripes[stripe].buf + stripeoff[stripe]);
-                uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
                 uint64_t addr = offset + pos;
 
-                if (crc32 != *((uint32_t*)th->csum) || th->address != addr) {
+                if (!check_tree_checksum(Vcb, th) || th->address != addr) {
                     log_error(Vcb, addr, c->devices[stripe]->devitem.dev_id, true, false, false);
                     log_device_error(Vcb, c->devices[stripe], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
                 }
@@ -1002,7 +997,7 @@ static NTSTATUS scrub_extent_raid0(device_extension* Vcb, chunk* c, uint64_t off
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t offset, uint32_t length, uint16_t startoffstripe, uint32_t* csum, scrub_context* context) {
+static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t offset, uint32_t length, uint16_t startoffstripe, void* csum, scrub_context* context) {
     ULONG j;
     uint16_t stripe, sub_stripes = max(c->chunk_item->sub_stripes, 1);
     uint32_t pos, *stripeoff;
@@ -1045,9 +1040,7 @@ static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t of
                         }
                     } else {
                         for (j = 0; j < readlen; j += Vcb->superblock.sector_size) {
-                            uint32_t crc32 = ~calc_crc32c(0xffffffff, context->stripes[(stripe * sub_stripes) + k].buf + stripeoff[stripe] + j, Vcb->superblock.sector_size);
-
-                            if (crc32 != csum[(pos + j) / Vcb->superblock.sector_size]) {
+                            if (!check_sector_csum(Vcb, context->stripes[(stripe * sub_stripes) + k].buf + stripeoff[stripe] + j, (uint8_t*)csum + (((pos + j) / Vcb->superblock.sector_size) * Vcb->csum_size))) {
                                 csum_error = true;
                                 context->stripes[(stripe * sub_stripes) + k].csum_error = true;
                                 log_device_error(Vcb, c->devices[(stripe * sub_stripes) + k], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
@@ -1081,10 +1074,9 @@ static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t of
                     } else {
                         for (j = 0; j < readlen; j += Vcb->superblock.node_size) {
                             tree_header* th = (tree_header*)(context->stripes[(stripe * sub_stripes) + k].buf + stripeoff[stripe] + j);
-                            uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
                             uint64_t addr = offset + pos + j;
 
-                            if (crc32 != *((uint32_t*)th->csum) || th->address != addr) {
+                            if (!check_tree_checksum(Vcb, th) || th->address != addr) {
                                 csum_error = true;
                                 context->stripes[(stripe * sub_stripes) + k].csum_error = true;
                                 log_device_error(Vcb, c->devices[(stripe * sub_stripes) + k], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
@@ -1213,7 +1205,7 @@ static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t of
                 if (csum) {
                     for (k = 0; k < sub_stripes; k++) {
                         if (c->devices[j + k]->devobj) {
-                            context->stripes[j + k].bad_csums = ExAllocatePoolWithTag(PagedPool, context->stripes[j + k].length * sizeof(uint32_t) / Vcb->superblock.sector_size, ALLOC_TAG);
+                            context->stripes[j + k].bad_csums = ExAllocatePoolWithTag(PagedPool, context->stripes[j + k].length * Vcb->csum_size / Vcb->superblock.sector_size, ALLOC_TAG);
                             if (!context->stripes[j + k].bad_csums) {
                                 ERR("out of memory\n");
                                 Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -1232,7 +1224,7 @@ static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t of
                         if (c->devices[j + k]->devobj) {
                             ULONG l;
 
-                            context->stripes[j + k].bad_csums = ExAllocatePoolWithTag(PagedPool, context->stripes[j + k].length * sizeof(uint32_t) / Vcb->superblock.node_size, ALLOC_TAG);
+                            context->stripes[j + k].bad_csums = ExAllocatePoolWithTag(PagedPool, context->stripes[j + k].length * Vcb->csum_size / Vcb->superblock.node_size, ALLOC_TAG);
                             if (!context->stripes[j + k].bad_csums) {
                                 ERR("out of memory\n");
                                 Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -1241,9 +1233,8 @@ static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t of
 
                             for (l = 0; l < context->stripes[j + k].length / Vcb->superblock.node_size; l++) {
                                 tree_header* th = (tree_header*)&context->stripes[j + k].buf[l * Vcb->superblock.node_size];
-                                uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-                                context->stripes[j + k].bad_csums[l] = crc32;
+                                get_tree_checksum(Vcb, th, (uint8_t*)context->stripes[j + k].bad_csums + (l * Vcb->csum_size));
                             }
                         }
                     }
@@ -1266,13 +1257,13 @@ static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t of
 
                         if (csum) {
                             for (l = 0; l < readlen; l += Vcb->superblock.sector_size) {
-                                uint32_t crc32 = csum[pos / Vcb->superblock.sector_size];
+                                uint8_t* sector_csum = (uint8_t*)csum + ((pos / Vcb->superblock.sector_size) * Vcb->csum_size);
                                 bool has_error = false;
 
                                 goodstripe = 0xffffffff;
                                 for (k = 0; k < sub_stripes; k++) {
                                     if (c->devices[j + k]->devobj) {
-                                        if (context->stripes[j + k].bad_csums[so / Vcb->superblock.sector_size] != crc32)
+                                        if (RtlCompareMemory((uint8_t*)context->stripes[j + k].bad_csums + ((so / Vcb->superblock.sector_size) * Vcb->csum_size), sector_csum, Vcb->csum_size) != Vcb->csum_size)
                                             has_error = true;
                                         else
                                             goodstripe = k;
@@ -1282,7 +1273,7 @@ static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t of
                                 if (has_error) {
                                     if (goodstripe != 0xffffffff) {
                                         for (k = 0; k < sub_stripes; k++) {
-                                            if (c->devices[j + k]->devobj && context->stripes[j + k].bad_csums[so / Vcb->superblock.sector_size] != crc32) {
+                                            if (c->devices[j + k]->devobj && RtlCompareMemory((uint8_t*)context->stripes[j + k].bad_csums + ((so / Vcb->superblock.sector_size) * Vcb->csum_size), sector_csum, Vcb->csum_size) != Vcb->csum_size) {
                                                 uint64_t addr = offset + pos;
 
                                                 log_error(Vcb, addr, c->devices[j + k]->devitem.dev_id, false, true, false);
@@ -1315,7 +1306,7 @@ static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t of
                                         tree_header* th = (tree_header*)&context->stripes[j + k].buf[so];
                                         uint64_t addr = offset + pos;
 
-                                        if (context->stripes[j + k].bad_csums[so / Vcb->superblock.node_size] != *((uint32_t*)th->csum) || th->address != addr) {
+                                        if (RtlCompareMemory((uint8_t*)context->stripes[j + k].bad_csums + ((so / Vcb->superblock.node_size) * Vcb->csum_size), th->csum, Vcb->csum_size) != Vcb->csum_size || th->address != addr) {
                                             ULONG m;
 
                                             recovered = false;
@@ -1324,7 +1315,7 @@ static NTSTATUS scrub_extent_raid10(device_extension* Vcb, chunk* c, uint64_t of
                                                 if (m != k) {
                                                     tree_header* th2 = (tree_header*)&context->stripes[j + m].buf[so];
 
-                                                    if (context->stripes[j + m].bad_csums[so / Vcb->superblock.node_size] == *((uint32_t*)th2->csum) && th2->address == addr) {
+                                                    if (RtlCompareMemory((uint8_t*)context->stripes[j + m].bad_csums + ((so / Vcb->superblock.node_size) * Vcb->csum_size), th2->csum, Vcb->csum_size) == Vcb->csum_size && th2->address == addr) {
                                                         log_error(Vcb, addr, c->devices[j + k]->devitem.dev_id, true, true, false);
 
                                                         RtlCopyMemory(th, th2, Vcb->superblock.node_size);
@@ -1382,7 +1373,7 @@ end:
     return Status;
 }
 
-static NTSTATUS scrub_extent(device_extension* Vcb, chunk* c, ULONG type, uint64_t offset, uint32_t size, uint32_t* csum) {
+static NTSTATUS scrub_extent(device_extension* Vcb, chunk* c, ULONG type, uint64_t offset, uint32_t size, void* csum) {
     ULONG i;
     scrub_context context;
     CHUNK_ITEM_STRIPE* cis;
@@ -1632,7 +1623,7 @@ end:
     return Status;
 }
 
-static NTSTATUS scrub_data_extent(device_extension* Vcb, chunk* c, uint64_t offset, ULONG type, uint32_t* csum, RTL_BITMAP* bmp, ULONG bmplen) {
+static NTSTATUS scrub_data_extent(device_extension* Vcb, chunk* c, uint64_t offset, ULONG type, void* csum, RTL_BITMAP* bmp, ULONG bmplen) {
     NTSTATUS Status;
     ULONG runlength, index;
 
@@ -1657,7 +1648,7 @@ static NTSTATUS scrub_data_extent(device_extension* Vcb, chunk* c, uint64_t offs
             else
                 rl = runlength;
 
-            Status = scrub_extent(Vcb, c, type, offset + UInt32x32To64(index, Vcb->superblock.sector_size), rl * Vcb->superblock.sector_size, &csum[index]);
+            Status = scrub_extent(Vcb, c, type, offset + UInt32x32To64(index, Vcb->superblock.sector_size), rl * Vcb->superblock.sector_size, (uint8_t*)csum + (index * Vcb->csum_size));
             if (!NT_SUCCESS(Status)) {
                 ERR("scrub_data_extent_dup returned %08x\n", Status);
                 return Status;
@@ -1691,9 +1682,10 @@ typedef struct {
     RTL_BITMAP alloc;
     RTL_BITMAP has_csum;
     RTL_BITMAP is_tree;
-    uint32_t* csum;
+    uint8_t* csum;
     uint8_t* parity_scratch;
     uint8_t* parity_scratch2;
+    uint8_t** parity_srcs;
 } scrub_context_raid56;
 
 _Function_class_(IO_COMPLETION_ROUTINE)
@@ -1722,8 +1714,13 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     off = (ULONG)(bit_start + num - stripe_start) * sectors_per_stripe * (c->chunk_item->num_stripes - 1);
     stripeoff = num * sectors_per_stripe;
 
-    if (missing_devices == 0)
-        RtlCopyMemory(context->parity_scratch, &context->stripes[parity].buf[num * c->chunk_item->stripe_length], (ULONG)c->chunk_item->stripe_length);
+    if (missing_devices == 0) {
+        for (i = 0; i < c->chunk_item->num_stripes; i++) {
+            context->parity_srcs[i] = &context->stripes[(parity + i) % c->chunk_item->num_stripes].buf[num * c->chunk_item->stripe_length];
+        }
+
+        do_xor_multi(context->parity_scratch, context->parity_srcs, c->chunk_item->num_stripes, (ULONG)c->chunk_item->stripe_length);
+    }
 
     while (stripe != parity) {
         RtlClearAllBits(&context->stripes[stripe].error);
@@ -1733,9 +1730,8 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                 if (RtlCheckBit(&context->is_tree, off)) {
                     tree_header* th = (tree_header*)&context->stripes[stripe].buf[stripeoff * Vcb->superblock.sector_size];
                     uint64_t addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 1) * c->chunk_item->stripe_length) + (off * Vcb->superblock.sector_size);
-                    uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-                    if (crc32 != *((uint32_t*)th->csum) || th->address != addr) {
+                    if (!check_tree_checksum(Vcb, th) || th->address != addr) {
                         RtlSetBits(&context->stripes[stripe].error, i, Vcb->superblock.node_size / Vcb->superblock.sector_size);
                         log_device_error(Vcb, c->devices[stripe], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
 
@@ -1749,9 +1745,7 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
 
                     continue;
                 } else if (RtlCheckBit(&context->has_csum, off)) {
-                    uint32_t crc32 = ~calc_crc32c(0xffffffff, context->stripes[stripe].buf + (stripeoff * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-
-                    if (crc32 != context->csum[off]) {
+                    if (!check_sector_csum(Vcb, context->stripes[stripe].buf + (stripeoff * Vcb->superblock.sector_size), context->csum + (off * Vcb->csum_size))) {
                         RtlSetBit(&context->stripes[stripe].error, i);
                         log_device_error(Vcb, c->devices[stripe], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
 
@@ -1768,9 +1762,6 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             stripeoff++;
         }
 
-        if (missing_devices == 0)
-            do_xor(context->parity_scratch, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], (ULONG)c->chunk_item->stripe_length);
-
         stripe = (stripe + 1) % c->chunk_item->num_stripes;
         stripeoff = num * sectors_per_stripe;
     }
@@ -1843,7 +1834,6 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             log_error(Vcb, addr, c->devices[parity]->devitem.dev_id, false, true, true);
             log_device_error(Vcb, c->devices[parity], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
         } else if (num_errors == 1) {
-            uint32_t crc32;
             uint64_t addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 1) * c->chunk_item->stripe_length) + (bad_off * Vcb->superblock.sector_size);
 
             if (RtlCheckBit(&context->is_tree, bad_off)) {
@@ -1854,9 +1844,8 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                        Vcb->superblock.node_size);
 
                 th = (tree_header*)&context->parity_scratch[i * Vcb->superblock.sector_size];
-                crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-                if (crc32 == *((uint32_t*)th->csum) && th->address == addr) {
+                if (check_tree_checksum(Vcb, th) && th->address == addr) {
                     RtlCopyMemory(&context->stripes[bad_stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                                   &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
 
@@ -1872,9 +1861,7 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                        &context->stripes[bad_stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                        Vcb->superblock.sector_size);
 
-                crc32 = ~calc_crc32c(0xffffffff, &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
-
-                if (crc32 == context->csum[bad_off]) {
+                if (check_sector_csum(Vcb, &context->parity_scratch[i * Vcb->superblock.sector_size], context->csum + (bad_off * Vcb->csum_size))) {
                     RtlCopyMemory(&context->stripes[bad_stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                                   &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
 
@@ -1915,8 +1902,15 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     off = (ULONG)(bit_start + num - stripe_start) * sectors_per_stripe * (c->chunk_item->num_stripes - 2);
     stripeoff = num * sectors_per_stripe;
 
-    if (c->devices[parity1]->devobj)
-        RtlCopyMemory(context->parity_scratch, &context->stripes[parity1].buf[num * c->chunk_item->stripe_length], (ULONG)c->chunk_item->stripe_length);
+    if (c->devices[parity1]->devobj) {
+        context->parity_srcs[0] = &context->stripes[parity1].buf[num * c->chunk_item->stripe_length];
+
+        for (i = 2; i < c->chunk_item->num_stripes; i++) {
+            context->parity_srcs[i - 1] = &context->stripes[(parity1 + i) % c->chunk_item->num_stripes].buf[num * c->chunk_item->stripe_length];
+        }
+
+        do_xor_multi(context->parity_scratch, context->parity_srcs, c->chunk_item->num_stripes - 1, (ULONG)c->chunk_item->stripe_length);
+    }
 
     if (c->devices[parity2]->devobj)
         RtlZeroMemory(context->parity_scratch2, (ULONG)c->chunk_item->stripe_length);
@@ -1929,9 +1923,8 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                 if (RtlCheckBit(&context->is_tree, off)) {
                     tree_header* th = (tree_header*)&context->stripes[stripe].buf[stripeoff * Vcb->superblock.sector_size];
                     uint64_t addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 2) * c->chunk_item->stripe_length) + (off * Vcb->superblock.sector_size);
-                    uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-                    if (crc32 != *((uint32_t*)th->csum) || th->address != addr) {
+                    if (!check_tree_checksum(Vcb, th) || th->address != addr) {
                         RtlSetBits(&context->stripes[stripe].error, i, Vcb->superblock.node_size / Vcb->superblock.sector_size);
                         log_device_error(Vcb, c->devices[stripe], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
 
@@ -1945,9 +1938,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
 
                     continue;
                 } else if (RtlCheckBit(&context->has_csum, off)) {
-                    uint32_t crc32 = ~calc_crc32c(0xffffffff, context->stripes[stripe].buf + (stripeoff * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-
-                    if (crc32 != context->csum[off]) {
+                    if (!check_sector_csum(Vcb, context->stripes[stripe].buf + (stripeoff * Vcb->superblock.sector_size), context->csum + (off * Vcb->csum_size))) {
                         uint64_t addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 2) * c->chunk_item->stripe_length) + (off * Vcb->superblock.sector_size);
 
                         RtlSetBit(&context->stripes[stripe].error, i);
@@ -1963,9 +1954,6 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             stripeoff++;
         }
 
-        if (c->devices[parity1]->devobj)
-            do_xor(context->parity_scratch, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], (uint32_t)c->chunk_item->stripe_length);
-
         stripe = (stripe + 1) % c->chunk_item->num_stripes;
         stripeoff = num * sectors_per_stripe;
     }
@@ -1997,8 +1985,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
         stripe = parity1 == 0 ? (c->chunk_item->num_stripes - 1) : (parity1 - 1);
 
         while (stripe != parity2) {
-            galois_double(context->parity_scratch2, (uint32_t)c->chunk_item->stripe_length);
-            do_xor(context->parity_scratch2, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], (uint32_t)c->chunk_item->stripe_length);
+            galois_double_xor(context->parity_scratch2, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], (uint32_t)c->chunk_item->stripe_length);
 
             stripe = stripe == 0 ? (c->chunk_item->num_stripes - 1) : (stripe - 1);
         }
@@ -2081,7 +2068,8 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                 log_device_error(Vcb, c->devices[parity2], BTRFS_DEV_STAT_CORRUPTION_ERRORS);
             }
         } else if (num_errors == 1) {
-            uint32_t crc32a, crc32b, len;
+            uint32_t len;
+            bool valid1 = false, valid2 = false;
             uint16_t stripe_num, bad_stripe_num;
             uint64_t addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 2) * c->chunk_item->stripe_length) + (bad_off1 * Vcb->superblock.sector_size);
             uint8_t* scratch;
@@ -2126,17 +2114,16 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
 
                 if (c->devices[parity1]->devobj) {
                     th1 = (tree_header*)&context->parity_scratch[i * Vcb->superblock.sector_size];
-                    crc32a = ~calc_crc32c(0xffffffff, (uint8_t*)&th1->fs_uuid, Vcb->superblock.node_size - sizeof(th1->csum));
+                    valid1 = check_tree_checksum(Vcb, th1) && th1->address == addr;
                 }
 
                 if (c->devices[parity2]->devobj) {
                     th2 = (tree_header*)scratch;
-                    crc32b = ~calc_crc32c(0xffffffff, (uint8_t*)&th2->fs_uuid, Vcb->superblock.node_size - sizeof(th2->csum));
+                    valid2 = check_tree_checksum(Vcb, th2) && th2->address == addr;
                 }
 
-                if ((c->devices[parity1]->devobj && crc32a == *((uint32_t*)th1->csum) && th1->address == addr) ||
-                    (c->devices[parity2]->devobj && crc32b == *((uint32_t*)th2->csum) && th2->address == addr)) {
-                    if (!c->devices[parity1]->devobj || crc32a != *((uint32_t*)th1->csum) || th1->address != addr) {
+                if (valid1 || valid2) {
+                    if (!valid1) {
                         RtlCopyMemory(&context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                                       scratch, Vcb->superblock.node_size);
 
@@ -2168,7 +2155,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                         RtlCopyMemory(&context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                                       &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
 
-                        if (!c->devices[parity2]->devobj || crc32b != *((uint32_t*)th2->csum) || th2->address != addr) {
+                        if (!valid2) {
                             // fix parity 2
                             stripe = parity1 == 0 ? (c->chunk_item->num_stripes - 1) : (parity1 - 1);
 
@@ -2206,17 +2193,17 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                     log_error(Vcb, addr, c->devices[bad_stripe1]->devitem.dev_id, true, false, false);
             } else {
                 if (c->devices[parity1]->devobj)
-                    crc32a = ~calc_crc32c(0xffffffff, &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
+                    valid1 = check_sector_csum(Vcb, &context->parity_scratch[i * Vcb->superblock.sector_size], context->csum + (bad_off1 * Vcb->csum_size));
 
                 if (c->devices[parity2]->devobj)
-                    crc32b = ~calc_crc32c(0xffffffff, scratch, Vcb->superblock.sector_size);
+                    valid2 = check_sector_csum(Vcb, scratch, context->csum + (bad_off1 * Vcb->csum_size));
 
-                if ((c->devices[parity1]->devobj && crc32a == context->csum[bad_off1]) || (c->devices[parity2]->devobj && crc32b == context->csum[bad_off1])) {
-                    if (c->devices[parity2]->devobj && crc32b == context->csum[bad_off1]) {
+                if (valid1 || valid2) {
+                    if (valid2) {
                         RtlCopyMemory(&context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                                       scratch, Vcb->superblock.sector_size);
 
-                        if (c->devices[parity1]->devobj && crc32a != context->csum[bad_off1]) {
+                        if (c->devices[parity1]->devobj && !valid1) {
                             // fix parity 1
 
                             stripe = (parity1 + 2) % c->chunk_item->num_stripes;
@@ -2244,7 +2231,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                         RtlCopyMemory(&context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                                       &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
 
-                        if (c->devices[parity2]->devobj && crc32b != context->csum[bad_off1]) {
+                        if (c->devices[parity2]->devobj && !valid2) {
                             // fix parity 2
                             stripe = parity1 == 0 ? (c->chunk_item->num_stripes - 1) : (parity1 - 1);
 
@@ -2283,8 +2270,6 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             uint16_t x, y, k;
             uint64_t addr;
             uint32_t len = (RtlCheckBit(&context->is_tree, bad_off1) || RtlCheckBit(&context->is_tree, bad_off2)) ? Vcb->superblock.node_size : Vcb->superblock.sector_size;
-            uint8_t gyx, gx, denom, a, b, *p, *q, *pxy, *qxy;
-            uint32_t j;
 
             stripe = parity1 == 0 ? (c->chunk_item->num_stripes - 1) : (parity1 - 1);
 
@@ -2327,37 +2312,16 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                 k--;
             } while (stripe != parity2);
 
-            gyx = gpow2(y > x ? (y-x) : (255-x+y));
-            gx = gpow2(255-x);
-
-            denom = gdiv(1, gyx ^ 1);
-            a = gmul(gyx, denom);
-            b = gmul(gx, denom);
-
-            p = &context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)];
-            q = &context->stripes[parity2].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)];
-            pxy = &context->parity_scratch2[i * Vcb->superblock.sector_size];
-            qxy = &context->parity_scratch[i * Vcb->superblock.sector_size];
-
-            for (j = 0; j < len; j++) {
-                *qxy = gmul(a, *p ^ *pxy) ^ gmul(b, *q ^ *qxy);
-
-                p++;
-                q++;
-                pxy++;
-                qxy++;
-            }
-
-            do_xor(&context->parity_scratch2[i * Vcb->superblock.sector_size], &context->parity_scratch[i * Vcb->superblock.sector_size], len);
-            do_xor(&context->parity_scratch2[i * Vcb->superblock.sector_size], &context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)], len);
+            galois_recover2(&context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
+                            &context->stripes[parity2].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
+                            &context->parity_scratch2[i * Vcb->superblock.sector_size], &context->parity_scratch[i * Vcb->superblock.sector_size], x, y, len);
 
             addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 2) * c->chunk_item->stripe_length) + (bad_off1 * Vcb->superblock.sector_size);
 
             if (RtlCheckBit(&context->is_tree, bad_off1)) {
                 tree_header* th = (tree_header*)&context->parity_scratch[i * Vcb->superblock.sector_size];
-                uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-                if (crc32 == *((uint32_t*)th->csum) && th->address == addr) {
+                if (check_tree_checksum(Vcb, th) && th->address == addr) {
                     RtlCopyMemory(&context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                                   &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
 
@@ -2369,9 +2333,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                 } else
                     log_error(Vcb, addr, c->devices[bad_stripe1]->devitem.dev_id, true, false, false);
             } else {
-                uint32_t crc32 = ~calc_crc32c(0xffffffff, &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
-
-                if (crc32 == context->csum[bad_off1]) {
+                if (check_sector_csum(Vcb, &context->parity_scratch[i * Vcb->superblock.sector_size], context->csum + (bad_off1 * Vcb->csum_size))) {
                     RtlCopyMemory(&context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                                   &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
 
@@ -2386,9 +2348,8 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
 
             if (RtlCheckBit(&context->is_tree, bad_off2)) {
                 tree_header* th = (tree_header*)&context->parity_scratch2[i * Vcb->superblock.sector_size];
-                uint32_t crc32 = ~calc_crc32c(0xffffffff, (uint8_t*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
 
-                if (crc32 == *((uint32_t*)th->csum) && th->address == addr) {
+                if (check_tree_checksum(Vcb, th) && th->address == addr) {
                     RtlCopyMemory(&context->stripes[bad_stripe2].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                                   &context->parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
 
@@ -2400,9 +2361,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                 } else
                     log_error(Vcb, addr, c->devices[bad_stripe2]->devitem.dev_id, true, false, false);
             } else {
-                uint32_t crc32 = ~calc_crc32c(0xffffffff, &context->parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
-
-                if (crc32 == context->csum[bad_off2]) {
+                if (check_sector_csum(Vcb, &context->parity_scratch2[i * Vcb->superblock.sector_size], context->csum + (bad_off2 * Vcb->csum_size))) {
                     RtlCopyMemory(&context->stripes[bad_stripe2].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                                   &context->parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
 
@@ -2503,7 +2462,7 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, u
         RtlInitializeBitMap(&context.has_csum, csumarr, num_sectors);
         RtlClearAllBits(&context.has_csum);
 
-        context.csum = ExAllocatePoolWithTag(PagedPool, num_sectors * sizeof(uint32_t), ALLOC_TAG);
+        context.csum = ExAllocatePoolWithTag(PagedPool, num_sectors * Vcb->csum_size, ALLOC_TAG);
         if (!context.csum) {
             ERR("out of memory\n");
             ExFreePool(allocarr);
@@ -2586,13 +2545,13 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, u
 
                         if (tp2.item->key.offset >= extent_start) {
                             uint64_t csum_start = max(extent_start, tp2.item->key.offset);
-                            uint64_t csum_end = min(extent_end, tp2.item->key.offset + (tp2.item->size * Vcb->superblock.sector_size / sizeof(uint32_t)));
+                            uint64_t csum_end = min(extent_end, tp2.item->key.offset + (tp2.item->size * Vcb->superblock.sector_size / Vcb->csum_size));
 
                             RtlSetBits(&context.has_csum, (ULONG)((csum_start - run_start) / Vcb->superblock.sector_size), (ULONG)((csum_end - csum_start) / Vcb->superblock.sector_size));
 
-                            RtlCopyMemory(&context.csum[(csum_start - run_start) / Vcb->superblock.sector_size],
-                                          tp2.item->data + ((csum_start - tp2.item->key.offset) * sizeof(uint32_t) / Vcb->superblock.sector_size),
-                                          (ULONG)((csum_end - csum_start) * sizeof(uint32_t) / Vcb->superblock.sector_size));
+                            RtlCopyMemory(context.csum + ((csum_start - run_start) * Vcb->csum_size / Vcb->superblock.sector_size),
+                                          tp2.item->data + ((csum_start - tp2.item->key.offset) * Vcb->csum_size / Vcb->superblock.sector_size),
+                                          (ULONG)((csum_end - csum_start) * Vcb->csum_size / Vcb->superblock.sector_size));
                         }
 
                         b2 = find_next_item(Vcb, &tp2, &next_tp2, false, NULL);
@@ -2617,6 +2576,14 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, u
         goto end;
     }
 
+    context.parity_srcs = ExAllocatePoolWithTag(PagedPool, sizeof(uint8_t*) * c->chunk_item->num_stripes, ALLOC_TAG);
+    if (!context.parity_srcs) {
+        ERR("out of memory\n");
+        ExFreePool(context.stripes);
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
     max_read = (uint32_t)min(1048576 / c->chunk_item->stripe_length, stripe_end - stripe_start + 1); // only process 1 MB of data at a time
 
     for (i = 0; i < c->chunk_item->num_stripes; i++) {
@@ -2630,6 +2597,7 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, u
                 ExFreePool(context.stripes[j].buf);
             }
             ExFreePool(context.stripes);
+            ExFreePool(context.parity_srcs);
 
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
@@ -2647,6 +2615,7 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, u
                 ExFreePool(context.stripes[j].buf);
             }
             ExFreePool(context.stripes);
+            ExFreePool(context.parity_srcs);
 
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
@@ -2826,6 +2795,7 @@ end2:
         ExFreePool(context.stripes[i].errorarr);
     }
     ExFreePool(context.stripes);
+    ExFreePool(context.parity_srcs);
 
 end:
     ExFreePool(treearr);
@@ -2978,7 +2948,7 @@ static NTSTATUS scrub_chunk(device_extension* Vcb, chunk* c, uint64_t* offset, b
         if (tp.item->key.obj_id >= *offset && (tp.item->key.obj_type == TYPE_EXTENT_ITEM || tp.item->key.obj_type == TYPE_METADATA_ITEM)) {
             uint64_t size = tp.item->key.obj_type == TYPE_METADATA_ITEM ? Vcb->superblock.node_size : tp.item->key.offset;
             bool is_tree;
-            uint32_t* csum = NULL;
+            uint8_t* csum = NULL;
             RTL_BITMAP bmp;
             ULONG* bmparr = NULL, bmplen;
 
@@ -3011,7 +2981,7 @@ static NTSTATUS scrub_chunk(device_extension* Vcb, chunk* c, uint64_t* offset, b
             if (!is_tree) {
                 traverse_ptr tp2;
 
-                csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(sizeof(uint32_t) * size / Vcb->superblock.sector_size), ALLOC_TAG);
+                csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(Vcb->csum_size * size / Vcb->superblock.sector_size), ALLOC_TAG);
                 if (!csum) {
                     ERR("out of memory\n");
                     Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -3050,13 +3020,13 @@ static NTSTATUS scrub_chunk(device_extension* Vcb, chunk* c, uint64_t* offset, b
                         if (tp2.item->key.obj_type == TYPE_EXTENT_CSUM) {
                             if (tp2.item->key.offset >= tp.item->key.obj_id + size)
                                 break;
-                            else if (tp2.item->size >= sizeof(uint32_t) && tp2.item->key.offset + (tp2.item->size * Vcb->superblock.sector_size / sizeof(uint32_t)) >= tp.item->key.obj_id) {
+                            else if (tp2.item->size >= Vcb->csum_size && tp2.item->key.offset + (tp2.item->size * Vcb->superblock.sector_size / Vcb->csum_size) >= tp.item->key.obj_id) {
                                 uint64_t cs = max(tp.item->key.obj_id, tp2.item->key.offset);
-                                uint64_t ce = min(tp.item->key.obj_id + size, tp2.item->key.offset + (tp2.item->size * Vcb->superblock.sector_size / sizeof(uint32_t)));
+                                uint64_t ce = min(tp.item->key.obj_id + size, tp2.item->key.offset + (tp2.item->size * Vcb->superblock.sector_size / Vcb->csum_size));
 
-                                RtlCopyMemory(csum + ((cs - tp.item->key.obj_id) / Vcb->superblock.sector_size),
-                                              tp2.item->data + ((cs - tp2.item->key.offset) * sizeof(uint32_t) / Vcb->superblock.sector_size),
-                                              (ULONG)((ce - cs) * sizeof(uint32_t) / Vcb->superblock.sector_size));
+                                RtlCopyMemory(csum + ((cs - tp.item->key.obj_id) * Vcb->csum_size / Vcb->superblock.sector_size),
+                                              tp2.item->data + ((cs - tp2.item->key.offset) * Vcb->csum_size / Vcb->superblock.sector_size),
+                                              (ULONG)((ce - cs) * Vcb->csum_size / Vcb->superblock.sector_size));
 
                                 RtlClearBits(&bmp, (ULONG)((cs - tp.item->key.obj_id) / Vcb->superblock.sector_size), (ULONG)((ce - cs) / Vcb->superblock.sector_size));
 
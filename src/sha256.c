@@ -0,0 +1,200 @@
+/* Copyright (c) Mark Harmstone 2016-17
+ *
+ * This file is part of WinBtrfs.
+ *
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <windef.h>
+#include <immintrin.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern bool have_sha;
+
+#define SHA256_BLOCK_SIZE 64
+
+#ifdef _MSC_VER
+#define TARGET_SHA
+#else
+#define TARGET_SHA __attribute__((target("sse4.1,sha")))
+#endif
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t k[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_blocks_sw(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32_t w[64];
+    unsigned int i;
+
+    while (blocks > 0) {
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[(i * 4) + 1] << 16) |
+                   ((uint32_t)data[(i * 4) + 2] << 8) | (uint32_t)data[(i * 4) + 3];
+        }
+
+        for (i = 16; i < 64; i++) {
+            uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        for (i = 0; i < 64; i++) {
+            uint32_t s1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + k[i] + w[i];
+            uint32_t s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+
+        data += SHA256_BLOCK_SIZE;
+        blocks--;
+    }
+}
+
+// Four rounds using the SHA extensions. msg holds w[i..i+3], which gets k[i..i+3] added here.
+#define SHA_ROUNDS(i, msg) { \
+    __m128i wk = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i*)&k[i])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, wk); \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0e)); \
+}
+
+// Computes the next four message words into m0, given the previous sixteen in m0..m3.
+#define SHA_SCHEDULE(m0, m1, m2, m3) \
+    m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4)), m3)
+
+static TARGET_SHA void sha256_blocks_ni(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, tmp;
+    unsigned int i;
+
+    // rearrange the state into the ABEF / CDGH layout that the instructions expect
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (blocks > 0) {
+        __m128i save0 = state0, save1 = state1;
+        __m128i m0, m1, m2, m3;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), bswap);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), bswap);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), bswap);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), bswap);
+
+        SHA_ROUNDS(0, m0);
+        SHA_ROUNDS(4, m1);
+        SHA_ROUNDS(8, m2);
+        SHA_ROUNDS(12, m3);
+
+        for (i = 16; i < 64; i += 16) {
+            SHA_SCHEDULE(m0, m1, m2, m3);
+            SHA_ROUNDS(i, m0);
+            SHA_SCHEDULE(m1, m2, m3, m0);
+            SHA_ROUNDS(i + 4, m1);
+            SHA_SCHEDULE(m2, m3, m0, m1);
+            SHA_ROUNDS(i + 8, m2);
+            SHA_SCHEDULE(m3, m0, m1, m2);
+            SHA_ROUNDS(i + 12, m3);
+        }
+
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+
+        data += SHA256_BLOCK_SIZE;
+        blocks--;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+static void sha256_blocks(uint32_t* state, const uint8_t* data, size_t blocks) {
+    if (have_sha)
+        sha256_blocks_ni(state, data, blocks);
+    else
+        sha256_blocks_sw(state, data, blocks);
+}
+
+void calc_sha256(uint8_t* hash, const void* input, size_t len) {
+    uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    uint8_t last[SHA256_BLOCK_SIZE * 2];
+    const uint8_t* data = input;
+    size_t left, lastlen;
+    uint64_t bits = (uint64_t)len * 8;
+    unsigned int i;
+
+    if (len >= SHA256_BLOCK_SIZE)
+        sha256_blocks(state, data, len / SHA256_BLOCK_SIZE);
+
+    left = len % SHA256_BLOCK_SIZE;
+    lastlen = left < SHA256_BLOCK_SIZE - sizeof(uint64_t) ? SHA256_BLOCK_SIZE : (SHA256_BLOCK_SIZE * 2);
+
+    // pad with 0x80, then zeroes, then the big-endian bit count
+    memcpy(last, data + len - left, left);
+    last[left] = 0x80;
+    memset(last + left + 1, 0, lastlen - left - 1);
+
+    for (i = 0; i < 8; i++) {
+        last[lastlen - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+
+    sha256_blocks(state, last, lastlen / SHA256_BLOCK_SIZE);
+
+    for (i = 0; i < 8; i++) {
+        hash[i * 4] = (uint8_t)(state[i] >> 24);
+        hash[(i * 4) + 1] = (uint8_t)(state[i] >> 16);
+        hash[(i * 4) + 2] = (uint8_t)(state[i] >> 8);
+        hash[(i * 4) + 3] = (uint8_t)state[i];
+    }
+}
@@ -17,6 +17,115 @@
 
 #include "btrfs_drv.h"
 
+// The index is a sorted array of pointers into t->itemlist, so that lookups
+// can binary-search rather than walking the list. It is only ever rebuilt while
+// the tree is private to us or Vcb->tree_lock is held exclusively.
+static void build_tree_index(tree* t) {
+    LIST_ENTRY* le;
+    uint32_t num = 0;
+
+    le = t->itemlist.Flink;
+    while (le != &t->itemlist) {
+        num++;
+        le = le->Flink;
+    }
+
+    if (!t->index || num > t->index_alloc) {
+        tree_data** index;
+        uint32_t alloc = num < 16 ? 16 : num;
+
+        index = ExAllocatePoolWithTag(PagedPool, alloc * sizeof(tree_data*), ALLOC_TAG);
+        if (!index) {
+            ERR("out of memory\n");
+            t->index_valid = false;
+            return;
+        }
+
+        if (t->index)
+            ExFreePool(t->index);
+
+        t->index = index;
+        t->index_alloc = alloc;
+    }
+
+    num = 0;
+
+    le = t->itemlist.Flink;
+    while (le != &t->itemlist) {
+        t->index[num] = CONTAINING_RECORD(le, tree_data, list_entry);
+        num++;
+        le = le->Flink;
+    }
+
+    t->index_len = num;
+    t->index_valid = true;
+}
+
+// returns the position of the first item whose key is not less than key
+static uint32_t tree_index_lower_bound(tree* t, const KEY* key) {
+    uint32_t lo = 0, hi = t->index_len;
+    KEY key2 = *key;
+
+    while (lo < hi) {
+        uint32_t mid = lo + ((hi - lo) / 2);
+
+        if (keycmp(t->index[mid]->key, key2) == -1)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// td must already have been linked into t->itemlist
+static void tree_index_insert(tree* t, tree_data* td) {
+    uint32_t pos;
+
+    if (td->list_entry.Blink == &t->itemlist)
+        pos = 0;
+    else {
+        tree_data* prev = CONTAINING_RECORD(td->list_entry.Blink, tree_data, list_entry);
+
+        pos = tree_index_lower_bound(t, &prev->key);
+
+        while (pos < t->index_len && t->index[pos] != prev) {
+            pos++;
+        }
+
+        if (pos == t->index_len) {
+            ERR("could not find previous item in tree index\n");
+            t->index_valid = false;
+            return;
+        }
+
+        pos++;
+    }
+
+    if (t->index_len == t->index_alloc) {
+        uint32_t alloc = t->index_alloc == 0 ? 16 : (t->index_alloc * 2);
+        tree_data** index = ExAllocatePoolWithTag(PagedPool, alloc * sizeof(tree_data*), ALLOC_TAG);
+
+        if (!index) {
+            ERR("out of memory\n");
+            t->index_valid = false;
+            return;
+        }
+
+        if (t->index) {
+            RtlCopyMemory(index, t->index, t->index_len * sizeof(tree_data*));
+            ExFreePool(t->index);
+        }
+
+        t->index = index;
+        t->index_alloc = alloc;
+    }
+
+    RtlMoveMemory(&t->index[pos + 1], &t->index[pos], (t->index_len - pos) * sizeof(tree_data*));
+    t->index[pos] = td;
+    t->index_len++;
+}
+
 NTSTATUS load_tree(device_extension* Vcb, uint64_t addr, uint8_t* buf, root* r, tree** pt) {
     tree_header* th;
     tree* t;
@@ -58,6 +167,10 @@ NTSTATUS load_tree(device_extension* Vcb, uint64_t addr, uint8_t* buf, root* r,
     t->updated_extents = false;
     t->write = false;
     t->uniqueness_determined = false;
+    t->index = NULL;
+    t->index_len = 0;
+    t->index_alloc = 0;
+    t->index_valid = false;
 
     InitializeListHead(&t->itemlist);
 
@@ -137,6 +250,8 @@ NTSTATUS load_tree(device_extension* Vcb, uint64_t addr, uint8_t* buf, root* r,
         t->buf = NULL;
     }
 
+    build_tree_index(t);
+
     ExAcquireFastMutex(&Vcb->trees_list_mutex);
 
     InsertTailList(&Vcb->trees, &t->list_entry);
@@ -215,6 +330,212 @@ static NTSTATUS do_load_tree2(device_extension* Vcb, tree_holder* th, uint8_t* b
     return STATUS_SUCCESS;
 }
 
+NTSTATUS init_node_cache(device_extension* Vcb) {
+    node_cache* nc = &Vcb->node_cache;
+    unsigned int i;
+
+    ExInitializeFastMutex(&nc->mutex);
+    InitializeListHead(&nc->lru);
+    InitializeListHead(&nc->readaheads);
+    nc->num_readaheads = 0;
+    KeInitializeEvent(&nc->readaheads_done, NotificationEvent, true);
+
+    nc->size = 0;
+    nc->max_size = (uint64_t)Vcb->options.node_cache_size * 1048576;
+    nc->hits = 0;
+    nc->misses = 0;
+
+    nc->hash = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * NODE_CACHE_BUCKETS, ALLOC_TAG);
+    if (!nc->hash) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < NODE_CACHE_BUCKETS; i++) {
+        InitializeListHead(&nc->hash[i]);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static __inline LIST_ENTRY* node_cache_bucket(device_extension* Vcb, uint64_t address) {
+    return &Vcb->node_cache.hash[(address / Vcb->superblock.node_size) % NODE_CACHE_BUCKETS];
+}
+
+static void node_cache_free_entry(node_cache* nc, node_cache_entry* nce, uint32_t node_size) {
+    RemoveEntryList(&nce->list_entry_hash);
+    RemoveEntryList(&nce->list_entry_lru);
+
+    nc->size -= node_size;
+
+    ExFreePool(nce);
+}
+
+void flush_node_cache(device_extension* Vcb) {
+    node_cache* nc = &Vcb->node_cache;
+
+    if (!nc->hash)
+        return;
+
+    ExAcquireFastMutex(&nc->mutex);
+
+    while (!IsListEmpty(&nc->lru)) {
+        node_cache_entry* nce = CONTAINING_RECORD(nc->lru.Flink, node_cache_entry, list_entry_lru);
+
+        node_cache_free_entry(nc, nce, Vcb->superblock.node_size);
+    }
+
+    ExReleaseFastMutex(&nc->mutex);
+}
+
+void free_node_cache(device_extension* Vcb) {
+    if (!Vcb->node_cache.hash)
+        return;
+
+    KeWaitForSingleObject(&Vcb->node_cache.readaheads_done, Executive, KernelMode, false, NULL);
+
+    flush_node_cache(Vcb);
+
+    ExFreePool(Vcb->node_cache.hash);
+    Vcb->node_cache.hash = NULL;
+}
+
+static node_cache_entry* node_cache_find(device_extension* Vcb, uint64_t address) {
+    LIST_ENTRY* bucket = node_cache_bucket(Vcb, address);
+    LIST_ENTRY* le;
+
+    le = bucket->Flink;
+    while (le != bucket) {
+        node_cache_entry* nce = CONTAINING_RECORD(le, node_cache_entry, list_entry_hash);
+
+        if (nce->address == address)
+            return nce;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+static tree_readahead* find_readahead(node_cache* nc, uint64_t address, uint64_t generation) {
+    LIST_ENTRY* le;
+
+    le = nc->readaheads.Flink;
+    while (le != &nc->readaheads) {
+        tree_readahead* ra = CONTAINING_RECORD(le, tree_readahead, list_entry);
+
+        if (ra->address == address && ra->generation == generation)
+            return ra;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+static void release_readahead(tree_readahead* ra) {
+    if (InterlockedDecrement(&ra->refcount) == 0)
+        ExFreePool(ra);
+}
+
+static bool node_cache_get(device_extension* Vcb, uint64_t address, uint64_t generation, uint8_t* buf) {
+    node_cache* nc = &Vcb->node_cache;
+    node_cache_entry* nce;
+    tree_readahead* ra;
+
+    if (nc->max_size == 0 || generation == 0)
+        return false;
+
+    ExAcquireFastMutex(&nc->mutex);
+
+    // if this node is already being read in the background, wait for that rather than reading it again
+    ra = find_readahead(nc, address, generation);
+
+    if (ra) {
+        InterlockedIncrement(&ra->refcount);
+        ExReleaseFastMutex(&nc->mutex);
+
+        KeWaitForSingleObject(&ra->event, Executive, KernelMode, false, NULL);
+        release_readahead(ra);
+
+        ExAcquireFastMutex(&nc->mutex);
+    }
+
+    nce = node_cache_find(Vcb, address);
+
+    // Nodes are immutable once written, so an entry is only ever wrong if its extent
+    // has since been freed and reused - in which case the generation won't match.
+    if (!nce || nce->generation != generation) {
+        nc->misses++;
+        ExReleaseFastMutex(&nc->mutex);
+        return false;
+    }
+
+    RtlCopyMemory(buf, nce->data, Vcb->superblock.node_size);
+
+    RemoveEntryList(&nce->list_entry_lru);
+    InsertHeadList(&nc->lru, &nce->list_entry_lru);
+
+    nc->hits++;
+
+    ExReleaseFastMutex(&nc->mutex);
+
+    return true;
+}
+
+void node_cache_add(device_extension* Vcb, uint64_t address, uint8_t* buf) {
+    node_cache* nc = &Vcb->node_cache;
+    node_cache_entry *nce, *old;
+
+    if (nc->max_size < Vcb->superblock.node_size)
+        return;
+
+    nce = ExAllocatePoolWithTag(PagedPool, offsetof(node_cache_entry, data[0]) + Vcb->superblock.node_size, ALLOC_TAG);
+    if (!nce) {
+        ERR("out of memory\n");
+        return;
+    }
+
+    nce->address = address;
+    nce->generation = ((tree_header*)buf)->generation;
+    RtlCopyMemory(nce->data, buf, Vcb->superblock.node_size);
+
+    ExAcquireFastMutex(&nc->mutex);
+
+    old = node_cache_find(Vcb, address);
+    if (old)
+        node_cache_free_entry(nc, old, Vcb->superblock.node_size);
+
+    InsertTailList(node_cache_bucket(Vcb, address), &nce->list_entry_hash);
+    InsertHeadList(&nc->lru, &nce->list_entry_lru);
+    nc->size += Vcb->superblock.node_size;
+
+    while (nc->size > nc->max_size) {
+        node_cache_entry* lru = CONTAINING_RECORD(nc->lru.Blink, node_cache_entry, list_entry_lru);
+
+        node_cache_free_entry(nc, lru, Vcb->superblock.node_size);
+    }
+
+    ExReleaseFastMutex(&nc->mutex);
+}
+
+void node_cache_remove(device_extension* Vcb, uint64_t address) {
+    node_cache* nc = &Vcb->node_cache;
+    node_cache_entry* nce;
+
+    if (nc->max_size == 0)
+        return;
+
+    ExAcquireFastMutex(&nc->mutex);
+
+    nce = node_cache_find(Vcb, address);
+
+    if (nce)
+        node_cache_free_entry(nc, nce, Vcb->superblock.node_size);
+
+    ExReleaseFastMutex(&nc->mutex);
+}
+
 NTSTATUS do_load_tree(device_extension* Vcb, tree_holder* th, root* r, tree* t, tree_data* td, PIRP Irp) {
     NTSTATUS Status;
     uint8_t* buf;
@@ -226,12 +547,16 @@ NTSTATUS do_load_tree(device_extension* Vcb, tree_holder* th, root* r, tree* t,
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    Status = read_data(Vcb, th->address, Vcb->superblock.node_size, NULL, true, buf, NULL,
-                       &c, Irp, th->generation, false, NormalPagePriority);
-    if (!NT_SUCCESS(Status)) {
-        ERR("read_data returned 0x%08x\n", Status);
-        ExFreePool(buf);
-        return Status;
+    if (!node_cache_get(Vcb, th->address, th->generation, buf)) {
+        Status = read_data(Vcb, th->address, Vcb->superblock.node_size, NULL, true, buf, NULL,
+                           &c, Irp, th->generation, false, NormalPagePriority);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_data returned 0x%08x\n", Status);
+            ExFreePool(buf);
+            return Status;
+        }
+
+        node_cache_add(Vcb, th->address, buf);
     }
 
     if (t)
@@ -307,6 +632,9 @@ void free_tree(tree* t) {
     if (t->buf)
         ExFreePool(t->buf);
 
+    if (t->index)
+        ExFreePool(t->index);
+
     if (t->nonpaged)
         ExFreePool(t->nonpaged);
 
@@ -440,11 +768,57 @@ NTSTATUS skip_to_difference(device_extension* Vcb, traverse_ptr* tp, traverse_pt
     }
 }
 
+static tree_data* find_item_in_index(tree* t, const KEY* searchkey, bool ignore) {
+    uint32_t pos;
+    int cmp;
+    KEY key2;
+
+    if (t->index_len == 0)
+        return NULL;
+
+    pos = tree_index_lower_bound(t, searchkey);
+
+    if (pos == t->index_len)
+        return t->index[pos - 1];
+
+    key2 = *searchkey;
+    cmp = keycmp(key2, t->index[pos]->key);
+
+    if (cmp == 0) {
+        if (t->header.level == 0 && !ignore && t->index[pos]->ignore) {
+            uint32_t i = pos + 1;
+
+            while (i < t->index_len && t->index[i]->ignore) {
+                i++;
+            }
+
+            if (i < t->index_len && !keycmp(key2, t->index[i]->key))
+                return t->index[i];
+        }
+
+        return t->index[pos];
+    }
+
+    return pos > 0 ? t->index[pos - 1] : t->index[0];
+}
+
 static NTSTATUS find_item_in_tree(device_extension* Vcb, tree* t, traverse_ptr* tp, const KEY* searchkey, bool ignore, uint8_t level, PIRP Irp) {
     int cmp;
     tree_data *td, *lasttd;
     KEY key2;
 
+    // only rebuild a stale index if nobody else can be looking at it
+    if (!t->index_valid && ExIsResourceAcquiredExclusiveLite(&Vcb->tree_lock))
+        build_tree_index(t);
+
+    if (t->index_valid) {
+        td = find_item_in_index(t, searchkey, ignore);
+
+        if (!td) return STATUS_NOT_FOUND;
+
+        goto found;
+    }
+
     cmp = 1;
     td = first_item(t);
     lasttd = NULL;
@@ -482,6 +856,7 @@ static NTSTATUS find_item_in_tree(device_extension* Vcb, tree* t, traverse_ptr*
     if ((cmp == -1 || !td) && lasttd)
         td = lasttd;
 
+found:
     if (t->header.level == 0) {
         if (td->ignore && !ignore) {
             traverse_ptr oldtp;
@@ -589,6 +964,110 @@ NTSTATUS find_item_to_level(device_extension* Vcb, root* r, traverse_ptr* tp, co
     return Status;
 }
 
+_Function_class_(WORKER_THREAD_ROUTINE)
+static void __stdcall tree_readahead_worker(void* context) {
+    tree_readahead* ra = context;
+    device_extension* Vcb = ra->Vcb;
+    node_cache* nc = &Vcb->node_cache;
+    uint8_t* buf;
+
+    buf = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+    if (!buf)
+        ERR("out of memory\n");
+    else {
+        // Don't wait for the lock - if a flush is in progress, whoever queued us
+        // could be waiting on us while holding it.
+        if (ExAcquireResourceSharedLite(&Vcb->tree_lock, false)) {
+            if (!Vcb->removing) {
+                NTSTATUS Status = read_data(Vcb, ra->address, Vcb->superblock.node_size, NULL, true, buf, NULL,
+                                            NULL, NULL, ra->generation, false, NormalPagePriority);
+
+                if (NT_SUCCESS(Status))
+                    node_cache_add(Vcb, ra->address, buf);
+                else
+                    WARN("read_data returned %08x\n", Status);
+            }
+
+            ExReleaseResourceLite(&Vcb->tree_lock);
+        }
+
+        ExFreePool(buf);
+    }
+
+    ExAcquireFastMutex(&nc->mutex);
+
+    RemoveEntryList(&ra->list_entry);
+
+    nc->num_readaheads--;
+    if (nc->num_readaheads == 0)
+        KeSetEvent(&nc->readaheads_done, 0, false);
+
+    ExReleaseFastMutex(&nc->mutex);
+
+    KeSetEvent(&ra->event, 0, false);
+
+    release_readahead(ra);
+}
+
+// Start reading the next few children of t after td in the background, so that
+// a sequential scan doesn't have to wait for each leaf in turn.
+static void queue_tree_readahead(device_extension* Vcb, tree* t, tree_data* td) {
+    node_cache* nc = &Vcb->node_cache;
+    unsigned int num = 0;
+
+    if (nc->max_size < Vcb->superblock.node_size || ExIsResourceAcquiredExclusiveLite(&Vcb->tree_lock))
+        return;
+
+    while ((td = next_item(t, td)) && num < TREE_READAHEAD_NODES) {
+        tree_readahead* ra;
+        node_cache_entry* nce;
+
+        if (td->ignore || td->treeholder.tree || td->treeholder.generation == 0)
+            continue;
+
+        num++;
+
+        ExAcquireFastMutex(&nc->mutex);
+
+        if (find_readahead(nc, td->treeholder.address, td->treeholder.generation)) {
+            ExReleaseFastMutex(&nc->mutex);
+            continue;
+        }
+
+        nce = node_cache_find(Vcb, td->treeholder.address);
+
+        if (nce && nce->generation == td->treeholder.generation) {
+            ExReleaseFastMutex(&nc->mutex);
+            continue;
+        }
+
+        ra = ExAllocatePoolWithTag(NonPagedPool, sizeof(tree_readahead), ALLOC_TAG);
+        if (!ra) {
+            ERR("out of memory\n");
+            ExReleaseFastMutex(&nc->mutex);
+            return;
+        }
+
+        ra->Vcb = Vcb;
+        ra->address = td->treeholder.address;
+        ra->generation = td->treeholder.generation;
+        ra->refcount = 1;
+        KeInitializeEvent(&ra->event, NotificationEvent, false);
+
+        InsertTailList(&nc->readaheads, &ra->list_entry);
+
+        if (nc->num_readaheads == 0)
+            KeClearEvent(&nc->readaheads_done);
+
+        nc->num_readaheads++;
+
+        ExReleaseFastMutex(&nc->mutex);
+
+        ExInitializeWorkItem(&ra->item, tree_readahead_worker, ra);
+        ExQueueWorkItem(&ra->item, DelayedWorkQueue);
+    }
+}
+
 bool find_next_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, const traverse_ptr* tp, traverse_ptr* next_tp, bool ignore, PIRP Irp) {
     tree* t;
     tree_data *td = NULL, *next;
@@ -632,6 +1111,9 @@ bool find_next_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vc
     if (!t)
         return false;
 
+    // we've run off the end of a node, so this looks like a sequential scan
+    queue_tree_readahead(Vcb, t->parent, td);
+
     if (!td->treeholder.tree) {
         Status = do_load_tree(Vcb, &td->treeholder, t->parent->root, t->parent, td, Irp);
         if (!NT_SUCCESS(Status)) {
@@ -957,6 +1439,9 @@ NTSTATUS insert_tree_item(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock)
     else
         InsertHeadList(&tp.item->list_entry, &td->list_entry);
 
+    if (tp.tree->index_valid)
+        tree_index_insert(tp.tree, td);
+
     tp.tree->header.num_items++;
     tp.tree->size += size + sizeof(leaf_node);
 
@@ -1059,6 +1544,9 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
             {
                 rollback_extent* re = ri->ptr;
 
+                if (!re->ext->ignore)
+                    unindex_fcb_extent(re->fcb, re->ext);
+
                 re->ext->ignore = true;
 
                 if (re->ext->extent_data.type == EXTENT_TYPE_REGULAR || re->ext->extent_data.type == EXTENT_TYPE_PREALLOC) {
@@ -1088,6 +1576,9 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
             {
                 rollback_extent* re = ri->ptr;
 
+                if (re->ext->ignore)
+                    index_fcb_extent(re->fcb, re->ext);
+
                 re->ext->ignore = false;
 
                 if (re->ext->extent_data.type == EXTENT_TYPE_REGULAR || re->ext->extent_data.type == EXTENT_TYPE_PREALLOC) {
@@ -2091,6 +2582,9 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                 td->inserted = true;
             }
 
+            // we're about to change the item list directly
+            tp.tree->index_valid = false;
+
             cmp = keycmp(bi->key, tp.item->key);
 
             if (cmp == -1) { // very first key in root
@@ -30,12 +30,12 @@ NTSTATUS do_read_job(PIRP Irp) {
     PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     fcb* fcb = FileObject->FsContext;
-    bool acquired_fcb_lock = false;
+    bool acquired_fcb_lock = false, acquired_tree_lock = false;
 
     Irp->IoStatus.Information = 0;
 
     if (!ExIsResourceAcquiredSharedLite(fcb->Header.Resource)) {
-        ExAcquireResourceSharedLite(fcb->Header.Resource, true);
+        acquire_fcb_for_read(fcb, true, &acquired_tree_lock);
         acquired_fcb_lock = true;
     }
 
@@ -48,6 +48,9 @@ NTSTATUS do_read_job(PIRP Irp) {
     if (acquired_fcb_lock)
         ExReleaseResourceLite(fcb->Header.Resource);
 
+    if (acquired_tree_lock)
+        ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+
     if (!NT_SUCCESS(Status))
         ERR("do_read returned %08x\n", Status);
 
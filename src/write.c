@@ -36,7 +36,6 @@ extern tFsRtlUpdateDiskCounters fFsRtlUpdateDiskCounters;
 extern bool diskacc;
 
 bool find_data_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t length, uint64_t* address) {
-    LIST_ENTRY* le;
     space* s;
 
     TRACE("(%p, %I64x, %I64x, %p)\n", Vcb, c->offset, length, address);
@@ -53,59 +52,156 @@ bool find_data_address_in_chunk(device_extension* Vcb, chunk* c, uint64_t length
         }
     }
 
-    if (IsListEmpty(&c->space_size))
+    s = find_space_best_fit(c, length);
+    if (!s)
         return false;
 
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
+    *address = s->address;
 
-        if (s->size == length) {
-            *address = s->address;
-            return true;
-        } else if (s->size < length) {
-            if (le == c->space_size.Flink)
-                return false;
+    return true;
+}
 
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
+static chunk* search_chunk_map(chunk_map* map, ULONG len, uint64_t address) {
+    ULONG lo = 0, hi;
 
-            *address = s->address;
-            return true;
-        }
+    if (!map)
+        return NULL;
 
-        le = le->Flink;
-    }
+    hi = min(len, map->alloc);
 
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+    while (lo < hi) {
+        ULONG mid = (lo + hi) / 2;
+        chunk_map_entry* cme = &map->entries[mid];
 
-    if (s->size > length) {
-        *address = s->address;
-        return true;
+        if (address < cme->offset)
+            hi = mid;
+        else if (address >= cme->offset + cme->size)
+            lo = mid + 1;
+        else
+            return cme->c;
     }
 
-    return false;
+    return NULL;
 }
 
+// The chunk map is a sorted array of chunk ranges. Writers hold chunk_lock exclusively and
+// bump chunk_map_seq before and after each change, so readers can search it without taking
+// the lock at all, and only fall back to it if they race with a writer. Arrays are only
+// freed on unmount, so a reader holding a stale pointer is never left with freed memory.
 chunk* get_chunk_from_address(device_extension* Vcb, uint64_t address) {
-    LIST_ENTRY* le2;
+    LONG seq;
+    chunk* c;
 
-    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+    seq = Vcb->chunk_map_seq;
+    KeMemoryBarrier();
+
+    if (!(seq & 1)) {
+        c = search_chunk_map(Vcb->chunk_map, Vcb->chunk_map_len, address);
 
-    le2 = Vcb->chunks.Flink;
-    while (le2 != &Vcb->chunks) {
-        chunk* c = CONTAINING_RECORD(le2, chunk, list_entry);
+        KeMemoryBarrier();
 
-        if (address >= c->offset && address < c->offset + c->chunk_item->size) {
-            ExReleaseResourceLite(&Vcb->chunk_lock);
+        if (seq == Vcb->chunk_map_seq)
             return c;
+    }
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, true);
+    c = search_chunk_map(Vcb->chunk_map, Vcb->chunk_map_len, address);
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    return c;
+}
+
+static ULONG chunk_map_position(device_extension* Vcb, uint64_t offset) {
+    ULONG lo = 0, hi = Vcb->chunk_map_len;
+
+    while (lo < hi) {
+        ULONG mid = (lo + hi) / 2;
+
+        if (Vcb->chunk_map->entries[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+NTSTATUS chunk_map_insert(device_extension* Vcb, chunk* c) {
+    chunk_map* map = Vcb->chunk_map;
+    ULONG pos;
+
+    if (!map || Vcb->chunk_map_len == map->alloc) {
+        chunk_map* map2;
+        ULONG alloc = map ? (map->alloc * 2) : 64;
+
+        map2 = ExAllocatePoolWithTag(NonPagedPool, offsetof(chunk_map, entries[0]) + (alloc * sizeof(chunk_map_entry)), ALLOC_TAG);
+        if (!map2) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        le2 = le2->Flink;
+        map2->prev = map;
+        map2->alloc = alloc;
+
+        if (map)
+            RtlCopyMemory(map2->entries, map->entries, Vcb->chunk_map_len * sizeof(chunk_map_entry));
+
+        map = map2;
     }
 
-    ExReleaseResourceLite(&Vcb->chunk_lock);
+    InterlockedIncrement(&Vcb->chunk_map_seq);
 
-    return NULL;
+    Vcb->chunk_map = map;
+
+    pos = chunk_map_position(Vcb, c->offset);
+
+    if (pos < Vcb->chunk_map_len)
+        RtlMoveMemory(&map->entries[pos + 1], &map->entries[pos], (Vcb->chunk_map_len - pos) * sizeof(chunk_map_entry));
+
+    map->entries[pos].offset = c->offset;
+    map->entries[pos].size = c->chunk_item->size;
+    map->entries[pos].c = c;
+    Vcb->chunk_map_len++;
+
+    InterlockedIncrement(&Vcb->chunk_map_seq);
+
+    return STATUS_SUCCESS;
+}
+
+void chunk_map_remove(device_extension* Vcb, chunk* c) {
+    ULONG pos;
+
+    if (!Vcb->chunk_map)
+        return;
+
+    pos = chunk_map_position(Vcb, c->offset);
+
+    if (pos == Vcb->chunk_map_len || Vcb->chunk_map->entries[pos].c != c) {
+        ERR("could not find chunk %I64x in chunk map\n", c->offset);
+        return;
+    }
+
+    InterlockedIncrement(&Vcb->chunk_map_seq);
+
+    RtlMoveMemory(&Vcb->chunk_map->entries[pos], &Vcb->chunk_map->entries[pos + 1], (Vcb->chunk_map_len - pos - 1) * sizeof(chunk_map_entry));
+    Vcb->chunk_map_len--;
+
+    InterlockedIncrement(&Vcb->chunk_map_seq);
+}
+
+void free_chunk_map(device_extension* Vcb) {
+    chunk_map* map = Vcb->chunk_map;
+
+    while (map) {
+        chunk_map* prev = map->prev;
+
+        ExFreePool(map);
+
+        map = prev;
+    }
+
+    Vcb->chunk_map = NULL;
+    Vcb->chunk_map_len = 0;
 }
 
 typedef struct {
@@ -605,7 +701,9 @@ NTSTATUS alloc_chunk(device_extension* Vcb, uint64_t flags, chunk** pc, bool ful
 
     InitializeListHead(&c->space);
     InitializeListHead(&c->space_size);
+    c->space_tree = c->space_size_tree = NULL;
     InitializeListHead(&c->deleting);
+    InitializeListHead(&c->pinned);
     InitializeListHead(&c->changed_extents);
 
     InitializeListHead(&c->range_locks);
@@ -628,10 +726,16 @@ NTSTATUS alloc_chunk(device_extension* Vcb, uint64_t flags, chunk** pc, bool ful
     s->address = c->offset;
     s->size = c->chunk_item->size;
     InsertTailList(&c->space, &s->list_entry);
-    InsertTailList(&c->space_size, &s->list_entry_size);
+    index_space_entry(s, &c->space_size);
 
     protect_superblocks(c);
 
+    Status = chunk_map_insert(Vcb, c);
+    if (!NT_SUCCESS(Status)) {
+        ERR("chunk_map_insert returned %08x\n", Status);
+        goto end;
+    }
+
     for (i = 0; i < num_stripes; i++) {
         stripes[i].device->devitem.bytes_used += stripe_size;
 
@@ -1055,6 +1159,7 @@ static NTSTATUS prepare_raid5_write(device_extension* Vcb, chunk* c, uint64_t ad
     NTSTATUS Status;
     PFN_NUMBER *pfns, *parity_pfns;
     log_stripe* log_stripes = NULL;
+    uint8_t** parity_srcs = NULL;
 
     if ((address + length - c->offset) % (num_data_stripes * c->chunk_item->stripe_length) > 0) {
         uint64_t delta = (address + length - c->offset) % (num_data_stripes * c->chunk_item->stripe_length);
@@ -1414,15 +1519,19 @@ static NTSTATUS prepare_raid5_write(device_extension* Vcb, chunk* c, uint64_t ad
         }
     }
 
-    for (i = 0; i < num_data_stripes; i++) {
-        uint8_t* ss = MmGetSystemAddressForMdlSafe(log_stripes[i].mdl, priority);
+    parity_srcs = ExAllocatePoolWithTag(NonPagedPool, sizeof(uint8_t*) * num_data_stripes, ALLOC_TAG);
+    if (!parity_srcs) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
 
-        if (i == 0)
-            RtlCopyMemory(wtc->parity1, ss, (uint32_t)(parity_end - parity_start));
-        else
-            do_xor(wtc->parity1, ss, (uint32_t)(parity_end - parity_start));
+    for (i = 0; i < num_data_stripes; i++) {
+        parity_srcs[i] = MmGetSystemAddressForMdlSafe(log_stripes[i].mdl, priority);
     }
 
+    do_xor_multi(wtc->parity1, parity_srcs, num_data_stripes, (uint32_t)(parity_end - parity_start));
+
     Status = STATUS_SUCCESS;
 
 exit:
@@ -1438,6 +1547,9 @@ exit:
     if (stripeoff)
         ExFreePool(stripeoff);
 
+    if (parity_srcs)
+        ExFreePool(parity_srcs);
+
     return Status;
 }
 
@@ -1452,6 +1564,7 @@ static NTSTATUS prepare_raid6_write(device_extension* Vcb, chunk* c, uint64_t ad
     NTSTATUS Status;
     PFN_NUMBER *pfns, *parity1_pfns, *parity2_pfns;
     log_stripe* log_stripes = NULL;
+    uint8_t** parity_srcs = NULL;
 
     if ((address + length - c->offset) % (num_data_stripes * c->chunk_item->stripe_length) > 0) {
         uint64_t delta = (address + length - c->offset) % (num_data_stripes * c->chunk_item->stripe_length);
@@ -1846,20 +1959,24 @@ static NTSTATUS prepare_raid6_write(device_extension* Vcb, chunk* c, uint64_t ad
         }
     }
 
-    for (i = 0; i < num_data_stripes; i++) {
-        uint8_t* ss = MmGetSystemAddressForMdlSafe(log_stripes[c->chunk_item->num_stripes - 3 - i].mdl, priority);
+    parity_srcs = ExAllocatePoolWithTag(NonPagedPool, sizeof(uint8_t*) * num_data_stripes, ALLOC_TAG);
+    if (!parity_srcs) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
 
-        if (i == 0) {
-            RtlCopyMemory(wtc->parity1, ss, (ULONG)(parity_end - parity_start));
-            RtlCopyMemory(wtc->parity2, ss, (ULONG)(parity_end - parity_start));
-        } else {
-            do_xor(wtc->parity1, ss, (uint32_t)(parity_end - parity_start));
+    for (i = 0; i < num_data_stripes; i++) {
+        parity_srcs[i] = MmGetSystemAddressForMdlSafe(log_stripes[c->chunk_item->num_stripes - 3 - i].mdl, priority);
 
-            galois_double(wtc->parity2, (uint32_t)(parity_end - parity_start));
-            do_xor(wtc->parity2, ss, (uint32_t)(parity_end - parity_start));
-        }
+        if (i == 0)
+            RtlCopyMemory(wtc->parity2, parity_srcs[i], (ULONG)(parity_end - parity_start));
+        else
+            galois_double_xor(wtc->parity2, parity_srcs[i], (uint32_t)(parity_end - parity_start));
     }
 
+    do_xor_multi(wtc->parity1, parity_srcs, num_data_stripes, (uint32_t)(parity_end - parity_start));
+
     Status = STATUS_SUCCESS;
 
 exit:
@@ -1875,6 +1992,9 @@ exit:
     if (stripeoff)
         ExFreePool(stripeoff);
 
+    if (parity_srcs)
+        ExFreePool(parity_srcs);
+
     return Status;
 }
 
@@ -2348,28 +2468,95 @@ void free_write_data_stripes(write_data_context* wtc) {
     }
 }
 
-void add_extent(_In_ fcb* fcb, _In_ LIST_ENTRY* prevextle, _In_ __drv_aliasesMem extent* newext) {
-    LIST_ENTRY* le = prevextle->Flink;
+// fcb->extent_tree indexes the live extents in fcb->extents by offset, so that
+// we can find where to start without walking the whole list. Deleted extents
+// stay in the list until the next flush, and can overlap live ones or be out of
+// order, so they're left out of the tree.
 
-    while (le != &fcb->extents) {
-        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+void index_fcb_extent(fcb* fcb, extent* ext) {
+    avl_node** link = &fcb->extent_tree;
+    avl_node* parent = NULL;
 
-        if (ext->offset >= newext->offset) {
-            InsertHeadList(ext->list_entry.Blink, &newext->list_entry);
-            return;
-        }
+    while (*link) {
+        parent = *link;
 
-        le = le->Flink;
+        if (ext->offset < CONTAINING_RECORD(parent, extent, node)->offset)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    avl_link(&fcb->extent_tree, &ext->node, parent, link);
+}
+
+void unindex_fcb_extent(fcb* fcb, extent* ext) {
+    avl_remove(&fcb->extent_tree, &ext->node);
+}
+
+// Returns the last live extent starting at or before offset, i.e. the only one
+// which can contain it.
+static extent* find_prev_fcb_extent(fcb* fcb, uint64_t offset) {
+    avl_node* n = fcb->extent_tree;
+    extent* ret = NULL;
+
+    while (n) {
+        extent* ext = CONTAINING_RECORD(n, extent, node);
+
+        if (ext->offset <= offset) {
+            ret = ext;
+            n = n->right;
+        } else
+            n = n->left;
+    }
+
+    return ret;
+}
+
+// Returns where to start walking fcb->extents for anything overlapping offset or
+// after it - nothing before the returned entry can.
+LIST_ENTRY* find_fcb_extent(fcb* fcb, uint64_t offset) {
+    extent* ext = find_prev_fcb_extent(fcb, offset);
+
+    return ext ? &ext->list_entry : fcb->extents.Flink;
+}
+
+// Returns the first live extent starting at or after offset.
+static extent* find_next_fcb_extent(fcb* fcb, uint64_t offset) {
+    avl_node* n = fcb->extent_tree;
+    extent* ret = NULL;
+
+    while (n) {
+        extent* ext = CONTAINING_RECORD(n, extent, node);
+
+        if (ext->offset >= offset) {
+            ret = ext;
+            n = n->left;
+        } else
+            n = n->right;
     }
 
-    InsertTailList(&fcb->extents, &newext->list_entry);
+    return ret;
+}
+
+void add_extent(_In_ fcb* fcb, _In_ __drv_aliasesMem extent* newext) {
+    extent* next = find_next_fcb_extent(fcb, newext->offset);
+
+    if (next)
+        InsertTailList(&next->list_entry, &newext->list_entry);
+    else
+        InsertTailList(&fcb->extents, &newext->list_entry);
+
+    index_fcb_extent(fcb, newext);
+
+    InterlockedIncrement(&fcb->Vcb->writeback.dirty_extents);
+    check_writeback(fcb->Vcb);
 }
 
 NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, uint64_t end_data, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     LIST_ENTRY* le;
 
-    le = fcb->extents.Flink;
+    le = find_fcb_extent(fcb, start_data);
 
     while (le != &fcb->extents) {
         LIST_ENTRY* le2 = le->Flink;
@@ -2379,12 +2566,15 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
         uint64_t len;
 
         if (!ext->ignore) {
+            if (ext->offset >= end_data)
+                break;
+
             if (ed->type != EXTENT_TYPE_INLINE)
                 ed2 = (EXTENT_DATA2*)ed->data;
 
             len = ed->type == EXTENT_TYPE_INLINE ? ed->decoded_size : ed2->num_bytes;
 
-            if (ext->offset < end_data && ext->offset + len > start_data) {
+            if (ext->offset + len > start_data) {
                 if (ed->type == EXTENT_TYPE_INLINE) {
                     if (start_data <= ext->offset && end_data >= ext->offset + len) { // remove all
                         remove_fcb_extent(fcb, ext, rollback);
@@ -2399,6 +2589,15 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                         return STATUS_INTERNAL_ERROR;
                     }
                 } else if (ed->type != EXTENT_TYPE_INLINE) {
+                    // if we're only removing part of it, the new extents need the checksums of what's left
+                    if (start_data > ext->offset || end_data < ext->offset + len) {
+                        Status = load_extent_csum(Vcb, fcb, ext, Irp);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("load_extent_csum returned %08x\n", Status);
+                            goto end;
+                        }
+                    }
+
                     if (start_data <= ext->offset && end_data >= ext->offset + len) { // remove all
                         if (ed2->size != 0) {
                             chunk* c;
@@ -2458,7 +2657,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
 
                         if (ext->csum) {
                             if (ed->compression == BTRFS_COMPRESSION_NONE) {
-                                newext->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ned2->num_bytes * sizeof(uint32_t) / Vcb->superblock.sector_size), ALLOC_TAG);
+                                newext->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ned2->num_bytes * Vcb->csum_size / Vcb->superblock.sector_size), ALLOC_TAG);
                                 if (!newext->csum) {
                                     ERR("out of memory\n");
                                     Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2466,10 +2665,10 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                                     goto end;
                                 }
 
-                                RtlCopyMemory(newext->csum, &ext->csum[(end_data - ext->offset) / Vcb->superblock.sector_size],
-                                              (ULONG)(ned2->num_bytes * sizeof(uint32_t) / Vcb->superblock.sector_size));
+                                RtlCopyMemory(newext->csum, (uint8_t*)ext->csum + (((end_data - ext->offset) / Vcb->superblock.sector_size) * Vcb->csum_size),
+                                              (ULONG)(ned2->num_bytes * Vcb->csum_size / Vcb->superblock.sector_size));
                             } else {
-                                newext->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2->size * sizeof(uint32_t) / Vcb->superblock.sector_size), ALLOC_TAG);
+                                newext->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2->size * Vcb->csum_size / Vcb->superblock.sector_size), ALLOC_TAG);
                                 if (!newext->csum) {
                                     ERR("out of memory\n");
                                     Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2477,12 +2676,12 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                                     goto end;
                                 }
 
-                                RtlCopyMemory(newext->csum, ext->csum, (ULONG)(ed2->size * sizeof(uint32_t) / Vcb->superblock.sector_size));
+                                RtlCopyMemory(newext->csum, ext->csum, (ULONG)(ed2->size * Vcb->csum_size / Vcb->superblock.sector_size));
                             }
                         } else
                             newext->csum = NULL;
 
-                        add_extent(fcb, &ext->list_entry, newext);
+                        add_extent(fcb, newext);
 
                         remove_fcb_extent(fcb, ext, rollback);
                     } else if (start_data > ext->offset && end_data >= ext->offset + len) { // remove end
@@ -2522,7 +2721,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
 
                         if (ext->csum) {
                             if (ed->compression == BTRFS_COMPRESSION_NONE) {
-                                newext->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ned2->num_bytes * sizeof(uint32_t) / Vcb->superblock.sector_size), ALLOC_TAG);
+                                newext->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ned2->num_bytes * Vcb->csum_size / Vcb->superblock.sector_size), ALLOC_TAG);
                                 if (!newext->csum) {
                                     ERR("out of memory\n");
                                     Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2530,9 +2729,9 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                                     goto end;
                                 }
 
-                                RtlCopyMemory(newext->csum, ext->csum, (ULONG)(ned2->num_bytes * sizeof(uint32_t) / Vcb->superblock.sector_size));
+                                RtlCopyMemory(newext->csum, ext->csum, (ULONG)(ned2->num_bytes * Vcb->csum_size / Vcb->superblock.sector_size));
                             } else {
-                                newext->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2->size * sizeof(uint32_t) / Vcb->superblock.sector_size), ALLOC_TAG);
+                                newext->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2->size * Vcb->csum_size / Vcb->superblock.sector_size), ALLOC_TAG);
                                 if (!newext->csum) {
                                     ERR("out of memory\n");
                                     Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2540,12 +2739,13 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                                     goto end;
                                 }
 
-                                RtlCopyMemory(newext->csum, ext->csum, (ULONG)(ed2->size * sizeof(uint32_t) / Vcb->superblock.sector_size));
+                                RtlCopyMemory(newext->csum, ext->csum, (ULONG)(ed2->size * Vcb->csum_size / Vcb->superblock.sector_size));
                             }
                         } else
                             newext->csum = NULL;
 
                         InsertHeadList(&ext->list_entry, &newext->list_entry);
+                        index_fcb_extent(fcb, newext);
 
                         remove_fcb_extent(fcb, ext, rollback);
                     } else if (start_data > ext->offset && end_data < ext->offset + len) { // remove middle
@@ -2627,7 +2827,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
 
                         if (ext->csum) {
                             if (ed->compression == BTRFS_COMPRESSION_NONE) {
-                                newext1->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(neda2->num_bytes * sizeof(uint32_t) / Vcb->superblock.sector_size), ALLOC_TAG);
+                                newext1->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(neda2->num_bytes * Vcb->csum_size / Vcb->superblock.sector_size), ALLOC_TAG);
                                 if (!newext1->csum) {
                                     ERR("out of memory\n");
                                     Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2636,7 +2836,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                                     goto end;
                                 }
 
-                                newext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(nedb2->num_bytes * sizeof(uint32_t) / Vcb->superblock.sector_size), ALLOC_TAG);
+                                newext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(nedb2->num_bytes * Vcb->csum_size / Vcb->superblock.sector_size), ALLOC_TAG);
                                 if (!newext2->csum) {
                                     ERR("out of memory\n");
                                     Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2646,11 +2846,11 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                                     goto end;
                                 }
 
-                                RtlCopyMemory(newext1->csum, ext->csum, (ULONG)(neda2->num_bytes * sizeof(uint32_t) / Vcb->superblock.sector_size));
-                                RtlCopyMemory(newext2->csum, &ext->csum[(end_data - ext->offset) / Vcb->superblock.sector_size],
-                                              (ULONG)(nedb2->num_bytes * sizeof(uint32_t) / Vcb->superblock.sector_size));
+                                RtlCopyMemory(newext1->csum, ext->csum, (ULONG)(neda2->num_bytes * Vcb->csum_size / Vcb->superblock.sector_size));
+                                RtlCopyMemory(newext2->csum, (uint8_t*)ext->csum + (((end_data - ext->offset) / Vcb->superblock.sector_size) * Vcb->csum_size),
+                                              (ULONG)(nedb2->num_bytes * Vcb->csum_size / Vcb->superblock.sector_size));
                             } else {
-                                newext1->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2->size * sizeof(uint32_t) / Vcb->superblock.sector_size), ALLOC_TAG);
+                                newext1->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2->size * Vcb->csum_size / Vcb->superblock.sector_size), ALLOC_TAG);
                                 if (!newext1->csum) {
                                     ERR("out of memory\n");
                                     Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2659,7 +2859,7 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                                     goto end;
                                 }
 
-                                newext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2->size * sizeof(uint32_t) / Vcb->superblock.sector_size), ALLOC_TAG);
+                                newext2->csum = ExAllocatePoolWithTag(PagedPool, (ULONG)(ed2->size * Vcb->csum_size / Vcb->superblock.sector_size), ALLOC_TAG);
                                 if (!newext2->csum) {
                                     ERR("out of memory\n");
                                     Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -2669,8 +2869,8 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                                     goto end;
                                 }
 
-                                RtlCopyMemory(newext1->csum, ext->csum, (ULONG)(ed2->size * sizeof(uint32_t) / Vcb->superblock.sector_size));
-                                RtlCopyMemory(newext2->csum, ext->csum, (ULONG)(ed2->size * sizeof(uint32_t) / Vcb->superblock.sector_size));
+                                RtlCopyMemory(newext1->csum, ext->csum, (ULONG)(ed2->size * Vcb->csum_size / Vcb->superblock.sector_size));
+                                RtlCopyMemory(newext2->csum, ext->csum, (ULONG)(ed2->size * Vcb->csum_size / Vcb->superblock.sector_size));
                             }
                         } else {
                             newext1->csum = NULL;
@@ -2678,7 +2878,8 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, uint64_t start_data, ui
                         }
 
                         InsertHeadList(&ext->list_entry, &newext1->list_entry);
-                        add_extent(fcb, &newext1->list_entry, newext2);
+                        index_fcb_extent(fcb, newext1);
+                        add_extent(fcb, newext2);
 
                         remove_fcb_extent(fcb, ext, rollback);
                     }
@@ -2718,9 +2919,8 @@ void add_insert_extent_rollback(LIST_ENTRY* rollback, fcb* fcb, extent* ext) {
 #pragma warning(suppress: 28194)
 #endif
 NTSTATUS add_extent_to_fcb(_In_ fcb* fcb, _In_ uint64_t offset, _In_reads_bytes_(edsize) EXTENT_DATA* ed, _In_ uint16_t edsize,
-                           _In_ bool unique, _In_opt_ _When_(return >= 0, __drv_aliasesMem) uint32_t* csum, _In_ LIST_ENTRY* rollback) {
+                           _In_ bool unique, _In_opt_ _When_(return >= 0, __drv_aliasesMem) void* csum, _In_ LIST_ENTRY* rollback) {
     extent* ext;
-    LIST_ENTRY* le;
 
     ext = ExAllocatePoolWithTag(PagedPool, offsetof(extent, extent_data) + edsize, ALLOC_TAG);
     if (!ext) {
@@ -2737,21 +2937,8 @@ NTSTATUS add_extent_to_fcb(_In_ fcb* fcb, _In_ uint64_t offset, _In_reads_bytes_
 
     RtlCopyMemory(&ext->extent_data, ed, edsize);
 
-    le = fcb->extents.Flink;
-    while (le != &fcb->extents) {
-        extent* oldext = CONTAINING_RECORD(le, extent, list_entry);
+    add_extent(fcb, ext);
 
-        if (oldext->offset >= offset) {
-            InsertHeadList(le->Blink, &ext->list_entry);
-            goto end;
-        }
-
-        le = le->Flink;
-    }
-
-    InsertTailList(&fcb->extents, &ext->list_entry);
-
-end:
     add_insert_extent_rollback(rollback, fcb, ext);
 
     return STATUS_SUCCESS;
@@ -2765,6 +2952,7 @@ static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback) {
         rollback_extent* re;
 
         ext->ignore = true;
+        unindex_fcb_extent(fcb, ext);
 
         re = ExAllocatePoolWithTag(NonPagedPool, sizeof(rollback_extent), ALLOC_TAG);
         if (!re) {
@@ -2780,33 +2968,21 @@ static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback) {
 }
 
 NTSTATUS calc_csum(_In_ device_extension* Vcb, _In_reads_bytes_(sectors*Vcb->superblock.sector_size) uint8_t* data,
-                   _In_ uint32_t sectors, _Out_writes_bytes_(sectors*sizeof(uint32_t)) uint32_t* csum) {
-    NTSTATUS Status;
-    calc_job* cj;
-
+                   _In_ uint32_t sectors, _Out_writes_bytes_(sectors*Vcb->csum_size) void* csum) {
     // From experimenting, it seems that 40 sectors is roughly the crossover
-    // point where offloading the crc32 calculation becomes worth it.
+    // point where offloading the checksum calculation becomes worth it.
 
     if (sectors < 40 || get_num_of_processors() < 2) {
         ULONG j;
 
         for (j = 0; j < sectors; j++) {
-            csum[j] = ~calc_crc32c(0xffffffff, data + (j * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
+            get_sector_csum(Vcb, data + (j * Vcb->superblock.sector_size), (uint8_t*)csum + (j * Vcb->csum_size));
         }
 
         return STATUS_SUCCESS;
     }
 
-    Status = add_calc_job(Vcb, data, sectors, csum, &cj);
-    if (!NT_SUCCESS(Status)) {
-        ERR("add_calc_job returned %08x\n", Status);
-        return Status;
-    }
-
-    KeWaitForSingleObject(&cj->event, Executive, KernelMode, false, NULL);
-    free_calc_job(cj);
-
-    return STATUS_SUCCESS;
+    return do_calc_job(Vcb, calc_job_csum, data, sectors, csum);
 }
 
 _Requires_lock_held_(c->lock)
@@ -2818,7 +2994,7 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
     EXTENT_DATA* ed;
     EXTENT_DATA2* ed2;
     uint16_t edsize = (uint16_t)(offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2));
-    uint32_t* csum = NULL;
+    void* csum = NULL;
 
     TRACE("(%p, (%I64x, %I64x), %I64x, %I64x, %I64x, %u, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, rollback);
 
@@ -2848,7 +3024,7 @@ bool insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
     if (!prealloc && data && !(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
         ULONG sl = (ULONG)(length / Vcb->superblock.sector_size);
 
-        csum = ExAllocatePoolWithTag(PagedPool, sl * sizeof(uint32_t), ALLOC_TAG);
+        csum = ExAllocatePoolWithTag(PagedPool, sl * Vcb->csum_size, ALLOC_TAG);
         if (!csum) {
             ERR("out of memory\n");
             ExFreePool(ed);
@@ -2908,25 +3084,9 @@ static bool try_extend_data(device_extension* Vcb, fcb* fcb, uint64_t start_data
     EXTENT_DATA2* ed2;
     chunk* c;
     LIST_ENTRY* le;
-    extent* ext = NULL;
-
-    le = fcb->extents.Flink;
-
-    while (le != &fcb->extents) {
-        extent* nextext = CONTAINING_RECORD(le, extent, list_entry);
-
-        if (!nextext->ignore) {
-            if (nextext->offset == start_data) {
-                ext = nextext;
-                break;
-            } else if (nextext->offset > start_data)
-                break;
+    extent* ext;
 
-            ext = nextext;
-        }
-
-        le = le->Flink;
-    }
+    ext = find_prev_fcb_extent(fcb, start_data);
 
     if (!ext)
         return false;
@@ -3578,7 +3738,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
 
         if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
             ULONG sl = (ULONG)(ed2->num_bytes / fcb->Vcb->superblock.sector_size);
-            uint32_t* csum = ExAllocatePoolWithTag(PagedPool, sl * sizeof(uint32_t), ALLOC_TAG);
+            void* csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
 
             if (!csum) {
                 ERR("out of memory\n");
@@ -3606,6 +3766,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext->ignore = false;
         newext->inserted = true;
         InsertHeadList(&ext->list_entry, &newext->list_entry);
+        index_fcb_extent(fcb, newext);
 
         add_insert_extent_rollback(rollback, fcb, newext);
 
@@ -3650,7 +3811,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
 
         if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
             ULONG sl = (ULONG)((end_data - ext->offset) / fcb->Vcb->superblock.sector_size);
-            uint32_t* csum = ExAllocatePoolWithTag(PagedPool, sl * sizeof(uint32_t), ALLOC_TAG);
+            void* csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
 
             if (!csum) {
                 ERR("out of memory\n");
@@ -3680,6 +3841,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext1->ignore = false;
         newext1->inserted = true;
         InsertHeadList(&ext->list_entry, &newext1->list_entry);
+        index_fcb_extent(fcb, newext1);
 
         add_insert_extent_rollback(rollback, fcb, newext1);
 
@@ -3689,7 +3851,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext2->ignore = false;
         newext2->inserted = true;
         newext2->csum = NULL;
-        add_extent(fcb, &newext1->list_entry, newext2);
+        add_extent(fcb, newext2);
 
         add_insert_extent_rollback(rollback, fcb, newext2);
 
@@ -3747,7 +3909,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
 
         if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
             ULONG sl = (ULONG)(ned2->num_bytes / fcb->Vcb->superblock.sector_size);
-            uint32_t* csum = ExAllocatePoolWithTag(PagedPool, sl * sizeof(uint32_t), ALLOC_TAG);
+            void* csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
 
             if (!csum) {
                 ERR("out of memory\n");
@@ -3778,6 +3940,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext1->inserted = true;
         newext1->csum = NULL;
         InsertHeadList(&ext->list_entry, &newext1->list_entry);
+        index_fcb_extent(fcb, newext1);
 
         add_insert_extent_rollback(rollback, fcb, newext1);
 
@@ -3786,7 +3949,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext2->unique = ext->unique;
         newext2->ignore = false;
         newext2->inserted = true;
-        add_extent(fcb, &newext1->list_entry, newext2);
+        add_extent(fcb, newext2);
 
         add_insert_extent_rollback(rollback, fcb, newext2);
 
@@ -3858,7 +4021,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
 
         if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
             ULONG sl = (ULONG)((end_data - start_data) / fcb->Vcb->superblock.sector_size);
-            uint32_t* csum = ExAllocatePoolWithTag(PagedPool, sl * sizeof(uint32_t), ALLOC_TAG);
+            void* csum = ExAllocatePoolWithTag(PagedPool, sl * fcb->Vcb->csum_size, ALLOC_TAG);
 
             if (!csum) {
                 ERR("out of memory\n");
@@ -3891,6 +4054,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext1->inserted = true;
         newext1->csum = NULL;
         InsertHeadList(&ext->list_entry, &newext1->list_entry);
+        index_fcb_extent(fcb, newext1);
 
         add_insert_extent_rollback(rollback, fcb, newext1);
 
@@ -3899,7 +4063,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext2->unique = ext->unique;
         newext2->ignore = false;
         newext2->inserted = true;
-        add_extent(fcb, &newext1->list_entry, newext2);
+        add_extent(fcb, newext2);
 
         add_insert_extent_rollback(rollback, fcb, newext2);
 
@@ -3909,7 +4073,7 @@ static NTSTATUS do_write_file_prealloc(fcb* fcb, extent* ext, uint64_t start_dat
         newext3->ignore = false;
         newext3->inserted = true;
         newext3->csum = NULL;
-        add_extent(fcb, &newext2->list_entry, newext3);
+        add_extent(fcb, newext3);
 
         add_insert_extent_rollback(rollback, fcb, newext3);
 
@@ -3949,7 +4113,7 @@ NTSTATUS do_write_file(fcb* fcb, uint64_t start, uint64_t end_data, void* data,
 
     last_cow_start = 0;
 
-    le = fcb->extents.Flink;
+    le = find_fcb_extent(fcb, start);
     while (le != &fcb->extents) {
         extent* ext = CONTAINING_RECORD(le, extent, list_entry);
 
@@ -4012,8 +4176,14 @@ NTSTATUS do_write_file(fcb* fcb, uint64_t start, uint64_t end_data, void* data,
 
                     // This shouldn't ever get called - nocow files should always also be nosum.
                     if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
+                        Status = load_extent_csum(fcb->Vcb, fcb, ext, Irp);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("load_extent_csum returned %08x\n", Status);
+                            return Status;
+                        }
+
                         calc_csum(fcb->Vcb, (uint8_t*)data + written, (uint32_t)(write_len / fcb->Vcb->superblock.sector_size),
-                                  &ext->csum[(start + written - ext->offset) / fcb->Vcb->superblock.sector_size]);
+                                  (uint8_t*)ext->csum + (((start + written - ext->offset) / fcb->Vcb->superblock.sector_size) * fcb->Vcb->csum_size));
 
                         ext->inserted = true;
                         extents_changed = true;
@@ -4102,44 +4272,94 @@ nextitem:
 
 NTSTATUS write_compressed(fcb* fcb, uint64_t start_data, uint64_t end_data, void* data, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
-    uint64_t i;
+    uint64_t num_pieces, done;
+    uint32_t batch, bufsize, i;
+    uint8_t type;
+    calc_comp_piece* pieces;
+
+    num_pieces = sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE;
+
+    if (num_pieces == 0)
+        return STATUS_SUCCESS;
+
+    type = get_compression_type(fcb);
+    bufsize = get_compression_buffer_size(type, COMPRESSED_EXTENT_SIZE);
+
+    // Compress a couple of extents per calc thread at a time, so we're not holding
+    // the whole write's worth of compressed data in memory.
+    batch = (uint32_t)min(num_pieces, fcb->Vcb->calcthreads.num_threads * 2);
+
+    pieces = ExAllocatePoolWithTag(PagedPool, sizeof(calc_comp_piece) * batch, ALLOC_TAG);
+    if (!pieces) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < batch; i++) {
+        pieces[i].out = ExAllocatePoolWithTag(PagedPool, bufsize, ALLOC_TAG);
+        if (!pieces[i].out) {
+            ERR("out of memory\n");
+
+            while (i > 0) {
+                i--;
+                ExFreePool(pieces[i].out);
+            }
+
+            ExFreePool(pieces);
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        pieces[i].outlen = bufsize;
+    }
+
+    done = 0;
 
-    for (i = 0; i < sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE; i++) {
-        uint64_t s2, e2;
-        bool compressed;
+    while (done < num_pieces) {
+        uint32_t num = (uint32_t)min(batch, num_pieces - done);
 
-        s2 = start_data + (i * COMPRESSED_EXTENT_SIZE);
-        e2 = min(s2 + COMPRESSED_EXTENT_SIZE, end_data);
+        for (i = 0; i < num; i++) {
+            uint64_t s2 = start_data + ((done + i) * COMPRESSED_EXTENT_SIZE);
 
-        Status = write_compressed_bit(fcb, s2, e2, (uint8_t*)data + (i * COMPRESSED_EXTENT_SIZE), &compressed, Irp, rollback);
+            pieces[i].in = (uint8_t*)data + ((done + i) * COMPRESSED_EXTENT_SIZE);
+            pieces[i].inlen = (uint32_t)(min(s2 + COMPRESSED_EXTENT_SIZE, end_data) - s2);
+        }
 
+        Status = do_calc_job_comp(fcb->Vcb, type, pieces, num);
         if (!NT_SUCCESS(Status)) {
-            ERR("write_compressed_bit returned %08x\n", Status);
-            return Status;
+            ERR("do_calc_job_comp returned %08x\n", Status);
+            goto end;
         }
 
-        // If the first 128 KB of a file is incompressible, we set the nocompress flag so we don't
-        // bother with the rest of it.
-        if (s2 == 0 && e2 == COMPRESSED_EXTENT_SIZE && !compressed && !fcb->Vcb->options.compress_force) {
-            fcb->inode_item.flags |= BTRFS_INODE_NOCOMPRESS;
-            fcb->inode_item_changed = true;
-            mark_fcb_dirty(fcb);
+        // Add the extents in order. Pieces which failed the compressibility check, or which
+        // didn't compress, are written uncompressed.
+        for (i = 0; i < num; i++) {
+            uint64_t s2, e2;
 
-            // write subsequent data non-compressed
-            if (e2 < end_data) {
-                Status = do_write_file(fcb, e2, end_data, (uint8_t*)data + e2, Irp, false, 0, rollback);
+            s2 = start_data + ((done + i) * COMPRESSED_EXTENT_SIZE);
+            e2 = s2 + pieces[i].inlen;
 
-                if (!NT_SUCCESS(Status)) {
-                    ERR("do_write_file returned %08x\n", Status);
-                    return Status;
-                }
-            }
+            Status = write_compressed_bit(fcb, s2, e2, pieces[i].in, type, pieces[i].out, pieces[i].complen, Irp, rollback);
 
-            return STATUS_SUCCESS;
+            if (!NT_SUCCESS(Status)) {
+                ERR("write_compressed_bit returned %08x\n", Status);
+                goto end;
+            }
         }
+
+        done += num;
     }
 
-    return STATUS_SUCCESS;
+    Status = STATUS_SUCCESS;
+
+end:
+    for (i = 0; i < batch; i++) {
+        ExFreePool(pieces[i].out);
+    }
+
+    ExFreePool(pieces);
+
+    return Status;
 }
 
 NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void* buf, ULONG* length, bool paging_io, bool no_cache,
@@ -4772,6 +4992,9 @@ NTSTATUS __stdcall drv_write(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
         goto end;
     }
 
+    if (top_level && wait && !(Irp->Flags & IRP_PAGING_IO))
+        throttle_writer(Vcb);
+
     try {
         if (IrpSp->MinorFunction & IRP_MN_COMPLETE) {
             CcMdlWriteComplete(IrpSp->FileObject, &IrpSp->Parameters.Write.ByteOffset, Irp->MdlAddress);